@@ -24,7 +24,7 @@ extern "C" {
     val ^= macro; \
 }
 
-void fuse_ll_debug_print_open_flags(int val)
+static inline void fuse_ll_debug_print_open_flags(int val)
 {
     test_acc(val, O_RDONLY, "O_RDONLY");
     test_acc(val, O_WRONLY, "O_WRONLY");
@@ -195,6 +195,15 @@ inline const char *fuse_ll_op_name(uint32_t opcode)
 	case 49:
 	      op_name = "FUSE_REMOVEMAPPING";
 	      break;
+	case 50:
+	      op_name = "FUSE_SYNCFS";
+	      break;
+	case 51:
+	      op_name = "FUSE_TMPFILE";
+	      break;
+	case 52:
+	      op_name = "FUSE_STATX";
+	      break;
 	case 4096:
 	      op_name = "CUSE_INIT";
 	      break;
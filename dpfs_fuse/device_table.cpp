@@ -0,0 +1,99 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <errno.h>
+
+#include "device_table.h"
+#include "write_gather.h"
+
+void fuse_ll_device_table_init(struct fuse_ll_device_table *t)
+{
+    for (size_t i = 0; i < DPFS_FUSE_MAX_DEVICES; i++)
+        t->devs[i].store(NULL, std::memory_order_relaxed);
+    for (size_t i = 0; i < DPFS_FUSE_MAX_THREADS; i++)
+        t->qs[i].seen.store(0, std::memory_order_relaxed);
+    t->gp.store(0, std::memory_order_relaxed);
+    t->nthreads = 0;
+    t->pinned.store(0, std::memory_order_relaxed);
+    t->nretired.store(0, std::memory_order_relaxed);
+}
+
+int fuse_ll_device_publish(struct fuse_ll_device_table *t, struct fuse_ll_device *dev)
+{
+    if (dev->device_id >= DPFS_FUSE_MAX_DEVICES)
+        return -EINVAL;
+
+    struct fuse_ll_device *expected = NULL;
+    if (!t->devs[dev->device_id].compare_exchange_strong(expected, dev, std::memory_order_release))
+        return -EEXIST;
+    return 0;
+}
+
+struct fuse_ll_device *fuse_ll_device_unpublish(struct fuse_ll_device_table *t, uint16_t device_id)
+{
+    if (device_id >= DPFS_FUSE_MAX_DEVICES)
+        return NULL;
+    return t->devs[device_id].exchange(NULL, std::memory_order_seq_cst);
+}
+
+void fuse_ll_device_retire(struct fuse_ll_device_table *t, struct fuse_ll_device *dev)
+{
+    {
+        std::lock_guard<std::mutex> lock(t->retired_lock);
+        // Any HAL thread that has seen this grace period has also seen the device unpublished
+        dev->retired_gp = t->gp.fetch_add(1, std::memory_order_acq_rel) + 1;
+        t->retired.push_back(dev);
+        t->nretired.store(t->retired.size(), std::memory_order_relaxed);
+    }
+    fuse_ll_device_reclaim(t, -1);
+}
+
+void fuse_ll_device_reclaim(struct fuse_ll_device_table *t, int thread_id)
+{
+    std::unique_lock<std::mutex> lock(t->retired_lock, std::defer_lock);
+    if (thread_id >= 0) {
+        if (!lock.try_lock())
+            return;
+    } else {
+        lock.lock();
+    }
+
+    if (t->pinned.load(std::memory_order_seq_cst) != 0)
+        return;
+
+    uint64_t min_seen = UINT64_MAX;
+    for (uint16_t i = 0; i < t->nthreads; i++) {
+        uint64_t seen = t->qs[i].seen.load(std::memory_order_acquire);
+        if (seen < min_seen)
+            min_seen = seen;
+    }
+
+    for (auto it = t->retired.begin(); it != t->retired.end();) {
+        struct fuse_ll_device *dev = *it;
+        // No HAL thread handles a request of the device anymore, only its write backs may still
+        // be going on
+        if (dev->retired_gp <= min_seen && (!dev->wg || write_gather_drain(dev->wg, thread_id))) {
+            delete dev;
+            it = t->retired.erase(it);
+        } else {
+            it++;
+        }
+    }
+    t->nretired.store(t->retired.size(), std::memory_order_relaxed);
+}
+
+void fuse_ll_device_table_destroy(struct fuse_ll_device_table *t)
+{
+    std::lock_guard<std::mutex> lock(t->retired_lock);
+    for (struct fuse_ll_device *dev : t->retired)
+        delete dev;
+    t->retired.clear();
+    t->nretired.store(0, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < DPFS_FUSE_MAX_DEVICES; i++)
+        delete t->devs[i].exchange(NULL, std::memory_order_relaxed);
+}
@@ -0,0 +1,168 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef DEVICE_TABLE_H
+#define DEVICE_TABLE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "dpfs/hal.h"
+#include "dpfs_fuse.h"
+#include "negative_cache.h"
+
+/*
+ * Dense table of the virtio-fs devices of a dpfs_fuse, indexed by device_id, so that getting
+ * the session of a request costs a single load.
+ *
+ * Devices can come and go while the HAL threads are handling requests (e.g. VF hot-plug):
+ * - a device is fully set up before it is published with a release store
+ * - a removed device is unpublished and retired, and only freed once every HAL thread has
+ *   finished a request since then (quiescent-state based RCU). The HAL threads never hold on to
+ *   a device in between requests. A HAL thread that is idle holds up the freeing of retired
+ *   devices until its next request or until dpfs_fuse_destroy().
+ * - dpfs_fuse_device_stats() can be called from any thread, it pins the table while it looks
+ *   at a device.
+ * - the write gathering of a retired device is drained before the device is freed: once the
+ *   grace period has passed and the write backs that were in flight have completed, the HAL
+ *   thread that reclaims the device writes back what is still gathered (see write_gather_drain()).
+ * The HAL only removes a device once it can't receive requests anymore, so async completions
+ * can still use the session of their request.
+ */
+
+#define DPFS_FUSE_MAX_DEVICES 1024
+#define DPFS_FUSE_MAX_THREADS 256
+
+struct write_gather;
+struct fuse_ll_flow;
+void write_gather_destroy(struct write_gather *);
+
+// Per device settings from the [dpfs.device.<device_id>] table of the config
+struct fuse_ll_device_conf {
+    // Override the timeouts the backend replies with, < 0 keeps those of the backend
+    double attr_timeout;
+    double entry_timeout;
+    // FUSE_CAP_* that are never negotiated with the host of this device
+    uint64_t disable_caps;
+    // Index into the backends of the dpfs_fuse
+    int backend;
+};
+
+struct alignas(64) fuse_ll_device {
+    // Must stay the first member, see fuse_ll_device_of()
+    struct fuse_session se;
+    // NULL if write gathering is disabled, freed with the device
+    struct write_gather *wg;
+    // NULL if the negative dentry cache is disabled, freed with the device
+    struct negative_cache *nc;
+    struct fuse_ll_device_conf conf;
+    uint16_t device_id;
+
+    // Copied from the backend of the device, so that a request doesn't need to look up the backend
+    struct fuse_ll_operations ops;
+    void *user_data;
+    dpfs_fuse_handler_t handler;
+    // Shared by all devices, the device is limited by the capacity of the thread that owns it
+    struct fuse_ll_flow *flow;
+
+    // Only written by the HAL thread that owns the device, see fuse_ll_device_count()
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> async;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> throttled;
+
+    // The grace period in which the device was retired
+    uint64_t retired_gp;
+
+    // Only once write_gather_drain() returned true or the HAL threads have stopped
+    ~fuse_ll_device()
+    {
+        if (wg)
+            write_gather_destroy(wg);
+        if (nc)
+            negative_cache_destroy(nc);
+    }
+};
+
+struct fuse_ll_device_table {
+    std::atomic<struct fuse_ll_device *> devs[DPFS_FUSE_MAX_DEVICES];
+
+    // Bumped for every retired device
+    std::atomic<uint64_t> gp;
+    // The grace period each HAL thread has seen at the end of its last request
+    struct alignas(64) {
+        std::atomic<uint64_t> seen;
+    } qs[DPFS_FUSE_MAX_THREADS];
+    // 0 as long as the HAL isn't handling requests yet
+    uint16_t nthreads;
+    // Callers from outside of the HAL threads that are looking at a device
+    std::atomic<int> pinned;
+
+    // The HAL threads only report quiescent states while there is something to free
+    std::atomic<size_t> nretired;
+    std::mutex retired_lock;
+    std::vector<struct fuse_ll_device *> retired;
+};
+
+static inline struct fuse_ll_device *fuse_ll_device_get(struct fuse_ll_device_table *t, uint16_t device_id)
+{
+    if (device_id >= DPFS_FUSE_MAX_DEVICES)
+        return NULL;
+    return t->devs[device_id].load(std::memory_order_acquire);
+}
+
+// The session of a request is always that of a device in the table
+static inline struct fuse_ll_device *fuse_ll_device_of(struct fuse_session *se)
+{
+    return reinterpret_cast<struct fuse_ll_device *>(se);
+}
+
+// Single writer, so no need for an atomic read-modify-write
+static inline void fuse_ll_device_count(std::atomic<uint64_t> &counter)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void fuse_ll_device_table_init(struct fuse_ll_device_table *);
+// Publishes the device, returns -EEXIST if the device_id is in use
+int fuse_ll_device_publish(struct fuse_ll_device_table *, struct fuse_ll_device *);
+// Unpublishes the device, returns NULL if there is no such device.
+// The caller has to fuse_ll_device_retire() it once it is done with it.
+struct fuse_ll_device *fuse_ll_device_unpublish(struct fuse_ll_device_table *, uint16_t device_id);
+void fuse_ll_device_retire(struct fuse_ll_device_table *, struct fuse_ll_device *);
+// Frees the devices whose grace period has passed and whose write gathering is drained.
+// thread_id is that of the calling HAL thread, which only tries the lock so that it stays cheap,
+// or -1 for other threads (which can't start write backs)
+void fuse_ll_device_reclaim(struct fuse_ll_device_table *, int thread_id);
+// Frees all retired devices, only when the HAL threads have stopped. Blocks until the write
+// gathering of the devices is written back
+void fuse_ll_device_table_destroy(struct fuse_ll_device_table *);
+
+// Called by a HAL thread after every request
+static inline void fuse_ll_device_quiescent(struct fuse_ll_device_table *t)
+{
+    if (t->nretired.load(std::memory_order_relaxed) == 0)
+        return;
+
+    uint16_t thread_id = dpfs_hal_thread_id();
+    t->qs[thread_id].seen.store(t->gp.load(std::memory_order_acquire), std::memory_order_release);
+    fuse_ll_device_reclaim(t, thread_id);
+}
+
+// For threads other than the HAL threads
+static inline struct fuse_ll_device *fuse_ll_device_pin(struct fuse_ll_device_table *t, uint16_t device_id)
+{
+    t->pinned.fetch_add(1, std::memory_order_seq_cst);
+    return fuse_ll_device_get(t, device_id);
+}
+static inline void fuse_ll_device_unpin(struct fuse_ll_device_table *t)
+{
+    t->pinned.fetch_sub(1, std::memory_order_release);
+}
+
+#endif // DEVICE_TABLE_H
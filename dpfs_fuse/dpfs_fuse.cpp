@@ -29,8 +29,13 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/fcntl.h>
+#include <sys/sysmacros.h>
 #include <stddef.h>
 #include <unordered_map>
+#include <vector>
+#include <utility>
+#include <string>
+#include <new>
 #include <linux/fuse.h>
 #include <string.h>
 
@@ -39,30 +44,60 @@
 #include "debug.h"
 #include "dpfs/hal.h"
 #include "dpfs_fuse.h"
+#include "write_gather.h"
+#include "negative_cache.h"
+#include "flow_control.h"
+#include "device_table.h"
+#include "trace.h"
+#include "toml.h"
 
 #define MIN(x, y) x < y ? x : y
 #define MAX(x, y) x > y ? x : y
 
-struct dpfs_fuse;
-typedef int (*fuse_handler_t) (struct dpfs_fuse *,
+typedef int (*fuse_handler_t) (struct fuse_ll_device *,
                              struct iovec *fuse_in_iov, int in_iovcnt,
                              struct iovec *fuse_out_iov, int out_iovcnt,
                              void *completion_context, uint16_t device_id);
 
+#ifdef DPFS_FUSE_STATX
+#define DPFS_FUSE_MAX_OPCODE FUSE_STATX
+#else
 #define DPFS_FUSE_MAX_OPCODE FUSE_REMOVEMAPPING
+#endif
 // The opcodes begin at FUSE_LOOKUP = 1, so need one more array index
 #define DPFS_FUSE_HANDLERS_LEN DPFS_FUSE_MAX_OPCODE+1
 
 struct dpfs_fuse {
+    // NULL when replaying a trace
     struct dpfs_hal *hal;
 
     fuse_handler_t fuse_handlers[DPFS_FUSE_HANDLERS_LEN];
-    std::unordered_map<uint16_t, fuse_session*> se;
-
-    void *user_data;
-    struct fuse_ll_operations ops;
-    dpfs_hal_register_device_t register_device_cb;
-    dpfs_hal_unregister_device_t unregister_device_cb;
+    struct fuse_ll_device_table devs;
+
+    // The ops and user_data of these are copied into every device they serve
+    std::vector<struct dpfs_fuse_backend> backends;
+    // The ops of the backends, the callers' may be gone by the time a device is registered
+    std::vector<struct fuse_ll_operations> backend_ops;
+    // The poll hooks of the backends that have one, called from the poll hook of the HAL
+    std::vector<std::pair<void (*) (void *, uint16_t), void *>> polls;
+
+    // NULL if write gathering is disabled
+    struct write_gather_conf *wg_conf;
+    // Per device negative dentry cache, 0 entries disables it
+    size_t nc_entries;
+    uint64_t nc_ttl_msec;
+    // Kept for as long as the dpfs_fuse lives, devices can be registered at any time (hot-plug).
+    // Read-only once dpfs_fuse_new_multi() has parsed it
+    std::unordered_map<uint16_t, struct fuse_ll_device_conf> dev_conf;
+
+    // Queues the requests the backends have no capacity for, see flow_control.h
+    struct fuse_ll_flow *flow;
+
+    // NULL unless the requests get captured, see trace.h
+    struct fuse_ll_trace *trace;
+    // Replay this trace instead of serving a host
+    std::string replay_path;
+    bool replay_original_timing;
 };
 
 #define ST_ATIM_NSEC(stbuf) ((stbuf)->st_atim.tv_nsec)
@@ -86,9 +121,9 @@ static void convert_stat(const struct stat *stbuf, struct fuse_attr *attr)
     attr->atime	= stbuf->st_atime;
     attr->mtime	= stbuf->st_mtime;
     attr->ctime	= stbuf->st_ctime;
-    attr->atimensec = 0;
-    attr->mtimensec = 0;
-    attr->ctimensec = 0;
+    attr->atimensec = ST_ATIM_NSEC(stbuf);
+    attr->mtimensec = ST_MTIM_NSEC(stbuf);
+    attr->ctimensec = ST_CTIM_NSEC(stbuf);
 }
 static void convert_statx(const struct statx *stbuf, struct fuse_attr *attr)
 {
@@ -97,18 +132,48 @@ static void convert_statx(const struct statx *stbuf, struct fuse_attr *attr)
     attr->nlink	= stbuf->stx_nlink;
     attr->uid	= stbuf->stx_uid;
     attr->gid	= stbuf->stx_gid;
-    attr->rdev	= stbuf->stx_rdev_major;
+    attr->rdev	= makedev(stbuf->stx_rdev_major, stbuf->stx_rdev_minor);
     attr->size	= stbuf->stx_size;
     attr->blksize	= stbuf->stx_blksize;
     attr->blocks	= stbuf->stx_blocks;
     attr->atime	= stbuf->stx_atime.tv_sec;
     attr->mtime	= stbuf->stx_mtime.tv_sec;
     attr->ctime	= stbuf->stx_ctime.tv_sec;
-    attr->atimensec = 0;
-    attr->mtimensec = 0;
-    attr->ctimensec = 0;
+    attr->atimensec = stbuf->stx_atime.tv_nsec;
+    attr->mtimensec = stbuf->stx_mtime.tv_nsec;
+    attr->ctimensec = stbuf->stx_ctime.tv_nsec;
 }
 
+#ifdef DPFS_FUSE_STATX
+static void convert_statx_sx_time(const struct statx_timestamp *ts, struct fuse_sx_time *sx)
+{
+    sx->tv_sec = ts->tv_sec;
+    sx->tv_nsec = ts->tv_nsec;
+}
+static void convert_statx_full(const struct statx *stbuf, struct fuse_statx *sx)
+{
+    sx->mask = stbuf->stx_mask;
+    sx->blksize = stbuf->stx_blksize;
+    sx->attributes = stbuf->stx_attributes;
+    sx->nlink = stbuf->stx_nlink;
+    sx->uid = stbuf->stx_uid;
+    sx->gid = stbuf->stx_gid;
+    sx->mode = stbuf->stx_mode;
+    sx->ino = stbuf->stx_ino;
+    sx->size = stbuf->stx_size;
+    sx->blocks = stbuf->stx_blocks;
+    sx->attributes_mask = stbuf->stx_attributes_mask;
+    convert_statx_sx_time(&stbuf->stx_atime, &sx->atime);
+    convert_statx_sx_time(&stbuf->stx_btime, &sx->btime);
+    convert_statx_sx_time(&stbuf->stx_ctime, &sx->ctime);
+    convert_statx_sx_time(&stbuf->stx_mtime, &sx->mtime);
+    sx->rdev_major = stbuf->stx_rdev_major;
+    sx->rdev_minor = stbuf->stx_rdev_minor;
+    sx->dev_major = stbuf->stx_dev_major;
+    sx->dev_minor = stbuf->stx_dev_minor;
+}
+#endif
+
 static void convert_attr(const struct fuse_setattr_in *attr, struct stat *stbuf)
 {
     stbuf->st_mode	       = attr->mode;
@@ -118,9 +183,9 @@ static void convert_attr(const struct fuse_setattr_in *attr, struct stat *stbuf)
     stbuf->st_atime	       = attr->atime;
     stbuf->st_mtime	       = attr->mtime;
     stbuf->st_ctime        = attr->ctime;
-    stbuf->st_atim.tv_nsec = 0;
-    stbuf->st_mtim.tv_nsec = 0;
-    stbuf->st_ctim.tv_nsec = 0;
+    ST_ATIM_NSEC_SET(stbuf, attr->atimensec);
+    ST_MTIM_NSEC_SET(stbuf, attr->mtimensec);
+    ST_CTIM_NSEC_SET(stbuf, attr->ctimensec);
 }
 
 static void convert_statfs(const struct statvfs *stbuf,
@@ -137,6 +202,12 @@ static void convert_statfs(const struct statvfs *stbuf,
     kstatfs->namelen     = stbuf->f_namemax;
 }
 
+// The per device timeout from the config wins over the one of the backend
+static inline double fuse_ll_timeout(double conf_timeout, double timeout)
+{
+    return conf_timeout >= 0 ? conf_timeout : timeout;
+}
+
 static void fill_entry(struct fuse_entry_out *arg,
                const struct fuse_entry_param *e)
 {
@@ -149,6 +220,21 @@ static void fill_entry(struct fuse_entry_out *arg,
     convert_stat(&e->attr, &arg->attr);
 }
 
+static void fill_entry_se(struct fuse_session *se, struct fuse_entry_out *arg,
+               const struct fuse_entry_param *e)
+{
+    struct fuse_ll_device_conf *conf = &fuse_ll_device_of(se)->conf;
+    fill_entry(arg, e);
+    if (conf->entry_timeout >= 0) {
+        arg->entry_valid = calc_timeout_sec(conf->entry_timeout);
+        arg->entry_valid_nsec = calc_timeout_nsec(conf->entry_timeout);
+    }
+    if (conf->attr_timeout >= 0) {
+        arg->attr_valid = calc_timeout_sec(conf->attr_timeout);
+        arg->attr_valid_nsec = calc_timeout_nsec(conf->attr_timeout);
+    }
+}
+
 static void fill_open(struct fuse_open_out *arg,
               const struct fuse_file_info *f)
 {
@@ -193,6 +279,7 @@ int fuse_ll_reply_attrx(struct fuse_session *se, struct fuse_out_header *out_hdr
     size_t size = se->conn.proto_minor < 9 ?
         FUSE_COMPAT_ATTR_OUT_SIZE : sizeof(*out_attr);
 
+    attr_timeout = fuse_ll_timeout(fuse_ll_device_of(se)->conf.attr_timeout, attr_timeout);
     memset(out_attr, 0, sizeof(*out_attr));
     out_attr->attr_valid = calc_timeout_sec(attr_timeout);
     out_attr->attr_valid_nsec = calc_timeout_nsec(attr_timeout);
@@ -202,10 +289,24 @@ int fuse_ll_reply_attrx(struct fuse_session *se, struct fuse_out_header *out_hdr
     return 0;
 }
 
+#ifdef DPFS_FUSE_STATX
+int fuse_ll_reply_statx(struct fuse_session *se, struct fuse_out_header *out_hdr, struct fuse_statx_out *out_statx, struct statx *s, double attr_timeout) {
+    attr_timeout = fuse_ll_timeout(fuse_ll_device_of(se)->conf.attr_timeout, attr_timeout);
+    memset(out_statx, 0, sizeof(*out_statx));
+    out_statx->attr_valid = calc_timeout_sec(attr_timeout);
+    out_statx->attr_valid_nsec = calc_timeout_nsec(attr_timeout);
+    convert_statx_full(s, &out_statx->stat);
+
+    out_hdr->len += sizeof(*out_statx);
+    return 0;
+}
+#endif
+
 int fuse_ll_reply_attr(struct fuse_session *se, struct fuse_out_header *out_hdr, struct fuse_attr_out *out_attr, struct stat *s, double attr_timeout) {
     size_t size = se->conn.proto_minor < 9 ?
         FUSE_COMPAT_ATTR_OUT_SIZE : sizeof(*out_attr);
 
+    attr_timeout = fuse_ll_timeout(fuse_ll_device_of(se)->conf.attr_timeout, attr_timeout);
     memset(out_attr, 0, sizeof(*out_attr));
     out_attr->attr_valid = calc_timeout_sec(attr_timeout);
     out_attr->attr_valid_nsec = calc_timeout_nsec(attr_timeout);
@@ -227,11 +328,25 @@ int fuse_ll_reply_entry(struct fuse_session *se, struct fuse_out_header *out_hdr
     }
 
     memset(out_entry, 0, sizeof(*out_entry));
-    fill_entry(out_entry, e);
+    fill_entry_se(se, out_entry, e);
 
     out_hdr->len += size;
     return 0;
 }
+
+// Replays a negative entry (nodeid 0) from the negative dentry cache
+static void fuse_ll_reply_negative_entry(struct fuse_session *se, struct fuse_out_header *out_hdr,
+        struct fuse_entry_out *out_entry, uint64_t entry_valid, uint32_t entry_valid_nsec)
+{
+    size_t size = se->conn.proto_minor < 9 ?
+        FUSE_COMPAT_ENTRY_OUT_SIZE : sizeof(*out_entry);
+
+    memset(out_entry, 0, sizeof(*out_entry));
+    out_entry->entry_valid = entry_valid;
+    out_entry->entry_valid_nsec = entry_valid_nsec;
+    out_hdr->len += size;
+}
+
 int fuse_ll_reply_open(struct fuse_session *se, struct fuse_out_header *out_hdr,
         struct fuse_open_out *out_open, struct fuse_file_info *fi)
 {
@@ -249,7 +364,7 @@ int fuse_ll_reply_create(struct fuse_session *se, struct fuse_out_header *out_hd
         FUSE_COMPAT_ENTRY_OUT_SIZE : sizeof(struct fuse_entry_out);
 
     memset(out_entry, 0, sizeof(*out_entry));
-    fill_entry(out_entry, e);
+    fill_entry_se(se, out_entry, e);
     fill_open(out_open, fi);
     out_hdr->len += entrysize + sizeof(struct fuse_open_out);
     return 0;
@@ -314,62 +429,144 @@ size_t iov_write_buf(struct iov *iov, void *buf, size_t size) {
     return size;
 }
 
-size_t fuse_add_direntry(struct iov *read_iov,
-             const char *name, const struct stat *stbuf, off_t off)
+// Returns where the next size bytes go if they fit in the current iovec and are aligned for
+// the fuse_dirent, so that the entry can be encoded in place. NULL if it has to be spilled.
+static inline char *iov_reserve(struct iov *iov, size_t size)
+{
+    if (iov->bytes_unused < size)
+        return NULL;
+    struct iovec *v = &iov->iovec[iov->iov_idx];
+    char *p = ((char *) v->iov_base) + iov->buf_idx;
+    if (v->iov_len - iov->buf_idx < size || ((uintptr_t) p & (sizeof(uint64_t) - 1)) != 0)
+        return NULL;
+
+    if (iov->buf_idx + size == v->iov_len) {
+        iov->iov_idx++;
+        iov->buf_idx = 0;
+    } else {
+        iov->buf_idx += size;
+    }
+    iov->bytes_unused -= size;
+    return p;
+}
+
+static inline void fill_dirent(struct fuse_dirent *dirent, uint64_t ino, mode_t mode, off_t off,
+        const char *name, size_t namelen, size_t padding)
+{
+    dirent->ino = ino;
+    dirent->off = off;
+    dirent->namelen = namelen;
+    dirent->type = (mode & S_IFMT) >> 12;
+    memcpy(dirent->name, name, namelen);
+    memset(dirent->name + namelen, 0, padding);
+}
+
+static size_t add_direntry(struct iov *read_iov, const char *name, size_t namelen,
+             uint64_t ino, mode_t mode, off_t off)
 {
-    size_t namelen = strlen(name);
     size_t entlen = FUSE_NAME_OFFSET + namelen;
     size_t entlen_padded = FUSE_DIRENT_ALIGN(entlen);
 
-    // iov_write_buf also checks this, but we should do it before we execute the memcpys
     if (read_iov->bytes_unused < entlen_padded) {
         return 0;
     }
 
+    char *p = iov_reserve(read_iov, entlen_padded);
+    if (p) {
+        fill_dirent((struct fuse_dirent *) p, ino, mode, off, name, namelen, entlen_padded - entlen);
+        return entlen_padded;
+    }
+
+    // The entry crosses into the next iovec
     char buf[entlen_padded];
+    fill_dirent((struct fuse_dirent *) buf, ino, mode, off, name, namelen, entlen_padded - entlen);
+    return iov_write_buf(read_iov, buf, entlen_padded);
+}
 
-    struct fuse_dirent *dirent = (struct fuse_dirent *) buf;
-    dirent->ino = stbuf->st_ino;
-    dirent->off = off;
-    dirent->namelen = namelen;
-    dirent->type = (stbuf->st_mode & S_IFMT) >> 12;
-    memcpy(dirent->name, name, namelen);
-    memset(dirent->name + namelen, 0, entlen_padded - entlen);
+size_t fuse_add_direntry_len(struct iov *read_iov, const char *name, size_t namelen,
+             const struct stat *stbuf, off_t off)
+{
+    return add_direntry(read_iov, name, namelen, stbuf->st_ino, stbuf->st_mode, off);
+}
 
-    return iov_write_buf(read_iov, buf, entlen_padded);
+size_t fuse_add_direntry(struct iov *read_iov,
+             const char *name, const struct stat *stbuf, off_t off)
+{
+    return fuse_add_direntry_len(read_iov, name, strlen(name), stbuf, off);
 }
 
-size_t fuse_add_direntry_plus(struct iov *read_iov,
-                  const char *name,
+static inline void fill_direntplus(struct fuse_direntplus *dp, const struct fuse_entry_param *e,
+        off_t off, const char *name, size_t namelen, size_t padding)
+{
+    memset(&dp->entry_out, 0, sizeof(dp->entry_out));
+    fill_entry(&dp->entry_out, e);
+    fill_dirent(&dp->dirent, e->attr.st_ino, e->attr.st_mode, off, name, namelen, padding);
+}
+
+size_t fuse_add_direntry_plus_len(struct iov *read_iov, const char *name, size_t namelen,
                   const struct fuse_entry_param *e, off_t off)
 {
-    size_t namelen = strlen(name);
     size_t entlen = FUSE_NAME_OFFSET_DIRENTPLUS + namelen;
     size_t entlen_padded = FUSE_DIRENT_ALIGN(entlen);
 
-    // iov_write_buf also checks this, but we should do it before we execute the memcpys
     if (read_iov->bytes_unused < entlen_padded) {
         return 0;
     }
 
+    char *p = iov_reserve(read_iov, entlen_padded);
+    if (p) {
+        fill_direntplus((struct fuse_direntplus *) p, e, off, name, namelen, entlen_padded - entlen);
+        return entlen_padded;
+    }
+
+    // The entry crosses into the next iovec
     char buf[entlen_padded];
+    fill_direntplus((struct fuse_direntplus *) buf, e, off, name, namelen, entlen_padded - entlen);
+    return iov_write_buf(read_iov, buf, entlen_padded);
+}
 
-    struct fuse_direntplus *dp = (struct fuse_direntplus *) buf;
-    memset(&dp->entry_out, 0, sizeof(dp->entry_out));
-    fill_entry(&dp->entry_out, e);
+size_t fuse_add_direntry_plus(struct iov *read_iov,
+                  const char *name,
+                  const struct fuse_entry_param *e, off_t off)
+{
+    return fuse_add_direntry_plus_len(read_iov, name, strlen(name), e, off);
+}
 
-    struct fuse_dirent *dirent = &dp->dirent;
-    dirent->ino = e->attr.st_ino;
-    dirent->off = off;
-    dirent->namelen = namelen;
-    dirent->type = (e->attr.st_mode & S_IFMT) >> 12;
-    memcpy(dirent->name, name, namelen);
-    memset(dirent->name + namelen, 0, entlen_padded - entlen);
+size_t fuse_add_direntries(struct iov *read_iov, const struct fuse_direntry *ents, size_t n,
+             size_t *written)
+{
+    size_t i = 0;
+    size_t total = 0;
+    for (; i < n; i++) {
+        size_t w = add_direntry(read_iov, ents[i].name, ents[i].namelen,
+                ents[i].ino, ents[i].mode, ents[i].off);
+        if (w == 0)
+            break;
+        total += w;
+    }
+    if (written)
+        *written = total;
+    return i;
+}
 
-    return iov_write_buf(read_iov, buf, entlen_padded);
+size_t fuse_add_direntries_plus(struct iov *read_iov, const struct fuse_direntry_plus *ents, size_t n,
+             size_t *written)
+{
+    size_t i = 0;
+    size_t total = 0;
+    for (; i < n; i++) {
+        size_t w = fuse_add_direntry_plus_len(read_iov, ents[i].name, ents[i].namelen,
+                &ents[i].e, ents[i].off);
+        if (w == 0)
+            break;
+        total += w;
+    }
+    if (written)
+        *written = total;
+    return i;
 }
 
-static int fuse_ll_init(struct dpfs_fuse *f_ll,
+static int fuse_ll_init(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                void *completion_context, uint16_t device_id) {
@@ -386,11 +583,13 @@ static int fuse_ll_init(struct dpfs_fuse *f_ll,
     struct fuse_init_in *inarg = (struct fuse_init_in *) fuse_in_iov[1].iov_base;
     struct fuse_init_out *outarg = (struct fuse_init_out *) fuse_out_iov[1].iov_base;
 
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
     if (se->got_init == 1 && se->got_destroy == 0) {
         out_hdr->error = -EISCONN;
         return 0;
     }
+    if (dev->nc)
+        negative_cache_clear(dev->nc);
 
     size_t bufsize = se->bufsize;
     size_t outargsize = sizeof(*outarg);
@@ -406,6 +605,13 @@ static int fuse_ll_init(struct dpfs_fuse *f_ll,
     se->conn.capable = 0;
     se->conn.want = 0;
     se->conn.max_background = DPFS_HAL_MAX_BACKGROUND;
+    // More background requests than the backend can take would only wait in the queue of
+    // flow control, while the host could have sent its synchronous requests instead
+    uint32_t capacity = fuse_ll_flow_capacity(dev->flow, dpfs_hal_thread_id());
+    if (capacity && capacity < se->conn.max_background) {
+        se->conn.max_background = capacity;
+        se->conn.congestion_threshold = capacity * 3 / 4;
+    }
 
     memset(outarg, 0, sizeof(*outarg));
     outarg->major = FUSE_KERNEL_VERSION;
@@ -515,6 +721,7 @@ static int fuse_ll_init(struct dpfs_fuse *f_ll,
     LL_SET_DEFAULT(1, FUSE_CAP_FLOCK_LOCKS);
     LL_SET_DEFAULT(1, FUSE_CAP_READDIRPLUS);
     LL_SET_DEFAULT(1, FUSE_CAP_READDIRPLUS_AUTO);
+    // The attributes carry nanoseconds, so the host can compare timestamps at full precision
     se->conn.time_gran = 1;
     
     if (bufsize < FUSE_MIN_READ_BUFFER) {
@@ -528,8 +735,8 @@ static int fuse_ll_init(struct dpfs_fuse *f_ll,
         se->conn.max_write = bufsize - FUSE_BUFFER_HEADER_SIZE;
 
     se->got_init = 1;
-    if (f_ll->ops.init) {
-        int op_res = f_ll->ops.init(se, f_ll->user_data, in_hdr, inarg, &se->conn, out_hdr, device_id);
+    if (dev->ops.init) {
+        int op_res = dev->ops.init(se, dev->user_data, in_hdr, inarg, &se->conn, out_hdr, device_id);
         if (out_hdr->error != 0 || op_res != 0) {
             se->error = -EPROTO;
             se->got_destroy = 1;
@@ -537,6 +744,8 @@ static int fuse_ll_init(struct dpfs_fuse *f_ll,
         }
     }
 
+    se->conn.want &= ~fuse_ll_device_of(se)->conf.disable_caps;
+
     if (se->conn.want & (~se->conn.capable)) {
         fprintf(stderr, "fuse: error: filesystem requested capabilities "
             "0x%X that are not supported by kernel, aborting.\n",
@@ -626,7 +835,7 @@ static int fuse_ll_init(struct dpfs_fuse *f_ll,
     return 0;
 }
 
-static int fuse_ll_destroy(struct dpfs_fuse *f_ll,
+static int fuse_ll_destroy(struct fuse_ll_device *dev,
                   struct iovec *fuse_in_iov, int in_iovcnt,
                   struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -641,15 +850,53 @@ static int fuse_ll_destroy(struct dpfs_fuse *f_ll,
     out_hdr->len = sizeof(*out_hdr);
     out_hdr->error = 0;
 
-    f_ll->se.at(device_id)->got_destroy = 1;
-    if (f_ll->ops.destroy)
-        return f_ll->ops.destroy(f_ll->se.at(device_id), f_ll->user_data, in_hdr, out_hdr, completion_context, device_id);
+    dev->se.got_destroy = 1;
+    if (dev->ops.destroy)
+        return dev->ops.destroy(&dev->se, dev->user_data, in_hdr, out_hdr, completion_context, device_id);
     else
         return 0;
 }
 
 
-static int fuse_ll_lookup(struct dpfs_fuse *f_ll,
+// Remembers a LOOKUP on the way back to the HAL, so that its miss can be cached
+struct fuse_ll_lookup_ctx {
+    struct fuse_ll_device *dev;
+    uint64_t parent;
+    std::string name;
+    struct fuse_out_header *out_hdr;
+    struct fuse_entry_out *out_entry;
+    uint64_t gen;
+    // Of the HAL
+    void *completion_context;
+    struct dpfs_hal_local_completion c;
+};
+
+static void fuse_ll_lookup_cache_miss(struct fuse_ll_lookup_ctx *ctx)
+{
+    if (ctx->out_hdr->error == -ENOENT) {
+        negative_cache_insert(ctx->dev->nc, ctx->gen, ctx->parent, ctx->name.c_str(), false, 0, 0);
+    } else if (ctx->out_hdr->error == 0 && ctx->out_hdr->len > sizeof(*ctx->out_hdr) &&
+               ctx->out_entry->nodeid == 0) {
+        // A negative entry with a zero timeout asks us not to cache it either
+        struct fuse_entry_out *e = ctx->out_entry;
+        if (e->entry_valid || e->entry_valid_nsec)
+            negative_cache_insert(ctx->dev->nc, ctx->gen, ctx->parent, ctx->name.c_str(), true,
+                    e->entry_valid, e->entry_valid_nsec);
+    }
+}
+
+static void fuse_ll_lookup_complete(void *arg, enum dpfs_hal_completion_status status)
+{
+    struct fuse_ll_lookup_ctx *ctx = (struct fuse_ll_lookup_ctx *) arg;
+    void *completion_context = ctx->completion_context;
+
+    if (status == DPFS_HAL_COMPLETION_SUCCES)
+        fuse_ll_lookup_cache_miss(ctx);
+    delete ctx;
+    dpfs_hal_async_complete(completion_context, status);
+}
+
+static int fuse_ll_lookup(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -671,19 +918,50 @@ static int fuse_ll_lookup(struct dpfs_fuse *f_ll,
     printf("* in_name: %s\n", in_name);
 #endif
 
-    if (!f_ll->se.at(device_id)->init_done) {
+    if (!dev->se.init_done) {
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (f_ll->ops.lookup)
-        return f_ll->ops.lookup(f_ll->se.at(device_id), f_ll->user_data, in_hdr, in_name, out_hdr, out_entry, completion_context, device_id);
-    else {
+    if (!dev->ops.lookup) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
+    if (!dev->nc)
+        return dev->ops.lookup(&dev->se, dev->user_data, in_hdr, in_name, out_hdr, out_entry, completion_context, device_id);
+
+    struct negative_cache_entry hit;
+    if (negative_cache_lookup(dev->nc, in_hdr->nodeid, in_name, &hit)) {
+        if (hit.entry)
+            fuse_ll_reply_negative_entry(&dev->se, out_hdr, out_entry, hit.entry_valid, hit.entry_valid_nsec);
+        else
+            out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    struct fuse_ll_lookup_ctx *ctx = new (std::nothrow) fuse_ll_lookup_ctx;
+    if (!ctx)
+        return dev->ops.lookup(&dev->se, dev->user_data, in_hdr, in_name, out_hdr, out_entry, completion_context, device_id);
+    ctx->dev = dev;
+    ctx->parent = in_hdr->nodeid;
+    ctx->name = in_name;
+    ctx->out_hdr = out_hdr;
+    ctx->out_entry = out_entry;
+    ctx->gen = negative_cache_gen(dev->nc);
+    ctx->completion_context = completion_context;
+    ctx->c.cb = fuse_ll_lookup_complete;
+    ctx->c.arg = ctx;
+
+    int ret = dev->ops.lookup(&dev->se, dev->user_data, in_hdr, in_name, out_hdr, out_entry,
+            dpfs_hal_local_completion_context(&ctx->c), device_id);
+    if (ret != EWOULDBLOCK) {
+        if (ret == 0)
+            fuse_ll_lookup_cache_miss(ctx);
+        delete ctx;
+    }
+    return ret;
 }
 
-static int fuse_ll_setattr(struct dpfs_fuse *f_ll,
+static int fuse_ll_setattr(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -707,12 +985,11 @@ static int fuse_ll_setattr(struct dpfs_fuse *f_ll,
     printf("* fh: %lu\n", in_setattr->fh);
 #endif
 
-    if (!f_ll->se.at(device_id)->init_done) {
+    if (!dev->se.init_done) {
         out_hdr->error = -EBUSY;
         return 0;
     }
-
-    if (f_ll->ops.setattr) {
+    if (dev->ops.setattr) {
         struct fuse_file_info *fi = NULL;
         struct fuse_file_info fi_store;
         struct stat s;
@@ -735,9 +1012,9 @@ static int fuse_ll_setattr(struct dpfs_fuse *f_ll,
             FUSE_SET_ATTR_MTIME_NOW |
             FUSE_SET_ATTR_CTIME;
 
-        return f_ll->ops.setattr(f_ll->se.at(device_id), f_ll->user_data, in_hdr, &s, in_setattr->valid, fi, out_hdr, out_attr, completion_context, device_id);
-    } else if (f_ll->ops.setattr_async) {
-        return f_ll->ops.setattr_async(f_ll->se.at(device_id), f_ll->user_data, in_hdr, in_setattr, out_hdr, out_attr, completion_context, device_id);
+        return dev->ops.setattr(&dev->se, dev->user_data, in_hdr, &s, in_setattr->valid, fi, out_hdr, out_attr, completion_context, device_id);
+    } else if (dev->ops.setattr_async) {
+        return dev->ops.setattr_async(&dev->se, dev->user_data, in_hdr, in_setattr, out_hdr, out_attr, completion_context, device_id);
     } else {
         out_hdr->error = -ENOSYS;
         return 0;
@@ -745,7 +1022,7 @@ static int fuse_ll_setattr(struct dpfs_fuse *f_ll,
 }
     
 
-static int fuse_ll_create(struct dpfs_fuse *f_ll,
+static int fuse_ll_create(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                void *completion_context, uint16_t device_id) {
@@ -753,7 +1030,7 @@ static int fuse_ll_create(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -790,15 +1067,17 @@ static int fuse_ll_create(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.create) {
+    if (!dev->ops.create) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.create(se, f_ll->user_data, in_hdr, *in_create, name, out_hdr, out_entry, out_open, completion_context, device_id);
+    if (dev->nc)
+        negative_cache_invalidate(dev->nc, in_hdr->nodeid, name);
+    return dev->ops.create(se, dev->user_data, in_hdr, *in_create, name, out_hdr, out_entry, out_open, completion_context, device_id);
 }
 
-static int fuse_ll_flush(struct dpfs_fuse *f_ll,
+static int fuse_ll_flush(struct fuse_ll_device *dev,
                 struct iovec *fuse_in_iov, int in_iovcnt,
                 struct iovec *fuse_out_iov, int out_iovcnt,
                 void *completion_context, uint16_t device_id) {
@@ -806,7 +1085,7 @@ static int fuse_ll_flush(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -826,7 +1105,14 @@ static int fuse_ll_flush(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.flush) {
+    struct write_gather *wg = dev->wg;
+    if (wg) {
+        out_hdr->error = write_gather_error(wg, in_hdr->nodeid);
+        // We need to see every FLUSH, so never make the host stop sending them with ENOSYS
+        if (out_hdr->error != 0 || !dev->ops.flush)
+            return 0;
+    }
+    if (!dev->ops.flush) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
@@ -837,10 +1123,10 @@ static int fuse_ll_flush(struct dpfs_fuse *f_ll,
     if (se->conn.proto_minor >= 7)
         fi.lock_owner = in_flush->lock_owner;
 
-    return f_ll->ops.flush(se, f_ll->user_data, in_hdr, fi, out_hdr, completion_context, device_id);
+    return dev->ops.flush(se, dev->user_data, in_hdr, fi, out_hdr, completion_context, device_id);
 }
 
-static int fuse_ll_setlk_common(struct dpfs_fuse *f_ll,
+static int fuse_ll_setlk_common(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                void *completion_context, uint16_t device_id, bool sleep) {
@@ -848,7 +1134,7 @@ static int fuse_ll_setlk_common(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -890,8 +1176,8 @@ static int fuse_ll_setlk_common(struct dpfs_fuse *f_ll,
         if (!sleep)
             op |= LOCK_NB;
 
-        if (f_ll->ops.flock) {
-            return f_ll->ops.flock(se, f_ll->user_data, in_hdr, fi, op, out_hdr, completion_context, device_id);
+        if (dev->ops.flock) {
+            return dev->ops.flock(se, dev->user_data, in_hdr, fi, op, out_hdr, completion_context, device_id);
         } else {
             out_hdr->error = -ENOSYS;
             return 0;
@@ -903,21 +1189,21 @@ static int fuse_ll_setlk_common(struct dpfs_fuse *f_ll,
     }
 }
 
-static int fuse_ll_setlkw(struct dpfs_fuse *f_ll,
+static int fuse_ll_setlkw(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
-    return fuse_ll_setlk_common(f_ll, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt, completion_context, device_id, true);
+    return fuse_ll_setlk_common(dev, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt, completion_context, device_id, true);
 }
 
-static int fuse_ll_setlk(struct dpfs_fuse *f_ll,
+static int fuse_ll_setlk(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
-    return fuse_ll_setlk_common(f_ll, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt, completion_context, device_id, true);
+    return fuse_ll_setlk_common(dev, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt, completion_context, device_id, true);
 }
 
-static int fuse_ll_getattr(struct dpfs_fuse *f_ll,
+static int fuse_ll_getattr(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -925,7 +1211,7 @@ static int fuse_ll_getattr(struct dpfs_fuse *f_ll,
         fprintf(stderr, "fuser_mirror_getattr: invalid number of iovecs!\n");
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -945,15 +1231,54 @@ static int fuse_ll_getattr(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.getattr) {
+    if (!dev->ops.getattr) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
+    return dev->ops.getattr(se, dev->user_data, in_hdr, in_getattr, out_hdr, out_attr, completion_context, device_id);
+}
+
+#ifdef DPFS_FUSE_STATX
+static int fuse_ll_statx(struct fuse_ll_device *dev,
+               struct iovec *fuse_in_iov, int in_iovcnt,
+               struct iovec *fuse_out_iov, int out_iovcnt,
+                  void *completion_context, uint16_t device_id) {
+    if (in_iovcnt != 2 || out_iovcnt != 2) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = &dev->se;
 
-    return f_ll->ops.getattr(se, f_ll->user_data, in_hdr, in_getattr, out_hdr, out_attr, completion_context, device_id);
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    struct fuse_statx_in *in_statx = (struct fuse_statx_in *) fuse_in_iov[1].iov_base;
+    struct fuse_statx_out *out_statx = (struct fuse_statx_out *) fuse_out_iov[1].iov_base;
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* fh: %lu\n", in_statx->fh);
+    printf("* sx_flags: 0x%X\n", in_statx->sx_flags);
+    printf("* sx_mask: 0x%X\n", in_statx->sx_mask);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    // The host falls back to GETATTR for good
+    if (!dev->ops.statx) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+    return dev->ops.statx(se, dev->user_data, in_hdr, in_statx, out_hdr, out_statx, completion_context, device_id);
 }
+#endif
 
-static int fuse_ll_opendir(struct dpfs_fuse *f_ll,
+static int fuse_ll_opendir(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -961,7 +1286,7 @@ static int fuse_ll_opendir(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -981,15 +1306,15 @@ static int fuse_ll_opendir(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.opendir) {
+    if (!dev->ops.opendir) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.opendir(se, f_ll->user_data, in_hdr, in_open, out_hdr, out_open, completion_context, device_id);
+    return dev->ops.opendir(se, dev->user_data, in_hdr, in_open, out_hdr, out_open, completion_context, device_id);
 }
 
-static int fuse_ll_releasedir(struct dpfs_fuse *f_ll,
+static int fuse_ll_releasedir(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -997,7 +1322,7 @@ static int fuse_ll_releasedir(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1016,15 +1341,15 @@ static int fuse_ll_releasedir(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.releasedir) {
+    if (!dev->ops.releasedir) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.releasedir(se, f_ll->user_data, in_hdr, in_release, out_hdr, completion_context, device_id);
+    return dev->ops.releasedir(se, dev->user_data, in_hdr, in_release, out_hdr, completion_context, device_id);
 }
 
-static int fuse_ll_readdir_common(struct dpfs_fuse *f_ll,
+static int fuse_ll_readdir_common(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                void *completion_context, uint16_t device_id,
@@ -1033,7 +1358,7 @@ static int fuse_ll_readdir_common(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1053,7 +1378,7 @@ static int fuse_ll_readdir_common(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.readdir) {
+    if (!dev->ops.readdir) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
@@ -1061,24 +1386,24 @@ static int fuse_ll_readdir_common(struct dpfs_fuse *f_ll,
     struct iov read_iov;
     iov_init(&read_iov, &fuse_out_iov[1], out_iovcnt-1);
 
-    return f_ll->ops.readdir(se, f_ll->user_data, in_hdr, in_read, plus, out_hdr, read_iov, completion_context, device_id);
+    return dev->ops.readdir(se, dev->user_data, in_hdr, in_read, plus, out_hdr, read_iov, completion_context, device_id);
 }
 
-static int fuse_ll_readdir(struct dpfs_fuse *f_ll,
+static int fuse_ll_readdir(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                 void *completion_context, uint16_t device_id) {
-    return fuse_ll_readdir_common(f_ll, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt, completion_context, device_id, false);
+    return fuse_ll_readdir_common(dev, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt, completion_context, device_id, false);
 }
 
-static int fuse_ll_readdirplus(struct dpfs_fuse *f_ll,
+static int fuse_ll_readdirplus(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
-    return fuse_ll_readdir_common(f_ll, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt, completion_context, device_id, true);
+    return fuse_ll_readdir_common(dev, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt, completion_context, device_id, true);
 }
 
-static int fuse_ll_open(struct dpfs_fuse *f_ll,
+static int fuse_ll_open(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1086,7 +1411,7 @@ static int fuse_ll_open(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1106,15 +1431,35 @@ static int fuse_ll_open(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.open) {
+    if (!dev->ops.open) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.open(se, f_ll->user_data, in_hdr, in_open, out_hdr, out_open, completion_context, device_id);
+    return dev->ops.open(se, dev->user_data, in_hdr, in_open, out_hdr, out_open, completion_context, device_id);
+}
+
+// Carries a write back error of the file into the reply of the backend to RELEASE
+struct fuse_ll_release_ctx {
+    struct fuse_out_header *out_hdr;
+    int error;
+    // Of the HAL
+    void *completion_context;
+    struct dpfs_hal_local_completion c;
+};
+
+static void fuse_ll_release_complete(void *arg, enum dpfs_hal_completion_status status)
+{
+    struct fuse_ll_release_ctx *ctx = (struct fuse_ll_release_ctx *) arg;
+    void *completion_context = ctx->completion_context;
+
+    if (ctx->out_hdr->error == 0)
+        ctx->out_hdr->error = ctx->error;
+    delete ctx;
+    dpfs_hal_async_complete(completion_context, status);
 }
 
-static int fuse_ll_release(struct dpfs_fuse *f_ll,
+static int fuse_ll_release(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1122,7 +1467,7 @@ static int fuse_ll_release(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1144,15 +1489,38 @@ static int fuse_ll_release(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.release) {
-        out_hdr->error = -ENOSYS;
+    // The file has been written back before the RELEASE got here, see write_gather_request()
+    int error = 0;
+    if (dev->wg)
+        error = write_gather_release(dev->wg, in_hdr->nodeid);
+    if (!dev->ops.release) {
+        out_hdr->error = error != 0 ? error : -ENOSYS;
         return 0;
     }
-
-    return f_ll->ops.release(se, f_ll->user_data, in_hdr, in_release, out_hdr, completion_context, device_id);
+    if (error == 0)
+        return dev->ops.release(se, dev->user_data, in_hdr, in_release, out_hdr, completion_context, device_id);
+
+    // The backend still has to release the handle
+    struct fuse_ll_release_ctx *ctx = new (std::nothrow) fuse_ll_release_ctx;
+    if (!ctx)
+        return dev->ops.release(se, dev->user_data, in_hdr, in_release, out_hdr, completion_context, device_id);
+    ctx->out_hdr = out_hdr;
+    ctx->error = error;
+    ctx->completion_context = completion_context;
+    ctx->c.cb = fuse_ll_release_complete;
+    ctx->c.arg = ctx;
+
+    int ret = dev->ops.release(se, dev->user_data, in_hdr, in_release, out_hdr,
+            dpfs_hal_local_completion_context(&ctx->c), device_id);
+    if (ret != EWOULDBLOCK) {
+        if (ret == 0 && out_hdr->error == 0)
+            out_hdr->error = error;
+        delete ctx;
+    }
+    return ret;
 }
 
-static int fuse_ll_fsync(struct dpfs_fuse *f_ll,
+static int fuse_ll_fsync(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1160,7 +1528,7 @@ static int fuse_ll_fsync(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1180,15 +1548,22 @@ static int fuse_ll_fsync(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.fsync) {
+    struct write_gather *wg = dev->wg;
+    if (wg) {
+        out_hdr->error = write_gather_error(wg, in_hdr->nodeid);
+        // We need to see every FSYNC, so never make the host stop sending them with ENOSYS
+        if (out_hdr->error != 0 || !dev->ops.fsync)
+            return 0;
+    }
+    if (!dev->ops.fsync) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.fsync(se, f_ll->user_data, in_hdr, in_fsync, out_hdr, completion_context, device_id);
+    return dev->ops.fsync(se, dev->user_data, in_hdr, in_fsync, out_hdr, completion_context, device_id);
 }
 
-static int fuse_ll_fsyncdir(struct dpfs_fuse *f_ll,
+static int fuse_ll_fsyncdir(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1196,7 +1571,7 @@ static int fuse_ll_fsyncdir(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1216,15 +1591,15 @@ static int fuse_ll_fsyncdir(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.fsyncdir) {
+    if (!dev->ops.fsyncdir) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.fsyncdir(se, f_ll->user_data, in_hdr, in_fsync, out_hdr, completion_context, device_id);
+    return dev->ops.fsyncdir(se, dev->user_data, in_hdr, in_fsync, out_hdr, completion_context, device_id);
 }
 
-static int fuse_ll_rmdir(struct dpfs_fuse *f_ll,
+static int fuse_ll_rmdir(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1232,7 +1607,7 @@ static int fuse_ll_rmdir(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1251,15 +1626,15 @@ static int fuse_ll_rmdir(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.rmdir) {
+    if (!dev->ops.rmdir) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.rmdir(se, f_ll->user_data, in_hdr, in_name, out_hdr, completion_context, device_id);
+    return dev->ops.rmdir(se, dev->user_data, in_hdr, in_name, out_hdr, completion_context, device_id);
 }
 
-static int fuse_ll_forget(struct dpfs_fuse *f_ll,
+static int fuse_ll_forget(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1275,13 +1650,16 @@ static int fuse_ll_forget(struct dpfs_fuse *f_ll,
     fuse_ll_debug_print_in_hdr(in_hdr);
 #endif
 
-    if (f_ll->ops.forget)
-        return f_ll->ops.forget(f_ll->se.at(device_id), f_ll->user_data, in_hdr, in_forget, completion_context, device_id);
+    // Forgotten nodeids may be reused by the backend
+    if (dev->nc)
+        negative_cache_invalidate_dir(dev->nc, in_hdr->nodeid);
+    if (dev->ops.forget)
+        return dev->ops.forget(&dev->se, dev->user_data, in_hdr, in_forget, completion_context, device_id);
     else
         return 0;
 }
 
-static int fuse_ll_batch_forget(struct dpfs_fuse *f_ll,
+static int fuse_ll_batch_forget(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1300,13 +1678,43 @@ static int fuse_ll_batch_forget(struct dpfs_fuse *f_ll,
     fuse_ll_debug_print_in_hdr(in_hdr);
 #endif
 
-    if (f_ll->ops.batch_forget)
-        return f_ll->ops.batch_forget(f_ll->se.at(device_id), f_ll->user_data, in_hdr, in_batch_forget, in_forget, completion_context, device_id);
+    if (dev->nc) {
+        for (uint32_t i = 0; i < in_batch_forget->count; i++)
+            negative_cache_invalidate_dir(dev->nc, in_forget[i].nodeid);
+    }
+    if (dev->ops.batch_forget)
+        return dev->ops.batch_forget(&dev->se, dev->user_data, in_hdr, in_batch_forget, in_forget, completion_context, device_id);
+    else
+        return 0;
+}
+
+static int fuse_ll_interrupt(struct fuse_ll_device *dev,
+               struct iovec *fuse_in_iov, int in_iovcnt,
+               struct iovec *fuse_out_iov, int out_iovcnt,
+                  void *completion_context, uint16_t device_id) {
+    if (in_iovcnt != 1 || out_iovcnt != 0) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = &dev->se;
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_interrupt_in *in_interrupt = (struct fuse_interrupt_in *) (((char *) fuse_in_iov[0].iov_base)
+            + sizeof(struct fuse_in_header));
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* unique: %lu\n", in_interrupt->unique);
+#endif
+
+    // Without backend support the interrupted request just runs to completion
+    if (se->init_done && dev->ops.interrupt)
+        return dev->ops.interrupt(se, dev->user_data, in_hdr, in_interrupt, completion_context, device_id);
     else
         return 0;
 }
 
-static int fuse_ll_rename(struct dpfs_fuse *f_ll,
+static int fuse_ll_rename(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1314,7 +1722,7 @@ static int fuse_ll_rename(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1337,16 +1745,18 @@ static int fuse_ll_rename(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.rename) {
+    if (!dev->ops.rename) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.rename(se, f_ll->user_data, in_hdr, name, in_rename->newdir,
+    if (dev->nc)
+        negative_cache_invalidate(dev->nc, in_rename->newdir, new_name);
+    return dev->ops.rename(se, dev->user_data, in_hdr, name, in_rename->newdir,
                     new_name, 0, out_hdr, completion_context, device_id);
 }
 
-static int fuse_ll_rename2(struct dpfs_fuse *f_ll,
+static int fuse_ll_rename2(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1354,7 +1764,7 @@ static int fuse_ll_rename2(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1378,17 +1788,18 @@ static int fuse_ll_rename2(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.rename) {
+    if (!dev->ops.rename) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-
-    return f_ll->ops.rename(se, f_ll->user_data, in_hdr, name, in_rename2->newdir,
+    if (dev->nc)
+        negative_cache_invalidate(dev->nc, in_rename2->newdir, new_name);
+    return dev->ops.rename(se, dev->user_data, in_hdr, name, in_rename2->newdir,
                     new_name, in_rename2->flags, out_hdr, completion_context, device_id);
 }
 
-static int fuse_ll_read(struct dpfs_fuse *f_ll,
+static int fuse_ll_read(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   void *completion_context, uint16_t device_id) {
@@ -1396,7 +1807,7 @@ static int fuse_ll_read(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1420,7 +1831,7 @@ static int fuse_ll_read(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.read) {
+    if (!dev->ops.read) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
@@ -1435,11 +1846,11 @@ static int fuse_ll_read(struct dpfs_fuse *f_ll,
         return -EINVAL;
     }
 
-    return f_ll->ops.read(se, f_ll->user_data, in_hdr, in_read, out_hdr,
+    return dev->ops.read(se, dev->user_data, in_hdr, in_read, out_hdr,
             &fuse_out_iov[1], out_iovcnt-1, completion_context, device_id);
 }
 
-static int fuse_ll_write(struct dpfs_fuse *f_ll,
+static int fuse_ll_write(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                void *completion_context, uint16_t device_id) {
@@ -1447,7 +1858,7 @@ static int fuse_ll_write(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1472,7 +1883,7 @@ static int fuse_ll_write(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.write) {
+    if (!dev->ops.write) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
@@ -1487,11 +1898,11 @@ static int fuse_ll_write(struct dpfs_fuse *f_ll,
         return -EINVAL;
     }
 
-    return f_ll->ops.write(se, f_ll->user_data, in_hdr, in_write,
+    return dev->ops.write(se, dev->user_data, in_hdr, in_write,
             &fuse_in_iov[2], in_iovcnt-2, out_hdr, out_write, completion_context, device_id);
 }
 
-static int fuse_ll_mknod(struct dpfs_fuse *f_ll,
+static int fuse_ll_mknod(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
            void *completion_context, uint16_t device_id)
@@ -1500,7 +1911,7 @@ static int fuse_ll_mknod(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1512,7 +1923,7 @@ static int fuse_ll_mknod(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.mknod) {
+    if (!dev->ops.mknod) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
@@ -1534,10 +1945,12 @@ static int fuse_ll_mknod(struct dpfs_fuse *f_ll,
     printf("* umask: 0x%X\n", in_mknod->umask);
 #endif
 
-    return f_ll->ops.mknod(se, f_ll->user_data, in_hdr, in_mknod, in_name, out_hdr, out_entry, completion_context, device_id);
+    if (dev->nc)
+        negative_cache_invalidate(dev->nc, in_hdr->nodeid, in_name);
+    return dev->ops.mknod(se, dev->user_data, in_hdr, in_mknod, in_name, out_hdr, out_entry, completion_context, device_id);
 }
 
-static int fuse_ll_mkdir(struct dpfs_fuse *f_ll,
+static int fuse_ll_mkdir(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
            void *completion_context, uint16_t device_id)
@@ -1546,7 +1959,7 @@ static int fuse_ll_mkdir(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1569,15 +1982,17 @@ static int fuse_ll_mkdir(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.mkdir) {
+    if (!dev->ops.mkdir) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.mkdir(se, f_ll->user_data, in_hdr, in_mkdir, in_name, out_hdr, out_entry, completion_context, device_id);
+    if (dev->nc)
+        negative_cache_invalidate(dev->nc, in_hdr->nodeid, in_name);
+    return dev->ops.mkdir(se, dev->user_data, in_hdr, in_mkdir, in_name, out_hdr, out_entry, completion_context, device_id);
 }
 
-static int fuse_ll_symlink(struct dpfs_fuse *f_ll,
+static int fuse_ll_symlink(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
            void *completion_context, uint16_t device_id)
@@ -1586,7 +2001,7 @@ static int fuse_ll_symlink(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1610,15 +2025,17 @@ static int fuse_ll_symlink(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.symlink) {
+    if (!dev->ops.symlink) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.symlink(se, f_ll->user_data, in_hdr, in_name, in_link_name, out_hdr, out_entry, completion_context, device_id);
+    if (dev->nc)
+        negative_cache_invalidate(dev->nc, in_hdr->nodeid, in_name);
+    return dev->ops.symlink(se, dev->user_data, in_hdr, in_name, in_link_name, out_hdr, out_entry, completion_context, device_id);
 }
 
-static int fuse_ll_statfs(struct dpfs_fuse *f_ll,
+static int fuse_ll_statfs(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
            void *completion_context, uint16_t device_id)
@@ -1627,7 +2044,7 @@ static int fuse_ll_statfs(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1645,15 +2062,15 @@ static int fuse_ll_statfs(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.statfs) {
+    if (!dev->ops.statfs) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.statfs(se, f_ll->user_data, in_hdr, out_hdr, out_statfs, completion_context, device_id);
+    return dev->ops.statfs(se, dev->user_data, in_hdr, out_hdr, out_statfs, completion_context, device_id);
 }
 
-static int fuse_ll_unlink(struct dpfs_fuse *f_ll,
+static int fuse_ll_unlink(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
            void *completion_context, uint16_t device_id)
@@ -1662,7 +2079,7 @@ static int fuse_ll_unlink(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1681,15 +2098,15 @@ static int fuse_ll_unlink(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.unlink) {
+    if (!dev->ops.unlink) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
 
-    return f_ll->ops.unlink(se, f_ll->user_data , in_hdr, in_name, out_hdr, completion_context, device_id);
+    return dev->ops.unlink(se, dev->user_data , in_hdr, in_name, out_hdr, completion_context, device_id);
 }
 
-static int fuse_ll_readlink(struct dpfs_fuse *f_ll,
+static int fuse_ll_readlink(struct fuse_ll_device *dev,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
            void *completion_context, uint16_t device_id)
@@ -1704,14 +2121,14 @@ static int fuse_ll_readlink(struct dpfs_fuse *f_ll,
         fprintf(stderr, " out_iov[%d].len=%ld", i, fuse_out_iov[i].iov_len);
     }
     fprintf(stderr, "\n");
-    (void) f_ll;
+    (void) dev;
 
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
     out_hdr->error = -ENOSYS;
     return 0;
 }
 
-static int fuse_ll_fallocate(struct dpfs_fuse *f_ll,
+static int fuse_ll_fallocate(struct fuse_ll_device *dev,
         struct iovec *fuse_in_iov, int in_iovcnt,
         struct iovec *fuse_out_iov, int out_iovcnt,
         void *completion_context, uint16_t device_id)
@@ -1720,7 +2137,7 @@ static int fuse_ll_fallocate(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
         return -EINVAL;
     }
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_session *se = &dev->se;
 
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
@@ -1742,12 +2159,92 @@ static int fuse_ll_fallocate(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
-    if (!f_ll->ops.fallocate) {
+    if (!dev->ops.fallocate) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+    return dev->ops.fallocate(se, dev->user_data, in_hdr, in_fallocate, out_hdr, completion_context, device_id);
+}
+
+static int fuse_ll_copy_file_range(struct fuse_ll_device *dev,
+        struct iovec *fuse_in_iov, int in_iovcnt,
+        struct iovec *fuse_out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt != 2 || out_iovcnt != 2) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = &dev->se;
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    struct fuse_copy_file_range_in *in_cfr = (struct fuse_copy_file_range_in *) fuse_in_iov[1].iov_base;
+    struct fuse_write_out *out_write = (struct fuse_write_out *) fuse_out_iov[1].iov_base;
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* fh_in: %lu\n", in_cfr->fh_in);
+    printf("* off_in: %lu\n", in_cfr->off_in);
+    printf("* nodeid_out: %lu\n", in_cfr->nodeid_out);
+    printf("* fh_out: %lu\n", in_cfr->fh_out);
+    printf("* off_out: %lu\n", in_cfr->off_out);
+    printf("* len: %lu\n", in_cfr->len);
+    printf("* flags: %lu\n", in_cfr->flags);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    if (!dev->ops.copy_file_range) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
+    return dev->ops.copy_file_range(se, dev->user_data, in_hdr, in_cfr, out_hdr, out_write, completion_context, device_id);
+}
+
+static int fuse_ll_lseek(struct fuse_ll_device *dev,
+        struct iovec *fuse_in_iov, int in_iovcnt,
+        struct iovec *fuse_out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt != 2 || out_iovcnt != 2) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = &dev->se;
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    struct fuse_lseek_in *in_lseek = (struct fuse_lseek_in *) fuse_in_iov[1].iov_base;
+    struct fuse_lseek_out *out_lseek = (struct fuse_lseek_out *) fuse_out_iov[1].iov_base;
 
-    return f_ll->ops.fallocate(se, f_ll->user_data, in_hdr, in_fallocate, out_hdr, completion_context, device_id);
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* fh: %lu\n", in_lseek->fh);
+    printf("* offset: %lu\n", in_lseek->offset);
+    printf("* whence: %u\n", in_lseek->whence);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    // The host remembers the ENOSYS and from then on treats the whole file as data
+    if (!dev->ops.lseek) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+    return dev->ops.lseek(se, dev->user_data, in_hdr, in_lseek, out_hdr, out_lseek, completion_context, device_id);
 }
 
 static void fuse_ll_map(struct dpfs_fuse *fuse_ll) {
@@ -1773,6 +2270,7 @@ static void fuse_ll_map(struct dpfs_fuse *fuse_ll) {
     fuse_ll->fuse_handlers[FUSE_RMDIR] = fuse_ll_rmdir;
     fuse_ll->fuse_handlers[FUSE_FORGET] = fuse_ll_forget;
     fuse_ll->fuse_handlers[FUSE_BATCH_FORGET] = fuse_ll_batch_forget;
+    fuse_ll->fuse_handlers[FUSE_INTERRUPT] = fuse_ll_interrupt;
     fuse_ll->fuse_handlers[FUSE_RENAME] = fuse_ll_rename;
     fuse_ll->fuse_handlers[FUSE_RENAME2] = fuse_ll_rename2;
     fuse_ll->fuse_handlers[FUSE_READ] = fuse_ll_read;
@@ -1787,9 +2285,14 @@ static void fuse_ll_map(struct dpfs_fuse *fuse_ll) {
     fuse_ll->fuse_handlers[FUSE_SETLKW] = fuse_ll_setlkw;
     fuse_ll->fuse_handlers[FUSE_SETLK] = fuse_ll_setlk;
     fuse_ll->fuse_handlers[FUSE_FALLOCATE] = fuse_ll_fallocate;
+    fuse_ll->fuse_handlers[FUSE_COPY_FILE_RANGE] = fuse_ll_copy_file_range;
+    fuse_ll->fuse_handlers[FUSE_LSEEK] = fuse_ll_lseek;
+#ifdef DPFS_FUSE_STATX
+    fuse_ll->fuse_handlers[FUSE_STATX] = fuse_ll_statx;
+#endif
 }
 
-static int fuse_unknown(struct dpfs_fuse *fuse_ll,
+static int fuse_unknown(struct fuse_ll_device *dev,
                         struct iovec *fuse_in_iov, int in_iovcnt,
                         struct iovec *fuse_out_iov, int out_iovcnt,
                         void *completion_context, uint16_t device_id) {
@@ -1802,13 +2305,11 @@ static int fuse_unknown(struct dpfs_fuse *fuse_ll,
     return 0;
 }
 
-static int fuse_handle_req(void *u,
-                           struct iovec *in_iov, int in_iovcnt,
-                           struct iovec *out_iov, int out_iovcnt,
-                           void *completion_context, uint16_t device_id)
+static int fuse_ll_dispatch(struct dpfs_fuse *fuse_ll, struct fuse_ll_device *dev,
+                            struct iovec *in_iov, int in_iovcnt,
+                            struct iovec *out_iov, int out_iovcnt,
+                            void *completion_context, uint16_t device_id)
 {
-    struct dpfs_fuse *fuse_ll = (struct dpfs_fuse *) u;
-
     if (in_iovcnt < 1 || in_iovcnt < 1) {
         fprintf(stderr, "%s: iovecs in and out don't both atleast one iovec\n", __func__);
         return -EINVAL;
@@ -1824,7 +2325,8 @@ static int fuse_handle_req(void *u,
         if (h == NULL) {
             h = fuse_unknown;
         }
-        int ret = h(fuse_ll, in_iov, in_iovcnt, out_iov, out_iovcnt, completion_context, device_id);
+
+        int ret = h(dev, in_iov, in_iovcnt, out_iov, out_iovcnt, completion_context, device_id);
         
 #ifdef DEBUG_ENABLED
         if (ret == 0 && out_iovcnt > 0 &&
@@ -1840,21 +2342,194 @@ static int fuse_handle_req(void *u,
     }
 }
 
+int dpfs_fuse_handle_req(struct dpfs_fuse *fuse_ll,
+                         struct iovec *in_iov, int in_iovcnt,
+                         struct iovec *out_iov, int out_iovcnt,
+                         void *completion_context, uint16_t device_id)
+{
+    return fuse_ll_dispatch(fuse_ll, fuse_ll_device_get(&fuse_ll->devs, device_id),
+            in_iov, in_iovcnt, out_iov, out_iovcnt, completion_context, device_id);
+}
+
+// Flow control hands the requests to the backend through this, also the ones that it queued
+static int fuse_ll_flow_handle(void *u,
+                               struct iovec *in_iov, int in_iovcnt,
+                               struct iovec *out_iov, int out_iovcnt,
+                               void *completion_context, uint16_t device_id)
+{
+    struct dpfs_fuse *fuse_ll = (struct dpfs_fuse *) u;
+    if (write_gather_is_wb(completion_context))
+        return write_gather_dispatch(in_iov, completion_context);
+
+    struct fuse_ll_device *dev = fuse_ll_device_get(&fuse_ll->devs, device_id);
+    if (!dev) {
+        fprintf(stderr, "%s: request for unknown device %u\n", __func__, device_id);
+        return -ENODEV;
+    }
+
+    if (dev->handler)
+        return dev->handler(fuse_ll, &dev->se, dev->user_data,
+                in_iov, in_iovcnt, out_iov, out_iovcnt, completion_context, device_id);
+    else
+        return fuse_ll_dispatch(fuse_ll, dev, in_iov, in_iovcnt, out_iov, out_iovcnt, completion_context, device_id);
+}
+
+// The poll hook of the HAL
+static void fuse_poll(void *u, uint16_t thread_id)
+{
+    struct dpfs_fuse *fuse_ll = (struct dpfs_fuse *) u;
+    fuse_ll_flow_poll(fuse_ll->flow, thread_id);
+    // After the flow control, so that the requests it dispatched are picked up as well
+    for (auto &poll : fuse_ll->polls)
+        poll.first(poll.second, thread_id);
+    // Resumes the requests that waited for write backs, which go to the flow control
+    if (fuse_ll->wg_conf) {
+        write_gather_poll(fuse_ll->wg_conf, thread_id);
+        write_gather_expire_thread(fuse_ll->wg_conf, &fuse_ll->devs, thread_id);
+    }
+    fuse_ll_device_quiescent(&fuse_ll->devs);
+}
+
+// Everything that comes after the capture of a request: write gathering and flow control
+static int fuse_ll_submit(struct dpfs_fuse *fuse_ll, struct fuse_ll_device *dev,
+                          struct iovec *in_iov, int in_iovcnt,
+                          struct iovec *out_iov, int out_iovcnt,
+                          void *completion_context, uint16_t device_id, bool *queued)
+{
+    *queued = false;
+    int ret;
+    if (dev->wg && write_gather_request(dev->wg, in_iov, in_iovcnt, out_iov, out_iovcnt,
+                completion_context, &ret))
+        return ret;
+
+    uint16_t thread_id = dpfs_hal_thread_id();
+    // Older requests first
+    fuse_ll_flow_poll(fuse_ll->flow, thread_id);
+    return fuse_ll_flow_submit(fuse_ll->flow, thread_id, in_iov, in_iovcnt, out_iov, out_iovcnt,
+            completion_context, device_id, queued);
+}
+
+// A request that waited for write backs, see write_gather.h
+static void fuse_ll_resume(void *u,
+                           struct iovec *in_iov, int in_iovcnt,
+                           struct iovec *out_iov, int out_iovcnt,
+                           void *completion_context, uint16_t device_id)
+{
+    struct dpfs_fuse *fuse_ll = (struct dpfs_fuse *) u;
+    struct fuse_ll_device *dev = fuse_ll_device_get(&fuse_ll->devs, device_id);
+    // The HAL got EWOULDBLOCK for this request, so it has to be completed either way
+    int ret = -ENODEV;
+    bool queued;
+    if (dev)
+        ret = fuse_ll_submit(fuse_ll, dev, in_iov, in_iovcnt, out_iov, out_iovcnt,
+                completion_context, device_id, &queued);
+    if (ret == 0)
+        dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_SUCCES);
+    else if (ret != EWOULDBLOCK)
+        dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_ERROR);
+}
+
+// The request handler of the HAL
+static int fuse_handle_req(void *u,
+                           struct iovec *in_iov, int in_iovcnt,
+                           struct iovec *out_iov, int out_iovcnt,
+                           void *completion_context, uint16_t device_id)
+{
+    struct dpfs_fuse *fuse_ll = (struct dpfs_fuse *) u;
+    struct fuse_ll_device *dev = fuse_ll_device_get(&fuse_ll->devs, device_id);
+    if (!dev) {
+        fprintf(stderr, "%s: request for unknown device %u\n", __func__, device_id);
+        return -ENODEV;
+    }
+    // Unique 0 is reserved for notifications, a host never sends it
+    if (in_iovcnt < 1 || in_iov[0].iov_len < sizeof(struct fuse_in_header) ||
+            ((struct fuse_in_header *) in_iov[0].iov_base)->unique == 0) {
+        fprintf(stderr, "%s: invalid request header from device %u\n", __func__, device_id);
+        return -EINVAL;
+    }
+
+    struct fuse_ll_trace_req *treq = NULL;
+    if (fuse_ll->trace) {
+        treq = fuse_ll_trace_begin(fuse_ll->trace, in_iov, in_iovcnt, out_iov, out_iovcnt,
+                completion_context, device_id);
+        if (treq)
+            completion_context = fuse_ll_trace_context(treq);
+    }
+
+    bool queued;
+    int ret = fuse_ll_submit(fuse_ll, dev, in_iov, in_iovcnt, out_iov, out_iovcnt,
+            completion_context, device_id, &queued);
+
+    if (treq && ret != EWOULDBLOCK)
+        fuse_ll_trace_end(treq, ret);
+
+    fuse_ll_device_count(dev->requests);
+    if (queued)
+        fuse_ll_device_count(dev->throttled);
+    if (ret == EWOULDBLOCK) {
+        fuse_ll_device_count(dev->async);
+    } else if (ret != 0) {
+        fuse_ll_device_count(dev->errors);
+    } else if (out_iovcnt > 0) {
+        struct fuse_out_header *out_hdr = (struct fuse_out_header *) out_iov[0].iov_base;
+        if (out_hdr->error != 0)
+            fuse_ll_device_count(dev->errors);
+    }
+
+    fuse_ll_device_quiescent(&fuse_ll->devs);
+    return ret;
+}
+
 uint16_t dpfs_fuse_nthreads(struct dpfs_fuse *f_ll)
 {
+    // The replayer hands out all requests from a single thread
+    if (!f_ll->hal)
+        return 1;
     return dpfs_hal_nthreads(f_ll->hal);
 }
 
+uint32_t dpfs_fuse_thread_queue_depth(struct dpfs_fuse *f_ll, uint16_t thread_id)
+{
+    // The replayer has as many requests in flight as the trace, which the host limited
+    if (!f_ll->hal)
+        return DPFS_HAL_MAX_BACKGROUND;
+    return dpfs_hal_thread_queue_depth(f_ll->hal, thread_id);
+}
+
+int dpfs_fuse_device_stats(struct dpfs_fuse *f_ll, uint16_t device_id,
+        struct dpfs_fuse_device_stats *stats)
+{
+    struct fuse_ll_device *dev = fuse_ll_device_pin(&f_ll->devs, device_id);
+    if (!dev) {
+        fuse_ll_device_unpin(&f_ll->devs);
+        return -ENODEV;
+    }
+    stats->requests = dev->requests.load(std::memory_order_relaxed);
+    stats->async = dev->async.load(std::memory_order_relaxed);
+    stats->errors = dev->errors.load(std::memory_order_relaxed);
+    stats->negative_hits = dev->nc ? dev->nc->hits.load(std::memory_order_relaxed) : 0;
+    stats->negative_misses = dev->nc ? dev->nc->misses.load(std::memory_order_relaxed) : 0;
+    stats->throttled = dev->throttled.load(std::memory_order_relaxed);
+    fuse_ll_device_unpin(&f_ll->devs);
+    return 0;
+}
+
 void register_dpfs_device(void *user_data, uint16_t device_id)
 {
     struct dpfs_fuse *f_ll = (struct dpfs_fuse *) user_data;
 
-    struct fuse_session *se = (struct fuse_session *) calloc(1, sizeof(struct fuse_session));
-    if (se == NULL) {
+    if (device_id >= DPFS_FUSE_MAX_DEVICES) {
+        fprintf(stderr, "%s - ERROR: device_id %u is too large, dpfs_fuse supports up to %u devices\n",
+                __func__, device_id, DPFS_FUSE_MAX_DEVICES);
+        return;
+    }
+    struct fuse_ll_device *dev = new (std::nothrow) fuse_ll_device();
+    if (dev == NULL) {
         fprintf(stderr, "%s - ERROR: Could not allocate memory for fuse_session", __func__);
         return;
     }
-    f_ll->se.insert(std::make_pair(device_id, se));
+    dev->device_id = device_id;
+    struct fuse_session *se = &dev->se;
 
     se->conn.max_write = UINT_MAX;
     se->conn.max_readahead = UINT_MAX;
@@ -1862,63 +2537,400 @@ void register_dpfs_device(void *user_data, uint16_t device_id)
     se->bufsize = FUSE_MAX_MAX_PAGES * getpagesize() +
         FUSE_BUFFER_HEADER_SIZE;
 
-    if (f_ll->register_device_cb)
-        f_ll->register_device_cb(f_ll->user_data, device_id);
+    auto conf = f_ll->dev_conf.find(device_id);
+    if (conf != f_ll->dev_conf.end()) {
+        dev->conf = conf->second;
+    } else {
+        dev->conf.attr_timeout = -1;
+        dev->conf.entry_timeout = -1;
+        dev->conf.disable_caps = 0;
+        dev->conf.backend = 0;
+    }
+    struct dpfs_fuse_backend *backend = &f_ll->backends[dev->conf.backend];
+    dev->ops = *backend->ops;
+    dev->user_data = backend->user_data;
+    dev->handler = backend->handler;
+    dev->flow = f_ll->flow;
+
+    // dpfs_fuse_new_multi() doesn't allow these with a handler
+    if (f_ll->wg_conf)
+        dev->wg = write_gather_new(f_ll->wg_conf, se, &dev->ops, dev->user_data, device_id,
+                f_ll->flow, fuse_ll_resume, f_ll);
+    if (f_ll->nc_entries)
+        dev->nc = negative_cache_new(f_ll->nc_entries, f_ll->nc_ttl_msec);
+
+    if (fuse_ll_device_publish(&f_ll->devs, dev) != 0) {
+        fprintf(stderr, "%s - ERROR: device %u is already registered\n", __func__, device_id);
+        delete dev;
+        return;
+    }
+
+    if (backend->register_device_cb)
+        backend->register_device_cb(backend->user_data, device_id);
 }
 
 void unregister_dpfs_device(void *user_data, uint16_t device_id)
 {
     struct dpfs_fuse *f_ll = (struct dpfs_fuse *) user_data;
-    struct fuse_session *se = f_ll->se.at(device_id);
+    struct fuse_ll_device *dev = fuse_ll_device_unpublish(&f_ll->devs, device_id);
+    if (!dev)
+        return;
+
+    struct dpfs_fuse_backend *backend = &f_ll->backends[dev->conf.backend];
+    if (backend->unregister_device_cb)
+        backend->unregister_device_cb(backend->user_data, device_id);
 
-    if (f_ll->unregister_device_cb)
-        f_ll->unregister_device_cb(f_ll->user_data, device_id);
+    // Freed with the device, dpfs_fuse_device_stats() might still be looking at it and the HAL
+    // thread of the device might still be in the middle of a write back (see write_gather_drain())
 
-    f_ll->se.erase(device_id);
-    free(se);
+    fuse_ll_device_retire(&f_ll->devs, dev);
 }
 
-struct dpfs_fuse *dpfs_fuse_new(struct fuse_ll_operations *ops, const char *hal_conf_path, 
-                   void *user_data, dpfs_hal_register_device_t register_device_cb,
-                   dpfs_hal_unregister_device_t unregister_device_cb)
+static const struct {
+    const char *name;
+    uint64_t cap;
+} fuse_ll_cap_names[] = {
+    { "async_read", FUSE_CAP_ASYNC_READ },
+    { "atomic_o_trunc", FUSE_CAP_ATOMIC_O_TRUNC },
+    { "flock_locks", FUSE_CAP_FLOCK_LOCKS },
+    { "auto_inval_data", FUSE_CAP_AUTO_INVAL_DATA },
+    { "readdirplus", FUSE_CAP_READDIRPLUS },
+    { "readdirplus_auto", FUSE_CAP_READDIRPLUS_AUTO },
+    { "async_dio", FUSE_CAP_ASYNC_DIO },
+    { "writeback_cache", FUSE_CAP_WRITEBACK_CACHE },
+    { "parallel_dirops", FUSE_CAP_PARALLEL_DIROPS },
+    { "posix_acl", FUSE_CAP_POSIX_ACL },
+    { "handle_killpriv", FUSE_CAP_HANDLE_KILLPRIV },
+    { "cache_symlinks", FUSE_CAP_CACHE_SYMLINKS },
+};
+
+// Reads the optional [dpfs.device.<device_id>] tables
+static int dpfs_fuse_parse_dev_conf(struct dpfs_fuse *f_ll, toml_table_t *dpfs_conf)
+{
+    toml_table_t *devs = toml_table_in(dpfs_conf, "device");
+    if (!devs)
+        return 0;
+
+    for (int i = 0; ; i++) {
+        const char *key = toml_key_in(devs, i);
+        if (!key)
+            break;
+        char *end;
+        unsigned long device_id = strtoul(key, &end, 10);
+        toml_table_t *dev = toml_table_in(devs, key);
+        if (*end != '\0' || device_id >= DPFS_FUSE_MAX_DEVICES || !dev) {
+            fprintf(stderr, "%s: [dpfs.device.%s] must be a table named after a device_id below %u\n",
+                    __func__, key, DPFS_FUSE_MAX_DEVICES);
+            return -1;
+        }
+
+        struct fuse_ll_device_conf conf;
+        conf.attr_timeout = -1;
+        conf.entry_timeout = -1;
+        conf.disable_caps = 0;
+        conf.backend = 0;
+
+        toml_datum_t backend = toml_string_in(dev, "backend"); // optional
+        if (backend.ok) {
+            size_t b = 0;
+            for (; b < f_ll->backends.size(); b++) {
+                if (strcmp(backend.u.s, f_ll->backends[b].name) == 0)
+                    break;
+            }
+            if (b == f_ll->backends.size()) {
+                fprintf(stderr, "%s: unknown backend %s for [dpfs.device.%s]\n", __func__, backend.u.s, key);
+                free(backend.u.s);
+                return -1;
+            }
+            conf.backend = b;
+            free(backend.u.s);
+        }
+
+        toml_datum_t attr_timeout = toml_double_in(dev, "attr_timeout"); // optional
+        if (attr_timeout.ok)
+            conf.attr_timeout = attr_timeout.u.d;
+        toml_datum_t entry_timeout = toml_double_in(dev, "entry_timeout"); // optional
+        if (entry_timeout.ok)
+            conf.entry_timeout = entry_timeout.u.d;
+
+        toml_array_t *caps = toml_array_in(dev, "disable_caps"); // optional
+        for (int j = 0; caps && j < toml_array_nelem(caps); j++) {
+            toml_datum_t cap = toml_string_at(caps, j);
+            size_t k = 0;
+            for (; cap.ok && k < sizeof(fuse_ll_cap_names) / sizeof(fuse_ll_cap_names[0]); k++) {
+                if (strcmp(cap.u.s, fuse_ll_cap_names[k].name) == 0) {
+                    conf.disable_caps |= fuse_ll_cap_names[k].cap;
+                    break;
+                }
+            }
+            if (!cap.ok || k == sizeof(fuse_ll_cap_names) / sizeof(fuse_ll_cap_names[0])) {
+                fprintf(stderr, "%s: unknown capability in disable_caps of [dpfs.device.%s]\n", __func__, key);
+                free(cap.u.s);
+                return -1;
+            }
+            free(cap.u.s);
+        }
+
+        f_ll->dev_conf[device_id] = conf;
+    }
+    return 0;
+}
+
+// Reads the optional dpfs_fuse settings under [dpfs]
+static int dpfs_fuse_parse_conf(struct dpfs_fuse *f_ll, const char *conf_path)
+{
+    FILE *fp;
+    char errbuf[200];
+
+    fp = fopen(conf_path, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: cannot open %s - %s\n", __func__,
+                conf_path, strerror(errno));
+        return -1;
+    }
+
+    toml_table_t *conf = toml_parse_file(fp, errbuf, sizeof(errbuf));
+    fclose(fp);
+
+    if (!conf) {
+        fprintf(stderr, "%s: cannot parse - %s\n", __func__, errbuf);
+        return -1;
+    }
+
+    toml_table_t *dpfs_conf = toml_table_in(conf, "dpfs");
+    if (!dpfs_conf) {
+        toml_free(conf);
+        return 0;
+    }
+
+    toml_datum_t write_gather = toml_bool_in(dpfs_conf, "write_gather"); // optional
+    if (write_gather.ok && write_gather.u.b) {
+        toml_datum_t budget = toml_int_in(dpfs_conf, "write_gather_budget_mib");
+        toml_datum_t file_limit = toml_int_in(dpfs_conf, "write_gather_file_kib");
+        toml_datum_t timeout = toml_int_in(dpfs_conf, "write_gather_timeout_msec");
+        if (!budget.ok || budget.u.i < 1 || !file_limit.ok || file_limit.u.i < 4 ||
+                !timeout.ok || timeout.u.i < 1) {
+            fprintf(stderr, "%s: write_gather requires write_gather_budget_mib >= 1, "
+                    "write_gather_file_kib >= 4 and write_gather_timeout_msec >= 1 under [dpfs]\n", __func__);
+            toml_free(conf);
+            return -1;
+        }
+        if (file_limit.u.i * 1024 > budget.u.i * 1024 * 1024) {
+            fprintf(stderr, "%s: write_gather_file_kib can't be larger than write_gather_budget_mib\n", __func__);
+            toml_free(conf);
+            return -1;
+        }
+
+        f_ll->wg_conf = write_gather_conf_new(budget.u.i * 1024 * 1024, file_limit.u.i * 1024, timeout.u.i);
+        if (!f_ll->wg_conf) {
+            fprintf(stderr, "%s: out of memory\n", __func__);
+            toml_free(conf);
+            return -1;
+        }
+        printf("dpfs_fuse: write gathering enabled, %ld KiB per file, %ld MiB in total, %ld ms timeout\n",
+                file_limit.u.i, budget.u.i, timeout.u.i);
+    }
+
+    toml_datum_t nc_entries = toml_int_in(dpfs_conf, "negative_cache_entries"); // optional
+    if (nc_entries.ok && nc_entries.u.i > 0) {
+        toml_datum_t ttl = toml_int_in(dpfs_conf, "negative_cache_ttl_msec");
+        if (!ttl.ok || ttl.u.i < 1) {
+            fprintf(stderr, "%s: negative_cache_entries requires negative_cache_ttl_msec >= 1 under [dpfs]\n", __func__);
+            toml_free(conf);
+            return -1;
+        }
+        f_ll->nc_entries = nc_entries.u.i;
+        f_ll->nc_ttl_msec = ttl.u.i;
+        printf("dpfs_fuse: negative dentry cache enabled, %ld entries per device, %ld ms TTL\n",
+                nc_entries.u.i, ttl.u.i);
+    }
+
+    toml_datum_t trace = toml_string_in(dpfs_conf, "trace"); // optional
+    toml_datum_t replay = toml_string_in(dpfs_conf, "replay"); // optional
+    if (trace.ok && replay.ok) {
+        fprintf(stderr, "%s: trace and replay under [dpfs] can't be combined\n", __func__);
+        free(trace.u.s);
+        free(replay.u.s);
+        toml_free(conf);
+        return -1;
+    }
+    if (trace.ok) {
+        toml_datum_t payloads = toml_bool_in(dpfs_conf, "trace_payloads"); // optional
+        f_ll->trace = fuse_ll_trace_open(trace.u.s, payloads.ok && payloads.u.b);
+        free(trace.u.s);
+        if (!f_ll->trace) {
+            toml_free(conf);
+            return -1;
+        }
+    }
+    if (replay.ok) {
+        f_ll->replay_path = replay.u.s;
+        free(replay.u.s);
+        f_ll->replay_original_timing = true;
+        toml_datum_t timing = toml_string_in(dpfs_conf, "replay_timing"); // optional
+        if (timing.ok) {
+            if (strcmp(timing.u.s, "fast") == 0) {
+                f_ll->replay_original_timing = false;
+            } else if (strcmp(timing.u.s, "original") != 0) {
+                fprintf(stderr, "%s: replay_timing under [dpfs] must be \"original\" or \"fast\"\n", __func__);
+                free(timing.u.s);
+                toml_free(conf);
+                return -1;
+            }
+            free(timing.u.s);
+        }
+    }
+
+    if (dpfs_fuse_parse_dev_conf(f_ll, dpfs_conf) != 0) {
+        toml_free(conf);
+        return -1;
+    }
+
+    toml_free(conf);
+    return 0;
+}
+
+struct dpfs_fuse *dpfs_fuse_new_multi(struct dpfs_fuse_backend *backends, int nbackends,
+                   const char *hal_conf_path)
 {
 #ifdef DEBUG_ENABLED
     printf("dpfs_fuse is running in DEBUG mode\n");
 #endif
 
-    struct dpfs_fuse *f_ll = (struct dpfs_fuse *) calloc(1, sizeof(struct dpfs_fuse));
-    f_ll->se = std::unordered_map<uint16_t, struct fuse_session *>();
-    f_ll->ops = *ops;
-    f_ll->user_data = user_data;
-    f_ll->register_device_cb = register_device_cb;
-    f_ll->unregister_device_cb = unregister_device_cb;
+    if (nbackends < 1) {
+        fprintf(stderr, "%s: at least one backend is required\n", __func__);
+        return NULL;
+    }
+
+    struct dpfs_fuse *f_ll = new dpfs_fuse();
+    fuse_ll_device_table_init(&f_ll->devs);
+    f_ll->backends.assign(backends, backends + nbackends);
+    f_ll->backend_ops.resize(nbackends);
+    for (int i = 0; i < nbackends; i++) {
+        f_ll->backend_ops[i] = *backends[i].ops;
+        f_ll->backends[i].ops = &f_ll->backend_ops[i];
+        if (backends[i].ops->poll)
+            f_ll->polls.emplace_back(backends[i].ops->poll, backends[i].user_data);
+    }
     fuse_ll_map(f_ll);
 
+    if (hal_conf_path && dpfs_fuse_parse_conf(f_ll, hal_conf_path) != 0) {
+        dpfs_fuse_destroy(f_ll);
+        return NULL;
+    }
+    // See dpfs_fuse_new_handler()
+    for (int i = 0; i < nbackends; i++) {
+        if (backends[i].handler && (f_ll->wg_conf || f_ll->nc_entries)) {
+            fprintf(stderr, "%s: backend %s has its own request handler, which can't be combined "
+                    "with write_gather or negative_cache_entries under [dpfs]\n", __func__, backends[i].name);
+            dpfs_fuse_destroy(f_ll);
+            return NULL;
+        }
+    }
+
+    // The devices get registered before the HAL tells how many threads it has
+    f_ll->flow = fuse_ll_flow_new(DPFS_FUSE_MAX_THREADS, fuse_ll_flow_handle, f_ll);
+    if (!f_ll->flow) {
+        fprintf(stderr, "%s: out of memory\n", __func__);
+        dpfs_fuse_destroy(f_ll);
+        return NULL;
+    }
+
+    // The devices only get registered once the replay starts in dpfs_fuse_loop()
+    if (!f_ll->replay_path.empty()) {
+        f_ll->devs.nthreads = 1;
+        return f_ll;
+    }
+
     struct dpfs_hal_params hal_params;
     memset(&hal_params, 0, sizeof(hal_params));
     hal_params.user_data = f_ll;
     hal_params.ops.request_handler = fuse_handle_req;
     hal_params.ops.register_device = register_dpfs_device;
     hal_params.ops.unregister_device = unregister_dpfs_device;
+    hal_params.ops.poll = fuse_poll;
     hal_params.conf_path = hal_conf_path;
 
     struct dpfs_hal *hal = dpfs_hal_new(&hal_params, false);
     if (hal == NULL) {
         fprintf(stderr, "Failed to initialize hal, exiting...\n");
+        dpfs_fuse_destroy(f_ll);
         return NULL;
     }
     f_ll->hal = hal;
 
+    if (dpfs_hal_nthreads(hal) > DPFS_FUSE_MAX_THREADS) {
+        fprintf(stderr, "%s: dpfs_fuse supports up to %u HAL threads\n", __func__, DPFS_FUSE_MAX_THREADS);
+        dpfs_fuse_destroy(f_ll);
+        return NULL;
+    }
+    // From here on retired devices have to wait for the HAL threads
+    f_ll->devs.nthreads = dpfs_hal_nthreads(hal);
+
     return f_ll;
 }
 
+struct dpfs_fuse *dpfs_fuse_new_handler(struct fuse_ll_operations *ops, const char *hal_conf_path,
+                   void *user_data, dpfs_hal_register_device_t register_device_cb,
+                   dpfs_hal_unregister_device_t unregister_device_cb,
+                   dpfs_fuse_handler_t handler)
+{
+    struct dpfs_fuse_backend backend;
+    backend.name = "default";
+    backend.ops = ops;
+    backend.user_data = user_data;
+    backend.register_device_cb = register_device_cb;
+    backend.unregister_device_cb = unregister_device_cb;
+    backend.handler = handler;
+
+    return dpfs_fuse_new_multi(&backend, 1, hal_conf_path);
+}
+
+struct dpfs_fuse *dpfs_fuse_new(struct fuse_ll_operations *ops, const char *hal_conf_path, 
+                   void *user_data, dpfs_hal_register_device_t register_device_cb,
+                   dpfs_hal_unregister_device_t unregister_device_cb)
+{
+    return dpfs_fuse_new_handler(ops, hal_conf_path, user_data, register_device_cb,
+            unregister_device_cb, NULL);
+}
+
 void dpfs_fuse_loop(struct dpfs_fuse *f_ll)
 {
+    if (!f_ll->hal) {
+        struct dpfs_hal_ops ops;
+        ops.request_handler = fuse_handle_req;
+        ops.register_device = register_dpfs_device;
+        ops.unregister_device = unregister_dpfs_device;
+        ops.poll = fuse_poll;
+        fuse_ll_replay(f_ll->replay_path.c_str(), f_ll->replay_original_timing, &ops, f_ll);
+        return;
+    }
     dpfs_hal_loop(f_ll->hal);
 }
+// Also the cleanup of a dpfs_fuse_new_multi() that failed halfway
 void dpfs_fuse_destroy(struct dpfs_fuse *f_ll)
 {
-    dpfs_hal_destroy(f_ll->hal);
+    if (f_ll->hal)
+        dpfs_hal_destroy(f_ll->hal);
+    // The HAL has stopped, so nothing is being traced anymore
+    if (f_ll->trace)
+        fuse_ll_trace_close(f_ll->trace);
+    // Writes back what the devices still have gathered, through the flow control
+    fuse_ll_device_table_destroy(&f_ll->devs);
+    if (f_ll->flow)
+        fuse_ll_flow_destroy(f_ll->flow);
+    if (f_ll->wg_conf)
+        write_gather_conf_destroy(f_ll->wg_conf);
+    delete f_ll;
+}
+
+void dpfs_fuse_set_capacity(struct dpfs_fuse *f_ll, uint16_t thread_id, uint32_t capacity)
+{
+    if (thread_id >= dpfs_fuse_nthreads(f_ll)) {
+        fprintf(stderr, "%s: there is no thread %u\n", __func__, thread_id);
+        return;
+    }
+    fuse_ll_flow_set_capacity(f_ll->flow, thread_id, capacity);
 }
 
 int dpfs_fuse_main(struct fuse_ll_operations *ops, const char *hal_conf_path, 
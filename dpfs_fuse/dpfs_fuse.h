@@ -25,6 +25,11 @@
 #include "dpfs/hal.h"
 #include "common.h"
 
+// FUSE_STATX is part of protocol 7.39 and up, older kernel headers don't have it
+#if FUSE_KERNEL_MINOR_VERSION >= 39
+#define DPFS_FUSE_STATX
+#endif
+
 // Beginning of libfuse/include/fuse_lowlevel.h selective copy
 
 #define FUSE_USE_VERSION 30
@@ -143,6 +148,10 @@ unsigned long calc_timeout_sec(double);
 
 int fuse_ll_reply_attr(struct fuse_session *, struct fuse_out_header *, struct fuse_attr_out *, struct stat *, double attr_timeout);
 int fuse_ll_reply_attrx(struct fuse_session *, struct fuse_out_header *, struct fuse_attr_out *, struct statx *, double attr_timeout);
+#ifdef DPFS_FUSE_STATX
+// Replies with every field of the statx, including the ones struct stat doesn't have (e.g. btime)
+int fuse_ll_reply_statx(struct fuse_session *, struct fuse_out_header *, struct fuse_statx_out *, struct statx *, double attr_timeout);
+#endif
 int fuse_ll_reply_entry(struct fuse_session *se, struct fuse_out_header *, struct fuse_entry_out *, struct fuse_entry_param *);
 int fuse_ll_reply_open(struct fuse_session *se, struct fuse_out_header *out_hdr, struct fuse_open_out *out_open, struct fuse_file_info *fi);
 int fuse_ll_reply_create(struct fuse_session *se, struct fuse_out_header *out_hdr,
@@ -155,6 +164,33 @@ size_t fuse_add_direntry(struct iov *read_iov, const char *name,
         const struct stat *stbuf, off_t off);
 size_t fuse_add_direntry_plus(struct iov *read_iov, const char *name,
         const struct fuse_entry_param *e, off_t off);
+// The same, for when the caller already knows the length of the name.
+// Entries are encoded straight into the iovecs, only the ones that cross into the next
+// iovec go through a bounce buffer.
+size_t fuse_add_direntry_len(struct iov *read_iov, const char *name, size_t namelen,
+        const struct stat *stbuf, off_t off);
+size_t fuse_add_direntry_plus_len(struct iov *read_iov, const char *name, size_t namelen,
+        const struct fuse_entry_param *e, off_t off);
+
+struct fuse_direntry {
+    const char *name;
+    size_t namelen;
+    off_t off;
+    uint64_t ino;
+    mode_t mode;
+};
+struct fuse_direntry_plus {
+    const char *name;
+    size_t namelen;
+    off_t off;
+    struct fuse_entry_param e;
+};
+// Append as many of the n entries as fit, returns the number of entries added
+// and the number of bytes written in *written (optional)
+size_t fuse_add_direntries(struct iov *read_iov, const struct fuse_direntry *ents, size_t n,
+        size_t *written);
+size_t fuse_add_direntries_plus(struct iov *read_iov, const struct fuse_direntry_plus *ents, size_t n,
+        size_t *written);
 
 struct fuse_ll_operations {
     int (*init) (struct fuse_session *, void *user_data,
@@ -275,17 +311,109 @@ struct fuse_ll_operations {
                       struct fuse_in_header *, struct fuse_fallocate_in *,
                       struct fuse_out_header *,
                       void *completion_context, uint16_t device_id);
+    // Copies in->len bytes from (in_hdr->nodeid, fh_in, off_in) to (nodeid_out, fh_out, off_out)
+    // without the data passing through the host, short copies are fine, the host retries
+    int (*copy_file_range) (struct fuse_session *, void *user_data,
+                            struct fuse_in_header *, struct fuse_copy_file_range_in *,
+                            struct fuse_out_header *, struct fuse_write_out *,
+                            void *completion_context, uint16_t device_id);
+    // The host gave up on the request with in_interrupt->unique, if it is still in flight
+    // the backend should cancel it and reply -EINTR, or else just finish it as usual.
+    // There is no reply to the interrupt itself, so this must return 0
+    int (*interrupt) (struct fuse_session *, void *user_data,
+                      struct fuse_in_header *, struct fuse_interrupt_in *in_interrupt,
+                      void *completion_context, uint16_t device_id);
+    // The host only sends SEEK_DATA and SEEK_HOLE, the others it handles itself
+    int (*lseek) (struct fuse_session *, void *user_data,
+                  struct fuse_in_header *, struct fuse_lseek_in *,
+                  struct fuse_out_header *, struct fuse_lseek_out *,
+                  void *completion_context, uint16_t device_id);
+#ifdef DPFS_FUSE_STATX
+    // GETATTR with the statx mask of the host, reply with fuse_ll_reply_statx()
+    int (*statx) (struct fuse_session *, void *user_data,
+                  struct fuse_in_header *, struct fuse_statx_in *,
+                  struct fuse_out_header *, struct fuse_statx_out *,
+                  void *completion_context, uint16_t device_id);
+#endif
+    // Optional, called on every HAL thread after each pass over its devices.
+    // E.g. to submit the I/O that the requests of the pass queued up in one go
+    void (*poll) (void *user_data, uint16_t thread_id);
 };
 
 uint16_t dpfs_fuse_nthreads(struct dpfs_fuse *);
+// How many requests the host can have outstanding at once on a thread, e.g. to size the
+// queues of the backend by
+uint32_t dpfs_fuse_thread_queue_depth(struct dpfs_fuse *, uint16_t thread_id);
 
 struct dpfs_fuse *dpfs_fuse_new(struct fuse_ll_operations *ops, const char *hal_conf_path, 
                    void *user_data, dpfs_hal_register_device_t register_device_cb,
                    dpfs_hal_unregister_device_t unregister_device_cb);
+
+// For front ends that parse and dispatch (some of) the requests themselves, such as
+// dpfs::FuseServer in dpfs_fuse.hpp. The handler is called for every request in place of
+// the fuse_ll_operations dispatching, with the session of the device and user_data, and
+// hands the requests it doesn't handle itself to dpfs_fuse_handle_req().
+// write_gather and negative_cache_entries in the config can't be used with a handler, because
+// they hook into the fuse_ll_operations dispatching of the requests that a handler takes over
+// (e.g. LOOKUP, WRITE, FLUSH and RELEASE). Creating the dpfs_fuse fails in that case.
+typedef int (*dpfs_fuse_handler_t) (struct dpfs_fuse *, struct fuse_session *, void *user_data,
+                                    struct iovec *fuse_in_iov, int in_iovcnt,
+                                    struct iovec *fuse_out_iov, int out_iovcnt,
+                                    void *completion_context, uint16_t device_id);
+struct dpfs_fuse *dpfs_fuse_new_handler(struct fuse_ll_operations *ops, const char *hal_conf_path,
+                   void *user_data, dpfs_hal_register_device_t register_device_cb,
+                   dpfs_hal_unregister_device_t unregister_device_cb,
+                   dpfs_fuse_handler_t handler);
+// The regular dispatching through the fuse_ll_operations
+int dpfs_fuse_handle_req(struct dpfs_fuse *,
+                         struct iovec *fuse_in_iov, int in_iovcnt,
+                         struct iovec *fuse_out_iov, int out_iovcnt,
+                         void *completion_context, uint16_t device_id);
+
+// One of the file systems served by a dpfs_fuse with multiple backends
+struct dpfs_fuse_backend {
+    // Referenced by `backend = "<name>"` under [dpfs.device.<device_id>] in the config
+    const char *name;
+    struct fuse_ll_operations *ops;
+    void *user_data;
+    // Optional, only called for the devices of this backend
+    dpfs_hal_register_device_t register_device_cb;
+    dpfs_hal_unregister_device_t unregister_device_cb;
+    // Optional, see dpfs_fuse_new_handler()
+    dpfs_fuse_handler_t handler;
+};
+// Serves a different backend on each device (PF/VF), every device has its own session.
+// Devices without a backend in the config are served by backends[0].
+struct dpfs_fuse *dpfs_fuse_new_multi(struct dpfs_fuse_backend *backends, int nbackends,
+                   const char *hal_conf_path);
+// Flow control: the backend reports how many requests it can have in flight (i.e. that it
+// returned EWOULDBLOCK for and hasn't completed yet) on HAL thread thread_id, e.g. the size
+// of its per-thread pool of request contexts. The requests beyond that wait in a queue in
+// dpfs_fuse until the backend completes one, and the host gets a max_background (and
+// congestion_threshold) at FUSE_INIT that fits. 0, the default, means no limit.
+// Can be called from any thread at any time, e.g. once a connection of the backend is up.
+void dpfs_fuse_set_capacity(struct dpfs_fuse *, uint16_t thread_id, uint32_t capacity);
 // Loops until stopped by Ctrl+c
 void dpfs_fuse_loop(struct dpfs_fuse *); 
 void dpfs_fuse_destroy(struct dpfs_fuse *); 
 
+// Counters of a device since it was registered, can be read from any thread
+struct dpfs_fuse_device_stats {
+    uint64_t requests;
+    // Requests the backend completed asynchronously
+    uint64_t async;
+    // Requests that were replied to with an error right away or that were aborted
+    uint64_t errors;
+    // LOOKUPs answered by the negative dentry cache, and those that went to the backend.
+    // Both stay 0 if the cache is disabled.
+    uint64_t negative_hits;
+    uint64_t negative_misses;
+    // Requests that had to wait because the backend was at its capacity, see dpfs_fuse_set_capacity()
+    uint64_t throttled;
+};
+// Returns -ENODEV if there is no such device
+int dpfs_fuse_device_stats(struct dpfs_fuse *, uint16_t device_id, struct dpfs_fuse_device_stats *);
+
 // Does new, loop and destroy for you, ala libfuse
 int dpfs_fuse_main(struct fuse_ll_operations *ops, const char *hal_conf_path, 
                    void *user_data, dpfs_hal_register_device_t register_device_cb,
@@ -0,0 +1,404 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef DPFS_FUSE_HPP
+#define DPFS_FUSE_HPP
+
+#include <type_traits>
+#include <utility>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "dpfs_fuse.h"
+
+/*
+ * Header-only C++17 front end to dpfs_fuse, for backends that are a class instead of a
+ * struct fuse_ll_operations full of function pointers and void *user_data casts.
+ *
+ *     class MyFs {
+ *     public:
+ *         int lookup(const dpfs::Request &, const char *name, struct fuse_entry_out *);
+ *         int read(const dpfs::Request &, struct fuse_read_in *, struct iovec *, int iovcnt);
+ *     };
+ *
+ *     MyFs fs;
+ *     dpfs::FuseServer<MyFs> server(fs, conf_path);
+ *     if (server.valid())
+ *         server.loop();
+ *
+ * The methods have the same contract as the fuse_ll_operations: return 0 when the reply has
+ * been filled in, or EWOULDBLOCK and call req.complete() once it has.
+ *
+ * FuseServer parses the hot operations below itself and calls the backend's methods
+ * directly, so the compiler can inline them into the switch. Which of these methods the
+ * backend has is known at compile time, the ones it doesn't have are replied to with
+ * ENOSYS right there. All other opcodes (INIT, DESTROY, INTERRUPT...) go through the
+ * regular dpfs_fuse dispatching, which only knows about init and destroy.
+ * A method is only used if it can be called with the arguments below, overloads are fine,
+ * a method that takes other arguments is ignored.
+ * FuseServer can't be combined with write_gather or negative_cache_entries in the config,
+ * see dpfs_fuse_new_handler().
+ *
+ * The methods a backend can implement:
+ *     int init(const Request &, struct fuse_init_in *, struct fuse_conn_info *);
+ *     int destroy(const Request &);
+ *     int lookup(const Request &, const char *name, struct fuse_entry_out *);
+ *     int forget(const Request &, uint64_t nodeid, uint64_t nlookup); // also for BATCH_FORGET
+ *     int getattr(const Request &, struct fuse_getattr_in *, struct fuse_attr_out *);
+ *     int setattr(const Request &, struct fuse_setattr_in *, struct fuse_attr_out *);
+ *     int mknod(const Request &, struct fuse_mknod_in *, const char *name, struct fuse_entry_out *);
+ *     int unlink(const Request &, const char *name);
+ *     int open(const Request &, struct fuse_open_in *, struct fuse_open_out *);
+ *     int read(const Request &, struct fuse_read_in *, struct iovec *, int iovcnt);
+ *     int write(const Request &, struct fuse_write_in *, struct iovec *, int iovcnt, struct fuse_write_out *);
+ *     int statfs(const Request &, struct fuse_statfs_out *);
+ *     int release(const Request &, struct fuse_release_in *);
+ *     int fsync(const Request &, struct fuse_fsync_in *);
+ *     int flush(const Request &, struct fuse_flush_in *);
+ *     int opendir(const Request &, struct fuse_open_in *, struct fuse_open_out *);
+ *     int readdir(const Request &, struct fuse_read_in *, bool plus, struct iov);
+ *     int releasedir(const Request &, struct fuse_release_in *);
+ */
+
+namespace dpfs {
+
+// The request that is being handled, small enough to copy into an async op
+struct Request {
+    struct fuse_session *se;
+    struct fuse_in_header *in_hdr;
+    struct fuse_out_header *out_hdr;
+    void *completion_context;
+    uint16_t device_id;
+
+    uint64_t nodeid() const { return in_hdr->nodeid; }
+    // Replies with the (positive) errno, returns 0 so it can be returned from a method
+    int error(int err) const
+    {
+        out_hdr->error = -err;
+        return 0;
+    }
+    // For requests that returned EWOULDBLOCK
+    void complete() const
+    {
+        dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_SUCCES);
+    }
+};
+
+namespace detail {
+
+// Whether the backend can be called as b.op(req, args...), this also works for a method
+// that is overloaded or a template, unlike taking &B::op
+#define DPFS_FUSE_HAS_OP(op, ...) \
+    template <typename B, typename Args, typename = void> \
+    struct has_##op##_args : std::false_type {}; \
+    template <typename B, typename... Args> \
+    struct has_##op##_args<B, void(Args...), std::void_t<decltype(std::declval<B &>().op( \
+            std::declval<const Request &>(), std::declval<Args>()...))>> : std::true_type {}; \
+    template <typename B> \
+    using has_##op = has_##op##_args<B, void(__VA_ARGS__)>;
+
+DPFS_FUSE_HAS_OP(init, struct fuse_init_in *, struct fuse_conn_info *)
+DPFS_FUSE_HAS_OP(destroy)
+DPFS_FUSE_HAS_OP(lookup, const char *, struct fuse_entry_out *)
+DPFS_FUSE_HAS_OP(forget, uint64_t, uint64_t)
+DPFS_FUSE_HAS_OP(getattr, struct fuse_getattr_in *, struct fuse_attr_out *)
+DPFS_FUSE_HAS_OP(setattr, struct fuse_setattr_in *, struct fuse_attr_out *)
+DPFS_FUSE_HAS_OP(mknod, struct fuse_mknod_in *, const char *, struct fuse_entry_out *)
+DPFS_FUSE_HAS_OP(unlink, const char *)
+DPFS_FUSE_HAS_OP(open, struct fuse_open_in *, struct fuse_open_out *)
+DPFS_FUSE_HAS_OP(read, struct fuse_read_in *, struct iovec *, int)
+DPFS_FUSE_HAS_OP(write, struct fuse_write_in *, struct iovec *, int, struct fuse_write_out *)
+DPFS_FUSE_HAS_OP(statfs, struct fuse_statfs_out *)
+DPFS_FUSE_HAS_OP(release, struct fuse_release_in *)
+DPFS_FUSE_HAS_OP(fsync, struct fuse_fsync_in *)
+DPFS_FUSE_HAS_OP(flush, struct fuse_flush_in *)
+DPFS_FUSE_HAS_OP(opendir, struct fuse_open_in *, struct fuse_open_out *)
+DPFS_FUSE_HAS_OP(readdir, struct fuse_read_in *, bool, struct iov &)
+DPFS_FUSE_HAS_OP(releasedir, struct fuse_release_in *)
+
+#undef DPFS_FUSE_HAS_OP
+
+} // namespace detail
+
+template <typename Backend>
+class FuseServer {
+public:
+    FuseServer(Backend &backend, const char *hal_conf_path,
+               dpfs_hal_register_device_t register_device_cb = NULL,
+               dpfs_hal_unregister_device_t unregister_device_cb = NULL)
+    {
+        struct fuse_ll_operations ops;
+        memset(&ops, 0, sizeof(ops));
+        if constexpr (detail::has_init<Backend>::value)
+            ops.init = init;
+        if constexpr (detail::has_destroy<Backend>::value)
+            ops.destroy = destroy;
+
+        fuse = dpfs_fuse_new_handler(&ops, hal_conf_path, &backend,
+                register_device_cb, unregister_device_cb, handle_req);
+    }
+    ~FuseServer()
+    {
+        if (fuse)
+            dpfs_fuse_destroy(fuse);
+    }
+    FuseServer(const FuseServer &) = delete;
+    FuseServer &operator=(const FuseServer &) = delete;
+
+    // False if the HAL couldn't be set up
+    bool valid() const { return fuse != NULL; }
+    // Loops until stopped by Ctrl+c
+    void loop() { dpfs_fuse_loop(fuse); }
+    // For the dpfs_fuse_*() functions, e.g. dpfs_fuse_device_stats()
+    struct dpfs_fuse *get() { return fuse; }
+
+private:
+    struct dpfs_fuse *fuse;
+
+    static int init(struct fuse_session *se, void *user_data,
+                    struct fuse_in_header *in_hdr, struct fuse_init_in *in_init,
+                    struct fuse_conn_info *conn, struct fuse_out_header *out_hdr,
+                    uint16_t device_id)
+    {
+        Request req = {se, in_hdr, out_hdr, NULL, device_id};
+        return static_cast<Backend *>(user_data)->init(req, in_init, conn);
+    }
+
+    static int destroy(struct fuse_session *se, void *user_data,
+                       struct fuse_in_header *in_hdr, struct fuse_out_header *out_hdr,
+                       void *completion_context, uint16_t device_id)
+    {
+        Request req = {se, in_hdr, out_hdr, completion_context, device_id};
+        return static_cast<Backend *>(user_data)->destroy(req);
+    }
+
+    static int invalid_iovcnt(uint32_t opcode)
+    {
+        fprintf(stderr, "dpfs::FuseServer: invalid number of iovecs for opcode %u!\n", opcode);
+        return -EINVAL;
+    }
+
+    static int handle_req(struct dpfs_fuse *f_ll, struct fuse_session *se, void *user_data,
+                          struct iovec *in_iov, int in_iovcnt,
+                          struct iovec *out_iov, int out_iovcnt,
+                          void *completion_context, uint16_t device_id)
+    {
+        if (in_iovcnt < 1)
+            return -EINVAL;
+
+        Backend *b = static_cast<Backend *>(user_data);
+        struct fuse_in_header *in_hdr = (struct fuse_in_header *) in_iov[0].iov_base;
+        Request req = {se, in_hdr, NULL, completion_context, device_id};
+
+        // FORGETs have no reply and their argument is in the header iovec
+        if (in_hdr->opcode == FUSE_FORGET || in_hdr->opcode == FUSE_BATCH_FORGET) {
+            if (in_iovcnt != 1 || out_iovcnt != 0)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_forget<Backend>::value) {
+                char *arg = ((char *) in_iov[0].iov_base) + sizeof(*in_hdr);
+                if (in_hdr->opcode == FUSE_FORGET)
+                    return b->forget(req, in_hdr->nodeid, ((struct fuse_forget_in *) arg)->nlookup);
+
+                struct fuse_batch_forget_in *in_batch = (struct fuse_batch_forget_in *) arg;
+                struct fuse_forget_one *one = (struct fuse_forget_one *) (arg + sizeof(*in_batch));
+                for (uint32_t i = 0; i < in_batch->count; i++)
+                    b->forget(req, one[i].nodeid, one[i].nlookup);
+            }
+            return 0;
+        }
+
+        switch (in_hdr->opcode) {
+        case FUSE_LOOKUP:
+        case FUSE_GETATTR:
+        case FUSE_SETATTR:
+        case FUSE_MKNOD:
+        case FUSE_UNLINK:
+        case FUSE_OPEN:
+        case FUSE_READ:
+        case FUSE_WRITE:
+        case FUSE_STATFS:
+        case FUSE_RELEASE:
+        case FUSE_FSYNC:
+        case FUSE_FLUSH:
+        case FUSE_OPENDIR:
+        case FUSE_READDIR:
+        case FUSE_READDIRPLUS:
+        case FUSE_RELEASEDIR:
+            break;
+        default:
+            return dpfs_fuse_handle_req(f_ll, in_iov, in_iovcnt, out_iov, out_iovcnt,
+                    completion_context, device_id);
+        }
+
+        if (out_iovcnt < 1)
+            return invalid_iovcnt(in_hdr->opcode);
+        req.out_hdr = (struct fuse_out_header *) out_iov[0].iov_base;
+        req.out_hdr->unique = in_hdr->unique;
+        req.out_hdr->len = sizeof(*req.out_hdr);
+        req.out_hdr->error = 0;
+
+        switch (in_hdr->opcode) {
+        case FUSE_LOOKUP:
+            if (in_iovcnt != 2 || out_iovcnt != 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_lookup<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->lookup(req, (const char *) in_iov[1].iov_base,
+                        (struct fuse_entry_out *) out_iov[1].iov_base);
+            }
+            break;
+        case FUSE_GETATTR:
+            if (in_iovcnt != 2 || out_iovcnt != 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_getattr<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->getattr(req, (struct fuse_getattr_in *) in_iov[1].iov_base,
+                        (struct fuse_attr_out *) out_iov[1].iov_base);
+            }
+            break;
+        case FUSE_SETATTR:
+            if (in_iovcnt != 2 || out_iovcnt != 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_setattr<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->setattr(req, (struct fuse_setattr_in *) in_iov[1].iov_base,
+                        (struct fuse_attr_out *) out_iov[1].iov_base);
+            }
+            break;
+        case FUSE_MKNOD:
+            if (in_iovcnt != 2 || out_iovcnt != 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_mknod<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                char *arg = (char *) in_iov[1].iov_base;
+                const char *name = arg + (se->conn.proto_minor < 12 ?
+                        FUSE_COMPAT_MKNOD_IN_SIZE : sizeof(struct fuse_mknod_in));
+                return b->mknod(req, (struct fuse_mknod_in *) arg, name,
+                        (struct fuse_entry_out *) out_iov[1].iov_base);
+            }
+            break;
+        case FUSE_UNLINK:
+            if (in_iovcnt != 2 || out_iovcnt != 1)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_unlink<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->unlink(req, (const char *) in_iov[1].iov_base);
+            }
+            break;
+        case FUSE_OPEN:
+            if (in_iovcnt != 2 || out_iovcnt != 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_open<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->open(req, (struct fuse_open_in *) in_iov[1].iov_base,
+                        (struct fuse_open_out *) out_iov[1].iov_base);
+            }
+            break;
+        case FUSE_READ:
+            if (in_iovcnt != 2 || out_iovcnt < 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_read<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->read(req, (struct fuse_read_in *) in_iov[1].iov_base,
+                        &out_iov[1], out_iovcnt - 1);
+            }
+            break;
+        case FUSE_WRITE:
+            if (in_iovcnt < 2 || out_iovcnt != 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_write<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->write(req, (struct fuse_write_in *) in_iov[1].iov_base,
+                        &in_iov[2], in_iovcnt - 2, (struct fuse_write_out *) out_iov[1].iov_base);
+            }
+            break;
+        case FUSE_STATFS:
+            if (in_iovcnt != 1 || out_iovcnt != 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_statfs<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->statfs(req, (struct fuse_statfs_out *) out_iov[1].iov_base);
+            }
+            break;
+        case FUSE_RELEASE:
+            if (in_iovcnt != 2 || out_iovcnt != 1)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_release<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->release(req, (struct fuse_release_in *) in_iov[1].iov_base);
+            }
+            break;
+        case FUSE_FSYNC:
+            if (in_iovcnt != 2 || out_iovcnt != 1)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_fsync<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->fsync(req, (struct fuse_fsync_in *) in_iov[1].iov_base);
+            }
+            break;
+        case FUSE_FLUSH:
+            if (in_iovcnt != 2 || out_iovcnt != 1)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_flush<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->flush(req, (struct fuse_flush_in *) in_iov[1].iov_base);
+            }
+            break;
+        case FUSE_OPENDIR:
+            if (in_iovcnt != 2 || out_iovcnt != 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_opendir<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->opendir(req, (struct fuse_open_in *) in_iov[1].iov_base,
+                        (struct fuse_open_out *) out_iov[1].iov_base);
+            }
+            break;
+        case FUSE_READDIR:
+        case FUSE_READDIRPLUS:
+            if (in_iovcnt != 2 || out_iovcnt < 2)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_readdir<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                struct iov read_iov;
+                iov_init(&read_iov, &out_iov[1], out_iovcnt - 1);
+                return b->readdir(req, (struct fuse_read_in *) in_iov[1].iov_base,
+                        in_hdr->opcode == FUSE_READDIRPLUS, read_iov);
+            }
+            break;
+        case FUSE_RELEASEDIR:
+            if (in_iovcnt != 2 || out_iovcnt != 1)
+                return invalid_iovcnt(in_hdr->opcode);
+            if constexpr (detail::has_releasedir<Backend>::value) {
+                if (!se->init_done)
+                    return req.error(EBUSY);
+                return b->releasedir(req, (struct fuse_release_in *) in_iov[1].iov_base);
+            }
+            break;
+        }
+
+        // The backend doesn't implement it
+        return req.error(ENOSYS);
+    }
+};
+
+} // namespace dpfs
+
+#endif // DPFS_FUSE_HPP
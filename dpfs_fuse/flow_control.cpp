@@ -0,0 +1,203 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <errno.h>
+#include <new>
+
+#include "flow_control.h"
+
+static void fuse_ll_flow_complete(void *arg, enum dpfs_hal_completion_status status);
+
+struct fuse_ll_flow *fuse_ll_flow_new(uint16_t nthreads, fuse_ll_flow_dispatch_t dispatch, void *arg)
+{
+    struct fuse_ll_flow *flow = new (std::nothrow) fuse_ll_flow();
+    if (!flow)
+        return NULL;
+    flow->dispatch = dispatch;
+    flow->arg = arg;
+    flow->nthreads = nthreads;
+    flow->threads = new (std::nothrow) fuse_ll_flow_thread[nthreads];
+    if (!flow->threads) {
+        delete flow;
+        return NULL;
+    }
+    for (uint16_t i = 0; i < nthreads; i++) {
+        struct fuse_ll_flow_thread *t = &flow->threads[i];
+        pthread_spin_init(&t->lock, PTHREAD_PROCESS_PRIVATE);
+        t->capacity = 0;
+        t->inflight = 0;
+        t->nqueued.store(0, std::memory_order_relaxed);
+        t->max_queued.store(0, std::memory_order_relaxed);
+    }
+    return flow;
+}
+
+void fuse_ll_flow_destroy(struct fuse_ll_flow *flow)
+{
+    for (uint16_t i = 0; i < flow->nthreads; i++) {
+        struct fuse_ll_flow_thread *t = &flow->threads[i];
+        for (struct fuse_ll_flow_req *req : t->free)
+            delete req;
+        pthread_spin_destroy(&t->lock);
+    }
+    delete[] flow->threads;
+    delete flow;
+}
+
+void fuse_ll_flow_set_capacity(struct fuse_ll_flow *flow, uint16_t thread_id, uint32_t capacity)
+{
+    struct fuse_ll_flow_thread *t = &flow->threads[thread_id];
+    pthread_spin_lock(&t->lock);
+    t->capacity = capacity;
+    pthread_spin_unlock(&t->lock);
+}
+
+uint32_t fuse_ll_flow_capacity(struct fuse_ll_flow *flow, uint16_t thread_id)
+{
+    struct fuse_ll_flow_thread *t = &flow->threads[thread_id];
+    pthread_spin_lock(&t->lock);
+    uint32_t capacity = t->capacity;
+    pthread_spin_unlock(&t->lock);
+    return capacity;
+}
+
+// Must hold the lock
+static struct fuse_ll_flow_req *fuse_ll_flow_req_get(struct fuse_ll_flow_thread *t)
+{
+    if (!t->free.empty()) {
+        struct fuse_ll_flow_req *req = t->free.back();
+        t->free.pop_back();
+        return req;
+    }
+    struct fuse_ll_flow_req *req = new (std::nothrow) fuse_ll_flow_req();
+    if (!req)
+        return NULL;
+    req->t = t;
+    req->c.cb = fuse_ll_flow_complete;
+    req->c.arg = req;
+    return req;
+}
+
+// Must hold the lock
+static void fuse_ll_flow_req_put(struct fuse_ll_flow_thread *t, struct fuse_ll_flow_req *req)
+{
+    t->inflight--;
+    t->free.push_back(req);
+}
+
+static void fuse_ll_flow_complete(void *arg, enum dpfs_hal_completion_status status)
+{
+    struct fuse_ll_flow_req *req = (struct fuse_ll_flow_req *) arg;
+    struct fuse_ll_flow_thread *t = req->t;
+    void *completion_context = req->completion_context;
+
+    // The HAL thread picks up the queue in its poll hook
+    pthread_spin_lock(&t->lock);
+    fuse_ll_flow_req_put(t, req);
+    pthread_spin_unlock(&t->lock);
+
+    dpfs_hal_async_complete(completion_context, status);
+}
+
+void *fuse_ll_flow_completion_context(void *completion_context)
+{
+    struct dpfs_hal_local_completion *c = dpfs_hal_local_completion_get(completion_context);
+    if (!c || c->cb != fuse_ll_flow_complete)
+        return completion_context;
+    return ((struct fuse_ll_flow_req *) c->arg)->completion_context;
+}
+
+// inflight has already been taken for the request
+static int fuse_ll_flow_dispatch(struct fuse_ll_flow *flow, struct fuse_ll_flow_req *req,
+                                 struct iovec *in_iov, int in_iovcnt,
+                                 struct iovec *out_iov, int out_iovcnt)
+{
+    struct fuse_ll_flow_thread *t = req->t;
+    int ret = flow->dispatch(flow->arg, in_iov, in_iovcnt, out_iov, out_iovcnt,
+            dpfs_hal_local_completion_context(&req->c), req->device_id);
+    if (ret != EWOULDBLOCK) {
+        // The backend is done with it right away, the caller replies
+        pthread_spin_lock(&t->lock);
+        fuse_ll_flow_req_put(t, req);
+        pthread_spin_unlock(&t->lock);
+    }
+    return ret;
+}
+
+int fuse_ll_flow_submit(struct fuse_ll_flow *flow, uint16_t thread_id,
+                        struct iovec *in_iov, int in_iovcnt,
+                        struct iovec *out_iov, int out_iovcnt,
+                        void *completion_context, uint16_t device_id, bool *queued)
+{
+    struct fuse_ll_flow_thread *t = &flow->threads[thread_id];
+    *queued = false;
+
+    pthread_spin_lock(&t->lock);
+    if (t->capacity == 0 && t->queue.empty()) {
+        pthread_spin_unlock(&t->lock);
+        return flow->dispatch(flow->arg, in_iov, in_iovcnt, out_iov, out_iovcnt,
+                completion_context, device_id);
+    }
+
+    struct fuse_ll_flow_req *req = fuse_ll_flow_req_get(t);
+    if (!req) {
+        pthread_spin_unlock(&t->lock);
+        return -ENOMEM;
+    }
+    req->completion_context = completion_context;
+    req->device_id = device_id;
+
+    // Don't overtake the requests that are already waiting
+    if (!t->queue.empty() || t->inflight >= t->capacity) {
+        req->in_iovcnt = in_iovcnt;
+        req->out_iovcnt = out_iovcnt;
+        req->iov.assign(in_iov, in_iov + in_iovcnt);
+        req->iov.insert(req->iov.end(), out_iov, out_iov + out_iovcnt);
+        t->queue.push_back(req);
+        size_t nqueued = t->queue.size();
+        t->nqueued.store(nqueued, std::memory_order_relaxed);
+        if (nqueued > t->max_queued.load(std::memory_order_relaxed))
+            t->max_queued.store(nqueued, std::memory_order_relaxed);
+        pthread_spin_unlock(&t->lock);
+
+        *queued = true;
+        return EWOULDBLOCK;
+    }
+    t->inflight++;
+    pthread_spin_unlock(&t->lock);
+
+    return fuse_ll_flow_dispatch(flow, req, in_iov, in_iovcnt, out_iov, out_iovcnt);
+}
+
+void fuse_ll_flow_poll(struct fuse_ll_flow *flow, uint16_t thread_id)
+{
+    struct fuse_ll_flow_thread *t = &flow->threads[thread_id];
+    if (t->nqueued.load(std::memory_order_relaxed) == 0)
+        return;
+
+    while (true) {
+        pthread_spin_lock(&t->lock);
+        if (t->queue.empty() || (t->capacity && t->inflight >= t->capacity)) {
+            pthread_spin_unlock(&t->lock);
+            return;
+        }
+        struct fuse_ll_flow_req *req = t->queue.front();
+        t->queue.pop_front();
+        t->nqueued.store(t->queue.size(), std::memory_order_relaxed);
+        t->inflight++;
+        pthread_spin_unlock(&t->lock);
+
+        // The HAL got EWOULDBLOCK for this request, so it has to be completed either way
+        void *completion_context = req->completion_context;
+        int ret = fuse_ll_flow_dispatch(flow, req, req->iov.data(), req->in_iovcnt,
+                req->iov.data() + req->in_iovcnt, req->out_iovcnt);
+        if (ret == 0)
+            dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_SUCCES);
+        else if (ret != EWOULDBLOCK)
+            dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_ERROR);
+    }
+}
@@ -0,0 +1,96 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef FLOW_CONTROL_H
+#define FLOW_CONTROL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "dpfs/hal.h"
+
+/*
+ * Flow control between the host and the backend. The host may have up to
+ * DPFS_HAL_MAX_BACKGROUND requests in flight, while a backend can only have so many
+ * requests in flight per HAL thread (its pool of request contexts, its io_uring, the slot
+ * table of its NFS session...). The backend reports that capacity per thread with
+ * dpfs_fuse_set_capacity(), and the requests beyond it wait in a FIFO queue of that
+ * thread until the backend completes one of the requests it has. Instead of failing with
+ * -ENOMEM or spinning on the HAL thread.
+ *
+ * A request counts against the capacity from the moment it is handed to the backend until
+ * the backend completes it, requests that the backend replies to right away don't count.
+ * The queue is drained on the HAL thread itself, after the backend completed a request
+ * (the HAL poll hook) or when the next request comes in.
+ * Every thread has its own lock, which the completions take (from any thread) to give the
+ * capacity back.
+ */
+
+typedef int (*fuse_ll_flow_dispatch_t) (void *arg,
+                                        struct iovec *in_iov, int in_iovcnt,
+                                        struct iovec *out_iov, int out_iovcnt,
+                                        void *completion_context, uint16_t device_id);
+
+struct fuse_ll_flow_thread;
+
+struct fuse_ll_flow_req {
+    struct fuse_ll_flow_thread *t;
+    // Of the HAL, the request is completed through c while the backend has it
+    void *completion_context;
+    struct dpfs_hal_local_completion c;
+    uint16_t device_id;
+    // Only filled in while the request is queued, the HAL doesn't keep its iovec arrays
+    int in_iovcnt;
+    int out_iovcnt;
+    std::vector<struct iovec> iov;
+};
+
+struct alignas(64) fuse_ll_flow_thread {
+    pthread_spinlock_t lock;
+    // 0 means no limit
+    uint32_t capacity;
+    uint32_t inflight;
+    std::deque<struct fuse_ll_flow_req *> queue;
+    // Recycled requests
+    std::vector<struct fuse_ll_flow_req *> free;
+    // The length of queue, so that the poll hook doesn't need the lock if there is nothing to do
+    std::atomic<size_t> nqueued;
+    std::atomic<size_t> max_queued;
+};
+
+struct fuse_ll_flow {
+    fuse_ll_flow_dispatch_t dispatch;
+    void *arg;
+    uint16_t nthreads;
+    struct fuse_ll_flow_thread *threads;
+};
+
+struct fuse_ll_flow *fuse_ll_flow_new(uint16_t nthreads, fuse_ll_flow_dispatch_t dispatch, void *arg);
+// All requests must have completed
+void fuse_ll_flow_destroy(struct fuse_ll_flow *);
+
+// Thread-safe, a lower capacity only takes effect as the requests in flight complete
+void fuse_ll_flow_set_capacity(struct fuse_ll_flow *, uint16_t thread_id, uint32_t capacity);
+uint32_t fuse_ll_flow_capacity(struct fuse_ll_flow *, uint16_t thread_id);
+
+// Hands the request to dispatch, or queues it and returns EWOULDBLOCK if the thread is at
+// capacity. queued tells which of the two happened.
+int fuse_ll_flow_submit(struct fuse_ll_flow *, uint16_t thread_id,
+                        struct iovec *in_iov, int in_iovcnt,
+                        struct iovec *out_iov, int out_iovcnt,
+                        void *completion_context, uint16_t device_id, bool *queued);
+// Dispatches the queued requests that fit now, must be called on the thread itself
+void fuse_ll_flow_poll(struct fuse_ll_flow *, uint16_t thread_id);
+// Given the completion_context that dispatch got, returns the one that was handed to
+// fuse_ll_flow_submit() for the request
+void *fuse_ll_flow_completion_context(void *completion_context);
+
+#endif // FLOW_CONTROL_H
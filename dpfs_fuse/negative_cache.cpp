@@ -0,0 +1,149 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <time.h>
+#include <iterator>
+#include <new>
+
+#include "negative_cache.h"
+
+static uint64_t negative_cache_now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct negative_cache *negative_cache_new(size_t capacity, uint64_t ttl_msec)
+{
+    struct negative_cache *nc = new (std::nothrow) negative_cache();
+    if (!nc)
+        return NULL;
+    nc->capacity = capacity;
+    nc->ttl_nsec = ttl_msec * 1000000;
+    nc->gen = 0;
+    nc->hits.store(0, std::memory_order_relaxed);
+    nc->misses.store(0, std::memory_order_relaxed);
+    return nc;
+}
+
+void negative_cache_destroy(struct negative_cache *nc)
+{
+    delete nc;
+}
+
+// Must hold the lock
+static void negative_cache_erase(struct negative_cache *nc,
+        std::list<struct negative_cache_entry>::iterator e)
+{
+    auto dir = nc->dirs.find(e->parent);
+    dir->second.erase(e->name);
+    if (dir->second.empty())
+        nc->dirs.erase(dir);
+    nc->lru.erase(e);
+}
+
+bool negative_cache_lookup(struct negative_cache *nc, uint64_t parent, const char *name,
+        struct negative_cache_entry *hit)
+{
+    std::lock_guard<std::mutex> lock(nc->lock);
+
+    auto dir = nc->dirs.find(parent);
+    if (dir == nc->dirs.end()) {
+        nc->misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    auto it = dir->second.find(name);
+    if (it == dir->second.end()) {
+        nc->misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    auto e = it->second;
+    if (e->expires_nsec <= negative_cache_now_nsec()) {
+        negative_cache_erase(nc, e);
+        nc->misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    nc->lru.splice(nc->lru.begin(), nc->lru, e);
+    hit->parent = e->parent;
+    hit->entry = e->entry;
+    hit->entry_valid = e->entry_valid;
+    hit->entry_valid_nsec = e->entry_valid_nsec;
+    hit->expires_nsec = e->expires_nsec;
+    nc->hits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+uint64_t negative_cache_gen(struct negative_cache *nc)
+{
+    std::lock_guard<std::mutex> lock(nc->lock);
+    return nc->gen;
+}
+
+void negative_cache_insert(struct negative_cache *nc, uint64_t gen, uint64_t parent, const char *name,
+        bool entry, uint64_t entry_valid, uint32_t entry_valid_nsec)
+{
+    std::lock_guard<std::mutex> lock(nc->lock);
+    // The name might have been created while the LOOKUP was in flight
+    if (gen != nc->gen)
+        return;
+
+    auto &dir = nc->dirs[parent];
+    auto it = dir.find(name);
+    if (it != dir.end()) {
+        negative_cache_erase(nc, it->second);
+    } else if (nc->lru.size() >= nc->capacity) {
+        negative_cache_erase(nc, std::prev(nc->lru.end()));
+    }
+
+    struct negative_cache_entry e;
+    e.parent = parent;
+    e.name = name;
+    e.expires_nsec = negative_cache_now_nsec() + nc->ttl_nsec;
+    e.entry = entry;
+    e.entry_valid = entry ? entry_valid : 0;
+    e.entry_valid_nsec = entry ? entry_valid_nsec : 0;
+    nc->lru.push_front(std::move(e));
+    // The eviction above may have dropped the (then empty) map of this directory
+    nc->dirs[parent][nc->lru.front().name] = nc->lru.begin();
+}
+
+void negative_cache_invalidate(struct negative_cache *nc, uint64_t parent, const char *name)
+{
+    std::lock_guard<std::mutex> lock(nc->lock);
+    nc->gen++;
+
+    auto dir = nc->dirs.find(parent);
+    if (dir == nc->dirs.end())
+        return;
+    auto it = dir->second.find(name);
+    if (it != dir->second.end())
+        negative_cache_erase(nc, it->second);
+}
+
+void negative_cache_invalidate_dir(struct negative_cache *nc, uint64_t parent)
+{
+    std::lock_guard<std::mutex> lock(nc->lock);
+    // No need to bump gen, the host doesn't forget a directory while it is looking up in it
+
+    auto dir = nc->dirs.find(parent);
+    if (dir == nc->dirs.end())
+        return;
+    for (auto &it : dir->second)
+        nc->lru.erase(it.second);
+    nc->dirs.erase(dir);
+}
+
+void negative_cache_clear(struct negative_cache *nc)
+{
+    std::lock_guard<std::mutex> lock(nc->lock);
+    nc->gen++;
+    nc->lru.clear();
+    nc->dirs.clear();
+}
@@ -0,0 +1,79 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef NEGATIVE_CACHE_H
+#define NEGATIVE_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ * Negative dentry cache: remembers the names that a LOOKUP didn't find, per parent directory,
+ * so that repeated misses (think $PATH and shared library searches) are answered on the DPU
+ * without a round trip to the backend.
+ *
+ * An entry is dropped when:
+ * - a CREATE, MKNOD, MKDIR, SYMLINK or RENAME puts the name into the directory
+ * - the host forgets the directory, the backend may reuse its nodeid
+ * - it is older than the TTL, which bounds how long a name created behind the back of the
+ *   DPU stays invisible
+ * - it is the least recently used entry and the cache is full
+ *
+ * Lookups are inserted by whichever thread completes them, so the cache has its own lock.
+ * A LOOKUP only inserts its miss if nothing got invalidated since it was started. The host
+ * serializes a LOOKUP against a CREATE of the same name (both hold the lock of the parent
+ * directory), so that is enough to never cache a name that exists.
+ */
+
+struct negative_cache_entry {
+    uint64_t parent;
+    std::string name;
+    uint64_t expires_nsec;
+    // The backend replied with nodeid 0 and these entry timeouts instead of -ENOENT
+    bool entry;
+    uint64_t entry_valid;
+    uint32_t entry_valid_nsec;
+};
+
+struct negative_cache {
+    size_t capacity;
+    uint64_t ttl_nsec;
+
+    std::mutex lock;
+    // Bumped by every invalidation
+    uint64_t gen;
+    // Most recently used at the front
+    std::list<struct negative_cache_entry> lru;
+    std::unordered_map<uint64_t, std::unordered_map<std::string, std::list<struct negative_cache_entry>::iterator>> dirs;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+};
+
+struct negative_cache *negative_cache_new(size_t capacity, uint64_t ttl_msec);
+void negative_cache_destroy(struct negative_cache *);
+
+// Returns true and fills in hit if the name is known not to exist
+bool negative_cache_lookup(struct negative_cache *, uint64_t parent, const char *name,
+        struct negative_cache_entry *hit);
+// Take this before sending the LOOKUP to the backend and pass it to negative_cache_insert()
+uint64_t negative_cache_gen(struct negative_cache *);
+// The entry timeouts are ignored unless entry is set
+void negative_cache_insert(struct negative_cache *, uint64_t gen, uint64_t parent, const char *name,
+        bool entry, uint64_t entry_valid, uint32_t entry_valid_nsec);
+
+void negative_cache_invalidate(struct negative_cache *, uint64_t parent, const char *name);
+void negative_cache_invalidate_dir(struct negative_cache *, uint64_t parent);
+// The nodeids of the previous session mean nothing anymore after a FUSE_INIT
+void negative_cache_clear(struct negative_cache *);
+
+#endif // NEGATIVE_CACHE_H
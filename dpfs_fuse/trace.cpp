@@ -0,0 +1,779 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stddef.h>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+
+#include "dpfs/hal.h"
+#include "debug.h"
+#include "trace.h"
+
+#define FUSE_LL_TRACE_BUF_SIZE (1 << 20)
+#define FUSE_LL_TRACE_ALIGN(x) (((x) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+
+static uint64_t fuse_ll_trace_now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Filled by a single thread, so recording a request doesn't need any synchronization
+struct fuse_ll_trace_buf {
+    size_t used;
+    char data[FUSE_LL_TRACE_BUF_SIZE];
+};
+
+struct fuse_ll_trace {
+    int fd;
+    bool payloads;
+    // Tells the thread_local buffer pointers of different traces apart
+    uint64_t id;
+    // Where the next flushed buffer goes in the file
+    std::atomic<uint64_t> off;
+    std::atomic<uint64_t> dropped;
+
+    // Only taken when a thread records its first request
+    std::mutex bufs_lock;
+    std::vector<struct fuse_ll_trace_buf *> bufs;
+};
+
+struct fuse_ll_trace_req {
+    struct fuse_ll_trace *trace;
+    struct iovec *in_iov;
+    int in_iovcnt;
+    struct iovec *out_iov;
+    int out_iovcnt;
+    // Of the HAL
+    void *completion_context;
+    uint16_t device_id;
+    uint64_t start_nsec;
+    struct dpfs_hal_local_completion c;
+};
+
+static std::atomic<uint64_t> fuse_ll_trace_ids{1};
+static thread_local struct {
+    uint64_t id;
+    struct fuse_ll_trace_buf *buf;
+} fuse_ll_trace_tls;
+
+static void fuse_ll_trace_pwrite(struct fuse_ll_trace *t, const char *buf, size_t len)
+{
+    // Reserving the range in the file is all the threads have to agree on
+    uint64_t off = t->off.fetch_add(len, std::memory_order_relaxed);
+    while (len > 0) {
+        ssize_t ret = pwrite(t->fd, buf, len, off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            // Leaves a hole of zeroes, which the replayer skips
+            t->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        buf += ret;
+        off += ret;
+        len -= ret;
+    }
+}
+
+static void fuse_ll_trace_flush(struct fuse_ll_trace *t, struct fuse_ll_trace_buf *b)
+{
+    if (b->used == 0)
+        return;
+    fuse_ll_trace_pwrite(t, b->data, b->used);
+    b->used = 0;
+}
+
+static struct fuse_ll_trace_buf *fuse_ll_trace_get_buf(struct fuse_ll_trace *t)
+{
+    if (fuse_ll_trace_tls.id == t->id)
+        return fuse_ll_trace_tls.buf;
+
+    struct fuse_ll_trace_buf *b = new (std::nothrow) fuse_ll_trace_buf;
+    if (!b)
+        return NULL;
+    b->used = 0;
+    {
+        std::lock_guard<std::mutex> lock(t->bufs_lock);
+        t->bufs.push_back(b);
+    }
+    fuse_ll_trace_tls.id = t->id;
+    fuse_ll_trace_tls.buf = b;
+    return b;
+}
+
+struct fuse_ll_trace *fuse_ll_trace_open(const char *path, bool payloads)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: cannot create %s - %s\n", __func__, path, strerror(errno));
+        return NULL;
+    }
+
+    struct fuse_ll_trace *t = new fuse_ll_trace();
+    t->fd = fd;
+    t->payloads = payloads;
+    t->id = fuse_ll_trace_ids.fetch_add(1, std::memory_order_relaxed);
+    t->off.store(0);
+    t->dropped.store(0);
+
+    struct fuse_ll_trace_file_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FUSE_LL_TRACE_MAGIC;
+    hdr.version = FUSE_LL_TRACE_VERSION;
+    fuse_ll_trace_pwrite(t, (const char *) &hdr, sizeof(hdr));
+    if (t->dropped.load()) {
+        fprintf(stderr, "%s: cannot write to %s - %s\n", __func__, path, strerror(errno));
+        close(fd);
+        delete t;
+        return NULL;
+    }
+
+    printf("dpfs_fuse: tracing requests to %s%s\n", path, payloads ? ", including payloads" : "");
+    return t;
+}
+
+void fuse_ll_trace_close(struct fuse_ll_trace *t)
+{
+    {
+        std::lock_guard<std::mutex> lock(t->bufs_lock);
+        for (struct fuse_ll_trace_buf *b : t->bufs) {
+            fuse_ll_trace_flush(t, b);
+            delete b;
+        }
+        t->bufs.clear();
+    }
+    if (t->dropped.load())
+        fprintf(stderr, "%s: %lu writes to the trace failed, the trace is incomplete\n",
+                __func__, t->dropped.load());
+    close(t->fd);
+    delete t;
+}
+
+static size_t fuse_ll_trace_captured(struct iovec *iov, int iovcnt, int payload_iov, bool payloads)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt && (payloads || i < payload_iov); i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+static char *fuse_ll_trace_copy(char *dst, struct iovec *iov, int iovcnt, int payload_iov, bool payloads)
+{
+    for (int i = 0; i < iovcnt && (payloads || i < payload_iov); i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    return dst;
+}
+
+static void fuse_ll_trace_record(struct fuse_ll_trace_req *treq, int ret)
+{
+    struct fuse_ll_trace *t = treq->trace;
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) treq->in_iov[0].iov_base;
+    int in_payload = fuse_ll_trace_payload_iov(in_hdr->opcode, false, treq->in_iovcnt);
+    int out_payload = fuse_ll_trace_payload_iov(in_hdr->opcode, true, treq->out_iovcnt);
+
+    size_t lens_size = FUSE_LL_TRACE_ALIGN((treq->in_iovcnt + treq->out_iovcnt) * sizeof(uint32_t));
+    size_t len = FUSE_LL_TRACE_ALIGN(sizeof(struct fuse_ll_trace_rec) + lens_size +
+            fuse_ll_trace_captured(treq->in_iov, treq->in_iovcnt, in_payload, t->payloads) +
+            fuse_ll_trace_captured(treq->out_iov, treq->out_iovcnt, out_payload, t->payloads));
+
+    struct fuse_ll_trace_buf *b = fuse_ll_trace_get_buf(t);
+    if (!b) {
+        t->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    char *dst;
+    if (len > FUSE_LL_TRACE_BUF_SIZE) {
+        // Only happens with payloads, straight to the file
+        dst = (char *) malloc(len);
+        if (!dst) {
+            t->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } else {
+        if (b->used + len > FUSE_LL_TRACE_BUF_SIZE)
+            fuse_ll_trace_flush(t, b);
+        dst = b->data + b->used;
+    }
+
+    struct fuse_ll_trace_rec *rec = (struct fuse_ll_trace_rec *) dst;
+    memset(rec, 0, sizeof(*rec));
+    rec->len = len;
+    rec->device_id = treq->device_id;
+    rec->flags = t->payloads ? FUSE_LL_TRACE_PAYLOADS : 0;
+    rec->in_iovcnt = treq->in_iovcnt;
+    rec->out_iovcnt = treq->out_iovcnt;
+    if (ret != 0)
+        rec->error = ret;
+    else if (treq->out_iovcnt > 0 && treq->out_iov[0].iov_len >= sizeof(struct fuse_out_header))
+        rec->error = ((struct fuse_out_header *) treq->out_iov[0].iov_base)->error;
+    rec->start_nsec = treq->start_nsec;
+    rec->latency_nsec = fuse_ll_trace_now_nsec() - treq->start_nsec;
+
+    uint32_t *lens = (uint32_t *) (rec + 1);
+    for (int i = 0; i < treq->in_iovcnt; i++)
+        *lens++ = treq->in_iov[i].iov_len;
+    for (int i = 0; i < treq->out_iovcnt; i++)
+        *lens++ = treq->out_iov[i].iov_len;
+    char *data = ((char *) (rec + 1)) + lens_size;
+    memset(lens, 0, data - (char *) lens);
+    data = fuse_ll_trace_copy(data, treq->in_iov, treq->in_iovcnt, in_payload, t->payloads);
+    data = fuse_ll_trace_copy(data, treq->out_iov, treq->out_iovcnt, out_payload, t->payloads);
+    memset(data, 0, dst + len - data);
+
+    if (len > FUSE_LL_TRACE_BUF_SIZE) {
+        fuse_ll_trace_pwrite(t, dst, len);
+        free(dst);
+    } else {
+        b->used += len;
+    }
+}
+
+static void fuse_ll_trace_complete(void *arg, enum dpfs_hal_completion_status status)
+{
+    struct fuse_ll_trace_req *treq = (struct fuse_ll_trace_req *) arg;
+    void *completion_context = treq->completion_context;
+
+    fuse_ll_trace_record(treq, status == DPFS_HAL_COMPLETION_SUCCES ? 0 : -EIO);
+    delete treq;
+    dpfs_hal_async_complete(completion_context, status);
+}
+
+struct fuse_ll_trace_req *fuse_ll_trace_begin(struct fuse_ll_trace *t,
+        struct iovec *in_iov, int in_iovcnt, struct iovec *out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt < 1 || in_iov[0].iov_len < sizeof(struct fuse_in_header))
+        return NULL;
+
+    struct fuse_ll_trace_req *treq = new (std::nothrow) fuse_ll_trace_req;
+    if (!treq)
+        return NULL;
+    treq->trace = t;
+    treq->in_iov = in_iov;
+    treq->in_iovcnt = in_iovcnt;
+    treq->out_iov = out_iov;
+    treq->out_iovcnt = out_iovcnt;
+    treq->completion_context = completion_context;
+    treq->device_id = device_id;
+    treq->c.cb = fuse_ll_trace_complete;
+    treq->c.arg = treq;
+    treq->start_nsec = fuse_ll_trace_now_nsec();
+    return treq;
+}
+
+void *fuse_ll_trace_context(struct fuse_ll_trace_req *treq)
+{
+    return dpfs_hal_local_completion_context(&treq->c);
+}
+
+void fuse_ll_trace_end(struct fuse_ll_trace_req *treq, int ret)
+{
+    fuse_ll_trace_record(treq, ret);
+    delete treq;
+}
+
+/*
+ * Replay
+ */
+
+struct fuse_ll_replay_req {
+    const struct fuse_ll_trace_rec *rec;
+    uint32_t opcode;
+    // When the request had completed in the trace
+    uint64_t trace_end_nsec;
+
+    char *buf;
+    std::vector<struct iovec> iov;
+    struct dpfs_hal_local_completion c;
+
+    uint64_t start_nsec;
+    // Set by whichever thread completes the request
+    std::atomic<bool> done;
+    uint64_t end_nsec;
+    int ret;
+};
+
+// The nodeids and file handles of the trace don't mean anything to the backend in the replay,
+// so these get learned from the replies and translated in the requests
+struct fuse_ll_replay_dev {
+    std::unordered_map<uint64_t, uint64_t> nodeids;
+    std::unordered_map<uint64_t, uint64_t> fhs;
+};
+
+struct fuse_ll_replay_stats {
+    uint64_t count;
+    uint64_t trace_nsec;
+    uint64_t replay_nsec;
+    uint64_t mismatches;
+};
+
+static void fuse_ll_replay_complete(void *arg, enum dpfs_hal_completion_status status)
+{
+    struct fuse_ll_replay_req *req = (struct fuse_ll_replay_req *) arg;
+    req->end_nsec = fuse_ll_trace_now_nsec();
+    req->ret = status == DPFS_HAL_COMPLETION_SUCCES ? 0 : -EIO;
+    req->done.store(true, std::memory_order_release);
+}
+
+static inline void fuse_ll_replay_map(std::unordered_map<uint64_t, uint64_t> &m, uint64_t *id)
+{
+    auto it = m.find(*id);
+    if (it != m.end())
+        *id = it->second;
+}
+
+static const uint32_t *fuse_ll_replay_lens(const struct fuse_ll_trace_rec *rec)
+{
+    return (const uint32_t *) (rec + 1);
+}
+
+static size_t fuse_ll_replay_lens_size(const struct fuse_ll_trace_rec *rec)
+{
+    return FUSE_LL_TRACE_ALIGN((rec->in_iovcnt + rec->out_iovcnt) * sizeof(uint32_t));
+}
+
+// Where the captured in (out) iovecs start, NULL if the record is cut off
+static const char *fuse_ll_replay_data(const struct fuse_ll_trace_rec *rec, bool out)
+{
+    const uint32_t *lens = fuse_ll_replay_lens(rec);
+    const char *data = ((const char *) lens) + fuse_ll_replay_lens_size(rec);
+    size_t avail = ((const char *) rec) + rec->len - data;
+    bool payloads = rec->flags & FUSE_LL_TRACE_PAYLOADS;
+    uint32_t opcode = ((const struct fuse_in_header *) data)->opcode;
+
+    size_t in_len = 0;
+    int in_payload = fuse_ll_trace_payload_iov(opcode, false, rec->in_iovcnt);
+    for (int i = 0; i < rec->in_iovcnt && (payloads || i < in_payload); i++)
+        in_len += lens[i];
+    size_t out_len = 0;
+    int out_payload = fuse_ll_trace_payload_iov(opcode, true, rec->out_iovcnt);
+    for (int i = 0; i < rec->out_iovcnt && (payloads || i < out_payload); i++)
+        out_len += lens[rec->in_iovcnt + i];
+
+    if (in_len + out_len > avail)
+        return NULL;
+    return out ? data + in_len : data;
+}
+
+// Sanity checks a record before anything in it is looked at
+static bool fuse_ll_replay_valid(const struct fuse_ll_trace_rec *rec, size_t avail)
+{
+    if (avail < sizeof(*rec) || rec->len < sizeof(*rec) || rec->len > avail || rec->len % sizeof(uint64_t))
+        return false;
+    size_t lens_size = fuse_ll_replay_lens_size(rec);
+    if (rec->in_iovcnt < 1 || sizeof(*rec) + lens_size + sizeof(struct fuse_in_header) > rec->len)
+        return false;
+    if (fuse_ll_replay_lens(rec)[0] < sizeof(struct fuse_in_header))
+        return false;
+    return fuse_ll_replay_data(rec, false) && fuse_ll_replay_data(rec, true);
+}
+
+static void fuse_ll_replay_translate(struct fuse_ll_replay_dev *dev, struct fuse_ll_replay_req *req)
+{
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) req->iov[0].iov_base;
+    fuse_ll_replay_map(dev->nodeids, &in_hdr->nodeid);
+
+    // FORGET, BATCH_FORGET and INTERRUPT have their argument in the iovec of the header
+    char *arg;
+    size_t arglen;
+    if (req->rec->in_iovcnt > 1) {
+        arg = (char *) req->iov[1].iov_base;
+        arglen = req->iov[1].iov_len;
+    } else {
+        arg = (char *) (in_hdr + 1);
+        arglen = req->iov[0].iov_len - sizeof(*in_hdr);
+    }
+#define ARG(type) (arglen >= sizeof(type) ? (type *) arg : NULL)
+
+    switch (req->opcode) {
+    case FUSE_READ:
+    case FUSE_READDIR:
+    case FUSE_READDIRPLUS:
+        if (auto a = ARG(struct fuse_read_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_WRITE:
+        if (auto a = ARG(struct fuse_write_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_RELEASE:
+    case FUSE_RELEASEDIR:
+        if (auto a = ARG(struct fuse_release_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_FSYNC:
+    case FUSE_FSYNCDIR:
+        if (auto a = ARG(struct fuse_fsync_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_FLUSH:
+        if (auto a = ARG(struct fuse_flush_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_GETATTR:
+        if (auto a = ARG(struct fuse_getattr_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_SETATTR:
+        if (auto a = ARG(struct fuse_setattr_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_SETLK:
+    case FUSE_SETLKW:
+        if (auto a = ARG(struct fuse_lk_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_FALLOCATE:
+        if (auto a = ARG(struct fuse_fallocate_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_LSEEK:
+        if (auto a = ARG(struct fuse_lseek_in)) fuse_ll_replay_map(dev->fhs, &a->fh);
+        break;
+    case FUSE_COPY_FILE_RANGE:
+        if (auto a = ARG(struct fuse_copy_file_range_in)) {
+            fuse_ll_replay_map(dev->fhs, &a->fh_in);
+            fuse_ll_replay_map(dev->nodeids, &a->nodeid_out);
+            fuse_ll_replay_map(dev->fhs, &a->fh_out);
+        }
+        break;
+    case FUSE_RENAME:
+        if (auto a = ARG(struct fuse_rename_in)) fuse_ll_replay_map(dev->nodeids, &a->newdir);
+        break;
+    case FUSE_RENAME2:
+        if (auto a = ARG(struct fuse_rename2_in)) fuse_ll_replay_map(dev->nodeids, &a->newdir);
+        break;
+    case FUSE_LINK:
+        if (auto a = ARG(struct fuse_link_in)) fuse_ll_replay_map(dev->nodeids, &a->oldnodeid);
+        break;
+    case FUSE_BATCH_FORGET:
+        if (auto a = ARG(struct fuse_batch_forget_in)) {
+            struct fuse_forget_one *one = (struct fuse_forget_one *) (a + 1);
+            for (uint32_t i = 0; i < a->count && (char *) (one + i + 1) <= arg + arglen; i++)
+                fuse_ll_replay_map(dev->nodeids, &one[i].nodeid);
+        }
+        break;
+    default:
+        break;
+    }
+#undef ARG
+}
+
+// The captured iovecs aren't aligned in the record
+static inline uint64_t fuse_ll_replay_u64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Learns the nodeids and file handles the backend handed out in the replay
+static void fuse_ll_replay_learn(struct fuse_ll_replay_dev *dev, struct fuse_ll_replay_req *req)
+{
+    const struct fuse_ll_trace_rec *rec = req->rec;
+    const uint32_t *out_lens = fuse_ll_replay_lens(rec) + rec->in_iovcnt;
+    if (rec->out_iovcnt < 2 || rec->error != 0)
+        return;
+    const struct fuse_out_header *out_hdr = (const struct fuse_out_header *) req->iov[rec->in_iovcnt].iov_base;
+    if (out_hdr->error != 0)
+        return;
+
+    const char *traced = fuse_ll_replay_data(rec, true) + out_lens[0];
+    const char *replayed = (const char *) req->iov[rec->in_iovcnt + 1].iov_base;
+    size_t len = out_lens[1];
+
+    switch (req->opcode) {
+    case FUSE_LOOKUP:
+    case FUSE_MKNOD:
+    case FUSE_MKDIR:
+    case FUSE_SYMLINK:
+    case FUSE_LINK:
+    case FUSE_CREATE:
+        if (len >= sizeof(struct fuse_entry_out)) {
+            uint64_t from = fuse_ll_replay_u64(traced + offsetof(struct fuse_entry_out, nodeid));
+            uint64_t to = fuse_ll_replay_u64(replayed + offsetof(struct fuse_entry_out, nodeid));
+            if (from != 0)
+                dev->nodeids[from] = to;
+        }
+        if (req->opcode == FUSE_CREATE &&
+                len >= sizeof(struct fuse_entry_out) + sizeof(struct fuse_open_out)) {
+            size_t off = sizeof(struct fuse_entry_out) + offsetof(struct fuse_open_out, fh);
+            dev->fhs[fuse_ll_replay_u64(traced + off)] = fuse_ll_replay_u64(replayed + off);
+        }
+        break;
+    case FUSE_OPEN:
+    case FUSE_OPENDIR:
+        if (len >= sizeof(struct fuse_open_out)) {
+            size_t off = offsetof(struct fuse_open_out, fh);
+            dev->fhs[fuse_ll_replay_u64(traced + off)] = fuse_ll_replay_u64(replayed + off);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static struct fuse_ll_replay_req *fuse_ll_replay_prepare(const struct fuse_ll_trace_rec *rec)
+{
+    const uint32_t *lens = fuse_ll_replay_lens(rec);
+    int iovcnt = rec->in_iovcnt + rec->out_iovcnt;
+
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++)
+        size += FUSE_LL_TRACE_ALIGN(lens[i]);
+    char *buf = (char *) calloc(1, size ? size : 1);
+    if (!buf)
+        return NULL;
+
+    struct fuse_ll_replay_req *req = new fuse_ll_replay_req();
+    req->rec = rec;
+    req->trace_end_nsec = rec->start_nsec + rec->latency_nsec;
+    req->buf = buf;
+    req->iov.resize(iovcnt);
+    req->c.cb = fuse_ll_replay_complete;
+    req->c.arg = req;
+    req->done.store(false);
+    req->ret = 0;
+
+    const char *data = fuse_ll_replay_data(rec, false);
+    const struct fuse_in_header *in_hdr = (const struct fuse_in_header *) data;
+    req->opcode = in_hdr->opcode;
+    bool payloads = rec->flags & FUSE_LL_TRACE_PAYLOADS;
+    int in_payload = fuse_ll_trace_payload_iov(req->opcode, false, rec->in_iovcnt);
+
+    for (int i = 0; i < iovcnt; i++) {
+        req->iov[i].iov_base = buf;
+        req->iov[i].iov_len = lens[i];
+        // Payloads that weren't captured are replayed as zeroes
+        if (i < rec->in_iovcnt && (payloads || i < in_payload)) {
+            memcpy(buf, data, lens[i]);
+            data += lens[i];
+        }
+        buf += FUSE_LL_TRACE_ALIGN(lens[i]);
+    }
+    return req;
+}
+
+// An INIT for the devices that were traced after the host had already mounted them
+static std::vector<char> fuse_ll_replay_init_rec(uint16_t device_id, uint64_t start_nsec)
+{
+    size_t lens_size = FUSE_LL_TRACE_ALIGN(4 * sizeof(uint32_t));
+    size_t in_size = sizeof(struct fuse_in_header) + sizeof(struct fuse_init_in);
+    size_t len = FUSE_LL_TRACE_ALIGN(sizeof(struct fuse_ll_trace_rec) + lens_size + in_size +
+            sizeof(struct fuse_out_header) + sizeof(struct fuse_init_out));
+    std::vector<char> v(len, 0);
+
+    struct fuse_ll_trace_rec *rec = (struct fuse_ll_trace_rec *) v.data();
+    rec->len = len;
+    rec->device_id = device_id;
+    rec->in_iovcnt = 2;
+    rec->out_iovcnt = 2;
+    rec->start_nsec = start_nsec;
+    uint32_t *lens = (uint32_t *) (rec + 1);
+    lens[0] = sizeof(struct fuse_in_header);
+    lens[1] = sizeof(struct fuse_init_in);
+    lens[2] = sizeof(struct fuse_out_header);
+    lens[3] = sizeof(struct fuse_init_out);
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) (((char *) lens) + lens_size);
+    in_hdr->len = in_size;
+    in_hdr->opcode = FUSE_INIT;
+    // Unique 0 is reserved for notifications, fuse_handle_req() rejects it
+    in_hdr->unique = UINT64_MAX;
+    struct fuse_init_in *in_init = (struct fuse_init_in *) (in_hdr + 1);
+    in_init->major = FUSE_KERNEL_VERSION;
+    in_init->minor = FUSE_KERNEL_MINOR_VERSION;
+    in_init->max_readahead = 128 * 1024;
+    // What a virtio-fs guest typically offers
+    in_init->flags = FUSE_ASYNC_READ | FUSE_POSIX_LOCKS | FUSE_ATOMIC_O_TRUNC | FUSE_EXPORT_SUPPORT |
+        FUSE_BIG_WRITES | FUSE_DONT_MASK | FUSE_FLOCK_LOCKS | FUSE_AUTO_INVAL_DATA |
+        FUSE_DO_READDIRPLUS | FUSE_READDIRPLUS_AUTO | FUSE_ASYNC_DIO | FUSE_PARALLEL_DIROPS |
+        FUSE_MAX_PAGES;
+    return v;
+}
+
+static void fuse_ll_replay_wait(struct fuse_ll_replay_req *req, struct dpfs_hal_ops *ops, void *user_data)
+{
+    while (!req->done.load(std::memory_order_acquire)) {
+        // The replayer is the HAL thread, the request might be waiting for its poll hook
+        if (ops->poll)
+            ops->poll(user_data, 0);
+        sched_yield();
+    }
+}
+
+int fuse_ll_replay(const char *path, bool original_timing, struct dpfs_hal_ops *ops, void *user_data)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: cannot open %s - %s\n", __func__, path, strerror(errno));
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long fsize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    // uint64_t so that the records are aligned
+    std::vector<uint64_t> file((fsize + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    if (fsize < (long) sizeof(struct fuse_ll_trace_file_hdr) || fread(file.data(), 1, fsize, fp) != (size_t) fsize) {
+        fprintf(stderr, "%s: cannot read %s\n", __func__, path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    const char *p = (const char *) file.data();
+    const char *end = p + fsize;
+    const struct fuse_ll_trace_file_hdr *hdr = (const struct fuse_ll_trace_file_hdr *) p;
+    if (hdr->magic != FUSE_LL_TRACE_MAGIC || hdr->version != FUSE_LL_TRACE_VERSION) {
+        fprintf(stderr, "%s: %s is not a dpfs_fuse trace of version %u\n", __func__, path, FUSE_LL_TRACE_VERSION);
+        return -1;
+    }
+    p += sizeof(*hdr);
+
+    std::vector<const struct fuse_ll_trace_rec *> recs;
+    size_t invalid = 0;
+    while (p + sizeof(struct fuse_ll_trace_rec) <= end) {
+        const struct fuse_ll_trace_rec *rec = (const struct fuse_ll_trace_rec *) p;
+        if (rec->len == 0) {
+            // A failed write left a hole, skip it
+            p += sizeof(uint64_t);
+            continue;
+        }
+        if (!fuse_ll_replay_valid(rec, end - p)) {
+            invalid++;
+            break;
+        }
+        recs.push_back(rec);
+        p += rec->len;
+    }
+    if (invalid)
+        fprintf(stderr, "%s: %s is cut off after %lu requests\n", __func__, path, recs.size());
+    if (recs.empty()) {
+        fprintf(stderr, "%s: %s has no requests\n", __func__, path);
+        return -1;
+    }
+    std::stable_sort(recs.begin(), recs.end(),
+            [](const struct fuse_ll_trace_rec *a, const struct fuse_ll_trace_rec *b) {
+                return a->start_nsec < b->start_nsec;
+            });
+
+    std::map<uint16_t, struct fuse_ll_replay_dev> devs;
+    std::vector<std::vector<char>> init_recs;
+    for (const struct fuse_ll_trace_rec *rec : recs) {
+        if (devs.count(rec->device_id))
+            continue;
+        devs[rec->device_id];
+        const struct fuse_in_header *in_hdr = (const struct fuse_in_header *) fuse_ll_replay_data(rec, false);
+        if (in_hdr->opcode != FUSE_INIT)
+            init_recs.push_back(fuse_ll_replay_init_rec(rec->device_id, recs[0]->start_nsec));
+    }
+    for (auto &v : init_recs)
+        recs.insert(recs.begin(), (const struct fuse_ll_trace_rec *) v.data());
+
+    // The replayer is the only thread handing requests to the dpfs_fuse
+    dpfs_hal_set_thread_id(0);
+    for (auto &dev : devs)
+        ops->register_device(user_data, dev.first);
+
+    printf("dpfs_fuse: replaying %lu requests of %s on %lu devices, %s\n", recs.size(), path, devs.size(),
+            original_timing ? "with the original timing" : "as fast as possible");
+
+    std::vector<struct fuse_ll_replay_req *> inflight;
+    std::map<uint32_t, struct fuse_ll_replay_stats> stats;
+    uint64_t failed = 0;
+
+    auto finish = [&](struct fuse_ll_replay_req *req) {
+        struct fuse_ll_replay_dev *dev = &devs[req->rec->device_id];
+        int error = req->ret;
+        if (error == 0 && req->rec->out_iovcnt > 0)
+            error = ((struct fuse_out_header *) req->iov[req->rec->in_iovcnt].iov_base)->error;
+        if (req->ret != 0)
+            failed++;
+        else
+            fuse_ll_replay_learn(dev, req);
+
+        struct fuse_ll_replay_stats *s = &stats[req->opcode];
+        s->count++;
+        s->trace_nsec += req->rec->latency_nsec;
+        s->replay_nsec += req->end_nsec - req->start_nsec;
+        if (error != req->rec->error)
+            s->mismatches++;
+
+        free(req->buf);
+        delete req;
+    };
+
+    uint64_t trace_start = recs[0]->start_nsec;
+    uint64_t replay_start = fuse_ll_trace_now_nsec();
+    for (const struct fuse_ll_trace_rec *rec : recs) {
+        // Keep the requests that depended on each other in the trace in order
+        for (auto it = inflight.begin(); it != inflight.end();) {
+            if ((*it)->trace_end_nsec <= rec->start_nsec)
+                fuse_ll_replay_wait(*it, ops, user_data);
+            if ((*it)->done.load(std::memory_order_acquire)) {
+                finish(*it);
+                it = inflight.erase(it);
+            } else {
+                it++;
+            }
+        }
+
+        if (original_timing) {
+            uint64_t target = replay_start + (rec->start_nsec - trace_start);
+            struct timespec ts = { (time_t) (target / 1000000000), (long) (target % 1000000000) };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        }
+
+        struct fuse_ll_replay_req *req = fuse_ll_replay_prepare(rec);
+        if (!req) {
+            fprintf(stderr, "%s: out of memory\n", __func__);
+            break;
+        }
+        fuse_ll_replay_translate(&devs[rec->device_id], req);
+
+        req->start_nsec = fuse_ll_trace_now_nsec();
+        int ret = ops->request_handler(user_data, req->iov.data(), rec->in_iovcnt,
+                req->iov.data() + rec->in_iovcnt, rec->out_iovcnt,
+                dpfs_hal_local_completion_context(&req->c), rec->device_id);
+        if (ret != EWOULDBLOCK) {
+            req->end_nsec = fuse_ll_trace_now_nsec();
+            req->ret = ret;
+            req->done.store(true, std::memory_order_release);
+        }
+        inflight.push_back(req);
+    }
+    for (struct fuse_ll_replay_req *req : inflight) {
+        fuse_ll_replay_wait(req, ops, user_data);
+        finish(req);
+    }
+    uint64_t replay_nsec = fuse_ll_trace_now_nsec() - replay_start;
+    uint64_t trace_nsec = recs.back()->start_nsec + recs.back()->latency_nsec - trace_start;
+
+    for (auto &dev : devs)
+        ops->unregister_device(user_data, dev.first);
+
+    printf("%-24s %10s %14s %14s %10s\n", "opcode", "count", "trace avg us", "replay avg us", "mismatch");
+    for (auto &s : stats) {
+        printf("%-24s %10lu %14.2f %14.2f %10lu\n", fuse_ll_op_name(s.first), s.second.count,
+                s.second.trace_nsec / 1000.0 / s.second.count, s.second.replay_nsec / 1000.0 / s.second.count,
+                s.second.mismatches);
+    }
+    printf("trace took %.3f s, replay took %.3f s", trace_nsec / 1e9, replay_nsec / 1e9);
+    if (failed)
+        printf(", %lu requests failed in the replay", failed);
+    printf("\n");
+
+    return 0;
+}
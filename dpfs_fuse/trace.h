@@ -0,0 +1,88 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <linux/fuse.h>
+#include "dpfs/hal.h"
+
+/*
+ * Capture of the FUSE requests that dpfs_fuse handles into a binary trace file, and a replayer
+ * that hands the requests of a trace to a dpfs_fuse (and thus any backend) without a host.
+ *
+ * The file starts with a fuse_ll_trace_file_hdr, followed by one record per request that is
+ * written once the request has completed. Records are written by the thread that completed
+ * the request, so they are only roughly ordered by start_nsec.
+ */
+
+#define FUSE_LL_TRACE_MAGIC 0x4543415254534650ULL // "PFSTRACE"
+#define FUSE_LL_TRACE_VERSION 1
+
+struct fuse_ll_trace_file_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+};
+
+// Every iovec was captured, otherwise see fuse_ll_trace_payload_iov()
+#define FUSE_LL_TRACE_PAYLOADS (1 << 0)
+
+struct fuse_ll_trace_rec {
+    // The whole record, 8 byte aligned
+    uint32_t len;
+    uint16_t device_id;
+    uint16_t flags;
+    uint16_t in_iovcnt;
+    uint16_t out_iovcnt;
+    // out_hdr->error of the reply, or what the request handler returned if it failed
+    int32_t error;
+    // CLOCK_MONOTONIC
+    uint64_t start_nsec;
+    uint64_t latency_nsec;
+    // Followed by uint32_t iov_len[in_iovcnt + out_iovcnt], padded to 8 bytes, and then the
+    // contents of the captured in and out iovecs back to back
+};
+
+// The first in (out) iovec that carries file data, these are only captured with payloads
+static inline int fuse_ll_trace_payload_iov(uint32_t opcode, bool out, int iovcnt)
+{
+    if (!out && opcode == FUSE_WRITE)
+        return 2;
+    if (out && (opcode == FUSE_READ || opcode == FUSE_READDIR || opcode == FUSE_READDIRPLUS))
+        return 1;
+    return iovcnt;
+}
+
+struct fuse_ll_trace;
+struct fuse_ll_trace_req;
+
+// Returns NULL if the file can't be created
+struct fuse_ll_trace *fuse_ll_trace_open(const char *path, bool payloads);
+// Flushes the buffers of all threads, only once no requests are being handled anymore
+void fuse_ll_trace_close(struct fuse_ll_trace *);
+
+// Starts tracing a request, pass the fuse_ll_trace_context() to the request handler in place
+// of the completion_context of the HAL. Returns NULL if the request can't be traced.
+struct fuse_ll_trace_req *fuse_ll_trace_begin(struct fuse_ll_trace *,
+        struct iovec *in_iov, int in_iovcnt, struct iovec *out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id);
+void *fuse_ll_trace_context(struct fuse_ll_trace_req *);
+// For requests that didn't return EWOULDBLOCK, ret is what the request handler returned
+void fuse_ll_trace_end(struct fuse_ll_trace_req *, int ret);
+
+// Hands every request in the trace to the request_handler of ops, like the HAL would, on the
+// calling thread. With original_timing the requests are started at the same pace as in the
+// trace, otherwise as fast as possible. In both cases a request is only started once the
+// requests that had completed before it started in the trace have completed.
+// Prints the latencies of the trace and of the replay per opcode.
+int fuse_ll_replay(const char *path, bool original_timing, struct dpfs_hal_ops *ops, void *user_data);
+
+#endif // TRACE_H
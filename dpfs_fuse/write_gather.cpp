@@ -0,0 +1,601 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <new>
+
+#include "dpfs/hal.h"
+#include "write_gather.h"
+
+static uint64_t write_gather_now_msec(void)
+{
+    struct timespec ts;
+    // We only need millisecond precision, so the coarse clock is plenty and a lot cheaper
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Claim a file buffer out of the global budget
+static bool write_gather_reserve(struct write_gather_conf *conf)
+{
+    size_t used = conf->used.load(std::memory_order_relaxed);
+    do {
+        if (used + conf->file_limit > conf->budget)
+            return false;
+    } while (!conf->used.compare_exchange_weak(used, used + conf->file_limit,
+                std::memory_order_relaxed));
+    return true;
+}
+
+static void write_gather_file_free(struct write_gather *wg, struct write_gather_file *f)
+{
+    free(f->buf);
+    free(f);
+    wg->conf->used.fetch_sub(wg->conf->file_limit, std::memory_order_relaxed);
+}
+
+// Give back the buffers of files on this device that have nothing gathered
+static void write_gather_reclaim(struct write_gather *wg)
+{
+    for (auto it = wg->files.begin(); it != wg->files.end();) {
+        struct write_gather_file *f = it->second;
+        if (f->len == 0 && f->error == 0) {
+            write_gather_file_free(wg, f);
+            it = wg->files.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+static void write_gather_wb_complete(void *arg, enum dpfs_hal_completion_status status);
+
+struct write_gather_conf *write_gather_conf_new(size_t budget, size_t file_limit, uint64_t timeout_msec)
+{
+    struct write_gather_conf *conf = new (std::nothrow) write_gather_conf();
+    if (!conf)
+        return NULL;
+    conf->budget = budget;
+    conf->file_limit = file_limit;
+    conf->timeout_msec = timeout_msec;
+    conf->used.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < DPFS_FUSE_MAX_THREADS; i++) {
+        pthread_spin_init(&conf->threads[i].lock, PTHREAD_PROCESS_PRIVATE);
+        conf->threads[i].ndone.store(0, std::memory_order_relaxed);
+        conf->threads[i].deadline_msec = UINT64_MAX;
+    }
+    return conf;
+}
+
+void write_gather_conf_destroy(struct write_gather_conf *conf)
+{
+    for (int i = 0; i < DPFS_FUSE_MAX_THREADS; i++)
+        pthread_spin_destroy(&conf->threads[i].lock);
+    delete conf;
+}
+
+static struct write_gather_file *write_gather_find(struct write_gather *wg, uint64_t nodeid)
+{
+    auto it = wg->files.find(nodeid);
+    if (it == wg->files.end())
+        return NULL;
+    return it->second;
+}
+
+// Hands the rest of the buffer to the backend as one big write
+static void write_gather_wb_submit(struct write_gather *wg, struct write_gather_file *f)
+{
+    struct write_gather_wb *wb = &f->wb;
+    size_t size = f->len - wb->done;
+
+    memset(&wb->in_hdr, 0, sizeof(wb->in_hdr));
+    wb->in_hdr.len = sizeof(wb->in_hdr) + sizeof(wb->in_write) + size;
+    wb->in_hdr.opcode = FUSE_WRITE;
+    wb->in_hdr.nodeid = f->nodeid;
+    wb->in_hdr.uid = f->uid;
+    wb->in_hdr.gid = f->gid;
+    wb->in_hdr.pid = f->pid;
+
+    memset(&wb->in_write, 0, sizeof(wb->in_write));
+    wb->in_write.fh = f->fh;
+    wb->in_write.offset = f->offset + wb->done;
+    wb->in_write.size = size;
+    wb->in_write.write_flags = f->write_flags;
+    wb->in_write.lock_owner = f->lock_owner;
+    wb->in_write.flags = f->flags;
+
+    wb->out_hdr.len = sizeof(wb->out_hdr);
+    wb->out_hdr.error = 0;
+    wb->out_hdr.unique = 0;
+    memset(&wb->out_write, 0, sizeof(wb->out_write));
+
+    wb->in_iov[0].iov_base = &wb->in_hdr;
+    wb->in_iov[0].iov_len = sizeof(wb->in_hdr);
+    wb->in_iov[1].iov_base = &wb->in_write;
+    wb->in_iov[1].iov_len = sizeof(wb->in_write);
+    wb->in_iov[2].iov_base = f->buf + wb->done;
+    wb->in_iov[2].iov_len = size;
+    wb->out_iov[0].iov_base = &wb->out_hdr;
+    wb->out_iov[0].iov_len = sizeof(wb->out_hdr);
+    wb->out_iov[1].iov_base = &wb->out_write;
+    wb->out_iov[1].iov_len = sizeof(wb->out_write);
+
+    wb->f = f;
+    wb->thread_id = wg->thread_id;
+    wb->status = DPFS_HAL_COMPLETION_SUCCES;
+    wb->c.cb = write_gather_wb_complete;
+    wb->c.arg = f;
+
+    bool queued;
+    int ret = fuse_ll_flow_submit(wg->flow, wb->thread_id, wb->in_iov, 3, wb->out_iov, 2,
+            dpfs_hal_local_completion_context(&wb->c), wg->device_id, &queued);
+    if (ret == EWOULDBLOCK)
+        return;
+    // Done right away, write_gather_poll() picks it up like any other completion
+    if (ret != 0)
+        wb->out_hdr.error = ret < 0 ? ret : -EIO;
+    write_gather_wb_complete(f, DPFS_HAL_COMPLETION_SUCCES);
+}
+
+// Starts writing back everything gathered for this file, unless that is already happening.
+// Returns true if the file has gathered writes, i.e. the caller has to wait for the write back
+static bool write_gather_write_back(struct write_gather *wg, struct write_gather_file *f)
+{
+    if (!f || f->len == 0)
+        return false;
+    if (!f->writing_back) {
+        f->writing_back = true;
+        f->wb.done = 0;
+        wg->nwriting++;
+        write_gather_wb_submit(wg, f);
+    }
+    return true;
+}
+
+// Same as write_gather_write_back(), for all files of the device
+static bool write_gather_write_back_all(struct write_gather *wg)
+{
+    if (wg->ndirty == 0)
+        return false;
+
+    for (auto &it : wg->files)
+        write_gather_write_back(wg, it.second);
+    wg->deadline_msec = UINT64_MAX;
+    return true;
+}
+
+// Starts writing back everything that has timed out, cheap to call for every request
+static void write_gather_expire(struct write_gather *wg)
+{
+    if (wg->ndirty == 0)
+        return;
+
+    uint64_t now = write_gather_now_msec();
+    if (now < wg->deadline_msec)
+        return;
+
+    uint64_t deadline = UINT64_MAX;
+    for (auto &it : wg->files) {
+        struct write_gather_file *f = it.second;
+        if (f->len == 0 || f->writing_back)
+            continue;
+        uint64_t expires = f->first_msec + wg->conf->timeout_msec;
+        if (expires <= now)
+            write_gather_write_back(wg, f);
+        else if (expires < deadline)
+            deadline = expires;
+    }
+    wg->deadline_msec = deadline;
+}
+
+// Puts the device on the dirty list of its HAL thread, for a new deadline
+static void write_gather_list(struct write_gather *wg)
+{
+    struct write_gather_thread *t = &wg->conf->threads[wg->thread_id];
+    if (wg->listed.load(std::memory_order_relaxed) != wg->thread_id) {
+        wg->listed.store(wg->thread_id, std::memory_order_relaxed);
+        t->dirty.push_back(wg->device_id);
+    }
+    if (wg->deadline_msec < t->deadline_msec)
+        t->deadline_msec = wg->deadline_msec;
+}
+
+void write_gather_expire_thread(struct write_gather_conf *conf, struct fuse_ll_device_table *devs,
+        uint16_t thread_id)
+{
+    struct write_gather_thread *t = &conf->threads[thread_id];
+    if (t->dirty.empty() || write_gather_now_msec() < t->deadline_msec)
+        return;
+
+    uint64_t deadline = UINT64_MAX;
+    size_t n = 0;
+    for (uint16_t device_id : t->dirty) {
+        struct fuse_ll_device *dev = fuse_ll_device_get(devs, device_id);
+        // Removed, write_gather_drain() takes care of what it still has gathered
+        if (!dev || !dev->wg)
+            continue;
+        struct write_gather *wg = dev->wg;
+        // A new device with the same device_id, that belongs to another thread
+        if (wg->listed.load(std::memory_order_relaxed) != thread_id)
+            continue;
+        if (wg->ndirty == 0) {
+            wg->listed.store(-1, std::memory_order_relaxed);
+            continue;
+        }
+        write_gather_expire(wg);
+        if (wg->deadline_msec < deadline)
+            deadline = wg->deadline_msec;
+        t->dirty[n++] = device_id;
+    }
+    t->dirty.resize(n);
+    t->deadline_msec = deadline;
+}
+
+// Called from whatever thread the backend completes its requests on
+static void write_gather_wb_complete(void *arg, enum dpfs_hal_completion_status status)
+{
+    struct write_gather_file *f = (struct write_gather_file *) arg;
+    f->wb.status = status;
+
+    struct write_gather_thread *t = &f->wg->conf->threads[f->wb.thread_id];
+    pthread_spin_lock(&t->lock);
+    t->done.push_back(f);
+    t->ndone.store(t->done.size(), std::memory_order_relaxed);
+    pthread_spin_unlock(&t->lock);
+}
+
+static int write_gather_park(struct write_gather *wg,
+        struct iovec *in_iov, int in_iovcnt,
+        struct iovec *out_iov, int out_iovcnt,
+        void *completion_context)
+{
+    struct write_gather_req *req = new (std::nothrow) write_gather_req();
+    if (!req)
+        return -ENOMEM;
+    req->completion_context = completion_context;
+    req->in_iovcnt = in_iovcnt;
+    req->out_iovcnt = out_iovcnt;
+    req->iov.assign(in_iov, in_iov + in_iovcnt);
+    req->iov.insert(req->iov.end(), out_iov, out_iov + out_iovcnt);
+    wg->parked.push_back(req);
+    return EWOULDBLOCK;
+}
+
+// Hands the parked requests to the regular path again, the ones that still have to wait
+// for a write back get parked again in the same order
+static void write_gather_resume(struct write_gather *wg)
+{
+    if (wg->parked.empty())
+        return;
+
+    std::deque<struct write_gather_req *> parked;
+    parked.swap(wg->parked);
+    for (struct write_gather_req *req : parked) {
+        wg->resume(wg->resume_arg, req->iov.data(), req->in_iovcnt,
+                req->iov.data() + req->in_iovcnt, req->out_iovcnt,
+                req->completion_context, wg->device_id);
+        delete req;
+    }
+}
+
+// On the HAL thread of the device
+static void write_gather_wb_done(struct write_gather_file *f)
+{
+    struct write_gather *wg = f->wg;
+    struct write_gather_wb *wb = &f->wb;
+    size_t size = f->len - wb->done;
+
+    int error = wb->out_hdr.error;
+    if (wb->status != DPFS_HAL_COMPLETION_SUCCES)
+        error = -EIO;
+    // A write that makes no progress would make us loop forever
+    else if (error == 0 && (wb->out_write.size == 0 || wb->out_write.size > size))
+        error = -EIO;
+
+    if (error != 0) {
+        fprintf(stderr, "%s: write back of %zu bytes at offset %lu of nodeid %lu failed with %d\n",
+                __func__, size, (uint64_t) wb->in_write.offset, f->nodeid, error);
+        f->error = error;
+    } else {
+        wb->done += wb->out_write.size;
+        // The backend did a short write
+        if (wb->done < f->len) {
+            write_gather_wb_submit(wg, f);
+            return;
+        }
+    }
+
+    f->len = 0;
+    f->writing_back = false;
+    wg->ndirty--;
+    write_gather_resume(wg);
+    // Must stay last, the device may be freed right after this drops to 0
+    wg->nwriting--;
+}
+
+void write_gather_poll(struct write_gather_conf *conf, uint16_t thread_id)
+{
+    struct write_gather_thread *t = &conf->threads[thread_id];
+    if (t->ndone.load(std::memory_order_relaxed) == 0)
+        return;
+
+    std::vector<struct write_gather_file *> done;
+    pthread_spin_lock(&t->lock);
+    done.swap(t->done);
+    t->ndone.store(0, std::memory_order_relaxed);
+    pthread_spin_unlock(&t->lock);
+
+    for (struct write_gather_file *f : done)
+        write_gather_wb_done(f);
+}
+
+bool write_gather_is_wb(void *completion_context)
+{
+    struct dpfs_hal_local_completion *c =
+        dpfs_hal_local_completion_get(fuse_ll_flow_completion_context(completion_context));
+    return c && c->cb == write_gather_wb_complete;
+}
+
+int write_gather_dispatch(struct iovec *in_iov, void *completion_context)
+{
+    struct write_gather_wb *wb = (struct write_gather_wb *) in_iov[0].iov_base;
+    struct write_gather *wg = wb->f->wg;
+    return wg->ops->write(wg->se, wg->user_data, &wb->in_hdr, &wb->in_write, &wb->in_iov[2], 1,
+            &wb->out_hdr, &wb->out_write, completion_context, wg->device_id);
+}
+
+struct write_gather *write_gather_new(struct write_gather_conf *conf, struct fuse_session *se,
+        struct fuse_ll_operations *ops, void *user_data, uint16_t device_id,
+        struct fuse_ll_flow *flow, write_gather_resume_t resume, void *resume_arg)
+{
+    struct write_gather *wg = new (std::nothrow) write_gather();
+    if (!wg)
+        return NULL;
+    wg->conf = conf;
+    wg->se = se;
+    wg->ops = ops;
+    wg->user_data = user_data;
+    wg->device_id = device_id;
+    wg->flow = flow;
+    wg->resume = resume;
+    wg->resume_arg = resume_arg;
+    wg->thread_id = 0;
+    wg->ndirty = 0;
+    wg->nwriting = 0;
+    wg->deadline_msec = UINT64_MAX;
+    wg->listed.store(-1, std::memory_order_relaxed);
+    return wg;
+}
+
+bool write_gather_drain(struct write_gather *wg, int thread_id)
+{
+    // The HAL thread of the device is still completing write backs, see write_gather_wb_done()
+    if (wg->nwriting.load(std::memory_order_acquire) > 0)
+        return false;
+    if (wg->ndirty == 0)
+        return true;
+    if (thread_id < 0)
+        return false;
+
+    // The write backs complete on this thread from now on
+    wg->thread_id = thread_id;
+    write_gather_write_back_all(wg);
+    return false;
+}
+
+void write_gather_destroy(struct write_gather *wg)
+{
+    write_gather_write_back_all(wg);
+    while (wg->nwriting > 0) {
+        fuse_ll_flow_poll(wg->flow, wg->thread_id);
+        if (wg->ops->poll)
+            wg->ops->poll(wg->user_data, wg->thread_id);
+        write_gather_poll(wg->conf, wg->thread_id);
+    }
+    for (auto &it : wg->files) {
+        write_gather_file_free(wg, it.second);
+    }
+    delete wg;
+}
+
+// Gathers the WRITE if it can, the gathered writes that it conflicts with have to be written
+// back first
+static bool write_gather_write(struct write_gather *wg,
+        struct iovec *in_iov, int in_iovcnt,
+        struct iovec *out_iov, int out_iovcnt,
+        void *completion_context, int *ret)
+{
+    struct fuse_session *se = wg->se;
+    struct write_gather_conf *conf = wg->conf;
+    // Anything out of the ordinary is left to the regular path to deal with
+    if (!se->init_done || !wg->ops->write || in_iovcnt < 2 || out_iovcnt != 2)
+        return false;
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) in_iov[0].iov_base;
+    struct fuse_write_in *in_write = (struct fuse_write_in *) in_iov[1].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) out_iov[0].iov_base;
+    struct fuse_write_out *out_write = (struct fuse_write_out *) out_iov[1].iov_base;
+
+    size_t total_write_iov_size = 0;
+    for (int i = 2; i < in_iovcnt; i++)
+        total_write_iov_size += in_iov[i].iov_len;
+    if (total_write_iov_size != in_write->size)
+        return false;
+
+    struct write_gather_file *f = write_gather_find(wg, in_hdr->nodeid);
+
+    // Before 7.9 there are no open flags in the write request, so we can't know about O_SYNC
+    bool gatherable = se->conn.proto_minor >= 9 &&
+        !(in_write->flags & (O_SYNC | O_DSYNC | O_DIRECT)) &&
+        in_write->size <= conf->file_limit;
+
+    if (f && f->len > 0) {
+        // Appends, and rewrites of what we already have, can be merged.
+        // Anything else has to wait for the gathered writes to be written back, to keep the order
+        bool mergeable = gatherable && !f->writing_back &&
+            f->fh == in_write->fh &&
+            in_write->offset >= f->offset &&
+            in_write->offset <= f->offset + f->len &&
+            in_write->offset + in_write->size <= f->offset + conf->file_limit;
+        if (!mergeable) {
+            write_gather_write_back(wg, f);
+            *ret = write_gather_park(wg, in_iov, in_iovcnt, out_iov, out_iovcnt, completion_context);
+            return true;
+        }
+    }
+    if (!gatherable)
+        return false;
+
+    if (!f) {
+        if (!write_gather_reserve(conf)) {
+            write_gather_reclaim(wg);
+            if (!write_gather_reserve(conf))
+                return false;
+        }
+        f = (struct write_gather_file *) calloc(1, sizeof(*f));
+        if (f)
+            f->buf = (char *) malloc(conf->file_limit);
+        if (!f || !f->buf) {
+            free(f);
+            conf->used.fetch_sub(conf->file_limit, std::memory_order_relaxed);
+            return false;
+        }
+        f->wg = wg;
+        f->nodeid = in_hdr->nodeid;
+        wg->files.insert(std::make_pair(in_hdr->nodeid, f));
+    }
+
+    if (f->len == 0) {
+        f->fh = in_write->fh;
+        f->offset = in_write->offset;
+        f->first_msec = write_gather_now_msec();
+        if (f->first_msec + conf->timeout_msec < wg->deadline_msec)
+            wg->deadline_msec = f->first_msec + conf->timeout_msec;
+        wg->ndirty++;
+        write_gather_list(wg);
+    }
+
+    char *dst = f->buf + (in_write->offset - f->offset);
+    for (int i = 2; i < in_iovcnt; i++) {
+        memcpy(dst, in_iov[i].iov_base, in_iov[i].iov_len);
+        dst += in_iov[i].iov_len;
+    }
+    size_t end = in_write->offset - f->offset + in_write->size;
+    if (end > f->len)
+        f->len = end;
+
+    f->uid = in_hdr->uid;
+    f->gid = in_hdr->gid;
+    f->pid = in_hdr->pid;
+    f->lock_owner = in_write->lock_owner;
+    f->write_flags = in_write->write_flags;
+    f->flags = in_write->flags;
+
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr) + sizeof(*out_write);
+    out_hdr->error = 0;
+    out_write->size = in_write->size;
+    out_write->padding = 0;
+    *ret = 0;
+    return true;
+}
+
+bool write_gather_request(struct write_gather *wg,
+        struct iovec *in_iov, int in_iovcnt,
+        struct iovec *out_iov, int out_iovcnt,
+        void *completion_context, int *ret)
+{
+    if (in_iovcnt < 1 || in_iov[0].iov_len < sizeof(struct fuse_in_header))
+        return false;
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) in_iov[0].iov_base;
+
+    wg->thread_id = dpfs_hal_thread_id();
+    write_gather_expire(wg);
+
+    bool wait = false;
+    switch (in_hdr->opcode) {
+    case FUSE_WRITE:
+        return write_gather_write(wg, in_iov, in_iovcnt, out_iov, out_iovcnt, completion_context, ret);
+    case FUSE_RELEASE:
+        if (in_iovcnt >= 2) {
+            struct fuse_release_in *in_release = (struct fuse_release_in *) in_iov[1].iov_base;
+            struct write_gather_file *f = write_gather_find(wg, in_hdr->nodeid);
+            // Unless it was gathered through another handle of the same file, which is still open
+            if (f && f->fh == in_release->fh)
+                wait = write_gather_write_back(wg, f);
+        }
+        break;
+    case FUSE_COPY_FILE_RANGE:
+        if (in_iovcnt >= 2) {
+            struct fuse_copy_file_range_in *in_cfr = (struct fuse_copy_file_range_in *) in_iov[1].iov_base;
+            // The backend copies straight from and into the files, start both write backs
+            bool in = write_gather_write_back(wg, write_gather_find(wg, in_hdr->nodeid));
+            bool out = write_gather_write_back(wg, write_gather_find(wg, in_cfr->nodeid_out));
+            wait = in || out;
+        }
+        break;
+    // These look at the data or size of the file, or report the write back error
+    case FUSE_SETATTR:
+    case FUSE_GETATTR:
+#ifdef DPFS_FUSE_STATX
+    case FUSE_STATX:
+#endif
+    case FUSE_READ:
+    case FUSE_FALLOCATE:
+    case FUSE_LSEEK:
+    case FUSE_FLUSH:
+    case FUSE_FSYNC:
+        wait = write_gather_write_back(wg, write_gather_find(wg, in_hdr->nodeid));
+        break;
+    // The entries could be files with gathered writes, whose size we would report too small
+    case FUSE_LOOKUP:
+    case FUSE_READDIRPLUS:
+    case FUSE_DESTROY:
+        wait = write_gather_write_back_all(wg);
+        break;
+    default:
+        break;
+    }
+    if (!wait)
+        return false;
+
+    *ret = write_gather_park(wg, in_iov, in_iovcnt, out_iov, out_iovcnt, completion_context);
+    return true;
+}
+
+int write_gather_error(struct write_gather *wg, uint64_t nodeid)
+{
+    struct write_gather_file *f = write_gather_find(wg, nodeid);
+    if (!f)
+        return 0;
+
+    int error = f->error;
+    f->error = 0;
+    return error;
+}
+
+int write_gather_release(struct write_gather *wg, uint64_t nodeid)
+{
+    auto it = wg->files.find(nodeid);
+    if (it == wg->files.end())
+        return 0;
+
+    struct write_gather_file *f = it->second;
+    // Gathered through another handle of the same file, which is still open
+    if (f->len > 0)
+        return 0;
+
+    int error = f->error;
+    write_gather_file_free(wg, f);
+    wg->files.erase(it);
+    return error;
+}
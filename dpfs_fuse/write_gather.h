@@ -0,0 +1,217 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef WRITE_GATHER_H
+#define WRITE_GATHER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <linux/fuse.h>
+#include "dpfs_fuse.h"
+#include "device_table.h"
+#include "flow_control.h"
+
+/*
+ * Write gathering: small writes (think 4k log appends) are copied into a per-file
+ * buffer in DPU memory and acked to the host right away. Contiguous (or overlapping)
+ * writes to the same file handle are merged and written back to the backend as a single
+ * large write when:
+ * - the buffer is full or the next write can't be merged
+ * - the oldest gathered write is older than the timeout
+ * - the host sends FSYNC, FLUSH, RELEASE or any op that looks at the file's data/size
+ * Writes with O_SYNC, O_DSYNC or O_DIRECT are never gathered.
+ * Just like with the page cache, an error during write back is returned at the next
+ * FSYNC, FLUSH or RELEASE of the file.
+ *
+ * The host requests pass through write_gather_request() before they go to flow control,
+ * i.e. before they can be queued. Gathered writes are replied to right there, without
+ * ever taking capacity of the backend. A request that needs a write back to complete first
+ * starts it and waits (parked) in the write_gather of its device, the HAL thread moves on.
+ * Once the write back completes, the parked requests are handed to resume, which passes
+ * them through write_gather_request() again.
+ * Write backs are regular WRITEs to the backend and go through flow control like the host
+ * requests do, with a local completion (see dpfs_hal_local_completion). The flow dispatches
+ * them to write_gather_dispatch() and they complete on whatever thread the backend completes
+ * on, which only hands them back to the HAL thread of the device (write_gather_poll()).
+ * A write back error is kept with the file until it is reported.
+ * Every HAL thread keeps a list of its devices with gathered writes, so that their timeouts
+ * also expire when the host stops sending requests (write_gather_expire_thread()).
+ *
+ * A device is only ever handled by a single HAL thread, so all of the per-device state
+ * is lockless. A removed device is handed over to the HAL thread that reclaims it, which
+ * writes back what is left (see write_gather_drain()).
+ */
+
+// Hands a parked request to the regular path again, same as fuse_ll_flow_dispatch_t
+typedef void (*write_gather_resume_t) (void *arg,
+                                       struct iovec *in_iov, int in_iovcnt,
+                                       struct iovec *out_iov, int out_iovcnt,
+                                       void *completion_context, uint16_t device_id);
+
+struct write_gather_file;
+
+// The write backs that the backend completed, per HAL thread
+struct alignas(64) write_gather_thread {
+    pthread_spinlock_t lock;
+    std::vector<struct write_gather_file *> done;
+    // The length of done, so that the poll hook doesn't need the lock if there is nothing to do
+    std::atomic<size_t> ndone;
+
+    // The devices of this HAL thread that have gathered writes. By device_id, the thread
+    // doesn't hold on to a device in between requests (see device_table.h).
+    // Only touched by the HAL thread itself
+    std::vector<uint16_t> dirty;
+    // The earliest time at which a gathered write of those devices times out
+    uint64_t deadline_msec;
+};
+
+// Shared by all devices
+struct write_gather_conf {
+    // Total bytes of DPU memory all of the gather buffers may use together
+    size_t budget;
+    // Max bytes that are gathered per file before they are written back
+    size_t file_limit;
+    // Max time in milliseconds a write may be gathered before it is written back
+    uint64_t timeout_msec;
+
+    std::atomic<size_t> used;
+    struct write_gather_thread threads[DPFS_FUSE_MAX_THREADS];
+};
+
+// A write back in flight, there is at most one per file
+struct write_gather_wb {
+    // Must stay the first member, see write_gather_dispatch()
+    struct fuse_in_header in_hdr;
+    struct fuse_write_in in_write;
+    struct fuse_out_header out_hdr;
+    struct fuse_write_out out_write;
+    struct iovec in_iov[3];
+    struct iovec out_iov[2];
+
+    struct write_gather_file *f;
+    // Bytes of the buffer that have been written back so far
+    size_t done;
+    uint16_t thread_id;
+    enum dpfs_hal_completion_status status;
+    struct dpfs_hal_local_completion c;
+};
+
+struct write_gather_file {
+    struct write_gather *wg;
+    uint64_t nodeid;
+    uint64_t fh;
+    // File offset of buf[0]
+    uint64_t offset;
+    size_t len;
+    // conf->file_limit bytes, kept around after write back for the next writes
+    char *buf;
+    // When the oldest gathered write was acked
+    uint64_t first_msec;
+    // Write back error, reported to the host at the next FSYNC, FLUSH or RELEASE
+    int error;
+    // buf is being written back, nothing may be gathered into it until that completes
+    bool writing_back;
+    struct write_gather_wb wb;
+
+    // Copied from the last gathered write, used for the write back request
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pid;
+    uint64_t lock_owner;
+    uint32_t write_flags;
+    uint32_t flags;
+};
+
+// A host request that waits for write backs, the HAL doesn't keep its iovec arrays
+struct write_gather_req {
+    void *completion_context;
+    int in_iovcnt;
+    int out_iovcnt;
+    std::vector<struct iovec> iov;
+};
+
+// Per device, only ever touched by the HAL thread that owns the device
+struct write_gather {
+    struct write_gather_conf *conf;
+    struct fuse_session *se;
+    struct fuse_ll_operations *ops;
+    void *user_data;
+    uint16_t device_id;
+    struct fuse_ll_flow *flow;
+    write_gather_resume_t resume;
+    void *resume_arg;
+    // The HAL thread of the device, as of its last request
+    uint16_t thread_id;
+
+    std::unordered_map<uint64_t, struct write_gather_file *> files;
+    // Number of files that currently have gathered writes, including those being written back
+    size_t ndirty;
+    // Number of write backs in flight. Only changed by the HAL thread of the device, atomic for
+    // write_gather_drain() on the thread that reclaims the device
+    std::atomic<size_t> nwriting;
+    // The earliest time at which a gathered write times out, UINT64_MAX if there are none
+    uint64_t deadline_msec;
+    // The HAL thread that has the device on its dirty list, -1 if none. Atomic for the HAL
+    // thread of another device that got the same device_id, see write_gather_expire_thread()
+    std::atomic<int> listed;
+    // In the order they came in
+    std::deque<struct write_gather_req *> parked;
+};
+
+struct write_gather_conf *write_gather_conf_new(size_t budget, size_t file_limit, uint64_t timeout_msec);
+void write_gather_conf_destroy(struct write_gather_conf *);
+
+struct write_gather *write_gather_new(struct write_gather_conf *, struct fuse_session *,
+        struct fuse_ll_operations *, void *user_data, uint16_t device_id,
+        struct fuse_ll_flow *, write_gather_resume_t resume, void *resume_arg);
+// Writes back all the gathered writes, waits for them and frees everything.
+// Only for device teardown, this polls the backend until it is done, so either once
+// write_gather_drain() returned true or when the HAL threads have stopped.
+void write_gather_destroy(struct write_gather *);
+// For a removed device that no HAL thread handles requests for anymore. Once the write backs
+// that were in flight have completed, writes back what is still gathered from the HAL thread
+// thread_id (-1 if the caller isn't one, then it only checks).
+// Returns true once there is nothing gathered nor being written back anymore
+bool write_gather_drain(struct write_gather *, int thread_id);
+
+// Called for every host request of the device before it goes to flow control.
+// Returns true if the request has been taken care of, *ret is then either 0 (a gathered
+// WRITE, the reply has been filled in), EWOULDBLOCK (parked until write backs complete)
+// or -ENOMEM.
+// Returns false if the request has to go to the backend as is, in that case any gathered
+// write it depends on has been written back.
+bool write_gather_request(struct write_gather *,
+        struct iovec *in_iov, int in_iovcnt,
+        struct iovec *out_iov, int out_iovcnt,
+        void *completion_context, int *ret);
+
+// Returns the pending write back error of the nodeid (if any) and resets it
+int write_gather_error(struct write_gather *, uint64_t nodeid);
+// Forgets the file unless it has gathered writes (of another handle, that is still open).
+// Returns the pending write back error of the file
+int write_gather_release(struct write_gather *, uint64_t nodeid);
+
+// Tells a write back by its local completion, given the completion_context that flow control
+// dispatches the request with. Nothing in the request itself, which the host could fake
+bool write_gather_is_wb(void *completion_context);
+// Flow control hands the write backs to this instead of the regular dispatching
+int write_gather_dispatch(struct iovec *in_iov, void *completion_context);
+
+// Picks up the write backs of the devices of this HAL thread that the backend completed,
+// and resumes the requests that waited for them. Must be called on the thread itself
+void write_gather_poll(struct write_gather_conf *, uint16_t thread_id);
+// Starts the write backs of the gathered writes of this HAL thread's devices that have timed out.
+// Must be called on the thread itself, in between requests
+void write_gather_expire_thread(struct write_gather_conf *, struct fuse_ll_device_table *,
+        uint16_t thread_id);
+
+#endif // WRITE_GATHER_H
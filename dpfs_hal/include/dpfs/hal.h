@@ -34,12 +34,17 @@ typedef int (*dpfs_hal_handler_t) (void *user_data,
                                    void *completion_context, uint16_t device_id);
 typedef void (*dpfs_hal_register_device_t) (void *user_data, uint16_t device_id);
 typedef void (*dpfs_hal_unregister_device_t) (void *user_data, uint16_t device_id);
+// Called by every polling thread after each pass over its devices, so that
+// the request handler can pick up work that it put aside on that thread
+typedef void (*dpfs_hal_poll_t) (void *user_data, uint16_t thread_id);
 
 struct dpfs_hal_ops {
     dpfs_hal_handler_t request_handler;    
     // These two callbacks are called during dpfs_hal_new
     dpfs_hal_register_device_t register_device;    
     dpfs_hal_unregister_device_t unregister_device;    
+    // Optional, NULL if the request handler doesn't need it
+    dpfs_hal_poll_t poll;
 };
 
 struct dpfs_hal_params {
@@ -55,14 +60,43 @@ enum dpfs_hal_completion_status {
     DPFS_HAL_COMPLETION_ERROR
 };
 
+// A completion context for requests that don't come from the host, but that the
+// FUSE layer makes up itself (e.g. writing back gathered writes to the backend).
+// Hand dpfs_hal_local_completion_context(&c) to the backend as its completion_context
+// and dpfs_hal_async_complete will call c.cb instead of replying to the host.
+// The tag lives in the lowest pointer bit, which is never set for the HAL's own contexts.
+typedef void (*dpfs_hal_local_completion_cb_t) (void *arg, enum dpfs_hal_completion_status);
+struct dpfs_hal_local_completion {
+    dpfs_hal_local_completion_cb_t cb;
+    void *arg;
+};
+#define DPFS_HAL_LOCAL_COMPLETION_TAG ((uintptr_t) 0x1)
+
+static inline void *dpfs_hal_local_completion_context(struct dpfs_hal_local_completion *c)
+{
+    return (void *) ((uintptr_t) c | DPFS_HAL_LOCAL_COMPLETION_TAG);
+}
+// Returns NULL if the completion_context belongs to a host request
+static inline struct dpfs_hal_local_completion *dpfs_hal_local_completion_get(void *completion_context)
+{
+    if (!((uintptr_t) completion_context & DPFS_HAL_LOCAL_COMPLETION_TAG))
+        return NULL;
+    return (struct dpfs_hal_local_completion *) ((uintptr_t) completion_context & ~DPFS_HAL_LOCAL_COMPLETION_TAG);
+}
+
 // Not user-accessible
 struct dpfs_hal;
 
 // Returns the current thread id
 // This should only be called from within the request handler context!!
 uint16_t dpfs_hal_thread_id(void);
+// For threads that hand requests to a dpfs_fuse without a HAL, such as the request replayer
+void dpfs_hal_set_thread_id(uint16_t thread_id);
 // Returns the total number of DPFS threads for request handling
 uint16_t dpfs_hal_nthreads(struct dpfs_hal *);
+// Returns how many requests the devices of a DPFS thread can have outstanding at once
+// (the queue depth times the queues of all the devices that the thread polls)
+uint32_t dpfs_hal_thread_queue_depth(struct dpfs_hal *, uint16_t thread_id);
 
 // Optionally starts a background thread that handles the mock virtio-fs devices,
 // which only get polled once a second. This should be set to true when not using
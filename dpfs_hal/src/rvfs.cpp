@@ -23,15 +23,32 @@
 using namespace erpc;
 
 pthread_key_t dpfs_hal_thread_id_key;
+static pthread_once_t dpfs_hal_thread_id_once = PTHREAD_ONCE_INIT;
+static int dpfs_hal_thread_id_err;
+static void dpfs_hal_thread_id_key_create(void)
+{
+    dpfs_hal_thread_id_err = pthread_key_create(&dpfs_hal_thread_id_key, NULL);
+}
 __attribute__((visibility("default")))
 uint16_t dpfs_hal_thread_id(void) {
     return (uint16_t) (size_t) pthread_getspecific(dpfs_hal_thread_id_key);
 }
 __attribute__((visibility("default")))
+void dpfs_hal_set_thread_id(uint16_t thread_id)
+{
+    pthread_once(&dpfs_hal_thread_id_once, dpfs_hal_thread_id_key_create);
+    pthread_setspecific(dpfs_hal_thread_id_key, (void *) (size_t) thread_id);
+}
+__attribute__((visibility("default")))
 uint16_t dpfs_hal_nthreads(struct dpfs_hal *hal)
 {
     return 1;
 }
+__attribute__((visibility("default")))
+uint32_t dpfs_hal_thread_queue_depth(struct dpfs_hal *hal, uint16_t thread_id)
+{
+    return hal->queue_depth;
+}
 
 struct rpc_msg {
     // Back reference to dpfs_hal for the async_completion
@@ -62,8 +79,10 @@ struct dpfs_hal {
     std::unique_ptr<Nexus> nexus;
     std::unique_ptr<Rpc<CTransport>> rpc;
 
+    size_t queue_depth;
+
     dpfs_hal(dpfs_hal_ops o, void *ud, size_t queue_size) :
-        ops(o), user_data(ud), avail(queue_size) {}
+        ops(o), user_data(ud), avail(queue_size), queue_depth(queue_size) {}
 };
 
 // When we receive a FUSE request from the DPU, aka the virtio-fs device
@@ -171,7 +190,8 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
         std::cerr << "The config must contain a positive integer `nic_numa_node` under [rvfs]" << std::endl;
         return nullptr;
     }
-    if (pthread_key_create(&dpfs_hal_thread_id_key, NULL)) {
+    pthread_once(&dpfs_hal_thread_id_once, dpfs_hal_thread_id_key_create);
+    if (dpfs_hal_thread_id_err) {
         std::cerr << "Failed to create thread-local key for dpfs_hal threadid" << std::endl;
         return nullptr;
     }
@@ -216,6 +236,8 @@ void dpfs_hal_loop(struct dpfs_hal *hal) {
 
     while(keep_running) {
         hal->rpc->run_event_loop_once();
+        if (hal->ops.poll)
+            hal->ops.poll(hal->user_data, 0);
     }
 
     stop_low_latency();
@@ -243,8 +265,14 @@ void dpfs_hal_destroy(struct dpfs_hal *hal) {
 }
 
 __attribute__((visibility("default")))
-int dpfs_hal_async_complete(void *completion_context, enum dpfs_hal_completion_status)
+int dpfs_hal_async_complete(void *completion_context, enum dpfs_hal_completion_status status)
 {
+    struct dpfs_hal_local_completion *local = dpfs_hal_local_completion_get(completion_context);
+    if (local) {
+        local->cb(local->arg, status);
+        return 0;
+    }
+
     rpc_msg *msg = static_cast<rpc_msg *>(completion_context);
     dpfs_hal *hal = msg->hal;
 
@@ -77,20 +77,43 @@ struct dpfs_hal {
     void *user_data;
     useconds_t polling_interval_usec;
     uint16_t nthreads;
+    int queue_depth;
 };
 
 static volatile int keep_running = 1;
 
 pthread_key_t dpfs_hal_thread_id_key;
+static pthread_once_t dpfs_hal_thread_id_once = PTHREAD_ONCE_INIT;
+static int dpfs_hal_thread_id_err;
+static void dpfs_hal_thread_id_key_create(void)
+{
+    dpfs_hal_thread_id_err = pthread_key_create(&dpfs_hal_thread_id_key, NULL);
+}
 __attribute__((visibility("default")))
 uint16_t dpfs_hal_thread_id(void) {
     return (uint16_t) (size_t) pthread_getspecific(dpfs_hal_thread_id_key);
 }
 __attribute__((visibility("default")))
+void dpfs_hal_set_thread_id(uint16_t thread_id)
+{
+    pthread_once(&dpfs_hal_thread_id_once, dpfs_hal_thread_id_key_create);
+    pthread_setspecific(dpfs_hal_thread_id_key, (void *) (size_t) thread_id);
+}
+__attribute__((visibility("default")))
 uint16_t dpfs_hal_nthreads(struct dpfs_hal *hal)
 {
     return hal->nthreads;
 }
+__attribute__((visibility("default")))
+uint32_t dpfs_hal_thread_queue_depth(struct dpfs_hal *hal, uint16_t thread_id)
+{
+    // The same split of the devices over the threads as in dpfs_hal_loop_thread
+    uint32_t ndevices = hal->ndevices / hal->nthreads;
+    if (thread_id == 0)
+        ndevices += hal->ndevices % hal->nthreads;
+    // Every device has a HiPrio and a Requests queue
+    return ndevices * 2 * hal->queue_depth;
+}
 
 static void signal_handler(int dummy)
 {
@@ -226,6 +249,8 @@ static void *dpfs_hal_loop_static_thread(void *arg)
         for (size_t i = devices_start; i < devices_end; i++) {
             dpfs_hal_poll_device(&hal->devices[i]);
         }
+        if (hal->ops.poll)
+            hal->ops.poll(hal->user_data, ht->thread_id);
     }
 
     return NULL;
@@ -298,6 +323,12 @@ struct dpfs_hal_completion_ctx {
 __attribute__((visibility("default")))
 int dpfs_hal_async_complete(void *completion_context, enum dpfs_hal_completion_status status)
 {
+    struct dpfs_hal_local_completion *local = dpfs_hal_local_completion_get(completion_context);
+    if (local) {
+        local->cb(local->arg, status);
+        return 0;
+    }
+
     // Increment IO counter
     // If timer is > 1 sec, calc the IOPS and reset the counter
     struct snap_fs_dev_io_done_ctx *cb = completion_context;
@@ -497,6 +528,7 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
     hal->user_data = params->user_data;
     hal->ops = params->ops;
     hal->nthreads = nthreads.u.i;
+    hal->queue_depth = qd.u.i;
     hal->ndevices = toml_array_nelem(pf_ids);
     hal->devices = calloc(hal->ndevices, sizeof(*hal->devices));
     if (mock_pf_ids) {
@@ -506,7 +538,8 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
 
     // Initialize the thread-local key we use to tell each of the Virtio
     // polling threads, which thread id it has
-    if (pthread_key_create(&dpfs_hal_thread_id_key, NULL)) {
+    pthread_once(&dpfs_hal_thread_id_once, dpfs_hal_thread_id_key_create);
+    if (dpfs_hal_thread_id_err) {
         fprintf(stderr, "Failed to create thread-local key for dpfs_hal threadid\n");
         goto out;
     }
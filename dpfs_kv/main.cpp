@@ -13,14 +13,16 @@
 
 #include <memory>
 #include <atomic>
+#include <iostream>
 #include <boost/lockfree/queue.hpp>
 
 #include "RamCloud.h"
 #include "ClientException.h"
 #include "TableEnumerator.h"
 
-#include "dpfs_fuse.h"
+#include "dpfs_fuse.hpp"
 #include "dpfs/hal.h"
+#include "tomlcpp.hpp"
 
 struct RamCloudUserData {
     RAMCloud::RamCloud *ramcloud;
@@ -358,312 +360,283 @@ public:
     }
 };
 
-static int fuse_init(struct fuse_session *se, RamCloudUserData *userData,
-                     struct fuse_in_header *in_hdr, struct fuse_init_in *in_init,
-                     struct fuse_conn_info *conn, struct fuse_out_header *out_hdr, uint16_t device_id)
-{
-
-    printf("FUSE init\n");
+class RamCloudFs {
+private:
+    RamCloudUserData& userData;
+public:
+    RamCloudFs(RamCloudUserData& userData) : userData{userData} {}
 
-    se->init_done = true;
+    int init(const dpfs::Request& req, struct fuse_init_in *in_init, struct fuse_conn_info *conn)
+    {
+        printf("FUSE init\n");
 
-    /* We do not do anything here for now */
+        req.se->init_done = true;
 
-    return 0;
-}
+        /* We do not do anything here for now */
 
-static int fuse_lookup(struct fuse_session *se, RamCloudUserData *userData,
-                       struct fuse_in_header *in_hdr, const char *const in_name,
-                       struct fuse_out_header *out_hdr, struct fuse_entry_out *out_entry,
-                       void *completion_context, uint16_t device_id)
-{
-    new AsyncLookupOp{*userData, fnv1a_hash(in_name), se, out_hdr, out_entry, completion_context};
+        return 0;
+    }
 
-    return EWOULDBLOCK;
-}
+    int lookup(const dpfs::Request& req, const char *name, struct fuse_entry_out *out_entry)
+    {
+        new AsyncLookupOp{userData, fnv1a_hash(name), req.se, req.out_hdr, out_entry,
+                          req.completion_context};
 
-static int fuse_getattr(struct fuse_session *se, RamCloudUserData *userData,
-                        struct fuse_in_header *in_hdr, struct fuse_getattr_in *in_getattr,
-                        struct fuse_out_header *out_hdr, struct fuse_attr_out *out_attr,
-                        void *completion_context, uint16_t device_id)
-{
-    struct stat st;
-
-    /* root directory */
-    if (in_hdr->nodeid == 1) {
-        st.st_dev = 0;         /* ID of device containing file */
-        st.st_ino = 1;         /* Inode number */
-        st.st_mode = S_IFDIR;  /* File type and mode */
-        st.st_nlink = 0;       /* Number of hard links */
-        st.st_uid = 0;         /* User ID of owner */
-        st.st_gid = 0;         /* Group ID of owner */
-        st.st_rdev = 0;        /* Device ID (if special file) */
-        st.st_size = 128;      /* Total size, in bytes */
-        st.st_blksize = 1;     /* Block size for filesystem I/O */
-        st.st_blocks = 1;      /* Number of 512B blocks allocated */
-
-        // st.st_atim;  /* Time of last access */
-        // st.st_mtim;  /* Time of last modification */
-        // st.st_ctim;  /* Time of last status change */
-        return fuse_ll_reply_attr(se, out_hdr, out_attr, &st, 1);
-    } else {
-        new AsyncGetAttrOp{*userData, in_hdr->nodeid, se, out_hdr, out_attr, completion_context};
         return EWOULDBLOCK;
     }
-}
 
-static int fuse_statfs(struct fuse_session *se, RamCloudUserData *userData,
-                       struct fuse_in_header *in_hdr,
-                       struct fuse_out_header *out_hdr, struct fuse_statfs_out *out_statfs,
-                       void *completion_context, uint16_t device_id)
-{
-    struct statvfs stbuf;
-    stbuf.f_bsize = 1;    /* Filesystem block size */
-    stbuf.f_frsize = 4096;   /* Fragment size */
-    stbuf.f_blocks = 1024*1024;   /* Size of fs in f_frsize units */
-    stbuf.f_bfree = 1024;    /* Number of free blocks */
-    stbuf.f_bavail = 1024;   /* Number of free blocks for unprivileged users */
-    stbuf.f_files = 1024;    /* Number of inodes */
-    stbuf.f_ffree = 1024;    /* Number of free inodes */
-    stbuf.f_favail = 1024;   /* Number of free inodes for unprivileged users */
-    stbuf.f_fsid = 1;     /* Filesystem ID */
-    stbuf.f_flag = 0;     /* Mount flags */
-    stbuf.f_namemax = MAX_FILE_NAME;  /* Maximum filename length */
-
-    return fuse_ll_reply_statfs(se, out_hdr, out_statfs, &stbuf);
-}
-
-static int fuse_setattr(struct fuse_session *se, RamCloudUserData *userData,
-                        struct fuse_in_header *in_hdr, struct stat *s, int valid, struct fuse_file_info *fi,
-                        struct fuse_out_header *out_hdr, struct fuse_attr_out *out_attr,
-                        void *completion_context, uint16_t device_id)
-{
-    RamCloudInode inode;
-    try {
-        RAMCloud::Buffer value;
-        userData->ramcloud->read(userData->inodeTableId, &in_hdr->nodeid, sizeof(in_hdr->nodeid),
-                            &value);
-        value.copy(0, sizeof(inode), &inode);
-    } catch (RAMCloud::ClientException& e) {
-        fprintf(stderr, "[ERROR] setattr read: %d\n", e.status);
-        if (e.status == RAMCloud::STATUS_OBJECT_DOESNT_EXIST) {
-            out_hdr->error = -ENOENT;
+    int getattr(const dpfs::Request& req, struct fuse_getattr_in *in_getattr,
+                struct fuse_attr_out *out_attr)
+    {
+        struct stat st;
+
+        /* root directory */
+        if (req.nodeid() == 1) {
+            st.st_dev = 0;         /* ID of device containing file */
+            st.st_ino = 1;         /* Inode number */
+            st.st_mode = S_IFDIR;  /* File type and mode */
+            st.st_nlink = 0;       /* Number of hard links */
+            st.st_uid = 0;         /* User ID of owner */
+            st.st_gid = 0;         /* Group ID of owner */
+            st.st_rdev = 0;        /* Device ID (if special file) */
+            st.st_size = 128;      /* Total size, in bytes */
+            st.st_blksize = 1;     /* Block size for filesystem I/O */
+            st.st_blocks = 1;      /* Number of 512B blocks allocated */
+
+            // st.st_atim;  /* Time of last access */
+            // st.st_mtim;  /* Time of last modification */
+            // st.st_ctim;  /* Time of last status change */
+            return fuse_ll_reply_attr(req.se, req.out_hdr, out_attr, &st, 1);
         } else {
-            out_hdr->error = -EIO;
+            new AsyncGetAttrOp{userData, req.nodeid(), req.se, req.out_hdr, out_attr,
+                               req.completion_context};
+            return EWOULDBLOCK;
         }
-        return 0;
     }
 
-    /* sync for now */
-    if (valid & FUSE_SET_ATTR_MODE) {
-        inode.attr.st_mode = s->st_mode;
-    }
+    int statfs(const dpfs::Request& req, struct fuse_statfs_out *out_statfs)
+    {
+        struct statvfs stbuf;
+        stbuf.f_bsize = 1;    /* Filesystem block size */
+        stbuf.f_frsize = 4096;   /* Fragment size */
+        stbuf.f_blocks = 1024*1024;   /* Size of fs in f_frsize units */
+        stbuf.f_bfree = 1024;    /* Number of free blocks */
+        stbuf.f_bavail = 1024;   /* Number of free blocks for unprivileged users */
+        stbuf.f_files = 1024;    /* Number of inodes */
+        stbuf.f_ffree = 1024;    /* Number of free inodes */
+        stbuf.f_favail = 1024;   /* Number of free inodes for unprivileged users */
+        stbuf.f_fsid = 1;     /* Filesystem ID */
+        stbuf.f_flag = 0;     /* Mount flags */
+        stbuf.f_namemax = MAX_FILE_NAME;  /* Maximum filename length */
+
+        return fuse_ll_reply_statfs(req.se, req.out_hdr, out_statfs, &stbuf);
+    }
+
+    int setattr(const dpfs::Request& req, struct fuse_setattr_in *in_setattr,
+                struct fuse_attr_out *out_attr)
+    {
+        uint64_t nodeid = req.nodeid();
+        RamCloudInode inode;
+        try {
+            RAMCloud::Buffer value;
+            userData.ramcloud->read(userData.inodeTableId, &nodeid, sizeof(nodeid), &value);
+            value.copy(0, sizeof(inode), &inode);
+        } catch (RAMCloud::ClientException& e) {
+            fprintf(stderr, "[ERROR] setattr read: %d\n", e.status);
+            if (e.status == RAMCloud::STATUS_OBJECT_DOESNT_EXIST) {
+                return req.error(ENOENT);
+            } else {
+                return req.error(EIO);
+            }
+        }
 
-    if (valid & FUSE_SET_ATTR_UID) {
-        inode.attr.st_uid = s->st_uid;
-    }
+        /* sync for now */
+        if (in_setattr->valid & FATTR_MODE) {
+            inode.attr.st_mode = in_setattr->mode;
+        }
 
-    if (valid & FUSE_SET_ATTR_GID) {
-        inode.attr.st_gid = s->st_gid;
-    }
+        if (in_setattr->valid & FATTR_UID) {
+            inode.attr.st_uid = in_setattr->uid;
+        }
 
-    if (valid & FUSE_SET_ATTR_SIZE) {
-        inode.attr.st_size = s->st_size;
-        /* Number of 512B blocks allocated */
-        inode.attr.st_blocks =  s->st_size / 512 + (s->st_size % 512 == 0 ? 0 : 1);
-    }
+        if (in_setattr->valid & FATTR_GID) {
+            inode.attr.st_gid = in_setattr->gid;
+        }
 
-    try {
-        userData->ramcloud->write(userData->inodeTableId, &in_hdr->nodeid, sizeof(in_hdr->nodeid),
-                                 &inode, sizeof(inode));
-    } catch (RAMCloud::ClientException& e) {
-        fprintf(stderr, "[ERROR] setattr write: %d\n", e.status);
-        out_hdr->error = -EIO;
-        return 0;
-    }
+        if (in_setattr->valid & FATTR_SIZE) {
+            inode.attr.st_size = in_setattr->size;
+            /* Number of 512B blocks allocated */
+            inode.attr.st_blocks = in_setattr->size / 512 + (in_setattr->size % 512 == 0 ? 0 : 1);
+        }
 
-    return fuse_ll_reply_attr(se, out_hdr, out_attr, &inode.attr, 1);
-}
+        try {
+            userData.ramcloud->write(userData.inodeTableId, &nodeid, sizeof(nodeid),
+                                     &inode, sizeof(inode));
+        } catch (RAMCloud::ClientException& e) {
+            fprintf(stderr, "[ERROR] setattr write: %d\n", e.status);
+            return req.error(EIO);
+        }
 
-static int fuse_mknod(struct fuse_session *se, RamCloudUserData *userData,
-                      struct fuse_in_header *in_hdr, struct fuse_mknod_in *in_mknod,
-                      const char *const in_name,
-                      struct fuse_out_header *out_hdr, struct fuse_entry_out *out_entry,
-                      void *completion_context, uint16_t device_id)
-{
-    if (in_hdr->nodeid != 1) {
-        /* we don't support directories so anything other than root nodeid should not happen!? */
-        fprintf(stderr, "[ERROR] mknod: invalid inode id\n");
-        out_hdr->error = -EIO;
-        return 0;
+        return fuse_ll_reply_attr(req.se, req.out_hdr, out_attr, &inode.attr, 1);
     }
 
-    if (!S_ISREG(in_mknod->mode)) {
-        /* We don't allow anything but files */
-        fprintf(stderr, "[ERROR] mknod: invalid mode\n");
-        out_hdr->error = -EINVAL;
-        return 0;
-    }
+    /* not sure if this is needed at all */
+    int mknod(const dpfs::Request& req, struct fuse_mknod_in *in_mknod, const char *name,
+              struct fuse_entry_out *out_entry)
+    {
+        if (req.nodeid() != 1) {
+            /* we don't support directories so anything other than root nodeid should not happen!? */
+            fprintf(stderr, "[ERROR] mknod: invalid inode id\n");
+            return req.error(EIO);
+        }
 
-    RamCloudInode inode;
-    strcpy(inode.name, in_name);
-    inode.attr.st_dev = 0;         /* ID of device containing file */
-    inode.attr.st_ino = fnv1a_hash(in_name);         /* Inode number */
-    inode.attr.st_mode = S_IFREG;  /* File type and mode */
-    inode.attr.st_nlink = 0;       /* Number of hard links */
-    inode.attr.st_uid = 0;         /* User ID of owner */
-    inode.attr.st_gid = 0;         /* Group ID of owner */
-    inode.attr.st_rdev = 0;        /* Device ID (if special file) */
-    inode.attr.st_size = 0;      /* Total size, in bytes */
-    inode.attr.st_blksize = 1;     /* Block size for filesystem I/O */
-    inode.attr.st_blocks = 1;      /* Number of 512B blocks allocated */
-
-    // inode.attr.st_atim;  /* Time of last access */
-    // inode.attr.st_mtim;  /* Time of last modification */
-    // inode.attr.st_ctim;  /* Time of last status change */
-
-    try {
-        userData->ramcloud->write(userData->inodeTableId, &inode.attr.st_ino,
-                                  sizeof(inode.attr.st_ino), &inode, sizeof(inode));
-    } catch (RAMCloud::ClientException& e) {
-        fprintf(stderr, "[ERROR] mknod write: %d\n", e.status);
-        out_hdr->error = -EIO;
-        return 0;
-    }
+        if (!S_ISREG(in_mknod->mode)) {
+            /* We don't allow anything but files */
+            fprintf(stderr, "[ERROR] mknod: invalid mode\n");
+            return req.error(EINVAL);
+        }
 
-    struct fuse_entry_param e;
-    e.ino = inode.attr.st_ino;
-    e.generation = 0;
-    e.attr_timeout = 1;
-    e.entry_timeout = 1;
-    e.attr = inode.attr;
-    return fuse_ll_reply_entry(se, out_hdr, out_entry, &e);
-}
+        RamCloudInode inode;
+        strcpy(inode.name, name);
+        inode.attr.st_dev = 0;         /* ID of device containing file */
+        inode.attr.st_ino = fnv1a_hash(name);         /* Inode number */
+        inode.attr.st_mode = S_IFREG;  /* File type and mode */
+        inode.attr.st_nlink = 0;       /* Number of hard links */
+        inode.attr.st_uid = 0;         /* User ID of owner */
+        inode.attr.st_gid = 0;         /* Group ID of owner */
+        inode.attr.st_rdev = 0;        /* Device ID (if special file) */
+        inode.attr.st_size = 0;      /* Total size, in bytes */
+        inode.attr.st_blksize = 1;     /* Block size for filesystem I/O */
+        inode.attr.st_blocks = 1;      /* Number of 512B blocks allocated */
+
+        // inode.attr.st_atim;  /* Time of last access */
+        // inode.attr.st_mtim;  /* Time of last modification */
+        // inode.attr.st_ctim;  /* Time of last status change */
+
+        try {
+            userData.ramcloud->write(userData.inodeTableId, &inode.attr.st_ino,
+                                     sizeof(inode.attr.st_ino), &inode, sizeof(inode));
+        } catch (RAMCloud::ClientException& e) {
+            fprintf(stderr, "[ERROR] mknod write: %d\n", e.status);
+            return req.error(EIO);
+        }
 
-static int fuse_write(struct fuse_session *se, RamCloudUserData *userData,
-                      struct fuse_in_header *in_hdr, struct fuse_write_in *in_write,
-                      struct iovec *in_iov, int iovcnt,
-                      struct fuse_out_header *out_hdr, struct fuse_write_out *out_write,
-                      void *completion_context, uint16_t device_id)
-{
-    // The ramcloud backend only allows for complete file writes
-    if (in_write->offset != 0) {
-        fprintf(stderr, "[ERROR] write: offset != 0\n");
-        out_hdr->error = -EINVAL;
-        return 0;
+        struct fuse_entry_param e;
+        e.ino = inode.attr.st_ino;
+        e.generation = 0;
+        e.attr_timeout = 1;
+        e.entry_timeout = 1;
+        e.attr = inode.attr;
+        return fuse_ll_reply_entry(req.se, req.out_hdr, out_entry, &e);
     }
 
-    new AsyncWriteOp{*userData, in_hdr->nodeid, in_iov, iovcnt, se, out_hdr, out_write,
-                     completion_context};
+    int write(const dpfs::Request& req, struct fuse_write_in *in_write,
+              struct iovec *in_iov, int iovcnt, struct fuse_write_out *out_write)
+    {
+        // The ramcloud backend only allows for complete file writes
+        if (in_write->offset != 0) {
+            fprintf(stderr, "[ERROR] write: offset != 0\n");
+            return req.error(EINVAL);
+        }
 
-    return EWOULDBLOCK;
-}
+        new AsyncWriteOp{userData, req.nodeid(), in_iov, iovcnt, req.se, req.out_hdr, out_write,
+                         req.completion_context};
 
-static int fuse_read(struct fuse_session *se, RamCloudUserData *userData,
-                 struct fuse_in_header *in_hdr, struct fuse_read_in *in_read,
-                 struct fuse_out_header *out_hdr, struct iovec *in_iov, int iovcnt,
-                 void *completion_context, uint16_t device_id)
-{
+        return EWOULDBLOCK;
+    }
 
-    new AsyncReadOp{*userData, in_hdr->nodeid, in_read->offset, in_iov, iovcnt, se, out_hdr,
-                    completion_context};
+    int read(const dpfs::Request& req, struct fuse_read_in *in_read,
+             struct iovec *in_iov, int iovcnt)
+    {
+        new AsyncReadOp{userData, req.nodeid(), in_read->offset, in_iov, iovcnt, req.se,
+                        req.out_hdr, req.completion_context};
 
-    return EWOULDBLOCK;
-}
+        return EWOULDBLOCK;
+    }
 
-static int fuse_readdir(struct fuse_session *se, RamCloudUserData *userData,
-                        struct fuse_in_header *in_hdr, struct fuse_read_in *in_read, bool plus,
-                        struct fuse_out_header *out_hdr, struct iov iov,
-                        void *completion_context, uint16_t device_id)
-{
-    RAMCloud::TableEnumerator *tableEnum =
-        reinterpret_cast<RAMCloud::TableEnumerator *>(in_read->fh);
-
-    size_t offset = in_read->offset + 1;
-    size_t totalWritten = 0;
-    while (tableEnum->hasNext()) {
-        const void* key;
-        uint32_t keyLength;
-        const void* value;
-        uint32_t valueLength;
-        tableEnum->nextKeyAndData(&keyLength, &key, &valueLength, &value);
-        if (keyLength != sizeof(key)) {
-            fprintf(stderr, "[ERROR] readdir: invalid key size\n");
-            break;
-        }
-        if (valueLength != sizeof(RamCloudInode)) {
-            fprintf(stderr, "[ERROR] readdir: invalid value size\n");
-            break;
-        }
-        const RamCloudInode *inode = reinterpret_cast<const RamCloudInode *>(value);
-        size_t written = 0;
-        if (plus) {
-            struct fuse_entry_param e;
-            e.ino = inode->attr.st_ino;
-            e.generation = 0;
-            e.attr = inode->attr;
-            e.attr_timeout = 1;
-            e.entry_timeout = 1;
-            written = fuse_add_direntry_plus(&iov, inode->name, &e, offset);
-        } else {
-            written = fuse_add_direntry(&iov, inode->name, &inode->attr, offset);
-        }
-        if (written == 0) {
-            /* buffer full */
-            break;
+    int readdir(const dpfs::Request& req, struct fuse_read_in *in_read, bool plus, struct iov iov)
+    {
+        RAMCloud::TableEnumerator *tableEnum =
+            reinterpret_cast<RAMCloud::TableEnumerator *>(in_read->fh);
+
+        size_t offset = in_read->offset + 1;
+        size_t totalWritten = 0;
+        while (tableEnum->hasNext()) {
+            const void* key;
+            uint32_t keyLength;
+            const void* value;
+            uint32_t valueLength;
+            tableEnum->nextKeyAndData(&keyLength, &key, &valueLength, &value);
+            if (keyLength != sizeof(key)) {
+                fprintf(stderr, "[ERROR] readdir: invalid key size\n");
+                break;
+            }
+            if (valueLength != sizeof(RamCloudInode)) {
+                fprintf(stderr, "[ERROR] readdir: invalid value size\n");
+                break;
+            }
+            const RamCloudInode *inode = reinterpret_cast<const RamCloudInode *>(value);
+            size_t written = 0;
+            if (plus) {
+                struct fuse_entry_param e;
+                e.ino = inode->attr.st_ino;
+                e.generation = 0;
+                e.attr = inode->attr;
+                e.attr_timeout = 1;
+                e.entry_timeout = 1;
+                written = fuse_add_direntry_plus(&iov, inode->name, &e, offset);
+            } else {
+                written = fuse_add_direntry(&iov, inode->name, &inode->attr, offset);
+            }
+            if (written == 0) {
+                /* buffer full */
+                break;
+            }
+            totalWritten += written;
+            offset++;
         }
-        totalWritten += written;
-        offset++;
-    }
 
-    out_hdr->len += totalWritten;
-    return 0;
-}
+        req.out_hdr->len += totalWritten;
+        return 0;
+    }
 
-static int fuse_opendir(struct fuse_session *se, RamCloudUserData *userData,
-                        struct fuse_in_header *in_hdr, struct fuse_open_in *in_open,
-                        struct fuse_out_header *out_hdr, struct fuse_open_out *out_open,
-                        void *completion_context, uint16_t device_id)
-{
-    struct fuse_file_info fi = {};
-    fi.fh = (uint64_t) new RAMCloud::TableEnumerator{*userData->ramcloud, userData->inodeTableId,
-                                                     false};
-    fi.flags = in_open->flags;
-    return fuse_ll_reply_open(se, out_hdr, out_open, &fi);
-}
+    int opendir(const dpfs::Request& req, struct fuse_open_in *in_open,
+                struct fuse_open_out *out_open)
+    {
+        struct fuse_file_info fi = {};
+        fi.fh = (uint64_t) new RAMCloud::TableEnumerator{*userData.ramcloud, userData.inodeTableId,
+                                                         false};
+        fi.flags = in_open->flags;
+        return fuse_ll_reply_open(req.se, req.out_hdr, out_open, &fi);
+    }
 
-static int fuse_releasedir(struct fuse_session *se, RamCloudUserData *userData,
-                           struct fuse_in_header *in_hdr, struct fuse_release_in *in_release,
-                           struct fuse_out_header *out_hdr,
-                           void *completion_context, uint16_t device_id)
-{
-    RAMCloud::TableEnumerator *tableEnum =
-        reinterpret_cast<RAMCloud::TableEnumerator *>(in_release->fh);
-    delete tableEnum;
-    return 0;
-}
+    int releasedir(const dpfs::Request& req, struct fuse_release_in *in_release)
+    {
+        RAMCloud::TableEnumerator *tableEnum =
+            reinterpret_cast<RAMCloud::TableEnumerator *>(in_release->fh);
+        delete tableEnum;
+        return 0;
+    }
 
-static int fuse_unlink(struct fuse_session *se, RamCloudUserData *userData,
-                       struct fuse_in_header *in_hdr, const char *const in_name,
-                       struct fuse_out_header *out_hdr,
-                       void *completion_context, uint16_t device_id)
-{
-    /* TODO: use multiRemove */
-    uint64_t inodeId = fnv1a_hash(in_name);
-    RAMCloud::RemoveRpc removeInode{userData->ramcloud, userData->inodeTableId, &inodeId,
-                                    sizeof(inodeId)};
-    RAMCloud::RemoveRpc removeData{userData->ramcloud, userData->dataTableId, &inodeId,
-                                    sizeof(inodeId)};
-    while (!removeData.isReady() || !removeInode.isReady());
-    try {
-        removeInode.wait();
-        removeData.wait();
-    } catch (RAMCloud::ClientException& e) {
-        fprintf(stderr, "[ERROR] unlink: %d\n", e.status);
-        out_hdr->error = -EIO;
+    int unlink(const dpfs::Request& req, const char *name)
+    {
+        /* TODO: use multiRemove */
+        uint64_t inodeId = fnv1a_hash(name);
+        RAMCloud::RemoveRpc removeInode{userData.ramcloud, userData.inodeTableId, &inodeId,
+                                        sizeof(inodeId)};
+        RAMCloud::RemoveRpc removeData{userData.ramcloud, userData.dataTableId, &inodeId,
+                                        sizeof(inodeId)};
+        while (!removeData.isReady() || !removeInode.isReady());
+        try {
+            removeInode.wait();
+            removeData.wait();
+        } catch (RAMCloud::ClientException& e) {
+            fprintf(stderr, "[ERROR] unlink: %d\n", e.status);
+            return req.error(EIO);
+        }
+        return 0;
     }
-    return 0;
-}
+};
 
 static void *ramcloud_poll(void *arg)
 {
@@ -687,13 +660,13 @@ void usage()
 
 int main(int argc, char **argv)
 {
-    char *coordinator = NULL;
+    char *conf_path = NULL;
 
     int opt;
     while ((opt = getopt(argc, argv, "c:")) != -1) {
         switch (opt) {
             case 'c':
-                config_path = optarg;
+                conf_path = optarg;
                 break;
             default: /* '?' */
                 usage();
@@ -701,6 +674,11 @@ int main(int argc, char **argv)
         }
     }
 
+    if (!conf_path) {
+        usage();
+        exit(1);
+    }
+
     auto res = toml::parseFile(conf_path);
     if (!res.table) {
         std::cerr << "cannot parse file: " << res.errmsg << std::endl;
@@ -718,9 +696,9 @@ int main(int argc, char **argv)
     }
 
     printf("dpfs_kv starting up!\n");
-    printf("Connecting to RAMCloud coordinator %s\n", coordinator);
+    printf("Connecting to RAMCloud coordinator %s\n", coordinator.c_str());
 
-    RAMCloud::RamCloud ramcloud(coordinator);
+    RAMCloud::RamCloud ramcloud(coordinator.c_str());
     RamCloudUserData user_data;
     user_data.stopPoller = false;
     user_data.ramcloud = &ramcloud;
@@ -728,7 +706,7 @@ int main(int argc, char **argv)
     user_data.dataTableId = ramcloud.createTable("data");
     user_data.inodeTableId = ramcloud.createTable("inode");
 
-    printf("Start poll thread for RAMCloud %s\n", coordinator);
+    printf("Start poll thread for RAMCloud %s\n", coordinator.c_str());
     // poll ramcloud here
     pthread_t ramcloud_poll_thread;
     if (pthread_create(&ramcloud_poll_thread, NULL, ramcloud_poll, &user_data)) {
@@ -736,27 +714,10 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    struct fuse_ll_operations ops;
-    memset(&ops, 0, sizeof(ops));
-    ops.init = (typeof(ops.init)) fuse_init;
-    ops.lookup = (typeof(ops.lookup)) fuse_lookup;
-    ops.getattr = (typeof(ops.getattr)) fuse_getattr;
-    ops.setattr = (typeof(ops.setattr)) fuse_setattr;
-    ops.opendir = (typeof(ops.opendir)) fuse_opendir;
-    ops.releasedir = (typeof(ops.releasedir)) fuse_releasedir;
-    ops.readdir = (typeof(ops.readdir)) fuse_readdir;
-    ops.open = NULL;
-    ops.release = NULL;
-    ops.create = NULL;
-    ops.forget = NULL;
-    ops.read =  (typeof(ops.read)) fuse_read;
-    ops.write = (typeof(ops.write)) fuse_write;
-    ops.statfs = (typeof(ops.statfs)) fuse_statfs;
-    ops.flush = NULL;
-    ops.mknod = (typeof(ops.mknod)) fuse_mknod; /* not sure if this is needed at all */
-    ops.unlink = (typeof(ops.unlink)) fuse_unlink;
-
-    dpfs_fuse_main(&ops, conf_path, &user_data, NULL, NULL);
+    RamCloudFs fs{user_data};
+    dpfs::FuseServer<RamCloudFs> server{fs, conf_path};
+    if (server.valid())
+        server.loop();
 
     user_data.stopPoller = true;
     pthread_join(ramcloud_poll_thread, NULL);
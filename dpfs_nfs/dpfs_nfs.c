@@ -208,6 +208,26 @@ struct write_cb_data {
     struct fuse_out_header *out_hdr;
     struct fuse_write_out *out_write;
 };
+struct copy_file_range_cb_data {
+    uint16_t thread_id;
+    void *completion_context;
+    struct virtionfs *vnfs;
+    struct vnfs_conn *conn;
+    // The slot of the READ, which the WRITE is sent on after it
+    uint32_t slotid;
+
+#ifdef LATENCY_MEASURING_ENABLED
+    struct ftimer ft;
+#endif
+
+    // The SEQUENCE of the READ, the one of the WRITE is the same with the next seqid
+    nfs_argop4 seq;
+    struct inode *i_out;
+    uint64_t off_out;
+
+    struct fuse_out_header *out_hdr;
+    struct fuse_write_out *out_write;
+};
 struct fsync_cb_data {
     uint16_t thread_id;
     void *completion_context;
@@ -269,6 +289,7 @@ struct cb_data {
         struct open_cb_data open;
         struct read_cb_data read;
         struct write_cb_data write;
+        struct copy_file_range_cb_data copy_file_range;
         struct fsync_cb_data fsync;
         struct release_cb_data release;
         struct create_cb_data create;
@@ -321,13 +342,14 @@ int vnfs4_op_sequence(nfs_argop4 *op, struct vnfs_conn *conn, bool cachethis)
                 // this is safe.
                 arg->sa_slotid = i;
                 conn->session.slots[i].in_use = true;
+                conn->session.slots[i].unique = 0;
                 goto slot_found;
             }
         }
-        // All slots are in use, wait for a bit
+        // All slots are in use, wait for a bit. Flow control in dpfs_fuse keeps the requests
+        // of the host within the slot table, so only our own extra requests can get here
         vnfs_error("All slots for connection %u are in use, suspending the Virtio poller"
-                   "thread for a bit.\n Please performance tune (the max_background operations in FUSE"
-                   "and the Virtio queue_depth so that this never happens!\n", conn->vnfs_conn_id);
+                   "thread for a bit.\n", conn->vnfs_conn_id);
         usleep(10);
     }
 slot_found:
@@ -343,6 +365,30 @@ slot_found:
     return arg->sa_slotid;
 }
 
+// Only called from VirtioQ poller thread, before the request is sent
+static void vnfs_slot_interruptible(struct vnfs_conn *conn, uint32_t slotid, uint64_t unique,
+        uint16_t device_id, struct fuse_out_header *out_hdr, void *completion_context)
+{
+    struct vnfs_slot *slot = &conn->session.slots[slotid];
+    slot->device_id = device_id;
+    slot->completion_context = completion_context;
+    slot->out_hdr = out_hdr;
+    atomic_store(&slot->replied, false);
+    slot->unique = unique;
+}
+
+// Only called from NFS poller thread
+// Returns false if FUSE_INTERRUPT already replied to the host, then the callback
+// must not touch the FUSE request anymore
+static bool vnfs_slot_release(struct vnfs_conn *conn, uint32_t slotid)
+{
+    struct vnfs_slot *slot = &conn->session.slots[slotid];
+    // Before the slot is freed, the VirtioQ thread resets replied when it reuses the slot
+    bool replied = atomic_exchange(&slot->replied, true);
+    slot->in_use = false;
+    return !replied;
+}
+
 // Only called from NFS poller thread
 int vnfs4_handle_sequence(COMPOUND4res *res, struct vnfs_conn *conn)
 {
@@ -582,7 +628,11 @@ void vfsync_cb(struct rpc_context *rpc, int status, void *data,
 
     LATENCY_MEASURING_STOP(FSYNC);
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    if (!vnfs_slot_release(cb_data->conn, cb_data->slotid)) {
+        // Interrupted, the host already got its reply
+        mpool_free(vnfs->p[cb_data->thread_id], cb_data);
+        return;
+    }
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_FSYNC:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
@@ -646,9 +696,11 @@ int vfsync(struct fuse_session *se, void *user_data,
     op[2].nfs_argop4_u.opcommit.offset = 0;
     op[2].nfs_argop4_u.opcommit.count = 0;
 
+    vnfs_slot_interruptible(conn, cb_data->slotid, in_hdr->unique, device_id, out_hdr, completion_context);
     LATENCY_MEASURING_START(FSYNC);
     if (rpc_nfs4_compound_async(conn->rpc, vfsync_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send NFS:commit request\n");
+        conn->session.slots[cb_data->slotid].unique = 0;
         mpool_free(vnfs->p[thread_id], cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
@@ -821,7 +873,11 @@ void vread_cb(struct rpc_context *rpc, int status, void *data,
 
     LATENCY_MEASURING_STOP(READ);
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    if (!vnfs_slot_release(cb_data->conn, cb_data->slotid)) {
+        // Interrupted, the host already got its reply
+        mpool_free(vnfs->p[cb_data->thread_id], cb_data);
+        return;
+    }
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_READ:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
@@ -903,9 +959,205 @@ int vread(struct fuse_session *se, void *user_data,
     op[2].nfs_argop4_u.opread.count = in_read->size;
     op[2].nfs_argop4_u.opread.offset = in_read->offset;
 
+    vnfs_slot_interruptible(conn, cb_data->slotid, in_hdr->unique, device_id, out_hdr, completion_context);
     LATENCY_MEASURING_START(READ);
     if (rpc_nfs4_compound_async(conn->rpc, vread_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send NFS:READ request\n");
+        conn->session.slots[cb_data->slotid].unique = 0;
+        mpool_free(vnfs->p[thread_id], cb_data);
+        out_hdr->error = -EREMOTEIO;
+        return 0;
+    }
+
+    return EWOULDBLOCK;
+#endif
+}
+
+// Gives back a slot we claimed but never sent a request with
+static void vnfs4_unclaim_slot(struct vnfs_conn *conn, nfs_argop4 *seq_op)
+{
+    struct SEQUENCE4args *arg = &seq_op->nfs_argop4_u.opsequence;
+    struct vnfs_slot *slot = &conn->session.slots[arg->sa_slotid];
+    // The server only accepts the next seqid on a slot, so undo the increment
+    slot->seqid--;
+    slot->in_use = false;
+}
+
+void vcopy_file_range_write_cb(struct rpc_context *rpc, int status, void *data,
+              void *private_data)
+{
+    struct copy_file_range_cb_data *cb_data = (struct copy_file_range_cb_data *)private_data;
+    struct virtionfs *vnfs = cb_data->vnfs;
+
+    LATENCY_MEASURING_STOP(COPY_FILE_RANGE);
+
+    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    if (status != RPC_STATUS_SUCCESS) {
+        vnfs_error("FUSE_COPY_FILE_RANGE:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
+        cb_data->out_hdr->error = -EREMOTEIO;
+        goto ret;
+    }
+    COMPOUND4res *res = data;
+    if (res->status != NFS4_OK) {
+        cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
+        vnfs_error("FUSE_COPY_FILE_RANGE:%lu - NFS:WRITE error=%d, FUSE error=%d\n",
+                cb_data->out_hdr->unique, res->status, cb_data->out_hdr->error);
+        goto ret;
+    }
+
+    cb_data->out_write->size = res->resarray.resarray_val[2].nfs_resop4_u.opwrite.WRITE4res_u.resok4.count;
+    cb_data->out_hdr->len += sizeof(*cb_data->out_write);
+
+ret:;
+    void *completion_context = cb_data->completion_context;
+    mpool_free(vnfs->p[cb_data->thread_id], cb_data);
+    dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_SUCCES);
+}
+
+void vcopy_file_range_read_cb(struct rpc_context *rpc, int status, void *data,
+              void *private_data)
+{
+    struct copy_file_range_cb_data *cb_data = (struct copy_file_range_cb_data *)private_data;
+    struct virtionfs *vnfs = cb_data->vnfs;
+    struct vnfs_conn *conn = cb_data->conn;
+    struct vnfs_slot *slot = &conn->session.slots[cb_data->slotid];
+
+    if (status != RPC_STATUS_SUCCESS) {
+        vnfs_error("FUSE_COPY_FILE_RANGE:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
+        cb_data->out_hdr->error = -EREMOTEIO;
+        goto ret;
+    }
+    COMPOUND4res *res = data;
+    if (res->status != NFS4_OK) {
+        cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
+        vnfs_error("FUSE_COPY_FILE_RANGE:%lu - NFS:READ error=%d, FUSE error=%d\n",
+                cb_data->out_hdr->unique, res->status, cb_data->out_hdr->error);
+        goto ret;
+    }
+
+    READ4resok *readok = &res->resarray.resarray_val[2].nfs_resop4_u.opread.READ4res_u.resok4;
+    if (readok->data.data_len == 0) {
+        // Nothing left to copy, the source is at EOF
+        cb_data->out_write->size = 0;
+        cb_data->out_hdr->len += sizeof(*cb_data->out_write);
+        goto ret;
+    }
+
+    COMPOUND4args args;
+    nfs_argop4 op[3];
+    memset(&args.tag, 0, sizeof(args.tag));
+    args.minorversion = NFS4DOT1_MINOR;
+    args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
+    args.argarray.argarray_val = op;
+
+    // The slot is still ours, so the WRITE goes out on it as the next request
+    op[0] = cb_data->seq;
+    op[0].nfs_argop4_u.opsequence.sa_sequenceid = ++slot->seqid;
+    // PUTFH
+    op[1].argop = OP_PUTFH;
+    op[1].nfs_argop4_u.opputfh.object.nfs_fh4_val = cb_data->i_out->fh_open.val;
+    op[1].nfs_argop4_u.opputfh.object.nfs_fh4_len = cb_data->i_out->fh_open.len;
+    // WRITE
+    // libnfs encodes the request into its own buffer while sending,
+    // so we can point straight into the READ reply
+    op[2].argop = OP_WRITE;
+    op[2].nfs_argop4_u.opwrite.stateid = cb_data->i_out->open_stateid;
+    op[2].nfs_argop4_u.opwrite.offset = cb_data->off_out;
+    op[2].nfs_argop4_u.opwrite.stable = UNSTABLE4;
+    op[2].nfs_argop4_u.opwrite.data.data_val = readok->data.data_val;
+    op[2].nfs_argop4_u.opwrite.data.data_len = readok->data.data_len;
+
+    // See vwrite for the alloc_hint
+    if (rpc_nfs4_compound_async2(conn->rpc, vcopy_file_range_write_cb, &args, cb_data,
+                readok->data.data_len) != 0) {
+    	vnfs_error("Failed to send NFS:WRITE request\n");
+        // The server only accepts the next seqid on a slot, so undo the increment
+        slot->seqid--;
+        cb_data->out_hdr->error = -EREMOTEIO;
+        goto ret;
+    }
+    return;
+
+ret:;
+    LATENCY_MEASURING_STOP(COPY_FILE_RANGE);
+    slot->in_use = false;
+    void *completion_context = cb_data->completion_context;
+    mpool_free(vnfs->p[cb_data->thread_id], cb_data);
+    dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_SUCCES);
+}
+
+// dpfs_nfs speaks NFSv4.1, which doesn't have the server-side COPY of NFSv4.2.
+// Instead we READ the source range onto the DPU and WRITE it straight back out,
+// so the data never crosses the host<->DPU link. Only one slot is claimed here, so that the
+// request fits the capacity we report to dpfs_fuse like any other. The slot stays claimed
+// after the READ and the WRITE is sent on it from the READ callback.
+// At most one READ worth of data is copied per request, the host retries short copies.
+int vcopy_file_range(struct fuse_session *se, void *user_data,
+          struct fuse_in_header *in_hdr, struct fuse_copy_file_range_in *in_cfr,
+          struct fuse_out_header *out_hdr, struct fuse_write_out *out_write,
+          void *completion_context, uint16_t device_id)
+{
+#ifdef VNFS_NULLDEV
+    out_write->size = in_cfr->len;
+    out_hdr->len += sizeof(*out_write);
+    return 0;
+#else
+
+    struct virtionfs *vnfs = user_data;
+    struct vnfs_conn *conn = vnfs_get_conn(vnfs);
+
+    struct inode *i_out = inode_table_get(vnfs->inodes, in_cfr->nodeid_out);
+    if (!i_out) {
+    	vnfs_error("Invalid nodeid_out supplied\n");
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    uint16_t thread_id = dpfs_hal_thread_id();
+    struct copy_file_range_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
+    if (!cb_data) {
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
+
+    cb_data->thread_id = thread_id;
+    cb_data->completion_context = completion_context;
+    cb_data->vnfs = vnfs;
+    cb_data->conn = conn;
+    cb_data->i_out = i_out;
+    cb_data->off_out = in_cfr->off_out;
+    cb_data->out_hdr = out_hdr;
+    cb_data->out_write = out_write;
+
+    COMPOUND4args args;
+    nfs_argop4 op[3];
+    memset(&args.tag, 0, sizeof(args.tag));
+    args.minorversion = NFS4DOT1_MINOR;
+    args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
+    args.argarray.argarray_val = op;
+
+    // PUTFH
+    struct inode *i = vnfs4_op_putfh_open(vnfs, &op[1], in_hdr->nodeid);
+    if (!i) {
+    	vnfs_error("Invalid nodeid supplied\n");
+        mpool_free(vnfs->p[thread_id], cb_data);
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+    cb_data->slotid = vnfs4_op_sequence(&op[0], conn, false);
+    cb_data->seq = op[0];
+    // READ
+    // The READ reply and the WRITE request both have to fit, play it safe with 4k for the rest
+    count4 maxcopysize = (MIN(conn->session.attrs.ca_maxresponsesize, conn->session.attrs.ca_maxrequestsize)) - 4096;
+    op[2].argop = OP_READ;
+    op[2].nfs_argop4_u.opread.stateid = i->open_stateid;
+    op[2].nfs_argop4_u.opread.count = MIN(in_cfr->len, maxcopysize);
+    op[2].nfs_argop4_u.opread.offset = in_cfr->off_in;
+
+    LATENCY_MEASURING_START(COPY_FILE_RANGE);
+    if (rpc_nfs4_compound_async(conn->rpc, vcopy_file_range_read_cb, &args, cb_data) != 0) {
+    	vnfs_error("Failed to send NFS:READ request\n");
+        vnfs4_unclaim_slot(conn, &op[0]);
         mpool_free(vnfs->p[thread_id], cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
@@ -1326,13 +1578,12 @@ void lookup_cb(struct rpc_context *rpc, int status, void *data,
     cb_data->out_entry->nodeid = fileid;
     cb_data->out_entry->generation = 0;
 
-    struct inode *i = inode_table_getsert(vnfs->inodes, fileid);
+    struct inode *i = inode_table_lookup(vnfs->inodes, fileid);
     if (!i) {
         vnfs_error("Couldn't getsert inode with fileid: %lu\n", fileid);
         cb_data->out_hdr->error = -ENOMEM;
         goto ret;
     }
-    atomic_fetch_add(&i->nlookup, 1);
     cb_data->out_entry->generation = i->generation;
 
     if (i->fh.len == 0) {
@@ -1531,6 +1782,91 @@ int getattr(struct fuse_session *se, void *user_data,
 
     return EWOULDBLOCK;
 }
+
+// Only READ and FSYNC can be interrupted, they don't change the file and have no side
+// effects on our own state that would be lost by abandoning them. A WRITE could still be
+// applied by the server after we replied -EINTR, so it always runs to completion.
+// The NFS request itself can't be taken back and the slot can only be reused once the
+// server has answered, so we only reply -EINTR to the host right away and the callback
+// cleans up whenever the server replies.
+int vinterrupt(struct fuse_session *se, void *user_data,
+               struct fuse_in_header *in_hdr, struct fuse_interrupt_in *in_interrupt,
+               void *completion_context, uint16_t device_id)
+{
+    struct virtionfs *vnfs = user_data;
+    // Slots that can't be interrupted have unique 0
+    if (in_interrupt->unique == 0)
+        return 0;
+
+    // A device is handled by a single VirtioQ thread, so the request is in a slot of our
+    // connection. Only this thread writes the unique of a slot, so a slot whose request
+    // already completed can still match, but then replied is set already
+    struct vnfs_conn *conn = vnfs_get_conn(vnfs);
+
+    for (uint32_t i = 0; i < conn->session.nslots; i++) {
+        struct vnfs_slot *slot = &conn->session.slots[i];
+        if (slot->unique != in_interrupt->unique || slot->device_id != device_id)
+            continue;
+        // Lost the race with the callback
+        if (atomic_exchange(&slot->replied, true))
+            break;
+        slot->out_hdr->error = -EINTR;
+        dpfs_hal_async_complete(slot->completion_context, DPFS_HAL_COMPLETION_SUCCES);
+        break;
+    }
+
+    return 0;
+}
+
+int forget(struct fuse_session *se, void *user_data,
+           struct fuse_in_header *in_hdr, struct fuse_forget_in *in_forget,
+           void *completion_context, uint16_t device_id)
+{
+    struct virtionfs *vnfs = user_data;
+
+    if (vnfs->forgets) {
+        forget_log_add(vnfs->forgets, dpfs_hal_thread_id(), in_hdr->nodeid, in_forget->nlookup);
+    } else {
+        struct forget_rec rec = { .nodeid = in_hdr->nodeid, .nlookup = in_forget->nlookup };
+        inode_table_forget(vnfs->inodes, &rec, 1);
+    }
+    return 0;
+}
+
+int batch_forget(struct fuse_session *se, void *user_data,
+                 struct fuse_in_header *in_hdr, struct fuse_batch_forget_in *in_batch_forget,
+                 struct fuse_forget_one *in_forget_one,
+                 void *completion_context, uint16_t device_id)
+{
+    struct virtionfs *vnfs = user_data;
+
+    if (vnfs->forgets) {
+        uint16_t thread_id = dpfs_hal_thread_id();
+        for (uint32_t i = 0; i < in_batch_forget->count; i++)
+            forget_log_add(vnfs->forgets, thread_id, in_forget_one[i].nodeid, in_forget_one[i].nlookup);
+        return 0;
+    }
+
+    struct forget_rec *recs = malloc(in_batch_forget->count * sizeof(*recs));
+    if (!recs) {
+        vnfs_error("Couldn't allocate the forget records, leaking %u inodes\n", in_batch_forget->count);
+        return 0;
+    }
+    for (uint32_t i = 0; i < in_batch_forget->count; i++) {
+        recs[i].nodeid = in_forget_one[i].nodeid;
+        recs[i].nlookup = in_forget_one[i].nlookup;
+    }
+    inode_table_forget(vnfs->inodes, recs, in_batch_forget->count);
+    free(recs);
+    return 0;
+}
+
+static void forget_apply(void *user_data, struct forget_rec *recs, size_t n)
+{
+    struct virtionfs *vnfs = user_data;
+    inode_table_forget(vnfs->inodes, recs, n);
+}
+
 int destroy(struct fuse_session *se, void *user_data,
             struct fuse_in_header *in_hdr,
             struct fuse_out_header *out_hdr,
@@ -1594,6 +1930,13 @@ void dpfs_nfs_assign_ops(struct fuse_ll_operations *ops) {
     ops->open = vopen;
     ops->read = vread;
     ops->write = vwrite;
+    ops->interrupt = vinterrupt;
+    ops->forget = forget;
+    ops->batch_forget = batch_forget;
+    ops->copy_file_range = vcopy_file_range;
+    // Finding holes needs the SEEK of NFSv4.2 and we speak NFSv4.1,
+    // without lseek the host treats the whole file as data
+    ops->lseek = NULL;
     ops->fsync = vfsync;
     ops->release = release;
     // NFS only does fsync(aka COMMIT) on files
@@ -1607,6 +1950,7 @@ void dpfs_nfs_assign_ops(struct fuse_ll_operations *ops) {
 
 void dpfs_nfs_main(char *server, char *export,
                double timeout, bool cq_polling,
+               uint64_t forget_interval_msec,
                const char *conf_path)
 {
     struct virtionfs *vnfs = calloc(1, sizeof(struct virtionfs));
@@ -1637,11 +1981,12 @@ void dpfs_nfs_main(char *server, char *export,
     struct dpfs_fuse *fuse = dpfs_fuse_new(&ops, conf_path, vnfs, NULL, NULL);
     if (!fuse)
         goto ret_a;
+    vnfs->fuse = fuse;
     vnfs->nthreads = dpfs_fuse_nthreads(fuse);
 
     vnfs->p = calloc(vnfs->nthreads, sizeof(*vnfs->p));
     for (uint16_t i = 0; i < vnfs->nthreads; i++) {
-        int ret = mpool_init(&vnfs->p[i], sizeof(struct cb_data), 256);
+        int ret = mpool_init(&vnfs->p[i], sizeof(struct cb_data), VNFS_CB_DATA_POOL_SIZE);
         if (ret < 0) {
             vnfs_error("Failed to init mpool - err=%d", ret);
             goto ret_a;
@@ -1655,8 +2000,19 @@ void dpfs_nfs_main(char *server, char *export,
     }
     vnfs_init_connections(vnfs);
 
+    if (forget_interval_msec) {
+        ret = forget_log_init(&vnfs->forgets, vnfs->nthreads, 4096, forget_interval_msec,
+                forget_apply, vnfs);
+        if (ret < 0) {
+            vnfs_error("Failed to init the forget log - err=%d", ret);
+            goto ret_c;
+        }
+    }
+
     dpfs_fuse_loop(fuse);
     dpfs_fuse_destroy(fuse);
+    if (vnfs->forgets)
+        forget_log_destroy(vnfs->forgets);
 
     inode_table_destroy(vnfs->inodes);
 ret_c:
@@ -17,12 +17,14 @@
 #include "config.h"
 #include "dpfs_fuse.h"
 #include "mpool.h"
+#include "forget_log.h"
 #ifdef LATENCY_MEASURING_ENABLED
 #include "ftimer.h"
 #endif
 
 void dpfs_nfs_main(char *server, char *export,
                double timeout, bool cq_polling,
+               uint64_t forget_interval_msec,
                const char *conf_path);
 
 enum vnfs_conn_state {
@@ -36,6 +38,14 @@ struct vnfs_slot {
     // Starts at 1
     sequenceid4 seqid;
     bool in_use;
+    // The FUSE request that is using this slot, so that FUSE_INTERRUPT can find it.
+    // 0 if the request can't be interrupted. Only touched by the VirtioQ poller thread
+    uint64_t unique;
+    uint16_t device_id;
+    void *completion_context;
+    struct fuse_out_header *out_hdr;
+    // Set by whoever replies to the host first, FUSE_INTERRUPT or the NFS callback
+    atomic_bool replied;
 };
 
 struct vnfs_session {
@@ -62,7 +72,11 @@ struct vnfs_conn {
 #endif
 };
 
+// Per thread
+#define VNFS_CB_DATA_POOL_SIZE 256
+
 struct virtionfs {
+    struct dpfs_fuse *fuse;
     uint16_t nthreads;
     bool cq_polling;
 
@@ -72,6 +86,8 @@ struct virtionfs {
     uint32_t conn_cntr;
 
     struct inode_table *inodes;
+    // NULL if FORGETs are applied right away
+    struct forget_log *forgets;
     struct mpool **p;
 
     char *server;
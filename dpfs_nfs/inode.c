@@ -77,7 +77,8 @@ static size_t inode_table_hash(struct inode_table *t, fattr4_fileid fileid) {
     return fileid % t->size;
 }
 
-struct inode *inode_table_get(struct inode_table *t, fattr4_fileid fileid) {
+// Must hold the lock
+static struct inode *inode_table_find(struct inode_table *t, fattr4_fileid fileid) {
     size_t hash = inode_table_hash(t, fileid);
 
     for (struct inode *inode = t->array[hash]; inode != NULL; inode = inode->next)
@@ -87,6 +88,13 @@ struct inode *inode_table_get(struct inode_table *t, fattr4_fileid fileid) {
     return NULL;
 }
 
+struct inode *inode_table_get(struct inode_table *t, fattr4_fileid fileid) {
+    pthread_mutex_lock(&t->m);
+    struct inode *i = inode_table_find(t, fileid);
+    pthread_mutex_unlock(&t->m);
+    return i;
+}
+
 struct inode *inode_table_insert(struct inode_table *t, struct inode *i) {
     size_t hash = inode_table_hash(t, i->fileid);
 
@@ -126,6 +134,31 @@ ret:
     return i;
 }
 
+struct inode *inode_table_lookup(struct inode_table *t, fattr4_fileid fileid)
+{
+    size_t hash = inode_table_hash(t, fileid);
+
+    struct inode *i;
+    pthread_mutex_lock(&t->m);
+    for (i = t->array[hash]; i != NULL; i = i->next)
+        if (i->fileid == fileid)
+            goto ret;
+
+    i = inode_new(fileid);
+    if (!i)
+        goto ret;
+
+    if (t->array[hash] != NULL)
+        i->next = t->array[hash];
+    t->array[hash] = i;
+
+ret:
+    if (i)
+        atomic_fetch_add(&i->nlookup, 1);
+    pthread_mutex_unlock(&t->m);
+    return i;
+}
+
 struct inode *inode_table_remove(struct inode_table *t, fattr4_fileid fileid) {
     size_t hash = inode_table_hash(t, fileid);
 
@@ -144,7 +177,6 @@ struct inode *inode_table_remove(struct inode_table *t, fattr4_fileid fileid) {
     return NULL;
 }
 
-// TODO call on forget
 bool inode_table_erase(struct inode_table *t, fattr4_fileid fileid) {
     pthread_mutex_lock(&t->m);
 
@@ -156,3 +188,32 @@ bool inode_table_erase(struct inode_table *t, fattr4_fileid fileid) {
     return i;
 }
 
+
+void inode_table_forget(struct inode_table *t, struct forget_rec *recs, size_t n) {
+    struct inode *dead = NULL;
+
+    pthread_mutex_lock(&t->m);
+    for (size_t r = 0; r < n; r++) {
+        struct inode *i = inode_table_find(t, recs[r].nodeid);
+        if (!i) {
+            fprintf(stderr, "%s: forget of unknown fileid %lu\n", __func__, recs[r].nodeid);
+            continue;
+        }
+        size_t nlookup = atomic_load(&i->nlookup);
+        if (recs[r].nlookup >= nlookup) {
+            inode_table_remove(t, i->fileid);
+            i->next = dead;
+            dead = i;
+        } else {
+            atomic_store(&i->nlookup, nlookup - recs[r].nlookup);
+        }
+    }
+    pthread_mutex_unlock(&t->m);
+
+    // Unlinked under the lock, so nobody can be walking past them anymore
+    while (dead) {
+        struct inode *next = dead->next;
+        inode_destroy(dead);
+        dead = next;
+    }
+}
@@ -16,6 +16,7 @@
 #include "config.h"
 #include "dpfs_fuse.h"
 #include "nfs_v4.h"
+#include "forget_log.h"
 
 struct inode {
     // We return the fileid as fuse_ino_t
@@ -49,6 +50,7 @@ struct inode {
 struct inode_table {
     struct inode **array;
     size_t size;
+    // Every walk of the chains takes it, inode_table_forget() frees inodes
     pthread_mutex_t m;
 };
 
@@ -59,9 +61,15 @@ void inode_destroy(struct inode *i);
 
 int inode_table_init(struct inode_table **t);
 void inode_table_destroy(struct inode_table *t);
+// The inode stays valid after the lock is dropped as long as the host knows it, i.e. for
+// the nodeid of a request
 struct inode *inode_table_get(struct inode_table *, fattr4_fileid);
 struct inode *inode_table_insert(struct inode_table *t, struct inode *i);
 struct inode *inode_table_getsert(struct inode_table *t, fattr4_fileid fileid);
+// getsert and count the lookup under the lock, so that a concurrent forget can't remove the inode in between
+struct inode *inode_table_lookup(struct inode_table *t, fattr4_fileid fileid);
+// Drops the lookup counts and removes the inodes that the host doesn't know anymore
+void inode_table_forget(struct inode_table *t, struct forget_rec *recs, size_t n);
 struct inode *inode_table_remove(struct inode_table *t, fattr4_fileid fileid);
 bool inode_table_erase(struct inode_table *, fattr4_fileid);
 
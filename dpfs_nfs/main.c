@@ -79,13 +79,19 @@ int main(int argc, char **argv)
         fprintf(stderr, "You must supply a bool `cq_polling` under [nfs]\n");
         return -1;
     }
+    toml_datum_t forget_interval = toml_int_in(nfs_conf, "forget_interval_msec"); // optional
+    if (forget_interval.ok && forget_interval.u.i < 0) {
+        fprintf(stderr, "`forget_interval_msec` under [nfs] can't be negative\n");
+        return -1;
+    }
 
 #ifdef VNFS_NULLDEV
     printf("running in *NULLDEV* mode!\n");
 #endif
     printf("DPFS-NFS will connect to %s:%s\n", server.u.s, export.u.s);
 
-    dpfs_nfs_main(server.u.s, export.u.s, 0.0, cq_polling.u.b, conf_path);
+    dpfs_nfs_main(server.u.s, export.u.s, 0.0, cq_polling.u.b,
+            forget_interval.ok ? forget_interval.u.i : 0, conf_path);
 
     return 0;
 }
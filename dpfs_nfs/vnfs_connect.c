@@ -190,6 +190,10 @@ static void create_session_cb(struct rpc_context *rpc, int status, void *data,
 
     conn->session.nslots = ok->csr_fore_chan_attrs.ca_maxrequests;
     conn->session.slots = calloc(conn->session.nslots, sizeof(struct vnfs_slot));
+    // Every request takes a slot and a cb_data, the rest of the requests of the host
+    // wait in dpfs_fuse until one of ours completes
+    dpfs_fuse_set_capacity(vnfs->fuse, conn->vnfs_conn_id,
+            conn->session.nslots < VNFS_CB_DATA_POOL_SIZE ? conn->session.nslots : VNFS_CB_DATA_POOL_SIZE);
 
     // The session and connection is now fully up
     // We might be the first connection and need to lookup the true rootfh
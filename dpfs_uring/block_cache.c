@@ -0,0 +1,593 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "block_cache.h"
+
+static inline uint64_t block_cache_mix(uint64_t x) {
+    // splitmix64
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t block_cache_file_hash(dev_t dev, ino_t ino) {
+    return block_cache_mix(block_cache_mix(dev) ^ ino);
+}
+
+// The shard is picked by the lower bits, the bucket in the shard by the bits above them
+static inline uint64_t block_cache_hash(dev_t dev, ino_t ino, uint64_t index) {
+    return block_cache_mix(block_cache_file_hash(dev, ino) ^ index);
+}
+
+static inline struct block_cache_file *block_cache_file_of(struct block_cache *c, dev_t dev, ino_t ino) {
+    return &c->files[block_cache_file_hash(dev, ino) % BLOCK_CACHE_FILES];
+}
+
+static inline struct block_cache_shard *block_cache_shard_of(struct block_cache *c, uint64_t hash) {
+    return &c->shards[hash % BLOCK_CACHE_SHARDS];
+}
+
+// Every shard owns an equal range of the extents
+static inline struct block_cache_shard *block_cache_shard_of_extent(struct block_cache *c,
+        struct block_cache_extent *e) {
+    return &c->shards[(e - c->extents) / (c->nextents / BLOCK_CACHE_SHARDS)];
+}
+
+static inline size_t block_cache_bucket(struct block_cache_shard *s, uint64_t hash) {
+    return (hash / BLOCK_CACHE_SHARDS) & (s->nbuckets - 1);
+}
+
+static inline void block_cache_stat(uint64_t *stat, uint64_t n) {
+    __atomic_fetch_add(stat, n, __ATOMIC_RELAXED);
+}
+
+// Copies len bytes of src to the iovecs, starting at byte off of the iovecs
+static void block_cache_to_iov(const struct iovec *iov, int iovcnt, size_t off, const char *src, size_t len) {
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - off < len ? iov[i].iov_len - off : len;
+        memcpy((char *) iov[i].iov_base + off, src, n);
+        src += n;
+        len -= n;
+        off = 0;
+    }
+}
+
+// Copies len bytes at byte off of the iovecs to dst
+static void block_cache_from_iov(const struct iovec *iov, int iovcnt, size_t off, char *dst, size_t len) {
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - off < len ? iov[i].iov_len - off : len;
+        memcpy(dst, (char *) iov[i].iov_base + off, n);
+        dst += n;
+        len -= n;
+        off = 0;
+    }
+}
+
+static bool block_cache_extent_valid(struct block_cache *c, struct block_cache_extent *e) {
+    struct block_cache_file *file = block_cache_file_of(c, e->dev, e->ino);
+    if (e->gen != __atomic_load_n(&file->gen, __ATOMIC_ACQUIRE))
+        return false;
+    if (e->len < c->extent_size && e->size_gen != __atomic_load_n(&file->size_gen, __ATOMIC_ACQUIRE))
+        return false;
+    return true;
+}
+
+// Must hold the lock of the shard
+static bool block_cache_ghost_has(struct block_cache_shard *s, uint64_t hash) {
+    return s->ghost_counts[(hash >> 32) & s->ghost_mask] != 0;
+}
+
+// Must hold the lock of the shard
+static void block_cache_ghost_push(struct block_cache_shard *s, uint64_t hash) {
+    if (s->ghost_count == s->nghosts) {
+        uint64_t oldest = s->ghosts[s->ghost_head];
+        s->ghost_counts[(oldest >> 32) & s->ghost_mask]--;
+        s->ghost_head = (s->ghost_head + 1) % s->nghosts;
+        s->ghost_count--;
+    }
+    s->ghosts[(s->ghost_head + s->ghost_count) % s->nghosts] = hash;
+    s->ghost_count++;
+    s->ghost_counts[(hash >> 32) & s->ghost_mask]++;
+}
+
+// Must hold the lock of the shard
+static struct block_cache_extent *block_cache_find(struct block_cache_shard *s, uint64_t hash,
+        dev_t dev, ino_t ino, uint64_t index) {
+    struct block_cache_extent *e = s->buckets[block_cache_bucket(s, hash)];
+    while (e && (e->index != index || e->ino != ino || e->dev != dev))
+        e = e->hnext;
+    return e;
+}
+
+// Must hold the lock of the shard
+static void block_cache_free_extent(struct block_cache_shard *s, struct block_cache_extent *e) {
+    e->where = BLOCK_CACHE_FREE;
+    list_add_head(&e->list, &s->free);
+    s->nfree++;
+}
+
+// Must hold the lock of the shard
+// Takes the extent out of the index and its queue
+static void block_cache_remove(struct block_cache_shard *s, struct block_cache_extent *e, uint64_t hash) {
+    struct block_cache_extent **p = &s->buckets[block_cache_bucket(s, hash)];
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+    list_del(&e->list);
+    if (e->where == BLOCK_CACHE_A1IN)
+        s->na1in--;
+    else
+        s->nam--;
+}
+
+// Must hold the lock of the shard
+static void block_cache_drop(struct block_cache_shard *s, struct block_cache_extent *e) {
+    block_cache_remove(s, e, block_cache_hash(e->dev, e->ino, e->index));
+    if (e->refs)
+        e->where = BLOCK_CACHE_ORPHAN;
+    else
+        block_cache_free_extent(s, e);
+}
+
+// Must hold the lock of the shard
+static void block_cache_insert(struct block_cache_shard *s, struct block_cache_extent *e, uint64_t hash) {
+    size_t b = block_cache_bucket(s, hash);
+    e->hnext = s->buckets[b];
+    s->buckets[b] = e;
+    if (block_cache_ghost_has(s, hash)) {
+        e->where = BLOCK_CACHE_AM;
+        list_add_head(&e->list, &s->am);
+        s->nam++;
+        s->stats.promotions++;
+    } else {
+        e->where = BLOCK_CACHE_A1IN;
+        list_add_head(&e->list, &s->a1in);
+        s->na1in++;
+    }
+}
+
+// Must hold the lock of the shard
+static struct block_cache_extent *block_cache_evict_from(struct block_cache_shard *s, struct list_head *queue) {
+    for (struct list_head *p = queue->prev; p != queue; p = p->prev) {
+        struct block_cache_extent *e = list_entry(p, struct block_cache_extent, list);
+        if (e->refs)
+            continue;
+        uint64_t hash = block_cache_hash(e->dev, e->ino, e->index);
+        bool a1in = e->where == BLOCK_CACHE_A1IN;
+        block_cache_remove(s, e, hash);
+        if (a1in)
+            block_cache_ghost_push(s, hash);
+        s->stats.evictions++;
+        return e;
+    }
+    return NULL;
+}
+
+// Must hold the lock of the shard
+// Returns a free extent, or NULL if all extents are pinned or filling
+static struct block_cache_extent *block_cache_alloc(struct block_cache_shard *s) {
+    struct block_cache_extent *e = NULL;
+    if (s->nfree) {
+        e = list_entry(s->free.next, struct block_cache_extent, list);
+        list_del(&e->list);
+        s->nfree--;
+    } else if (s->na1in > s->kin || !s->nam) {
+        e = block_cache_evict_from(s, &s->a1in);
+        if (!e)
+            e = block_cache_evict_from(s, &s->am);
+    } else {
+        e = block_cache_evict_from(s, &s->am);
+        if (!e)
+            e = block_cache_evict_from(s, &s->a1in);
+    }
+    if (e) {
+        e->where = BLOCK_CACHE_FILLING;
+        e->refs = 0;
+    }
+    return e;
+}
+
+static void block_cache_release(struct block_cache *c, struct block_cache_extent *e) {
+    struct block_cache_shard *s = block_cache_shard_of_extent(c, e);
+    pthread_spin_lock(&s->lock);
+    block_cache_free_extent(s, e);
+    pthread_spin_unlock(&s->lock);
+}
+
+static void block_cache_unpin(struct block_cache *c, struct block_cache_extent *e) {
+    struct block_cache_shard *s = block_cache_shard_of_extent(c, e);
+    pthread_spin_lock(&s->lock);
+    if (--e->refs == 0 && e->where == BLOCK_CACHE_ORPHAN)
+        block_cache_free_extent(s, e);
+    pthread_spin_unlock(&s->lock);
+}
+
+// Thread-safe
+ssize_t block_cache_read(struct block_cache *c, dev_t dev, ino_t ino, off_t offset, size_t size,
+                         const struct iovec *iov, int iovcnt) {
+    if (size == 0)
+        return -1;
+    size_t es = c->extent_size;
+    uint64_t first = offset / es;
+    uint64_t last = (offset + size - 1) / es;
+    if (last - first >= BLOCK_CACHE_MAX_FILL)
+        return -1;
+
+    struct block_cache_shard *stats = block_cache_shard_of(c, block_cache_hash(dev, ino, first));
+    struct block_cache_extent *ext[BLOCK_CACHE_MAX_FILL];
+    uint32_t n = 0;
+    for (uint64_t index = first; index <= last; index++) {
+        uint64_t hash = block_cache_hash(dev, ino, index);
+        struct block_cache_shard *s = block_cache_shard_of(c, hash);
+
+        pthread_spin_lock(&s->lock);
+        struct block_cache_extent *e = block_cache_find(s, hash, dev, ino, index);
+        if (e && !block_cache_extent_valid(c, e)) {
+            block_cache_drop(s, e);
+            e = NULL;
+        }
+        if (e) {
+            e->refs++;
+            if (e->where == BLOCK_CACHE_AM) {
+                list_del(&e->list);
+                list_add_head(&e->list, &s->am);
+            }
+        }
+        pthread_spin_unlock(&s->lock);
+
+        if (!e) {
+            for (uint32_t k = 0; k < n; k++)
+                block_cache_unpin(c, ext[k]);
+            block_cache_stat(&stats->stats.misses, 1);
+            return -1;
+        }
+        ext[n++] = e;
+        // Nothing beyond the end of the file
+        if (e->len < es)
+            break;
+    }
+
+    size_t done = 0;
+    for (uint32_t k = 0; k < n && done < size; k++) {
+        size_t from = k == 0 ? offset - first * es : 0;
+        if (from >= ext[k]->len)
+            break;
+        size_t len = ext[k]->len - from < size - done ? ext[k]->len - from : size - done;
+        block_cache_to_iov(iov, iovcnt, done, ext[k]->data + from, len);
+        done += len;
+    }
+    for (uint32_t k = 0; k < n; k++)
+        block_cache_unpin(c, ext[k]);
+
+    block_cache_stat(&stats->stats.hits, 1);
+    block_cache_stat(&stats->stats.bytes_hit, done);
+    return done;
+}
+
+// Thread-safe
+struct block_cache_fill *block_cache_fill_start(struct block_cache *c, dev_t dev, ino_t ino, off_t offset, size_t size) {
+    if (size == 0)
+        return NULL;
+    size_t es = c->extent_size;
+    uint64_t first = offset / es;
+    uint64_t last = (offset + size - 1) / es;
+    if (last - first >= BLOCK_CACHE_MAX_FILL)
+        return NULL;
+
+    // The read could see the data of a write in flight or not, so it can't be cached
+    struct block_cache_file *file = block_cache_file_of(c, dev, ino);
+    uint64_t wstart = __atomic_load_n(&file->wstart, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&file->wend, __ATOMIC_ACQUIRE) != wstart)
+        return NULL;
+
+    struct block_cache_fill *fill = slab_alloc(c->fills);
+    if (!fill)
+        return NULL;
+    fill->dev = dev;
+    fill->ino = ino;
+    fill->offset = first * es;
+    fill->wstart = wstart;
+    fill->gen = __atomic_load_n(&file->gen, __ATOMIC_ACQUIRE);
+    fill->size_gen = __atomic_load_n(&file->size_gen, __ATOMIC_ACQUIRE);
+
+    for (uint64_t index = first; index <= last; index++) {
+        struct block_cache_shard *s = block_cache_shard_of(c, block_cache_hash(dev, ino, index));
+
+        pthread_spin_lock(&s->lock);
+        struct block_cache_extent *e = block_cache_alloc(s);
+        pthread_spin_unlock(&s->lock);
+
+        if (!e) {
+            for (uint32_t k = 0; k < fill->n; k++)
+                block_cache_release(c, fill->ext[k]);
+            slab_free(c->fills, fill);
+            return NULL;
+        }
+        fill->ext[fill->n] = e;
+        fill->iov[fill->n].iov_base = e->data;
+        fill->iov[fill->n].iov_len = es;
+        fill->n++;
+    }
+    return fill;
+}
+
+// Thread-safe
+size_t block_cache_fill_complete(struct block_cache *c, struct block_cache_fill *fill, int res,
+                                 off_t offset, size_t size, const struct iovec *iov, int iovcnt) {
+    size_t es = c->extent_size;
+
+    size_t done = 0;
+    size_t pos = offset - fill->offset;
+    if (res > 0 && (size_t) res > pos) {
+        size_t len = (size_t) res - pos < size ? (size_t) res - pos : size;
+        while (done < len) {
+            size_t within = pos % es;
+            size_t n = es - within < len - done ? es - within : len - done;
+            block_cache_to_iov(iov, iovcnt, done, fill->ext[pos / es]->data + within, n);
+            done += n;
+            pos += n;
+        }
+    }
+
+    // A write that started in the meantime may or may not be in what we read
+    struct block_cache_file *file = block_cache_file_of(c, fill->dev, fill->ino);
+    bool keep = res >= 0 && __atomic_load_n(&file->wstart, __ATOMIC_ACQUIRE) == fill->wstart;
+    uint64_t first = fill->offset / es;
+    for (uint32_t k = 0; k < fill->n; k++) {
+        struct block_cache_extent *e = fill->ext[k];
+        size_t len = 0;
+        if (keep && (size_t) res > k * es)
+            len = (size_t) res - k * es < es ? (size_t) res - k * es : es;
+        uint64_t hash = block_cache_hash(fill->dev, fill->ino, first + k);
+        struct block_cache_shard *s = block_cache_shard_of(c, hash);
+
+        pthread_spin_lock(&s->lock);
+        if (len) {
+            struct block_cache_extent *old = block_cache_find(s, hash, fill->dev, fill->ino, first + k);
+            if (old && !block_cache_extent_valid(c, old)) {
+                block_cache_drop(s, old);
+                old = NULL;
+            }
+            // Else another read filled it first
+            if (!old) {
+                e->dev = fill->dev;
+                e->ino = fill->ino;
+                e->index = first + k;
+                e->gen = fill->gen;
+                e->size_gen = fill->size_gen;
+                e->len = len;
+                block_cache_insert(s, e, hash);
+                s->stats.fills++;
+                e = NULL;
+            }
+        }
+        if (e)
+            block_cache_free_extent(s, e);
+        pthread_spin_unlock(&s->lock);
+    }
+
+    slab_free(c->fills, fill);
+    return done;
+}
+
+// Thread-safe
+void block_cache_write_begin(struct block_cache *c, dev_t dev, ino_t ino) {
+    struct block_cache_file *file = block_cache_file_of(c, dev, ino);
+    __atomic_fetch_add(&file->wstart, 1, __ATOMIC_ACQ_REL);
+}
+
+// Thread-safe
+void block_cache_write_end(struct block_cache *c, dev_t dev, ino_t ino, off_t offset,
+                           const struct iovec *iov, int iovcnt, size_t len, bool allocate) {
+    struct block_cache_file *file = block_cache_file_of(c, dev, ino);
+    size_t es = c->extent_size;
+
+    if (len) {
+        // The end of the file may have moved
+        __atomic_fetch_add(&file->size_gen, 1, __ATOMIC_ACQ_REL);
+        uint64_t gen = __atomic_load_n(&file->gen, __ATOMIC_ACQUIRE);
+        uint64_t size_gen = __atomic_load_n(&file->size_gen, __ATOMIC_ACQUIRE);
+
+        uint64_t last = (offset + len - 1) / es;
+        for (uint64_t index = offset / es; index <= last; index++) {
+            uint64_t start = index * es;
+            size_t from = (uint64_t) offset > start ? offset - start : 0;
+            size_t to = offset + len < start + es ? offset + len - start : es;
+            size_t src = start + from - offset;
+            uint64_t hash = block_cache_hash(dev, ino, index);
+            struct block_cache_shard *s = block_cache_shard_of(c, hash);
+
+            pthread_spin_lock(&s->lock);
+            struct block_cache_extent *e = block_cache_find(s, hash, dev, ino, index);
+            if (e && !block_cache_extent_valid(c, e)) {
+                block_cache_drop(s, e);
+                e = NULL;
+            }
+            if (e) {
+                // A reader is copying it, so it can't be changed in place
+                if (e->refs) {
+                    block_cache_drop(s, e);
+                } else {
+                    block_cache_from_iov(iov, iovcnt, src, e->data + from, to - from);
+                    if (e->where == BLOCK_CACHE_AM) {
+                        list_del(&e->list);
+                        list_add_head(&e->list, &s->am);
+                    }
+                    s->stats.write_updates++;
+                }
+            } else if (allocate && from == 0 && to == es) {
+                e = block_cache_alloc(s);
+                if (e) {
+                    pthread_spin_unlock(&s->lock);
+                    block_cache_from_iov(iov, iovcnt, src, e->data, es);
+                    pthread_spin_lock(&s->lock);
+                    // Else another write got there first
+                    if (!block_cache_find(s, hash, dev, ino, index)) {
+                        e->dev = dev;
+                        e->ino = ino;
+                        e->index = index;
+                        e->gen = gen;
+                        e->size_gen = size_gen;
+                        e->len = es;
+                        block_cache_insert(s, e, hash);
+                        s->stats.write_updates++;
+                    } else {
+                        block_cache_free_extent(s, e);
+                    }
+                }
+            }
+            pthread_spin_unlock(&s->lock);
+        }
+    }
+
+    __atomic_fetch_add(&file->wend, 1, __ATOMIC_ACQ_REL);
+}
+
+// Thread-safe
+void block_cache_invalidate(struct block_cache *c, dev_t dev, ino_t ino) {
+    struct block_cache_file *file = block_cache_file_of(c, dev, ino);
+    __atomic_fetch_add(&file->gen, 1, __ATOMIC_ACQ_REL);
+    block_cache_stat(&c->invalidations, 1);
+}
+
+// Thread-safe, but only a snapshot
+void block_cache_stats(struct block_cache *c, struct block_cache_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->extents_total = c->nextents;
+    stats->invalidations = __atomic_load_n(&c->invalidations, __ATOMIC_RELAXED);
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        struct block_cache_shard *s = &c->shards[i];
+        pthread_spin_lock(&s->lock);
+        stats->hits += __atomic_load_n(&s->stats.hits, __ATOMIC_RELAXED);
+        stats->bytes_hit += __atomic_load_n(&s->stats.bytes_hit, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&s->stats.misses, __ATOMIC_RELAXED);
+        stats->fills += s->stats.fills;
+        stats->evictions += s->stats.evictions;
+        stats->promotions += s->stats.promotions;
+        stats->write_updates += s->stats.write_updates;
+        stats->extents_used += c->nextents / BLOCK_CACHE_SHARDS - s->nfree;
+        pthread_spin_unlock(&s->lock);
+    }
+}
+
+static void block_cache_free(struct block_cache *c) {
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        struct block_cache_shard *s = &c->shards[i];
+        pthread_spin_destroy(&s->lock);
+        free(s->buckets);
+        free(s->ghosts);
+        free(s->ghost_counts);
+    }
+    if (c->fills)
+        slab_destroy(c->fills);
+    if (c->mem)
+        munmap(c->mem, c->nextents * c->extent_size);
+    free(c->extents);
+    free(c->files);
+    free(c);
+}
+
+// Not thread-safe!
+int block_cache_init(struct block_cache **cp, size_t size, size_t extent_size, uint16_t ncaches) {
+    if (extent_size < 4096 || extent_size % 4096 || (extent_size & (extent_size - 1))
+            || size / extent_size < BLOCK_CACHE_SHARDS) {
+        fprintf(stderr, "block_cache: extent_size must be a power of two of at least 4096 "
+                "and size must fit %d extents\n", BLOCK_CACHE_SHARDS);
+        return -EINVAL;
+    }
+
+    struct block_cache *c = aligned_alloc(64, sizeof(struct block_cache));
+    if (!c)
+        return -ENOMEM;
+    memset(c, 0, sizeof(*c));
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++)
+        pthread_spin_init(&c->shards[i].lock, PTHREAD_PROCESS_PRIVATE);
+
+    size_t per_shard = size / extent_size / BLOCK_CACHE_SHARDS;
+    c->extent_size = extent_size;
+    c->nextents = per_shard * BLOCK_CACHE_SHARDS;
+
+    // Only backed by memory as the extents get used
+    c->mem = mmap(NULL, c->nextents * extent_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c->mem == MAP_FAILED) {
+        c->mem = NULL;
+        goto err;
+    }
+    madvise(c->mem, c->nextents * extent_size, MADV_HUGEPAGE);
+
+    c->extents = calloc(c->nextents, sizeof(*c->extents));
+    c->files = aligned_alloc(64, BLOCK_CACHE_FILES * sizeof(*c->files));
+    if (!c->extents || !c->files)
+        goto err;
+    memset(c->files, 0, BLOCK_CACHE_FILES * sizeof(*c->files));
+    if (slab_init(&c->fills, sizeof(struct block_cache_fill), ncaches) != 0) {
+        c->fills = NULL;
+        goto err;
+    }
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        struct block_cache_shard *s = &c->shards[i];
+        init_list_head(&s->free);
+        init_list_head(&s->a1in);
+        init_list_head(&s->am);
+
+        s->nbuckets = 1;
+        while (s->nbuckets < per_shard)
+            s->nbuckets *= 2;
+        s->buckets = calloc(s->nbuckets, sizeof(*s->buckets));
+
+        // The sizes of A1in and A1out that the 2Q paper recommends
+        s->kin = per_shard / 4 ? per_shard / 4 : 1;
+        s->nghosts = per_shard / 2 ? per_shard / 2 : 1;
+        s->ghosts = calloc(s->nghosts, sizeof(*s->ghosts));
+        size_t ncounts = 1;
+        while (ncounts < s->nghosts * 4)
+            ncounts *= 2;
+        s->ghost_mask = ncounts - 1;
+        s->ghost_counts = calloc(ncounts, sizeof(*s->ghost_counts));
+        if (!s->buckets || !s->ghosts || !s->ghost_counts)
+            goto err;
+
+        for (size_t j = i * per_shard; j < (i + 1) * per_shard; j++) {
+            struct block_cache_extent *e = &c->extents[j];
+            e->data = c->mem + j * extent_size;
+            list_add_tail(&e->list, &s->free);
+            s->nfree++;
+        }
+    }
+
+    *cp = c;
+    return 0;
+
+err:
+    block_cache_free(c);
+    return -ENOMEM;
+}
+
+// Not thread-safe!
+void block_cache_destroy(struct block_cache *c) {
+    block_cache_free(c);
+}
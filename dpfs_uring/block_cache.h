@@ -0,0 +1,216 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "list.h"
+#include "slab.h"
+
+/*
+    block_cache keeps the data of the mirrored files in DPU memory, in extents of a fixed size
+    that are keyed by the (src_dev, src_ino) of the file and the index of the extent in the file.
+    Because the key is the file in the mirrored directory and not a FUSE nodeid, all devices
+    (tenants) that are served by this process share the extents, so a golden image that they
+    all boot from is only read from the backend once.
+
+    Eviction is 2Q, so that a single sequential scan can't flush the working set: an extent
+    that is read in for the first time goes into A1in (FIFO, a quarter of the extents), and is
+    only remembered by its key in the ghost queue A1out once it falls out of there. An extent
+    that is read in again while its key is in A1out goes into Am (LRU) instead.
+
+    The extents are split into shards by the hash of their key, every shard has its own lock,
+    queues and hash index. Data is only copied while an extent is pinned, not under the lock.
+
+    Consistency: a write, truncate or fallocate through DPFS updates or drops the extents of the
+    file (see block_cache_write_begin/end and block_cache_invalidate), which is tracked per
+    file in a table of counters by the hash of (dev, ino). A collision in there only costs a
+    spurious invalidation. The backend hands out the inode number of a deleted file again, so
+    the extents of a file are also dropped when its last link is unlinked and when a CREATE,
+    MKNOD, MKDIR or SYMLINK returns its inode. Just like with metadata_timeout, changes that
+    don't go through DPFS are not seen.
+*/
+
+#define BLOCK_CACHE_SHARDS 16
+// Entries of the table of per file counters
+#define BLOCK_CACHE_FILES 16384
+// Max extents that a read can span to be served from or filled into the cache,
+// larger reads go to the backend directly
+#define BLOCK_CACHE_MAX_FILL 32
+
+enum block_cache_where {
+    BLOCK_CACHE_FREE = 0,
+    // Being read in from the backend, only known to its block_cache_fill
+    BLOCK_CACHE_FILLING,
+    BLOCK_CACHE_A1IN,
+    BLOCK_CACHE_AM,
+    // Dropped from the index while it was pinned, freed with the last pin
+    BLOCK_CACHE_ORPHAN,
+};
+
+struct block_cache_extent {
+    dev_t dev;
+    ino_t ino;
+    // offset / extent_size
+    uint64_t index;
+    // Of the file when the data was read or written
+    uint64_t gen;
+    uint64_t size_gen;
+    // Less than extent_size if the extent holds the end of the file
+    uint32_t len;
+    // Readers that are copying the data right now
+    uint32_t refs;
+    enum block_cache_where where;
+    // The chain of the bucket in the index of the shard
+    struct block_cache_extent *hnext;
+    // In the free list, A1in or Am of the shard
+    struct list_head list;
+    char *data;
+};
+
+struct block_cache_shard_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes_hit;
+    uint64_t fills;
+    uint64_t evictions;
+    uint64_t promotions;
+    uint64_t write_updates;
+};
+
+struct block_cache_shard {
+    pthread_spinlock_t lock;
+    // Power of two
+    size_t nbuckets;
+    struct block_cache_extent **buckets;
+    struct list_head free;
+    // Newest at the head
+    struct list_head a1in;
+    // Most recently used at the head
+    struct list_head am;
+    size_t nfree;
+    size_t na1in;
+    size_t nam;
+    // Size that A1in may grow to at the expense of Am
+    size_t kin;
+    // A1out, a FIFO of key hashes. ghost_counts counts them by their upper bits & ghost_mask,
+    // so that a lookup doesn't have to search the FIFO
+    uint64_t *ghosts;
+    size_t nghosts;
+    size_t ghost_head;
+    size_t ghost_count;
+    uint16_t *ghost_counts;
+    size_t ghost_mask;
+    // hits, misses and bytes_hit are updated with atomics (by the shard of the first extent
+    // of the read), the rest under the lock
+    struct block_cache_shard_stats stats;
+} __attribute__((aligned(64)));
+
+// Per file by the hash of (dev, ino), only updated with atomics
+struct block_cache_file {
+    // Bumped by block_cache_invalidate, an extent of an older gen is stale
+    uint64_t gen;
+    // Bumped by every write, the extent at the end of the file is stale if it is of an
+    // older size_gen, because the write may have moved the end of the file
+    uint64_t size_gen;
+    // Writes that were started and that have ended, no extents are read in while they differ
+    uint64_t wstart;
+    uint64_t wend;
+} __attribute__((aligned(32)));
+
+struct block_cache {
+    size_t extent_size;
+    size_t nextents;
+    uint64_t invalidations;
+    struct block_cache_shard shards[BLOCK_CACHE_SHARDS];
+    struct block_cache_file *files;
+    struct block_cache_extent *extents;
+    // nextents * extent_size bytes
+    char *mem;
+    // Of the block_cache_fill
+    struct slab *fills;
+};
+
+// The extents that a read on a miss goes into, submit a readv of iov at offset
+struct block_cache_fill {
+    dev_t dev;
+    ino_t ino;
+    off_t offset;
+    uint32_t n;
+    uint64_t gen;
+    uint64_t size_gen;
+    uint64_t wstart;
+    struct block_cache_extent *ext[BLOCK_CACHE_MAX_FILL];
+    struct iovec iov[BLOCK_CACHE_MAX_FILL];
+};
+
+struct block_cache_stats {
+    // Reads that were served from the cache in whole, and their bytes
+    uint64_t hits;
+    uint64_t bytes_hit;
+    uint64_t misses;
+    // Extents that were read in from the backend
+    uint64_t fills;
+    uint64_t evictions;
+    // Extents that were read in again soon after their eviction from A1in and went into Am
+    uint64_t promotions;
+    // Extents that were updated by writes, or allocated for them
+    uint64_t write_updates;
+    uint64_t invalidations;
+    size_t extents_used;
+    size_t extents_total;
+};
+
+/*
+ size = the memory budget in bytes, at least BLOCK_CACHE_SHARDS extents
+ extent_size = a power of two and a multiple of 4096, so that the extents can be read with O_DIRECT
+ ncaches = the number of threads that start and complete reads, for the slab of fills
+ returns error code if unsuccesful
+ */
+int block_cache_init(struct block_cache **, size_t size, size_t extent_size, uint16_t ncaches);
+// No fills may be in flight anymore
+void block_cache_destroy(struct block_cache *);
+
+// Thread-safe
+// Copies size bytes at offset of the file into the iovecs if all of them are cached, and
+// returns the number of bytes (less at the end of the file). Returns -1 on a miss
+ssize_t block_cache_read(struct block_cache *, dev_t, ino_t, off_t offset, size_t size,
+                         const struct iovec *iov, int iovcnt);
+
+// Thread-safe
+// Returns the extents that the read of size bytes at offset must go into after a miss, or NULL
+// if the read should bypass the cache (too large, a write to the file is in flight or all
+// extents are pinned)
+struct block_cache_fill *block_cache_fill_start(struct block_cache *, dev_t, ino_t, off_t offset, size_t size);
+// Thread-safe
+// res = the result of the readv of the fill. Copies the bytes of the read at offset into the
+// iovecs and returns how many, adds the extents to the cache and frees the fill
+size_t block_cache_fill_complete(struct block_cache *, struct block_cache_fill *, int res,
+                                 off_t offset, size_t size, const struct iovec *iov, int iovcnt);
+
+// Thread-safe
+// Around every write to the backend, len = the bytes that were written (0 if none) and iov
+// the data. With allocate, extents that the write covers in whole are added to the cache
+// if they weren't cached yet, else only the cached extents are updated
+void block_cache_write_begin(struct block_cache *, dev_t, ino_t);
+void block_cache_write_end(struct block_cache *, dev_t, ino_t, off_t offset,
+                           const struct iovec *iov, int iovcnt, size_t len, bool allocate);
+// Thread-safe
+// Drops all extents of the file, call it after the file was truncated or its inode number
+// was reused. Extents that were being read in before are dropped as well once they are filled
+void block_cache_invalidate(struct block_cache *, dev_t, ino_t);
+
+// Thread-safe, but only a snapshot
+void block_cache_stats(struct block_cache *, struct block_cache_stats *);
+
+#endif // BLOCK_CACHE_H
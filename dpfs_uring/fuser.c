@@ -19,131 +19,240 @@
 #include <limits.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "config.h"
 #include "mirror_impl.h"
 #include "fuser.h"
 
-struct inode *inode_new(fuse_ino_t ino) {
-    struct inode *i = calloc(1, sizeof(struct inode));
+struct inode *inode_new(struct inode_table *t, dev_t src_dev, ino_t src_ino) {
+    struct inode *i = slab_alloc(t->slab);
     if (!i)
         return NULL;
 
-    i->ino = ino;
+    i->src_dev = src_dev;
+    i->src_ino = src_ino;
     i->fd = -1;
-    pthread_mutex_init(&i->m, NULL);
 
     return i;
 }
 
-static void inode_destroy(struct inode *i) {
+void inode_destroy(struct inode_table *t, struct inode *i) {
     if (i->fd > 0)
         close(i->fd);
-    pthread_mutex_destroy(&i->m);
-    free(i);
+    if (i->snap)
+        dir_snapshot_put(i->snap);
+    slab_free(t->slab, i);
 }
 
 void inode_table_clear(struct inode_table *t) {
     // Everything should be cleared already
-    for (size_t i = 0; i < t->size; i++) {
-        struct inode *next = t->array[i];
-        while (next) {
-            struct inode *i = next;
-            next = i->next;
+    for (size_t s = 0; s < INODE_TABLE_STRIPES; s++) {
+        struct inode_table_stripe *stripe = &t->stripes[s];
+        pthread_rwlock_wrlock(&stripe->lock);
+        for (size_t b = 0; b < stripe->nbuckets; b++) {
+            struct inode *next = stripe->buckets[b];
+            while (next) {
+                struct inode *i = next;
+                next = i->next;
 #ifdef DEBUG_ENABLED
-            fprintf(stderr, "WARNING: a inode was not released by the host before destroying the file system");
+                fprintf(stderr, "WARNING: a inode was not released by the host before destroying the file system");
 
-            if (i->fd != -1) {
-                fprintf(stderr, ", fd was not closed");
-                close(i->fd);
-            }
-            fprintf(stderr, "\n");
+                if (i->fd != -1) {
+                    fprintf(stderr, ", fd was not closed");
+                    close(i->fd);
+                }
+                fprintf(stderr, "\n");
 #endif
-            free(i);
+                slab_free(t->slab, i);
+            }
+            stripe->buckets[b] = NULL;
         }
-        t->array[i] = NULL;
+        stripe->use = 0;
+        pthread_rwlock_unlock(&stripe->lock);
     }
 }
 
-int inode_table_init(struct inode_table **ret_t) {
-    struct inode_table *t = calloc(1, sizeof(struct inode_table));
+int inode_table_init(struct inode_table **ret_t, uint16_t ncaches) {
+    struct inode_table *t = aligned_alloc(64, sizeof(struct inode_table));
     if (t == NULL) {
         fprintf(stderr, "Could not allocate memory for inode_table!\n");
         return -1;
     }
-    t->size = INODE_TABLE_SIZE;
-    t->array = (struct inode **) calloc(1, sizeof(struct inode *) * t->size);
-    if (t->array == NULL) {
-        fprintf(stderr, "Could not allocate memory for inode_table.array!\n");
+    memset(t, 0, sizeof(struct inode_table));
+    if (slab_init(&t->slab, sizeof(struct inode), ncaches) != 0) {
+        fprintf(stderr, "Could not allocate memory for inode_table slab!\n");
+        free(t);
         return -1;
     }
-    t->use = 0;
+    for (size_t s = 0; s < INODE_TABLE_STRIPES; s++) {
+        struct inode_table_stripe *stripe = &t->stripes[s];
+        stripe->nbuckets = INODE_TABLE_STRIPE_BUCKETS;
+        stripe->buckets = calloc(stripe->nbuckets, sizeof(struct inode *));
+        if (stripe->buckets == NULL) {
+            fprintf(stderr, "Could not allocate memory for inode_table buckets!\n");
+            while (s--)
+                free(t->stripes[s].buckets);
+            slab_destroy(t->slab);
+            free(t);
+            return -1;
+        }
+        pthread_rwlock_init(&stripe->lock, NULL);
+    }
 
     *ret_t = t;
     return 0;
 }
 
-size_t inode_table_hash(struct inode_table *t, fuse_ino_t ino) {
-    return ino % t->size;
+void inode_table_destroy(struct inode_table *t) {
+    inode_table_clear(t);
+    for (size_t s = 0; s < INODE_TABLE_STRIPES; s++) {
+        pthread_rwlock_destroy(&t->stripes[s].lock);
+        free(t->stripes[s].buckets);
+    }
+    slab_destroy(t->slab);
+    free(t);
 }
 
-// TODO not thread-safe
-struct inode *inode_table_get(struct inode_table *t, fuse_ino_t ino) {
-    size_t hash = inode_table_hash(t, ino);
+// The inode numbers of a file system are mostly sequential, which a modulo keeps in the
+// lower bits only. Mix all bits of both into the hash (the splitmix64 finalizer), the low
+// bits pick the stripe and the bits above them the bucket
+size_t inode_table_hash(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t) ino ^ ((uint64_t) dev * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
 
-    for (struct inode *inode = t->array[hash]; inode != NULL; inode = inode->next)
-        if (inode->ino == ino)
-            return inode;
+static inline struct inode_table_stripe *inode_table_stripe(struct inode_table *t, size_t hash) {
+    return &t->stripes[hash % INODE_TABLE_STRIPES];
+}
 
+static inline struct inode **inode_table_bucket(struct inode_table_stripe *stripe, size_t hash) {
+    return &stripe->buckets[(hash / INODE_TABLE_STRIPES) & (stripe->nbuckets - 1)];
+}
+
+// Must hold the stripe lock
+static struct inode *inode_table_find(struct inode_table_stripe *stripe, size_t hash,
+                                      dev_t dev, ino_t ino) {
+    for (struct inode *i = *inode_table_bucket(stripe, hash); i != NULL; i = i->next)
+        if (i->src_ino == ino && i->src_dev == dev)
+            return i;
     return NULL;
 }
 
-struct inode *inode_table_getsert(struct inode_table *t, fuse_ino_t ino) {
-    size_t hash = inode_table_hash(t, ino);
+// Must hold the stripe write lock. Keeps the current buckets if there is no memory,
+// the chains only get longer
+static void inode_table_grow(struct inode_table_stripe *stripe) {
+    size_t nbuckets = stripe->nbuckets * 2;
+    struct inode **buckets = calloc(nbuckets, sizeof(struct inode *));
+    if (!buckets)
+        return;
+
+    struct inode **old = stripe->buckets;
+    size_t old_nbuckets = stripe->nbuckets;
+    stripe->buckets = buckets;
+    stripe->nbuckets = nbuckets;
+    for (size_t b = 0; b < old_nbuckets; b++) {
+        struct inode *next = old[b];
+        while (next) {
+            struct inode *i = next;
+            next = i->next;
+            struct inode **bucket = inode_table_bucket(stripe, inode_table_hash(i->src_dev, i->src_ino));
+            i->next = *bucket;
+            *bucket = i;
+        }
+    }
+    free(old);
+}
+
+// inode.m is taken after the stripe lock, but only with a trylock: READDIR holds inode.m of
+// the directory while it looks up the entries, which takes the stripe locks. If inode.m is
+// busy, drop the stripe lock and look the inode up again, it may be gone by then
+struct inode *inode_table_get(struct inode_table *t, dev_t dev, ino_t ino) {
+    size_t hash = inode_table_hash(dev, ino);
+    struct inode_table_stripe *stripe = inode_table_stripe(t, hash);
 
-    for (struct inode *inode = t->array[hash]; inode != NULL; inode = inode->next)
-        if (inode->ino == ino)
-            return inode;
+    while (true) {
+        pthread_rwlock_rdlock(&stripe->lock);
+        struct inode *i = inode_table_find(stripe, hash, dev, ino);
+        if (!i || inode_trylock(i)) {
+            pthread_rwlock_unlock(&stripe->lock);
+            return i;
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+        sched_yield();
+    }
+}
 
-    struct inode *i = inode_new(ino);
-    if (!i)
+struct inode *inode_table_getsert(struct inode_table *t, dev_t dev, ino_t ino) {
+    struct inode *i = inode_table_get(t, dev, ino);
+    if (i)
+        return i;
+
+    size_t hash = inode_table_hash(dev, ino);
+    struct inode_table_stripe *stripe = inode_table_stripe(t, hash);
+    // Allocate outside of the lock, another thread may insert it in the meantime
+    struct inode *new = inode_new(t, dev, ino);
+    if (!new)
         return NULL;
 
-    inode_table_insert(t, i);
+    while (true) {
+        pthread_rwlock_wrlock(&stripe->lock);
+        i = inode_table_find(stripe, hash, dev, ino);
+        if (!i) {
+            i = new;
+            new = NULL;
+            if (++stripe->use > stripe->nbuckets * 2)
+                inode_table_grow(stripe);
+            struct inode **bucket = inode_table_bucket(stripe, hash);
+            i->next = *bucket;
+            *bucket = i;
+        }
+        if (inode_trylock(i))
+            break;
+        pthread_rwlock_unlock(&stripe->lock);
+        sched_yield();
+    }
+    pthread_rwlock_unlock(&stripe->lock);
 
+    if (new)
+        inode_destroy(t, new);
     return i;
 }
 
-void inode_table_insert(struct inode_table *t, struct inode *i) {
-    size_t hash = inode_table_hash(t, i->ino);
+bool inode_table_remove(struct inode_table *t, struct inode *inode, dev_t dev, ino_t ino) {
+    size_t hash = inode_table_hash(dev, ino);
+    struct inode_table_stripe *stripe = inode_table_stripe(t, hash);
 
-    if (t->array[hash] != NULL)
-        i->next = t->array[hash];
-    t->array[hash] = i;
-}
-
-struct inode *inode_table_remove(struct inode_table *t, fuse_ino_t ino) {
-    size_t hash = inode_table_hash(t, ino);
-    struct inode *prev = NULL;
-    for (struct inode *inode = t->array[hash]; inode != NULL; inode = inode->next) {
-        if (inode->ino == ino) {
-            if (!prev) { // we set the first inode to the next
-                t->array[hash] = inode->next;
-            } else { // link prev and next
-                prev->next = inode->next;
+    while (true) {
+        pthread_rwlock_wrlock(&stripe->lock);
+        // Another FORGET may have removed (and freed) it already, only touch it if it is still here
+        struct inode **p = inode_table_bucket(stripe, hash);
+        while (*p != NULL && *p != inode)
+            p = &(*p)->next;
+        if (*p == NULL) {
+            pthread_rwlock_unlock(&stripe->lock);
+            return false;
+        }
+        if (inode_trylock(inode)) {
+            // A lookup may have taken a new reference since the caller dropped the last one
+            bool removed = !inode->nlookup;
+            if (removed) {
+                *p = inode->next;
+                stripe->use--;
             }
-            return inode;
+            inode_unlock(inode);
+            pthread_rwlock_unlock(&stripe->lock);
+            return removed;
         }
-        prev = inode;
+        pthread_rwlock_unlock(&stripe->lock);
+        sched_yield();
     }
-    return NULL;
-}
-
-bool inode_table_erase(struct inode_table *t, fuse_ino_t ino) {
-    struct inode *i = inode_table_remove(t, ino);
-    if (i)
-        inode_destroy(i);
-    return i;
 }
 
 struct inode *ino_to_inodeptr(struct fuser *f, fuse_ino_t ino) {
@@ -165,10 +274,389 @@ int ino_to_fd(struct fuser *f, fuse_ino_t ino) {
         return inode->fd;
 }
 
-void directory_destroy(struct directory *d) {
+// Not thread-safe!
+static int fuser_files_init(struct fuser *f, uint16_t ring, uint32_t nslots) {
+    struct fuser_files *files = &f->files[ring];
+    pthread_spin_init(&files->lock, PTHREAD_PROCESS_PRIVATE);
+    if (nslots == 0)
+        return 0;
+
+    files->free = malloc(nslots * sizeof(*files->free));
+    if (!files->free)
+        return -ENOMEM;
+    // Sparse, all slots start out empty and get filled with io_uring_register_files_update()
+    int ret = io_uring_register_files_sparse(&f->rings[ring], nslots);
+    if (ret < 0) {
+        free(files->free);
+        files->free = NULL;
+        return ret;
+    }
+    // Hand out the low slots first
+    for (uint32_t i = 0; i < nslots; i++)
+        files->free[i] = nslots - 1 - i;
+    files->nfree = nslots;
+    files->nslots = nslots;
+    return 0;
+}
+
+// Thread-safe
+uint64_t fuser_file_register(struct fuser *f, uint16_t ring, int fd) {
+    struct fuser_files *files = &f->files[ring];
+    if (files->nslots == 0)
+        return fd;
+
+    pthread_spin_lock(&files->lock);
+    if (files->nfree == 0) {
+        pthread_spin_unlock(&files->lock);
+        return fd;
+    }
+    uint32_t slot = files->free[--files->nfree];
+    pthread_spin_unlock(&files->lock);
+
+    int ret = io_uring_register_files_update(&f->rings[ring], slot, &fd, 1);
+    if (ret != 1) {
+        fprintf(stderr, "WARNING: failed to register fd %d with ring %u: %s\n", fd, ring, strerror(-ret));
+        pthread_spin_lock(&files->lock);
+        files->free[files->nfree++] = slot;
+        pthread_spin_unlock(&files->lock);
+        return fd;
+    }
+    return (uint64_t) ring << 48 | (uint64_t) (slot + 1) << 32 | (uint32_t) fd;
+}
+
+// Thread-safe
+void fuser_file_unregister(struct fuser *f, uint64_t fh) {
+    if (!FUSER_FH_SLOT(fh))
+        return;
+    uint16_t ring = FUSER_FH_RING(fh);
+    uint32_t slot = FUSER_FH_SLOT(fh) - 1;
+    struct fuser_files *files = &f->files[ring];
+
+    // Requests that are still in flight hold their own reference to the file
+    int empty = -1;
+    int ret = io_uring_register_files_update(&f->rings[ring], slot, &empty, 1);
+    if (ret != 1) {
+        // Don't hand the slot out again, it still points to the old file
+        fprintf(stderr, "WARNING: failed to unregister slot %u of ring %u: %s\n", slot, ring, strerror(-ret));
+        return;
+    }
+    pthread_spin_lock(&files->lock);
+    files->free[files->nfree++] = slot;
+    pthread_spin_unlock(&files->lock);
+}
+
+// Not thread-safe!
+static int fuser_bufs_init(struct fuser *f, uint16_t ring, uint32_t nbufs, size_t buf_size) {
+    struct fuser_bufs *bufs = &f->bufs[ring];
+    pthread_spin_init(&bufs->lock, PTHREAD_PROCESS_PRIVATE);
+    if (nbufs == 0)
+        return 0;
+
+    // Page aligned and populated right away, registering pins the pages anyway
+    size_t size = (size_t) nbufs * buf_size;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED)
+        return -errno;
+    struct iovec *iov = malloc(nbufs * sizeof(*iov));
+    bufs->free = malloc(nbufs * sizeof(*bufs->free));
+    if (!iov || !bufs->free) {
+        free(iov);
+        free(bufs->free);
+        bufs->free = NULL;
+        munmap(mem, size);
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < nbufs; i++) {
+        iov[i].iov_base = (char *) mem + i * buf_size;
+        iov[i].iov_len = buf_size;
+    }
+    int ret = io_uring_register_buffers(&f->rings[ring], iov, nbufs);
+    free(iov);
+    if (ret < 0) {
+        free(bufs->free);
+        bufs->free = NULL;
+        munmap(mem, size);
+        return ret;
+    }
+    // Hand out the low buffers first
+    for (uint32_t i = 0; i < nbufs; i++)
+        bufs->free[i] = nbufs - 1 - i;
+    bufs->nfree = nbufs;
+    bufs->nbufs = nbufs;
+    bufs->buf_size = buf_size;
+    bufs->mem = mem;
+    return 0;
+}
+
+// Not thread-safe!
+// The ring must not have any requests in flight
+static void fuser_bufs_destroy(struct fuser *f, uint16_t ring) {
+    struct fuser_bufs *bufs = &f->bufs[ring];
+    if (bufs->nbufs)
+        munmap(bufs->mem, (size_t) bufs->nbufs * bufs->buf_size);
+    free(bufs->free);
+    pthread_spin_destroy(&bufs->lock);
+}
+
+// Thread-safe
+int fuser_buf_get(struct fuser *f, uint16_t ring, size_t len) {
+    struct fuser_bufs *bufs = &f->bufs[ring];
+    if (len > bufs->buf_size)
+        return -1;
+
+    pthread_spin_lock(&bufs->lock);
+    if (bufs->nfree == 0) {
+        pthread_spin_unlock(&bufs->lock);
+        return -1;
+    }
+    int buf = bufs->free[--bufs->nfree];
+    pthread_spin_unlock(&bufs->lock);
+    return buf;
+}
+
+// Thread-safe
+void fuser_buf_put(struct fuser *f, uint16_t ring, int buf) {
+    struct fuser_bufs *bufs = &f->bufs[ring];
+    pthread_spin_lock(&bufs->lock);
+    bufs->free[bufs->nfree++] = buf;
+    pthread_spin_unlock(&bufs->lock);
+}
+
+#define FUSER_CB_DATA_STRIDE ((sizeof(struct fuser_cb_data) + 63) & ~(size_t) 63)
+// The first cache line holds the struct fuser_cb_chunk
+#define FUSER_CB_POOL_CHUNK_OBJS ((FUSER_CB_POOL_CHUNK_SIZE - 64) / FUSER_CB_DATA_STRIDE)
+
+static uint64_t fuser_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void fuser_cb_chunk_carve(struct fuser_cb_pool *pool, struct fuser_cb_chunk *chunk) {
+    char *obj = (char *) chunk + 64;
+    for (size_t i = 0; i < FUSER_CB_POOL_CHUNK_OBJS; i++, obj += FUSER_CB_DATA_STRIDE) {
+        struct fuser_cb_data *cb_data = (struct fuser_cb_data *) obj;
+        cb_data->pool_next = pool->free;
+        pool->free = cb_data;
+    }
+}
+
+// Only for the DPFS thread of the ring (or before it runs)
+static int fuser_cb_pool_grow(struct fuser_cb_pool *pool) {
+    void *mem = mmap(NULL, FUSER_CB_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        // No hugepages reserved, let THP back it if it can
+        mem = mmap(NULL, FUSER_CB_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return -errno;
+        madvise(mem, FUSER_CB_POOL_CHUNK_SIZE, MADV_HUGEPAGE);
+    }
+
+    struct fuser_cb_chunk *chunk = mem;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->nchunks++;
+    fuser_cb_chunk_carve(pool, chunk);
+    __atomic_store_n(&pool->total, pool->total + FUSER_CB_POOL_CHUNK_OBJS, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int fuser_cb_pool_init(struct fuser *f, uint16_t ring, size_t n) {
+    struct fuser_cb_pool *pool = &f->cb_pools[ring];
+    memset(pool, 0, sizeof(*pool));
+    do {
+        int ret = fuser_cb_pool_grow(pool);
+        if (ret)
+            return ret;
+    } while (pool->total < n);
+    pool->nprealloc_chunks = pool->nchunks;
+    return 0;
+}
+
+static void fuser_cb_pool_destroy(struct fuser *f, uint16_t ring) {
+    struct fuser_cb_pool *pool = &f->cb_pools[ring];
+    while (pool->chunks) {
+        struct fuser_cb_chunk *next = pool->chunks->next;
+        munmap(pool->chunks, FUSER_CB_POOL_CHUNK_SIZE);
+        pool->chunks = next;
+    }
+}
+
+struct fuser_cb_data *fuser_cb_data_get(struct fuser *f, uint16_t ring) {
+    struct fuser_cb_pool *pool = &f->cb_pools[ring];
+    if (!pool->free)
+        pool->free = __atomic_exchange_n(&pool->returned, NULL, __ATOMIC_ACQUIRE);
+    if (!pool->free) {
+        if (fuser_cb_pool_grow(pool) != 0) {
+            __atomic_store_n(&pool->exhausted, pool->exhausted + 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        __atomic_store_n(&pool->grows, pool->grows + 1, __ATOMIC_RELAXED);
+    }
+
+    struct fuser_cb_data *cb_data = pool->free;
+    pool->free = cb_data->pool_next;
+    size_t in_use = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+    if (in_use > pool->high_water)
+        __atomic_store_n(&pool->high_water, in_use, __ATOMIC_RELAXED);
+    return cb_data;
+}
+
+void fuser_cb_data_put(struct fuser *f, struct fuser_cb_data *cb_data) {
+    struct fuser_cb_pool *pool = &f->cb_pools[cb_data->thread_id];
+    struct fuser_cb_data *head = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+    do {
+        cb_data->pool_next = head;
+    } while (!__atomic_compare_exchange_n(&pool->returned, &head, cb_data, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    // Only after it is back, so that in_use == 0 means that every cb_data is back
+    __atomic_sub_fetch(&pool->in_use, 1, __ATOMIC_RELEASE);
+}
+
+// Only for the DPFS thread of the ring
+static void fuser_cb_pool_maybe_shrink(struct fuser *f, uint16_t ring) {
+    struct fuser_cb_pool *pool = &f->cb_pools[ring];
+    if (pool->nchunks == pool->nprealloc_chunks)
+        return;
+    if (__atomic_load_n(&pool->in_use, __ATOMIC_ACQUIRE) != 0) {
+        pool->idle_since_usec = 0;
+        return;
+    }
+    uint64_t now = fuser_now_usec();
+    if (!pool->idle_since_usec) {
+        pool->idle_since_usec = now;
+        return;
+    }
+    if (now - pool->idle_since_usec < f->cb_pool_shrink_usec)
+        return;
+
+    // Nothing is in flight and only we take from the pool, so every cb_data is free.
+    // The preallocated chunks are the oldest, at the end of the list
+    __atomic_store_n(&pool->returned, NULL, __ATOMIC_RELAXED);
+    while (pool->nchunks > pool->nprealloc_chunks) {
+        struct fuser_cb_chunk *next = pool->chunks->next;
+        munmap(pool->chunks, FUSER_CB_POOL_CHUNK_SIZE);
+        pool->chunks = next;
+        pool->nchunks--;
+    }
+    pool->free = NULL;
+    for (struct fuser_cb_chunk *chunk = pool->chunks; chunk; chunk = chunk->next)
+        fuser_cb_chunk_carve(pool, chunk);
+    __atomic_store_n(&pool->total, pool->nchunks * FUSER_CB_POOL_CHUNK_OBJS, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->shrinks, pool->shrinks + 1, __ATOMIC_RELAXED);
+    pool->idle_since_usec = 0;
+}
+
+void fuser_cb_pool_stats(struct fuser *f, uint16_t ring, struct fuser_cb_pool_stats *stats) {
+    struct fuser_cb_pool *pool = &f->cb_pools[ring];
+    stats->total = __atomic_load_n(&pool->total, __ATOMIC_RELAXED);
+    stats->in_use = __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED);
+    stats->high_water = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+    stats->grows = __atomic_load_n(&pool->grows, __ATOMIC_RELAXED);
+    stats->shrinks = __atomic_load_n(&pool->shrinks, __ATOMIC_RELAXED);
+    stats->exhausted = __atomic_load_n(&pool->exhausted, __ATOMIC_RELAXED);
+}
+
+// Not thread-safe, only for the DPFS thread of the ring
+int fuser_sq_flush(struct fuser *f, uint16_t ring) {
+    struct fuser_sq *sq = &f->sqs[ring];
+    int ret = io_uring_submit(&f->rings[ring]);
+    // The SQEs stay in the ring if this fails, the next flush tries again
+    if (ret >= 0)
+        sq->pending = 0;
+    return ret;
+}
+
+// Not thread-safe, only for the DPFS thread of the ring
+void fuser_submit(struct fuser *f, uint16_t ring) {
+    struct fuser_sq *sq = &f->sqs[ring];
+    if (f->submit_batch > 1) {
+        uint64_t now = fuser_now_usec();
+        if (sq->pending++ == 0)
+            sq->queued_usec = now;
+        if (sq->pending < f->submit_batch && now - sq->queued_usec < f->submit_deadline_usec
+                && io_uring_sq_space_left(&f->rings[ring]) > 0)
+            return;
+    } else {
+        sq->pending++;
+    }
+
+    // The SQE is queued and will complete through the cq, so the caller must not reply.
+    // If the submit fails, the SQE stays pending and fuser_poll() tries again
+    int ret = fuser_sq_flush(f, ring);
+    if (ret < 0 && ret != -EAGAIN && ret != -EBUSY && ret != -EINTR)
+        fprintf(stderr, "ERROR: failed to submit to io_uring %u: %s\n", ring, strerror(-ret));
+}
+
+void fuser_inflight_add(struct fuser *f, struct fuser_cb_data *cb_data) {
+    pthread_spin_lock(&f->inflight_locks[cb_data->thread_id]);
+    list_add_tail(&cb_data->inflight, &f->inflight[cb_data->thread_id]);
+    pthread_spin_unlock(&f->inflight_locks[cb_data->thread_id]);
+}
+
+void fuser_inflight_del(struct fuser *f, struct fuser_cb_data *cb_data) {
+    pthread_spin_lock(&f->inflight_locks[cb_data->thread_id]);
+    list_del(&cb_data->inflight);
+    pthread_spin_unlock(&f->inflight_locks[cb_data->thread_id]);
+}
+
+// Only a handful of requests are in flight per ring, so a linear search is fine
+// for something as rare as an interrupt
+struct fuser_cb_data *fuser_inflight_find(struct fuser *f, uint16_t ring, uint16_t device_id,
+                                          uint64_t unique) {
+    struct fuser_cb_data *found = NULL;
+    pthread_spin_lock(&f->inflight_locks[ring]);
+    for (struct list_head *e = f->inflight[ring].next; e != &f->inflight[ring]; e = e->next) {
+        struct fuser_cb_data *cb_data = list_entry(e, struct fuser_cb_data, inflight);
+        if (cb_data->unique == unique && cb_data->device_id == device_id) {
+            found = cb_data;
+            break;
+        }
+    }
+    pthread_spin_unlock(&f->inflight_locks[ring]);
+    return found;
+}
+
+// Not thread-safe, only for the DPFS thread of the ring.
+// Once the batched SQEs are submitted, the ring can only stay full with SQPOLL,
+// while the kernel thread hasn't picked up the SQEs yet
+int fuser_sq_reserve(struct fuser *f, uint16_t ring, unsigned nr) {
+    struct io_uring *r = &f->rings[ring];
+    if (io_uring_sq_space_left(r) >= nr)
+        return 0;
+    int ret = fuser_sq_flush(f, ring);
+    if (ret < 0)
+        return ret;
+    while (io_uring_sq_space_left(r) < nr) {
+        if (!(r->flags & IORING_SETUP_SQPOLL))
+            return -EBUSY;
+        ret = io_uring_sqring_wait(r);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+void dir_snapshot_put(struct dir_snapshot *s) {
+    if (--s->refs > 0)
+        return;
+    __atomic_sub_fetch(&s->f->dir_cache_nents, s->n, __ATOMIC_RELAXED);
+    free(s->ents);
+    free(s->names);
+    free(s);
+}
+
+struct directory *directory_new(struct fuser *f) {
+    return slab_alloc(f->dirs);
+}
+
+void directory_destroy(struct fuser *f, struct directory *d) {
     if (d->dp)
         closedir(d->dp);
-    free(d);
+    free(d->batch);
+    slab_free(f->dirs, d);
 }
 
 static void maximize_fd_limit() {
@@ -190,6 +678,64 @@ struct tdata {
     struct fuser *f;
 };
 
+static void fuser_complete(struct fuser *f, struct io_uring *ring, struct io_uring_cqe *cqe) {
+    uintptr_t data = (uintptr_t) io_uring_cqe_get_data(cqe);
+    if (data & FUSER_CB_DATA_LINK) {
+        // The request completes with the CQE of the next SQE in the chain
+        struct fuser_cb_data *cb_data = (struct fuser_cb_data *) (data & ~FUSER_CB_DATA_LINK);
+        cb_data->link_res = cqe->res;
+        io_uring_cqe_seen(ring, cqe);
+        return;
+    } else if (data & FUSER_CB_DATA_PART) {
+        struct fuser_cb_part *part = (struct fuser_cb_part *) (data & ~FUSER_CB_DATA_PART);
+        part->res = cqe->res;
+        if (--part->cb_data->parts > 0) {
+            io_uring_cqe_seen(ring, cqe);
+            return;
+        }
+        // The last part completes the request
+        data = (uintptr_t) part->cb_data;
+    }
+
+    struct fuser_cb_data *cb_data = (struct fuser_cb_data *) data;
+#ifdef DEBUG_ENABLED
+    printf("Uring: got cqe for FUSE OP(%u) with id=%lu\n", cb_data->in_hdr->opcode, cb_data->in_hdr->unique);
+#endif
+
+    fuser_inflight_del(f, cb_data);
+    // Cancelled because of a FUSE_INTERRUPT
+    if (cqe->res == -ECANCELED)
+        cqe->res = -EINTR;
+    cb_data->cb(cb_data, cqe);
+
+    io_uring_cqe_seen(ring, cqe);
+    fuser_cb_data_put(f, cb_data);
+}
+
+// The poll hook of dpfs_fuse, called on the DPFS thread of the ring after every pass over its devices
+static void fuser_poll(void *user_data, uint16_t thread_id) {
+    struct fuser *f = user_data;
+    if (f->sqs[thread_id].pending != 0) {
+        int ret = fuser_sq_flush(f, thread_id);
+        if (ret < 0 && ret != -EAGAIN && ret != -EBUSY && ret != -EINTR)
+            fprintf(stderr, "ERROR: failed to submit to io_uring %u: %s\n", thread_id, strerror(-ret));
+    }
+    if (f->cb_pool_shrink_usec)
+        fuser_cb_pool_maybe_shrink(f, thread_id);
+    if (!f->run_to_completion)
+        return;
+
+    // Completes the requests on the thread (and core) that submitted them. Only so many per
+    // pass, a stream of completions must not keep the thread from its devices
+    struct io_uring *ring = &f->rings[thread_id];
+    for (uint32_t n = 0; n < FUSER_REAP_BATCH; n++) {
+        struct io_uring_cqe *cqe;
+        if (io_uring_peek_cqe(ring, &cqe) != 0)
+            break;
+        fuser_complete(f, ring, cqe);
+    }
+}
+
 // Blocks on a single ring
 static void *fuser_io_blocking_thread(void *arg) {
     struct tdata *td = arg;
@@ -207,15 +753,7 @@ static void *fuser_io_blocking_thread(void *arg) {
                 return NULL;
             } // else process the event
 
-            struct fuser_cb_data *cb_data = io_uring_cqe_get_data(cqe);
-#ifdef DEBUG_ENABLED
-            printf("Uring: got cqe for FUSE OP(%u) with id=%lu\n", cb_data->in_hdr->opcode, cb_data->in_hdr->unique);
-#endif
-
-            cb_data->cb(cb_data, cqe);
-
-            io_uring_cqe_seen(&f->rings[td->thread_id], cqe);
-            mpool_free(f->cb_data_pools[cb_data->thread_id], cb_data);
+            fuser_complete(f, &f->rings[td->thread_id], cqe);
     }
     return NULL;
 }
@@ -226,7 +764,7 @@ static void *fuser_io_poll_thread(void *arg) {
     struct fuser *f = td->f;
 
     long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
-    if (dpfs_fuse_nthreads(f->fuse) + f->cq_polling_nthreads <= num_cpus) {
+    if (dpfs_fuse_nthreads(f->fuse) + f->cq_cpu_offset + f->cq_polling_nthreads <= num_cpus) {
         cpu_set_t loop_cpu;
         CPU_ZERO(&loop_cpu);
         // Calculate our polling CPU
@@ -235,7 +773,8 @@ static void *fuser_io_poll_thread(void *arg) {
         // DPFS thread 1 will occupy core 6
         // cq polling thread 0 will occupy core 5
         // cq polling thread 1 will occupy core 4
-        CPU_SET(num_cpus-1 - dpfs_fuse_nthreads(f->fuse) - td->thread_id, &loop_cpu);
+        // The threads of the next directory start at core 3
+        CPU_SET(num_cpus-1 - dpfs_fuse_nthreads(f->fuse) - f->cq_cpu_offset - td->thread_id, &loop_cpu);
         int ret = sched_setaffinity(gettid(), sizeof(loop_cpu), &loop_cpu);
         if (ret == -1) {
             warn("Could not set the CPU affinity of polling thread %u. uring polling thread %u will continue not pinned.", td->thread_id, td->thread_id);
@@ -269,23 +808,15 @@ static void *fuser_io_poll_thread(void *arg) {
                 return NULL;
             } // else process the event
 
-            struct fuser_cb_data *cb_data = io_uring_cqe_get_data(cqe);
-#ifdef DEBUG_ENABLED
-            printf("Uring: got cqe for FUSE OP(%u) with id=%lu\n", cb_data->in_hdr->opcode, cb_data->in_hdr->unique);
-#endif
-
-            cb_data->cb(cb_data, cqe);
-
-            io_uring_cqe_seen(&td->f->rings[i], cqe);
-            mpool_free(td->f->cb_data_pools[cb_data->thread_id], cb_data);
+            fuser_complete(td->f, &td->f->rings[i], cqe);
         }
     }
     return NULL;
 }
 
-// TODO proper error handling
-int fuser_main(char *source, double metadata_timeout, enum fuser_directio_mode directio_mode,
-        const char *conf_path, bool cq_polling, uint16_t cq_polling_nthreads, bool sq_polling) {
+// Everything of a mirrored directory that doesn't depend on the DPFS threads
+static struct fuser *fuser_new(char *source, double metadata_timeout, enum fuser_directio_mode directio_mode,
+        size_t dir_cache_max_entries) {
     struct fuser *f = calloc(1, sizeof(struct fuser));
     if (f == NULL)
         err(1, "ERROR: Could not allocate memory for struct fuser");
@@ -293,6 +824,7 @@ int fuser_main(char *source, double metadata_timeout, enum fuser_directio_mode d
     f->source = strdup(source);
     f->timeout = metadata_timeout;
     f->directio_mode = directio_mode;
+    f->dir_cache_max_entries = dir_cache_max_entries;
 
     struct stat s;
     int ret = lstat(f->source, &s);
@@ -307,60 +839,149 @@ int fuser_main(char *source, double metadata_timeout, enum fuser_directio_mode d
     if (f->root.fd == -1)
         err(1, "ERROR: open(\"%s\", O_PATH)", f->source);
     f->root.nlookup = 9999;
-    f->root.ino = FUSE_ROOT_ID;
+    return f;
+}
 
-    // Don't apply umask, use modes exactly as specified
-    umask(0);
+// The rings, caches and cq threads of a directory, once the number of DPFS threads is known
+static int fuser_start(struct fuser *f, struct dpfs_fuse *fuse, uint64_t forget_interval_msec,
+        bool cq_polling, uint16_t cq_polling_nthreads, uint16_t cq_cpu_offset, bool run_to_completion,
+        uint32_t fixed_files, uint32_t registered_buffers, size_t registered_buffer_size,
+        uint32_t submit_batch, uint64_t submit_deadline_usec, bool sq_polling, int sq_thread_cpu,
+        uint32_t sq_thread_idle_msec, uint64_t cb_pool_shrink_msec, size_t block_cache_size,
+        size_t block_cache_extent_size, struct tdata **td_out, uint16_t *nthreads_out) {
+    int ret;
 
-    // We need an fd for every dentry in our the filesystem that the
-    // kernel knows about. This is way more than most processes need,
-    // so try to get rid of any resource softlimit.
-    maximize_fd_limit();
+    f->fuse = fuse;
+    f->nrings = dpfs_fuse_nthreads(fuse);
 
-    ret = inode_table_init(&f->inodes);
+    // The HAL threads and the cq threads (that complete asynchronous lookups) each get a cache
+    uint16_t ncaches = f->nrings;
+    if (!run_to_completion)
+        ncaches += cq_polling ? cq_polling_nthreads : f->nrings;
+    ret = inode_table_init(&f->inodes, ncaches);
     if (ret == -1)
         err(1, "ERROR: Failed to init inode_table f->inodes");
-
-    struct fuse_ll_operations ops;
-    fuser_mirror_assign_ops(&ops);
-
-    struct dpfs_fuse *fuse = dpfs_fuse_new(&ops, conf_path, f, NULL, NULL);
-    f->fuse = fuse;
-    f->nrings = dpfs_fuse_nthreads(fuse);
+    ret = slab_init(&f->dirs, sizeof(struct directory), f->nrings);
+    if (ret != 0)
+        errx(1, "ERROR: Failed to init the slab of directory handles");
+    // Once a stripe has grown, it has between a half and one bucket per inode
+    printf("dpfs_uring: %zu bytes of memory per cached inode, plus %zu to %zu bytes of the inode table\n",
+            f->inodes->slab->obj_size, sizeof(struct inode *) / 2, sizeof(struct inode *));
 
     struct io_uring_params params;
 
     memset(&params, 0, sizeof(params));
     f->cq_polling = cq_polling;
     f->cq_polling_nthreads = cq_polling_nthreads;
+    f->cq_cpu_offset = cq_cpu_offset;
+    f->run_to_completion = run_to_completion;
     if (f->cq_polling) {
         // The io_uring docs say this flag needs to be supplied if peek_cqe is used
         // but if this flag is supplied, all I/O errors 🤷, without it works anyway
         //params.flags |= IORING_SETUP_IOPOLL;
     }
     if (sq_polling) {
-        // Kernel-side polling can only be enabled with fixed files
-        // Which we don't implement because that's a big mess with SNAP in the HAL
-        //params.flags |= IORING_SETUP_SQPOLL;
-        //params.sq_thread_idle = 2000;
+        // A kernel thread picks up the SQEs, so submitting doesn't need a syscall
+        // as long as that thread is awake
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = sq_thread_idle_msec;
+        if (sq_thread_cpu >= 0) {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = sq_thread_cpu;
+        }
     }
 
     f->rings = calloc(f->nrings, sizeof(*f->rings));
     for (uint16_t i = 0; i < f->nrings; i++) {
-        ret = io_uring_queue_init_params(512, &f->rings[i], &params);
+        if (sq_polling && i > 0) {
+            // All rings share the kernel thread of the first one, instead of taking a core each
+            params.flags |= IORING_SETUP_ATTACH_WQ;
+            params.wq_fd = f->rings[0].ring_fd;
+        }
+        // Room for everything the host can send this thread, CQEs beyond that (linked SQEs,
+        // READDIRPLUS batches) are buffered by the kernel if the CQ ring overflows
+        uint32_t entries = FUSER_RING_MIN_ENTRIES;
+        while (entries < dpfs_fuse_thread_queue_depth(fuse, i) && entries < FUSER_RING_MAX_ENTRIES)
+            entries *= 2;
+        ret = io_uring_queue_init_params(entries, &f->rings[i], &params);
         if (ret) {
             fprintf(stderr, "ERROR: Unable to setup io_uring: %s\n", strerror(-ret));
             return -1;
         }
+        if (sq_polling && !(params.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+            // Only the fds of open files are registered, not those of the inodes
+            fprintf(stderr, "ERROR: uring_sq_polling needs Linux 5.11 or newer\n");
+            return -1;
+        }
     }
 
-    f->cb_data_pools = calloc(f->nrings, sizeof(*f->cb_data_pools));
+    if (fixed_files > FUSER_MAX_FIXED_FILES)
+        fixed_files = FUSER_MAX_FIXED_FILES;
+    f->files = calloc(f->nrings, sizeof(*f->files));
     for (uint16_t i = 0; i < f->nrings; i++) {
-        mpool_init(&f->cb_data_pools[i], sizeof(struct fuser_cb_data), 256);
+        ret = fuser_files_init(f, i, fixed_files);
+        if (ret) {
+            fprintf(stderr, "WARNING: Unable to register files with io_uring %u, "
+                    "it will use regular fds: %s\n", i, strerror(-ret));
+        }
+    }
+
+    if (registered_buffers > FUSER_MAX_REGISTERED_BUFFERS)
+        registered_buffers = FUSER_MAX_REGISTERED_BUFFERS;
+    f->bufs = calloc(f->nrings, sizeof(*f->bufs));
+    for (uint16_t i = 0; i < f->nrings; i++) {
+        ret = fuser_bufs_init(f, i, registered_buffers, registered_buffer_size);
+        if (ret) {
+            // Most likely RLIMIT_MEMLOCK on kernels that still account registered buffers to it
+            fprintf(stderr, "WARNING: Unable to register buffers with io_uring %u, "
+                    "reads and writes will use the request buffers: %s\n", i, strerror(-ret));
+        }
+    }
+
+    f->submit_batch = submit_batch;
+    f->submit_deadline_usec = submit_deadline_usec;
+    f->sqs = aligned_alloc(64, f->nrings * sizeof(*f->sqs));
+    memset(f->sqs, 0, f->nrings * sizeof(*f->sqs));
+
+    f->cb_pool_shrink_usec = cb_pool_shrink_msec * 1000;
+    f->cb_pools = aligned_alloc(64, f->nrings * sizeof(*f->cb_pools));
+    for (uint16_t i = 0; i < f->nrings; i++) {
+        // The pool grows if needed, so dpfs_fuse doesn't have to hold requests back for it
+        ret = fuser_cb_pool_init(f, i, dpfs_fuse_thread_queue_depth(fuse, i) + FUSER_CB_DATA_RESERVE);
+        if (ret) {
+            fprintf(stderr, "ERROR: Unable to allocate the request contexts of ring %u: %s\n", i, strerror(-ret));
+            return -1;
+        }
+    }
+    if (block_cache_size) {
+        // Reads are started by the DPFS threads and completed by the cq threads
+        ret = block_cache_init(&f->block_cache, block_cache_size, block_cache_extent_size, ncaches);
+        if (ret) {
+            fprintf(stderr, "ERROR: Unable to setup the block cache: %s\n", strerror(-ret));
+            return -1;
+        }
+        printf("dpfs_uring: caching file data in %zu extents of %zu KiB\n",
+                f->block_cache->nextents, block_cache_extent_size / 1024);
+    }
+    if (forget_interval_msec) {
+        ret = forget_log_init(&f->forgets, f->nrings, 4096, forget_interval_msec,
+                fuser_mirror_forget_apply, f);
+        if (ret) {
+            fprintf(stderr, "ERROR: Unable to setup the forget log: %s\n", strerror(-ret));
+            return -1;
+        }
+    }
+    f->inflight = calloc(f->nrings, sizeof(*f->inflight));
+    f->inflight_locks = calloc(f->nrings, sizeof(*f->inflight_locks));
+    for (uint16_t i = 0; i < f->nrings; i++) {
+        init_list_head(&f->inflight[i]);
+        pthread_spin_init(&f->inflight_locks[i], PTHREAD_PROCESS_PRIVATE);
     }
 
     uint16_t nthreads;
-    if (f->cq_polling) {
+    if (f->run_to_completion) {
+        nthreads = 0; // the DPFS threads reap their own rings in fuser_poll
+    } else if (f->cq_polling) {
         nthreads = cq_polling_nthreads; // user-defined
 
         if (nthreads > f->nrings) {
@@ -369,14 +990,14 @@ int fuser_main(char *source, double metadata_timeout, enum fuser_directio_mode d
         }
 
         long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
-        if (dpfs_fuse_nthreads(fuse) + nthreads >= num_cpus) {
+        if (dpfs_fuse_nthreads(fuse) + f->cq_cpu_offset + nthreads >= num_cpus) {
             warn("DPFS is configured with as many or more threads than there are cores on the DPU!"
                     "Core pinning is therefore disabled in dpfs_uring!\n");
         }
     } else {
         nthreads = f->nrings; // a blocking thread per ring
     }
-    struct tdata td[nthreads];
+    struct tdata *td = calloc(nthreads, sizeof(*td));
 
     for (uint16_t i = 0; i < nthreads; i++) {
         td[i].thread_id = i;
@@ -387,14 +1008,15 @@ int fuser_main(char *source, double metadata_timeout, enum fuser_directio_mode d
             pthread_create(&td[i].t, NULL, fuser_io_blocking_thread, &td[i]);
     }
 
-    printf("The following operations are asynchrounous through io_uring: read, write, fsync");
-#ifndef IORING_METADATA_DISABLED
-    printf(", statx, open, create, fallocate, rename, close, unlink, mkdir, symlink");
-#endif
-    printf("\n");
+    *td_out = td;
+    *nthreads_out = nthreads;
+    return 0;
+}
 
-    dpfs_fuse_loop(fuse);
-    dpfs_fuse_destroy(fuse);
+// After dpfs_fuse_destroy(), no more requests come in
+static void fuser_stop(struct fuser *f, struct tdata *td, uint16_t nthreads) {
+    if (f->forgets)
+        forget_log_destroy(f->forgets);
 
     f->io_poll_thread_stop = true;
     for (uint16_t i = 0; i < f->nrings; i++) {
@@ -410,12 +1032,110 @@ int fuser_main(char *source, double metadata_timeout, enum fuser_directio_mode d
             pthread_cancel(td[i].t);
         }
     }
+    free(td);
     
     for (uint16_t i = 0; i < f->nrings; i++) {
-        mpool_destroy(f->cb_data_pools[i]);
+        struct fuser_cb_pool_stats stats;
+        fuser_cb_pool_stats(f, i, &stats);
+        printf("dpfs_uring: ring %u request contexts: %zu mapped, high-water %zu, grew %lu times, "
+                "shrank %lu times, exhausted %lu times\n", i, stats.total, stats.high_water,
+                stats.grows, stats.shrinks, stats.exhausted);
+        fuser_cb_pool_destroy(f, i);
+        pthread_spin_destroy(&f->inflight_locks[i]);
+        pthread_spin_destroy(&f->files[i].lock);
+        free(f->files[i].free);
+        fuser_bufs_destroy(f, i);
     }
-    // destroy inode table
+    free(f->files);
+    free(f->bufs);
+    free(f->sqs);
+    free(f->inflight);
+    free(f->inflight_locks);
+    free(f->cb_pools);
+    if (f->block_cache) {
+        struct block_cache_stats stats;
+        block_cache_stats(f->block_cache, &stats);
+        uint64_t reads = stats.hits + stats.misses;
+        printf("dpfs_uring: block cache: %lu of %lu reads hit (%.1f%%), %lu MiB not read from the backend, "
+                "%zu of %zu extents used, %lu filled, %lu evicted, %lu promoted, %lu updated by writes, "
+                "%lu invalidations\n", stats.hits, reads, reads ? 100.0 * stats.hits / reads : 0.0,
+                stats.bytes_hit >> 20, stats.extents_used, stats.extents_total, stats.fills,
+                stats.evictions, stats.promotions, stats.write_updates, stats.invalidations);
+        block_cache_destroy(f->block_cache);
+    }
+    inode_table_destroy(f->inodes);
+    slab_destroy(f->dirs);
     free(f);
+}
+
+// TODO proper error handling
+int fuser_main(struct fuser_dir *dirs, int ndirs, double metadata_timeout, enum fuser_directio_mode directio_mode,
+        size_t dir_cache_max_entries, uint64_t forget_interval_msec, const char *conf_path, bool cq_polling,
+        uint16_t cq_polling_nthreads, bool run_to_completion, uint32_t fixed_files,
+        uint32_t registered_buffers, size_t registered_buffer_size,
+        uint32_t submit_batch, uint64_t submit_deadline_usec, bool sq_polling, int sq_thread_cpu, uint32_t sq_thread_idle_msec,
+        uint64_t cb_pool_shrink_msec, size_t block_cache_size, size_t block_cache_extent_size) {
+    struct fuser **fs = calloc(ndirs, sizeof(*fs));
+    struct fuse_ll_operations *ops = calloc(ndirs, sizeof(*ops));
+    struct dpfs_fuse_backend *backends = calloc(ndirs, sizeof(*backends));
+    struct tdata **td = calloc(ndirs, sizeof(*td));
+    uint16_t *nthreads = calloc(ndirs, sizeof(*nthreads));
+    if (!fs || !ops || !backends || !td || !nthreads)
+        err(1, "ERROR: Could not allocate memory for the mirrored directories");
+
+    // Every directory is a backend of its own with its own inode table, rings and caches,
+    // a device is served by the one that the config assigns to it
+    for (int d = 0; d < ndirs; d++) {
+        fs[d] = fuser_new(dirs[d].source, metadata_timeout, directio_mode, dir_cache_max_entries);
+        fuser_mirror_assign_ops(&ops[d]);
+        ops[d].poll = fuser_poll;
+        backends[d].name = dirs[d].name;
+        backends[d].ops = &ops[d];
+        backends[d].user_data = fs[d];
+    }
+
+    // Don't apply umask, use modes exactly as specified
+    umask(0);
+
+    // We need an fd for every dentry in our the filesystem that the
+    // kernel knows about. This is way more than most processes need,
+    // so try to get rid of any resource softlimit.
+    maximize_fd_limit();
+
+    struct dpfs_fuse *fuse = dpfs_fuse_new_multi(backends, ndirs, conf_path);
+    if (!fuse)
+        return -1;
+
+    uint16_t cq_cpu_offset = 0;
+    for (int d = 0; d < ndirs; d++) {
+        int ret = fuser_start(fs[d], fuse, forget_interval_msec, cq_polling, cq_polling_nthreads,
+                cq_cpu_offset, run_to_completion, fixed_files, registered_buffers, registered_buffer_size,
+                submit_batch, submit_deadline_usec, sq_polling, sq_thread_cpu, sq_thread_idle_msec,
+                cb_pool_shrink_msec, block_cache_size, block_cache_extent_size, &td[d], &nthreads[d]);
+        if (ret)
+            return ret;
+        if (cq_polling && !run_to_completion)
+            cq_cpu_offset += cq_polling_nthreads;
+    }
+
+    if (run_to_completion)
+        printf("dpfs_uring: the DPFS threads reap their own rings, no cq threads\n");
+    printf("The following operations are asynchrounous through io_uring: read, write, fsync");
+#ifndef IORING_METADATA_DISABLED
+    printf(", lookup, statx, open, create, fallocate, rename, close, unlink, mkdir, symlink");
+#endif
+    printf("\n");
+
+    dpfs_fuse_loop(fuse);
+    dpfs_fuse_destroy(fuse);
+    for (int d = 0; d < ndirs; d++)
+        fuser_stop(fs[d], td[d], nthreads[d]);
+
+    free(fs);
+    free(ops);
+    free(backends);
+    free(td);
+    free(nthreads);
 
     return 0;
 }
@@ -14,53 +14,158 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <linux/fuse.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <liburing.h>
 
 #include "dpfs_fuse.h"
-#include "mpool.h"
+#include "forget_log.h"
+#include "slab.h"
+#include "list.h"
+#include "block_cache.h"
 
-struct inode {
-    fuse_ino_t ino;
+struct fuser;
+
+// Snapshot of the entries of a directory, taken at the first READDIR(PLUS) of a listing and
+// shared by every open handle of the directory that started a listing since then.
+// A handle keeps listing its snapshot until it starts over at offset 0, so offsets stay
+// stable while the directory changes underneath it. The offset of an entry is its index + 1.
+// Protected by the mutex of the inode of the directory.
+struct dir_snapshot {
+    struct fuser *f;
+    // The inode and every handle that lists it
+    uint64_t refs;
+    uint64_t expires_msec;
+    size_t n;
+    // The names point into names
+    struct fuse_direntry *ents;
+    // Taken for a READDIRPLUS, the ino and mode of ents are those of the files themselves and
+    // not of the dirents (mountpoints). Their attributes are looked up when they are listed
+    bool attrs;
+    char *names;
+};
 
+void dir_snapshot_put(struct dir_snapshot *);
+
+// Allocated from the slab of the inode_table, 60 bytes so that an inode takes a single cache line
+struct inode {
     // O_PATH | O_NOFOLLOW = just for passing it as the parent to openat
     // The fd with read and write permissions is not stored, but given and received from the user
     int fd;
+    // See inode_lock()
+    uint32_t lock;
 
     dev_t src_dev;
     ino_t src_ino;
-    int generation;
     uint64_t nopen;
     uint64_t nlookup;
-    pthread_mutex_t m;
+    // Protected by lock, NULL unless this is a directory with a current snapshot
+    struct dir_snapshot *snap;
 
+    // The chain of the bucket while in the inode_table
     struct inode *next;
+    int generation;
 };
 
-struct inode *inode_new(fuse_ino_t ino);
+_Static_assert(sizeof(struct inode) <= 64, "struct inode must fit in a cache line");
 
-struct inode_table {
-    struct inode **array;
+// A mutex in 4 bytes instead of the 40 of a pthread_mutex_t. 0 = unlocked, 1 = locked,
+// 2 = locked and there may be threads sleeping on the futex
+static inline bool inode_trylock(struct inode *i) {
+    uint32_t unlocked = 0;
+    return __atomic_compare_exchange_n(&i->lock, &unlocked, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void inode_lock(struct inode *i) {
+    uint32_t c = 0;
+    if (__atomic_compare_exchange_n(&i->lock, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    if (c != 2)
+        c = __atomic_exchange_n(&i->lock, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        syscall(SYS_futex, &i->lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        c = __atomic_exchange_n(&i->lock, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline void inode_unlock(struct inode *i) {
+    if (__atomic_exchange_n(&i->lock, 0, __ATOMIC_RELEASE) == 2)
+        syscall(SYS_futex, &i->lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+struct inode_table;
+
+// Returns NULL if there is no memory
+struct inode *inode_new(struct inode_table *, dev_t src_dev, ino_t src_ino);
+// Closes the fd, the inode must not be in the inode_table anymore
+void inode_destroy(struct inode_table *, struct inode *);
+
+#define INODE_TABLE_STRIPES 64
+// Initial buckets per stripe, a stripe grows once it has twice as many inodes as buckets
+#define INODE_TABLE_STRIPE_BUCKETS 128
+
+// The inodes that the host knows, by (src_dev, src_ino). The table is split into stripes by
+// the hash, each with its own lock and its own chained buckets, so that the pollers only
+// contend when they look up inodes of the same stripe. A stripe doubles its buckets when it
+// gets too full, which only rehashes the inodes of that stripe while the rest of the table
+// stays available.
+// The inode lock is only ever trylocked under a stripe lock, because READDIR holds the lock
+// of the directory while it looks up the entries. An inode is only removed while its stripe
+// is write locked and nlookup is 0 under the inode lock, so holding the inode lock (taken
+// under the stripe lock) keeps it alive after the stripe has been unlocked.
+struct inode_table_stripe {
+    pthread_rwlock_t lock;
+    // Power of two
+    size_t nbuckets;
     size_t use;
-    size_t size;
+    struct inode **buckets;
+} __attribute__((aligned(64)));
+
+struct inode_table {
+    struct inode_table_stripe stripes[INODE_TABLE_STRIPES];
+    // Where the inodes come from
+    struct slab *slab;
 };
 
-#define INODE_TABLE_SIZE 8192
+// Max CQEs that the DPFS thread reaps per pass over its devices in run_to_completion mode
+#define FUSER_REAP_BATCH 64
+// The pool of cb_data of a ring grows by chunks of this size, one hugepage
+#define FUSER_CB_POOL_CHUNK_SIZE (2 * 1024 * 1024)
+// On top of the queue depth of the thread, for the requests that dpfs_fuse makes up itself
+// (the write back of gathered writes) and FUSE_INTERRUPTs
+#define FUSER_CB_DATA_RESERVE 32
+// Bounds of the io_uring size, which is the queue depth of the thread rounded up to a power of 2
+#define FUSER_RING_MIN_ENTRIES 64
+#define FUSER_RING_MAX_ENTRIES 32768
 
-int inode_table_init(struct inode_table **);
-size_t inode_table_hash(struct inode_table *, fuse_ino_t);
-struct inode *inode_table_get(struct inode_table *, fuse_ino_t);
-struct inode *inode_table_getsert(struct inode_table *, fuse_ino_t);
-void inode_table_insert(struct inode_table *, struct inode *);
-struct inode *inode_table_remove(struct inode_table *, fuse_ino_t);
-bool inode_table_erase(struct inode_table *, fuse_ino_t);
+// ncaches = the number of threads that look up inodes, for the slab
+int inode_table_init(struct inode_table **, uint16_t ncaches);
+// Frees all inodes that are still in the table
+void inode_table_destroy(struct inode_table *);
+size_t inode_table_hash(dev_t, ino_t);
+// Return the inode locked, or NULL if it isn't in the table (get) or there was
+// no memory for a new one (getsert). A new inode has fd -1 and nlookup 0
+struct inode *inode_table_get(struct inode_table *, dev_t, ino_t);
+struct inode *inode_table_getsert(struct inode_table *, dev_t, ino_t);
+// Removes the inode if it is still in the table and its nlookup is (still) 0, the caller then
+// destroys it. dev and ino must have been read from the inode under its lock, which must not
+// be held anymore
+bool inode_table_remove(struct inode_table *, struct inode *, dev_t, ino_t);
 void inode_table_clear(struct inode_table *t);
 
 struct directory {
     DIR *dp;
     off_t offset;
+    // The snapshot this handle is listing, NULL if it is listing dp
+    struct dir_snapshot *snap;
+    // NULL until the first asynchronous READDIRPLUS of this handle
+    struct readdir_batch *batch;
 };
 
-void directory_destroy(struct directory *);
+// From the slab of directory handles, NULL if there is no memory
+struct directory *directory_new(struct fuser *);
+void directory_destroy(struct fuser *, struct directory *);
 
 enum fuser_directio_mode {
     // Do not modify the host's direct I/O whishes
@@ -72,12 +177,117 @@ enum fuser_directio_mode {
     FUSER_DIRECTIO_ALWAYS = 2,
 };
 
+// Per ring table of registered (fixed) files, so that the kernel doesn't have to look up the
+// fd of a READ or WRITE in the file table of the process, which is shared by all rings.
+// A file is only ever used by the ring of the thread that opened it, because a device is owned
+// by a single thread. The slots are taken by that thread or by the cq thread that completes
+// the OPEN, so they are locked.
+struct fuser_files {
+    pthread_spinlock_t lock;
+    // 0 if the ring has no registered files
+    uint32_t nslots;
+    uint32_t nfree;
+    uint32_t *free;
+};
+
+// The fh that we hand to the host: the fd in the lower 32 bits and, if the file is
+// registered with a ring, the ring in bits 48-63 and the slot + 1 in bits 32-47
+#define FUSER_FH_FD(fh) ((int) ((fh) & 0xffffffff))
+#define FUSER_FH_SLOT(fh) ((uint32_t) (((fh) >> 32) & 0xffff))
+#define FUSER_FH_RING(fh) ((uint16_t) ((fh) >> 48))
+#define FUSER_MAX_FIXED_FILES 0xffff
+
+// Per ring arena of buffers that are registered with io_uring, so that READ_FIXED and
+// WRITE_FIXED don't have to pin and map the pages of every request.
+// The buffers of the virtqueues are allocated by SNAP and not exposed by the HAL, so a read
+// or write bounces through a buffer of the arena. If the request is larger than a buffer or
+// all buffers are taken, it uses the iovecs of the request directly like before.
+// Taken by the DPFS thread and given back by the cq thread, so they are locked.
+struct fuser_bufs {
+    pthread_spinlock_t lock;
+    // 0 if the ring has no registered buffers
+    uint32_t nbufs;
+    size_t buf_size;
+    uint32_t nfree;
+    uint32_t *free;
+    char *mem;
+};
+
+// Per ring, the SQEs that have been queued but not submitted yet.
+// Only touched by the DPFS thread of the ring.
+struct fuser_sq {
+    uint32_t pending;
+    // Of the oldest pending SQE
+    uint64_t queued_usec;
+} __attribute__((aligned(64)));
+
+struct fuser_cb_chunk {
+    struct fuser_cb_chunk *next;
+};
+
+// Per ring pool of request contexts. Only the DPFS thread of the ring takes them, from its own
+// free list and without locks. The threads that complete the requests hand them back through
+// a lock-free stack, which the DPFS thread takes over as a whole once its free list runs dry.
+// If that is empty as well, the DPFS thread maps another chunk, so the pool grows with the
+// requests in flight instead of failing them with -ENOMEM.
+// Chunks are backed by hugepages if some are reserved, else by transparent hugepages if possible.
+// Once no request was in flight for shrink_usec, the chunks beyond the preallocated ones are
+// unmapped again.
+struct fuser_cb_pool {
+    // Only for the DPFS thread of the ring
+    struct fuser_cb_data *free;
+    struct fuser_cb_chunk *chunks;
+    size_t nchunks;
+    size_t nprealloc_chunks;
+    uint64_t idle_since_usec;
+
+    // Read by anyone through fuser_cb_pool_stats(), only written by the DPFS thread
+    size_t total;
+    size_t high_water;
+    uint64_t grows;
+    uint64_t shrinks;
+    uint64_t exhausted;
+
+    // Written by the threads that complete the requests
+    struct fuser_cb_data *returned __attribute__((aligned(64)));
+    size_t in_use;
+} __attribute__((aligned(64)));
+
+struct fuser_cb_pool_stats {
+    // cb_data that are mapped
+    size_t total;
+    size_t in_use;
+    // The most that were ever in use at once
+    size_t high_water;
+    uint64_t grows;
+    uint64_t shrinks;
+    // Times that no chunk could be mapped, the request got -ENOMEM
+    uint64_t exhausted;
+};
+
+// Only for the DPFS thread of the ring, NULL if the pool couldn't grow
+struct fuser_cb_data *fuser_cb_data_get(struct fuser *, uint16_t ring);
+// Thread-safe
+void fuser_cb_data_put(struct fuser *, struct fuser_cb_data *);
+// Thread-safe
+void fuser_cb_pool_stats(struct fuser *, uint16_t ring, struct fuser_cb_pool_stats *);
+
+// io_uring doesn't allow more than this many buffers per ring
+#define FUSER_MAX_REGISTERED_BUFFERS 16384
+
 struct fuser {
-    pthread_mutex_t m;
-    struct inode_table *inodes; // protected by m
+    struct inode_table *inodes;
+    // Of the struct directory handles
+    struct slab *dirs;
     struct inode root;
     double timeout;
     enum fuser_directio_mode directio_mode;
+    // Max entries of all directory snapshots together, 0 disables them (as does timeout = 0)
+    size_t dir_cache_max_entries;
+    // Updated with atomics
+    size_t dir_cache_nents;
+    // NULL if FORGETs are applied by the thread that receives them
+    struct forget_log *forgets;
     char *source;
     // size_t blocksize;
     dev_t src_dev; // gets set to the dev of the source
@@ -87,20 +297,104 @@ struct fuser {
 
     uint16_t nrings;
     uint16_t cq_polling_nthreads;
+    // The cq polling threads of the directories that were set up before this one, so that
+    // each directory pins its threads to cores of its own
+    uint16_t cq_cpu_offset;
 
     volatile bool io_poll_thread_stop;
     struct io_uring *rings;
     bool cq_polling;
     // if cq_polling == false, then nthreads = nrings
+    // The DPFS thread of a ring reaps its CQEs in the poll hook, there are no cq threads
+    // and cq_polling is ignored
+    bool run_to_completion;
 
-    struct mpool **cb_data_pools;
+    // Per ring
+    struct fuser_files *files;
+    struct fuser_bufs *bufs;
+    struct fuser_sq *sqs;
+    // Submit once this many SQEs are queued or the oldest was queued this long ago,
+    // or else at the end of the pass of the DPFS thread over its devices.
+    // A batch of 1 submits every SQE right away
+    uint32_t submit_batch;
+    uint64_t submit_deadline_usec;
+
+    // NULL if the data of the files isn't cached on the DPU
+    struct block_cache *block_cache;
+
+    struct fuser_cb_pool *cb_pools;
+    // 0 if the pools never shrink
+    uint64_t cb_pool_shrink_usec;
+    // Per ring, the requests that have been submitted but not completed yet.
+    // Added to by the DPFS thread and removed from by the cq thread.
+    struct list_head *inflight;
+    pthread_spinlock_t *inflight_locks;
 };
 
+struct fuser_cb_data;
+void fuser_inflight_add(struct fuser *, struct fuser_cb_data *);
+void fuser_inflight_del(struct fuser *, struct fuser_cb_data *);
+// Returns NULL if the request already completed
+struct fuser_cb_data *fuser_inflight_find(struct fuser *, uint16_t ring, uint16_t device_id,
+                                          uint64_t unique);
+
+// Makes room for nr more SQEs on the ring of the calling DPFS thread, by submitting the
+// batched ones if needed. Returns 0, or a negative errno if the ring stays full
+int fuser_sq_reserve(struct fuser *, uint16_t ring, unsigned nr);
+// io_uring_get_sqe() that waits for room under SQPOLL, NULL if there is none
+static inline struct io_uring_sqe *fuser_get_sqe(struct fuser *f, uint16_t ring)
+{
+    if (fuser_sq_reserve(f, ring, 1) < 0)
+        return NULL;
+    return io_uring_get_sqe(&f->rings[ring]);
+}
+
+// Returns the fh for the host, which is just the fd if the ring has no free slots
+uint64_t fuser_file_register(struct fuser *, uint16_t ring, int fd);
+// Before the fd gets closed
+void fuser_file_unregister(struct fuser *, uint64_t fh);
+// Call after io_uring_prep_*(sqe, FUSER_FH_FD(fh), ...) to use the registered file instead
+static inline void fuser_sqe_set_file(struct io_uring_sqe *sqe, uint16_t ring, uint64_t fh)
+{
+    if (FUSER_FH_SLOT(fh) && FUSER_FH_RING(fh) == ring) {
+        sqe->fd = FUSER_FH_SLOT(fh) - 1;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+// Call after queueing an SQE on the ring of the calling DPFS thread instead of io_uring_submit().
+// The SQE always completes through the cq from then on, a failed submit is retried by the poll hook
+void fuser_submit(struct fuser *, uint16_t ring);
+// Submits the SQEs that fuser_submit() has batched on the ring of the calling DPFS thread,
+// returns the same as io_uring_submit()
+int fuser_sq_flush(struct fuser *, uint16_t ring);
+
+// Returns the index of a free registered buffer of at least len bytes, or -1
+int fuser_buf_get(struct fuser *, uint16_t ring, size_t len);
+void fuser_buf_put(struct fuser *, uint16_t ring, int buf);
+static inline void *fuser_buf_addr(struct fuser *f, uint16_t ring, int buf)
+{
+    return f->bufs[ring].mem + (size_t) buf * f->bufs[ring].buf_size;
+}
+
 struct inode *ino_to_inodeptr(struct fuser *, fuse_ino_t);
 int ino_to_fd(struct fuser *, fuse_ino_t);
 
-int fuser_main(char *source, double metadata_timeout,
-               enum fuser_directio_mode directio_mode, const char *conf_path, bool cq_polling,
-               uint16_t cq_polling_nthreads, bool sq_polling);
+// A mirrored directory, served as a backend of its own (see dpfs_fuse_new_multi)
+struct fuser_dir {
+    // Referenced by `backend = "<name>"` under [dpfs.device.<device_id>]
+    const char *name;
+    char *source;
+};
+
+// Devices without a backend in the config are served by dirs[0]
+int fuser_main(struct fuser_dir *dirs, int ndirs, double metadata_timeout,
+               enum fuser_directio_mode directio_mode, size_t dir_cache_max_entries,
+               uint64_t forget_interval_msec, const char *conf_path, bool cq_polling,
+               uint16_t cq_polling_nthreads, bool run_to_completion, uint32_t fixed_files,
+               uint32_t registered_buffers, size_t registered_buffer_size,
+               uint32_t submit_batch, uint64_t submit_deadline_usec,
+               bool sq_polling, int sq_thread_cpu, uint32_t sq_thread_idle_msec,
+               uint64_t cb_pool_shrink_msec, size_t block_cache_size, size_t block_cache_extent_size);
 
 #endif // FUSER_H
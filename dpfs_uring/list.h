@@ -8,6 +8,13 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include <stddef.h>
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+#endif
+
 #define list_entry(ptr, type, member)           \
     container_of(ptr, type, member)
 
@@ -16,16 +23,16 @@ struct list_head {
     struct list_head *prev;
 };
 
-static void init_list_head(struct list_head *list) {
+static inline void init_list_head(struct list_head *list) {
     list->next = list;
     list->prev = list;
 }
 
-static int list_empty(const struct list_head *head) {
+static inline int list_empty(const struct list_head *head) {
     return head->next == head;
 }
 
-static void list_add(struct list_head *e, struct list_head *prev,
+static inline void list_add(struct list_head *e, struct list_head *prev,
              struct list_head *next) {
     next->prev = e;
     e->next = next;
@@ -75,6 +75,33 @@ int main(int argc, char **argv)
         fprintf(stderr, "Could not parse dir %s, errno=%d\n", dir.u.s, errno);
         exit(errno);
     }
+    // `dir` is served to the devices without a backend in the config, the directories
+    // under [local_mirror.dirs] to those with `backend = "<name>"` under [dpfs.device.<id>]
+    toml_table_t *dirs_conf = toml_table_in(local_mirror_conf, "dirs"); // optional
+    int ndirs = 1;
+    while (dirs_conf && toml_key_in(dirs_conf, ndirs - 1))
+        ndirs++;
+    struct fuser_dir *dirs = calloc(ndirs, sizeof(*dirs));
+    if (!dirs) {
+        fprintf(stderr, "Could not allocate the mirrored directories\n");
+        return -1;
+    }
+    dirs[0].name = "local_mirror";
+    dirs[0].source = rp;
+    for (int i = 1; i < ndirs; i++) {
+        const char *name = toml_key_in(dirs_conf, i - 1);
+        toml_datum_t d = toml_string_in(dirs_conf, name);
+        if (!d.ok) {
+            fprintf(stderr, "`%s` under [local_mirror.dirs] must be the directory to mirror\n", name);
+            return -1;
+        }
+        dirs[i].name = name;
+        dirs[i].source = realpath(d.u.s, NULL);
+        if (dirs[i].source == NULL) {
+            fprintf(stderr, "Could not parse dir %s, errno=%d\n", d.u.s, errno);
+            exit(errno);
+        }
+    }
     toml_datum_t metadata_timeout = toml_double_in(local_mirror_conf, "metadata_timeout");
     if (!metadata_timeout.ok) {
         fprintf(stderr, "You must supply `metadata_timeout` in seconds under [local_mirror]\n");
@@ -96,15 +123,84 @@ int main(int argc, char **argv)
         fprintf(stderr, "You must supply an int `uring_cq_polling_nthreads` of >=1 under [local_mirror]\n");
         return -1;
     }
-    // Currently not supported because we don't implement fixed files
-    //toml_datum_t sq_polling = toml_bool_in(local_mirror_conf, "uring_sq_polling");
-    //if (!sq_polling.ok) {
-    //    fprintf(stderr, "You must supply a bool `uring_sq_polling` under [local_mirror]\n");
-    //    return -1;
-    //}
+    toml_datum_t run_to_completion = toml_bool_in(local_mirror_conf, "uring_run_to_completion"); // optional
+    toml_datum_t dir_cache = toml_int_in(local_mirror_conf, "dir_cache_max_entries"); // optional
+    if (dir_cache.ok && dir_cache.u.i < 0) {
+        fprintf(stderr, "`dir_cache_max_entries` under [local_mirror] can't be negative\n");
+        return -1;
+    }
+
+    toml_datum_t forget_interval = toml_int_in(local_mirror_conf, "forget_interval_msec"); // optional
+    if (forget_interval.ok && forget_interval.u.i < 0) {
+        fprintf(stderr, "`forget_interval_msec` under [local_mirror] can't be negative\n");
+        return -1;
+    }
+
+    toml_datum_t fixed_files = toml_int_in(local_mirror_conf, "uring_fixed_files"); // optional
+    if (fixed_files.ok && (fixed_files.u.i < 0 || fixed_files.u.i > FUSER_MAX_FIXED_FILES)) {
+        fprintf(stderr, "`uring_fixed_files` under [local_mirror] must be between 0 and %d\n", FUSER_MAX_FIXED_FILES);
+        return -1;
+    }
+    toml_datum_t registered_buffers = toml_int_in(local_mirror_conf, "uring_registered_buffers"); // optional
+    if (registered_buffers.ok && (registered_buffers.u.i < 0 || registered_buffers.u.i > FUSER_MAX_REGISTERED_BUFFERS)) {
+        fprintf(stderr, "`uring_registered_buffers` under [local_mirror] must be between 0 and %d\n",
+                FUSER_MAX_REGISTERED_BUFFERS);
+        return -1;
+    }
+    toml_datum_t registered_buffer_size = toml_int_in(local_mirror_conf, "uring_registered_buffer_size"); // optional
+    if (registered_buffer_size.ok && (registered_buffer_size.u.i < 4096 || registered_buffer_size.u.i % 4096)) {
+        fprintf(stderr, "`uring_registered_buffer_size` under [local_mirror] must be a multiple of 4096\n");
+        return -1;
+    }
+    toml_datum_t submit_batch = toml_int_in(local_mirror_conf, "uring_submit_batch"); // optional
+    if (submit_batch.ok && submit_batch.u.i < 0) {
+        fprintf(stderr, "`uring_submit_batch` under [local_mirror] can't be negative\n");
+        return -1;
+    }
+    toml_datum_t submit_deadline = toml_int_in(local_mirror_conf, "uring_submit_deadline_usec"); // optional
+    if (submit_deadline.ok && submit_deadline.u.i < 0) {
+        fprintf(stderr, "`uring_submit_deadline_usec` under [local_mirror] can't be negative\n");
+        return -1;
+    }
+    toml_datum_t sq_polling = toml_bool_in(local_mirror_conf, "uring_sq_polling"); // optional
+    toml_datum_t sq_thread_cpu = toml_int_in(local_mirror_conf, "uring_sq_thread_cpu"); // optional
+    toml_datum_t sq_thread_idle = toml_int_in(local_mirror_conf, "uring_sq_thread_idle_msec"); // optional
+    if (sq_thread_idle.ok && sq_thread_idle.u.i < 0) {
+        fprintf(stderr, "`uring_sq_thread_idle_msec` under [local_mirror] can't be negative\n");
+        return -1;
+    }
+
+    toml_datum_t cb_pool_shrink = toml_int_in(local_mirror_conf, "uring_cb_pool_shrink_msec"); // optional
+    if (cb_pool_shrink.ok && cb_pool_shrink.u.i < 0) {
+        fprintf(stderr, "`uring_cb_pool_shrink_msec` under [local_mirror] can't be negative\n");
+        return -1;
+    }
+
+    toml_datum_t block_cache = toml_int_in(local_mirror_conf, "uring_block_cache_mib"); // optional
+    if (block_cache.ok && block_cache.u.i < 0) {
+        fprintf(stderr, "`uring_block_cache_mib` under [local_mirror] can't be negative\n");
+        return -1;
+    }
+    toml_datum_t block_cache_extent = toml_int_in(local_mirror_conf, "uring_block_cache_extent_kib"); // optional
+    if (block_cache_extent.ok && (block_cache_extent.u.i < 4 || (block_cache_extent.u.i & (block_cache_extent.u.i - 1)))) {
+        fprintf(stderr, "`uring_block_cache_extent_kib` under [local_mirror] must be a power of two of at least 4\n");
+        return -1;
+    }
 
     printf("dpfs_uring starting up!\n");
-    printf("Mirroring %s\n", rp);
+    for (int i = 0; i < ndirs; i++)
+        printf("Mirroring %s as backend %s\n", dirs[i].source, dirs[i].name);
 
-    fuser_main(rp, metadata_timeout.u.d, directio_mode.u.i, conf_path, cq_polling.u.b, cq_polling_nthreads.u.i, false);
+    fuser_main(dirs, ndirs, metadata_timeout.u.d, directio_mode.u.i, dir_cache.ok ? dir_cache.u.i : 0,
+            forget_interval.ok ? forget_interval.u.i : 0, conf_path, cq_polling.u.b, cq_polling_nthreads.u.i,
+            run_to_completion.ok && run_to_completion.u.b,
+            fixed_files.ok ? fixed_files.u.i : 4096,
+            registered_buffers.ok ? registered_buffers.u.i : 0,
+            registered_buffer_size.ok ? registered_buffer_size.u.i : 1024 * 1024,
+            submit_batch.ok ? submit_batch.u.i : 32, submit_deadline.ok ? submit_deadline.u.i : 50,
+            sq_polling.ok && sq_polling.u.b, sq_thread_cpu.ok ? sq_thread_cpu.u.i : -1,
+            sq_thread_idle.ok ? sq_thread_idle.u.i : 2000,
+            cb_pool_shrink.ok ? cb_pool_shrink.u.i : 0,
+            block_cache.ok ? (size_t) block_cache.u.i << 20 : 0,
+            block_cache_extent.ok ? (size_t) block_cache_extent.u.i << 10 : 64 * 1024);
 }
@@ -30,7 +30,9 @@
 #include <unistd.h>
 #include <sys/statvfs.h>
 #include <sys/file.h>
+#include <sys/sysmacros.h>
 #include <string.h>
+#include <time.h>
 #include "dpfs_fuse.h"
 #include "config.h"
 #include "debug.h"
@@ -43,7 +45,11 @@
 // Is this ugly? Yeah sure, but it does help reduce the redudancy and bug proneness of this all.
 #define CB_DATA(cb_func) \
     size_t thread_id = dpfs_hal_thread_id(); \
-    struct fuser_cb_data *cb_data = mpool_alloc(f->cb_data_pools[thread_id]); \
+    struct fuser_cb_data *cb_data = fuser_cb_data_get(f, thread_id); \
+    if (!cb_data) { \
+        out_hdr->error = -ENOMEM; \
+        return 0; \
+    } \
     cb_data->thread_id = thread_id; \
     cb_data->cb = cb_func; \
     cb_data->f = f; \
@@ -51,8 +57,35 @@
     cb_data->completion_context = completion_context; \
     cb_data->in_hdr = in_hdr; \
     cb_data->out_hdr = out_hdr; \
+    cb_data->unique = in_hdr->unique; \
+    cb_data->device_id = device_id; \
+    fuser_inflight_add(f, cb_data); \
     do {} while (0)
 
+// For a cb_data of CB_DATA that never made it into the ring
+static void fuser_cb_data_abort(struct fuser *f, struct fuser_cb_data *cb_data)
+{
+    fuser_inflight_del(f, cb_data);
+    fuser_cb_data_put(f, cb_data);
+}
+
+// After the data of the file changed other than by a WRITE, so that the extents that are
+// cached or being read in are dropped
+static void fuser_block_cache_invalidate(struct fuser *f, struct inode *i)
+{
+    if (f->block_cache)
+        block_cache_invalidate(f->block_cache, i->src_dev, i->src_ino);
+}
+
+// The cache is keyed by inode number, which the backend hands out again once the last link
+// of a file is gone. So the extents of a new inode are dropped, they are of a deleted file
+// (maybe of another tenant)
+static void fuser_block_cache_new_inode(struct fuser *f, struct fuse_entry_param *e)
+{
+    if (f->block_cache)
+        block_cache_invalidate(f->block_cache, e->attr.st_dev, e->attr.st_ino);
+}
+
 static void fuser_mirror_generic_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
 {
     if (cqe->res < 0) {
@@ -72,7 +105,7 @@ static void fuser_mirror_generic_cb(struct fuser_cb_data *cb_data, struct io_uri
 static void forget_one(struct fuser *f, fuse_ino_t ino, uint64_t n)
 {
     struct inode *i = ino_to_inodeptr(f, ino);
-    pthread_mutex_lock(&i->m);
+    inode_lock(i);
 
     if (n > i->nlookup) {
         fprintf(stderr, "INTERNAL ERROR: Negative lookup count for inode %ld\n", i->src_ino);
@@ -89,18 +122,17 @@ static void forget_one(struct fuser *f, fuse_ino_t ino, uint64_t n)
         printf("DEBUG: forget: cleaning up inode %ld\n", i->src_ino);
 #endif
 
-        pthread_mutex_lock(&f->m);
-        pthread_mutex_unlock(&i->m);
-        inode_table_erase(f->inodes, i->src_ino);
-        pthread_mutex_unlock(&f->m);
+        dev_t dev = i->src_dev;
+        ino_t ino = i->src_ino;
+        inode_unlock(i);
+        if (inode_table_remove(f->inodes, i, dev, ino))
+            inode_destroy(f->inodes, i);
     } else {
 #ifdef DEBUG_ENABLED
         printf("DEBUG: forget: inode %ld lookup count now %ld\n", i->src_ino, i->nlookup);
 #endif
+        inode_unlock(i);
     }
-
-    if (i->nlookup)
-        pthread_mutex_unlock(&i->m);
 }
 
 int fuser_mirror_init(struct fuse_session *se, void *user_data,
@@ -189,7 +221,7 @@ int fuser_mirror_getattr(struct fuse_session *se, void *user_data,
 
     int fd;
     if (in_getattr->getattr_flags & FUSE_GETATTR_FH) {
-        fd = in_getattr->fh;
+        fd = FUSER_FH_FD(in_getattr->fh);
     } else {
         struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
         fd = i->fd;
@@ -199,20 +231,17 @@ int fuser_mirror_getattr(struct fuse_session *se, void *user_data,
     CB_DATA(fuser_mirror_getattr_cb);
     cb_data->getattr.out_attr = out_attr;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
     io_uring_prep_statx(sqe, fd, "", AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_BASIC_STATS, &cb_data->getattr.s);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 #else
@@ -228,37 +257,91 @@ int fuser_mirror_getattr(struct fuse_session *se, void *user_data,
 #endif
 }
 
-static int do_lookup(struct fuser *f, fuse_ino_t parent, const char *name,
-                     struct fuse_entry_param *e) {
-    memset(e, 0, sizeof(*e));
-    e->attr_timeout = f->timeout;
-    e->entry_timeout = f->timeout;
+#ifdef DPFS_FUSE_STATX
+#ifndef IORING_METADATA_DISABLED
+static void fuser_mirror_statx_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
+{
+    if (cqe->res < 0) {
+        cb_data->out_hdr->error = cqe->res;
+#ifdef DEBUG_ENABLED
+        fprintf(stderr, "FUSE OP(%d) request ERROR returned by io_uring=%d, %s\n", cb_data->in_hdr->opcode,
+            cb_data->out_hdr->error, strerror(-cb_data->out_hdr->error));
+#endif
+        dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
+        return;
+    }
 
-    int newfd = openat(ino_to_fd(f, parent), name, O_PATH | O_NOFOLLOW);
-    if (newfd == -1)
-        return errno;
+    fuse_ll_reply_statx(cb_data->se, cb_data->out_hdr, cb_data->statx.out_statx, &cb_data->statx.s, cb_data->f->timeout);
+    dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
+}
+#endif
 
-    int res = fstatat(newfd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+// Like getattr, but the statx goes to the host as is, with whatever else the host asked for
+int fuser_mirror_statx(struct fuse_session *se, void *user_data,
+    struct fuse_in_header *in_hdr, struct fuse_statx_in *in_statx,
+    struct fuse_out_header *out_hdr, struct fuse_statx_out *out_statx,
+    void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+
+    int fd;
+    if (in_statx->getattr_flags & FUSE_GETATTR_FH) {
+        fd = FUSER_FH_FD(in_statx->fh);
+    } else {
+        struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+        fd = i->fd;
+    }
+    unsigned int mask = STATX_BASIC_STATS | in_statx->sx_mask;
+    // The host may ask to (not) sync the attributes with AT_STATX_*
+    int flags = AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | (in_statx->sx_flags & AT_STATX_SYNC_TYPE);
+
+#ifndef IORING_METADATA_DISABLED
+    CB_DATA(fuser_mirror_statx_cb);
+    cb_data->statx.out_statx = out_statx;
+
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
+    if (!sqe) {
+        fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
+    io_uring_prep_statx(sqe, fd, "", flags, mask, &cb_data->statx.s);
+    io_uring_sqe_set_data(sqe, cb_data);
+
+    fuser_submit(f, thread_id);
+
+    return EWOULDBLOCK; // We move async
+#else
+    struct statx s;
+    int res = statx(fd, "", flags, mask, &s);
     if (res == -1) {
-        int saveerr = errno;
-        close(newfd);
-#ifdef DEBUG_ENABLED
-        printf("DEBUG: lookup(): fstatat failed\n");
-#endif
-        return saveerr;
+        out_hdr->error = -errno;
+        return 0;
     }
 
+    return fuse_ll_reply_statx(se, out_hdr, out_statx, &s, f->timeout);
+#endif
+}
+#endif
+
+// Adds a lookup to the inode of newfd, whose attributes are in e->attr. Takes over newfd.
+// Thread-safe, also called by the cq threads
+static int lookup_insert(struct fuser *f, int newfd, struct fuse_entry_param *e) {
     if (e->attr.st_dev != f->src_dev) {
         printf("WARNING: Mountpoints in the source directory tree will be hidden.\n");
+        close(newfd);
         return ENOTSUP;
     } else if (e->attr.st_ino == FUSE_ROOT_ID) {
         printf("ERROR: Source directory tree must not include inode %d\n", FUSE_ROOT_ID);
+        close(newfd);
         return EIO;
     }
 
-    pthread_mutex_lock(&f->m);
-    struct inode *i = inode_table_getsert(f->inodes, e->attr.st_ino);
+    // Returns with i locked, a concurrent FORGET can't remove it before we took our lookup
+    struct inode *i = inode_table_getsert(f->inodes, e->attr.st_dev, e->attr.st_ino);
     if (i == NULL) {
+        close(newfd);
         return ENOMEM;
     }
     e->ino = (fuse_ino_t) i;
@@ -272,68 +355,176 @@ static int do_lookup(struct fuser *f, fuse_ino_t parent, const char *name,
     /* fallthrough to new inode but keep existing inode.nlookup */
     }
 
-    if (i->fd > 0) { // found existing inode
-        pthread_mutex_unlock(&f->m);
+    i->nlookup++;
 #ifdef DEBUG_ENABLED
-        printf("DEBUG: lookup(): inode %ld (userspace) already known; fd = %d\n", e->attr.st_ino, i->fd);
+    printf("DEBUG:%s:%d inode %ld count %ld\n", __func__, __LINE__, i->src_ino, i->nlookup);
 #endif
-        pthread_mutex_lock(&i->m);
-
-        i->nlookup++;
+    if (i->fd > 0) { // found existing inode
 #ifdef DEBUG_ENABLED
-        printf("DEBUG:%s:%d inode %ld count %ld\n", __func__, __LINE__, i->src_ino, i->nlookup);
+        printf("DEBUG: lookup(): inode %ld (userspace) already known; fd = %d\n", e->attr.st_ino, i->fd);
 #endif
-
+        inode_unlock(i);
         close(newfd);
-        pthread_mutex_unlock(&i->m);
     } else { // no existing inode
-        /* This is just here to make Helgrind happy. It violates the
-           lock ordering requirement (inode.m must be acquired before
-           fs.mutex), but this is of no consequence because at this
-           point no other thread has access to the inode mutex */
-        pthread_mutex_lock(&i->m);
-        i->src_ino = e->attr.st_ino;
-        i->src_dev = e->attr.st_dev;
-
-        i->nlookup++;
+        i->fd = newfd;
+        inode_unlock(i);
+
 #ifdef DEBUG_ENABLED
-        printf("DEBUG:%s:%d inode %ld count %ld\n", __func__, __LINE__, i->src_ino, i->nlookup);
+        printf("DEBUG: lookup(): created userspace inode %ld; fd = %d\n", e->attr.st_ino, newfd);
 #endif
+    }
 
-        i->fd = newfd;
-        pthread_mutex_unlock(&f->m);
-        pthread_mutex_unlock(&i->m);
+    return 0;
+}
+
+static int do_lookup(struct fuser *f, fuse_ino_t parent, const char *name,
+                     struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(*e));
+    e->attr_timeout = f->timeout;
+    e->entry_timeout = f->timeout;
 
+    int newfd = openat(ino_to_fd(f, parent), name, O_PATH | O_NOFOLLOW);
+    if (newfd == -1)
+        return errno;
+
+    int res = fstatat(newfd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    if (res == -1) {
+        int saveerr = errno;
+        close(newfd);
 #ifdef DEBUG_ENABLED
-        printf("DEBUG: lookup(): created userspace inode %ld; fd = %d\n", e->attr.st_ino, i->fd);
+        printf("DEBUG: lookup(): fstatat failed\n");
 #endif
+        return saveerr;
     }
 
-    return 0;
+    return lookup_insert(f, newfd, e);
 }
 
-int fuser_mirror_lookup(struct fuse_session *se, void *user_data,
-                        struct fuse_in_header *in_hdr, const char *const in_name,
+// Replies to a LOOKUP with the result of do_lookup() or its asynchronous counterpart
+static int lookup_reply(struct fuser *f, struct fuse_session *se, int err,
                         struct fuse_out_header *out_hdr, struct fuse_entry_out *out_entry,
-                        void *completion_context, uint16_t device_id)
+                        struct fuse_entry_param *e)
 {
-    struct fuser *f = user_data;
-
-    struct fuse_entry_param e;
-    int err = do_lookup(f, in_hdr->nodeid, in_name, &e);
     if (err == ENOENT) {
-        e.attr_timeout = f->timeout;
-        e.entry_timeout = f->timeout;
-        e.ino = e.attr.st_ino = 0;
-        return fuse_ll_reply_entry(se, out_hdr, out_entry, &e);
+        e->attr_timeout = f->timeout;
+        e->entry_timeout = f->timeout;
+        e->ino = e->attr.st_ino = 0;
+        return fuse_ll_reply_entry(se, out_hdr, out_entry, e);
     } else if (err) {
         if (err == ENFILE || err == EMFILE)
             fprintf(stderr, "ERROR: Reached maximum number of file descriptors.\n");
         out_hdr->error = -err;
         return 0;
     } else {
-        return fuse_ll_reply_entry(se, out_hdr, out_entry, &e);
+        return fuse_ll_reply_entry(se, out_hdr, out_entry, e);
+    }
+}
+
+#ifndef IORING_METADATA_DISABLED
+static void statx_to_stat(const struct statx *sx, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid = sx->stx_uid;
+    st->st_gid = sx->stx_gid;
+    st->st_rdev = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_size = sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks = sx->stx_blocks;
+    st->st_atim.tv_sec = sx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = sx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+// Finishes a lookup from the results of an openat and a statx of the same name.
+// Takes over newfd, which is the error of the openat if negative
+static int lookup_complete(struct fuser *f, int newfd, int statx_res, struct statx *sx,
+                           struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->attr_timeout = f->timeout;
+    e->entry_timeout = f->timeout;
+
+    if (newfd < 0) {
+        // The statx got cancelled because the openat failed
+        return -newfd;
+    } else if (statx_res < 0) {
+        close(newfd);
+        return -statx_res;
+    }
+
+    statx_to_stat(sx, &e->attr);
+    // The openat and the statx resolve the name separately, if it got replaced in between
+    // then the fd of a new inode must win, the host would otherwise operate on another file.
+    // Known inodes keep their own fd, so for them the statx is all we need
+    struct inode *known = inode_table_get(f->inodes, e->attr.st_dev, e->attr.st_ino);
+    bool is_known = false;
+    if (known) {
+        is_known = known->fd > 0;
+        inode_unlock(known);
+    }
+    struct stat fdst;
+    if (!is_known && fstatat(newfd, "", &fdst, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == 0
+            && fdst.st_ino != e->attr.st_ino)
+        e->attr = fdst;
+    return lookup_insert(f, newfd, e);
+}
+
+// The openat of the chain already completed, its result is in link_res
+static void fuser_mirror_lookup_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
+{
+    struct fuse_entry_param e;
+    int err = lookup_complete(cb_data->f, cb_data->link_res, cqe->res, &cb_data->lookup.s, &e);
+
+    lookup_reply(cb_data->f, cb_data->se, err, cb_data->out_hdr, cb_data->lookup.out_entry, &e);
+    dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
+}
+#endif
+
+int fuser_mirror_lookup(struct fuse_session *se, void *user_data,
+                        struct fuse_in_header *in_hdr, const char *const in_name,
+                        struct fuse_out_header *out_hdr, struct fuse_entry_out *out_entry,
+                        void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+
+#ifndef IORING_METADATA_DISABLED
+    // A slow backing file system (cold dentries, NFS) must not hold up the other requests
+    // of this thread, so the openat and statx are a linked chain
+    int parent_fd = ino_to_fd(f, in_hdr->nodeid);
+    int ret = fuser_sq_reserve(f, dpfs_hal_thread_id(), 2);
+    if (ret < 0) {
+        out_hdr->error = ret;
+        return 0;
     }
+    CB_DATA(fuser_mirror_lookup_cb);
+    cb_data->lookup.out_entry = out_entry;
+    cb_data->link_res = -ECANCELED;
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    io_uring_prep_openat(sqe, parent_fd, in_name, O_PATH | O_NOFOLLOW, 0);
+    io_uring_sqe_set_data(sqe, fuser_cb_data_link(cb_data));
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    io_uring_prep_statx(sqe, parent_fd, in_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+            STATX_BASIC_STATS, &cb_data->lookup.s);
+    io_uring_sqe_set_data(sqe, cb_data);
+
+    fuser_submit(f, thread_id);
+
+    return EWOULDBLOCK; // We move async
+#else
+    struct fuse_entry_param e;
+    int err = do_lookup(f, in_hdr->nodeid, in_name, &e);
+    return lookup_reply(f, se, err, out_hdr, out_entry, &e);
+#endif
 }
 
 int fuser_mirror_setattr(struct fuse_session *se, void *user_data,
@@ -349,7 +540,7 @@ int fuser_mirror_setattr(struct fuse_session *se, void *user_data,
 
     if (valid & FUSE_SET_ATTR_MODE) {
         if (fi) {
-            res = fchmod(fi->fh, s->st_mode);
+            res = fchmod(FUSER_FH_FD(fi->fh), s->st_mode);
         } else {
             char procname[128];
             sprintf(procname, "/proc/%i/fd/%i", getpid(), ifd);
@@ -368,7 +559,7 @@ int fuser_mirror_setattr(struct fuse_session *se, void *user_data,
     }
     if (valid & FUSE_SET_ATTR_SIZE) {
         if (fi) {
-            res = ftruncate(fi->fh, s->st_size);
+            res = ftruncate(FUSER_FH_FD(fi->fh), s->st_size);
         } else {
             char procname[128];
             sprintf(procname, "/proc/%i/fd/%i", getpid(), ifd);
@@ -376,6 +567,7 @@ int fuser_mirror_setattr(struct fuse_session *se, void *user_data,
         }
         if (res == -1)
             goto out_err;
+        fuser_block_cache_invalidate(f, i);
     }
     if (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
         struct timespec tv[2];
@@ -396,7 +588,7 @@ int fuser_mirror_setattr(struct fuse_session *se, void *user_data,
             tv[1] = s->st_mtim;
 
         if (fi)
-            res = futimens(fi->fh, tv);
+            res = futimens(FUSER_FH_FD(fi->fh), tv);
         else {
             char procname[128];
             sprintf(procname, "/proc/%i/fd/%i", getpid(), ifd);
@@ -430,16 +622,16 @@ int fuser_mirror_opendir(struct fuse_session *se, void *user_data,
         out_hdr->error = -EINVAL;
         return 0;
     }
-    struct directory *d = calloc(1, sizeof(struct directory));
+    struct directory *d = directory_new(f);
     if (!d) {
-        out_hdr->error = -errno;
+        out_hdr->error = -ENOMEM;
         return 0;
     }
 
     // Make Helgrind happy - it can't know that there's an implicit
     // synchronization due to the fact that other threads cannot
     // access d until we've called fuse_reply_*.
-    //pthread_mutex_lock(&i->m);
+    //inode_lock(i);
 
     int fd = openat(i->fd, ".", O_RDONLY);
     if (fd == -1)
@@ -464,7 +656,7 @@ int fuser_mirror_opendir(struct fuse_session *se, void *user_data,
 
 out_errno:
     out_hdr->error = -errno;
-    directory_destroy(d);
+    directory_destroy(f, d);
     if (errno == ENFILE || errno == EMFILE)
         fprintf(stderr, "ERROR: Reached maximum number of file descriptors.");
     return 0;
@@ -476,8 +668,15 @@ int fuser_mirror_releasedir(struct fuse_session *se, void *user_data,
                     struct fuse_out_header *out_hdr,
                     void *completion_context, uint16_t device_id)
 {
+    struct fuser *f = user_data;
     struct directory *d = (struct directory *) in_release->fh;
-    directory_destroy(d);
+    if (d->snap) {
+        struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+        inode_lock(i);
+        dir_snapshot_put(d->snap);
+        inode_unlock(i);
+    }
+    directory_destroy(f, d);
     return 0;
 }
 
@@ -486,6 +685,361 @@ static bool is_dot_or_dotdot(const char *name) {
            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
 }
 
+static uint64_t dir_cache_now_msec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Drops the snapshot of the directory, the handles that are listing it keep their reference
+static void dir_cache_invalidate(struct fuser *f, fuse_ino_t nodeid)
+{
+    if (!f->dir_cache_max_entries)
+        return;
+    struct inode *i = ino_to_inodeptr(f, nodeid);
+    if (!i)
+        return;
+
+    inode_lock(i);
+    if (i->snap) {
+        dir_snapshot_put(i->snap);
+        i->snap = NULL;
+    }
+    inode_unlock(i);
+}
+
+// Reads the whole directory, with the attributes of every entry if attrs is set.
+// Returns NULL if the directory can't be cached, the caller then falls back to readdir().
+// Must hold the mutex of i.
+static struct dir_snapshot *dir_snapshot_take(struct fuser *f, struct inode *i, bool attrs)
+{
+    int fd = openat(i->fd, ".", O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return NULL;
+    DIR *dp = fdopendir(fd);
+    if (!dp) {
+        close(fd);
+        return NULL;
+    }
+
+    struct dir_snapshot *s = calloc(1, sizeof(*s));
+    if (!s)
+        goto out_closedir;
+    size_t cap = 0, names_len = 0, names_cap = 0;
+
+    while (1) {
+        errno = 0;
+        struct dirent *entry = readdir(dp);
+        if (!entry) {
+            if (errno)
+                goto out_free;
+            break; // End of stream
+        }
+        if (is_dot_or_dotdot(entry->d_name))
+            continue;
+        if (s->n == f->dir_cache_max_entries)
+            goto out_free;
+
+        if (s->n == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct fuse_direntry *ents = realloc(s->ents, cap * sizeof(*ents));
+            if (!ents)
+                goto out_free;
+            s->ents = ents;
+        }
+
+        struct fuse_direntry *ent = &s->ents[s->n];
+        ent->ino = entry->d_ino;
+        ent->mode = entry->d_type << 12;
+        if (attrs) {
+            struct stat st;
+            if (fstatat(dirfd(dp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                if (errno == ENOENT)
+                    continue; // Removed since the readdir()
+                goto out_free;
+            }
+            // Mountpoints are hidden by do_lookup(), let the slow path deal with them
+            if (st.st_dev != f->src_dev)
+                goto out_free;
+            ent->ino = st.st_ino;
+            ent->mode = st.st_mode & S_IFMT;
+        }
+
+        ent->namelen = strlen(entry->d_name);
+        if (names_len + ent->namelen + 1 > names_cap) {
+            names_cap = names_cap ? names_cap * 2 : 4096;
+            while (names_len + ent->namelen + 1 > names_cap)
+                names_cap *= 2;
+            char *names = realloc(s->names, names_cap);
+            if (!names)
+                goto out_free;
+            s->names = names;
+        }
+        memcpy(s->names + names_len, entry->d_name, ent->namelen + 1);
+        // An offset into names until the arena stops moving
+        ent->name = (const char *) (uintptr_t) names_len;
+        names_len += ent->namelen + 1;
+
+        s->n++;
+        ent->off = s->n;
+    }
+
+    if (__atomic_add_fetch(&f->dir_cache_nents, s->n, __ATOMIC_RELAXED) > f->dir_cache_max_entries) {
+        __atomic_sub_fetch(&f->dir_cache_nents, s->n, __ATOMIC_RELAXED);
+        goto out_free;
+    }
+    for (size_t j = 0; j < s->n; j++)
+        s->ents[j].name = s->names + (uintptr_t) s->ents[j].name;
+
+    closedir(dp);
+    s->f = f;
+    s->attrs = attrs;
+    s->refs = 1;
+    s->expires_msec = dir_cache_now_msec() + (uint64_t) (f->timeout * 1000);
+    return s;
+
+out_free:
+    free(s->ents);
+    free(s->names);
+    free(s);
+out_closedir:
+    closedir(dp);
+    return NULL;
+}
+
+// Adds a reference to the inode if the host already knows it, without a lookup
+static struct inode *dir_cache_known_inode(struct fuser *f, ino_t src_ino)
+{
+    struct inode *i = inode_table_get(f->inodes, f->src_dev, src_ino);
+    if (!i)
+        return NULL;
+    if (i->fd <= 0) {
+        inode_unlock(i);
+        return NULL;
+    }
+    i->nlookup++;
+    inode_unlock(i);
+    return i;
+}
+
+// Lists the snapshot of the handle from off, with the same error semantics as readdir()
+static int dir_snapshot_readdir(struct fuser *f, struct dir_snapshot *s, fuse_ino_t nodeid,
+                                off_t off, bool plus, struct iov *read_iov, uint32_t *rem)
+{
+    if (off < 0 || (size_t) off >= s->n)
+        return 0;
+
+    if (!plus) {
+        size_t written;
+        fuse_add_direntries(read_iov, s->ents + off, s->n - off, &written);
+        *rem -= written;
+        return 0;
+    }
+
+    for (size_t j = off; j < s->n; j++) {
+        const struct fuse_direntry *ent = &s->ents[j];
+        struct fuse_entry_param e;
+        struct inode *i = s->attrs ? dir_cache_known_inode(f, ent->ino) : NULL;
+        memset(&e, 0, sizeof(e));
+        // The attributes of the snapshot are as old as the snapshot, the file may have been
+        // written or chmod-ed since (which doesn't change the directory). The host only caches
+        // what we reply for f->timeout, so they have to be current
+        if (i && fstat(i->fd, &e.attr) == -1) {
+            forget_one(f, (fuse_ino_t) i, 1);
+            i = NULL;
+        }
+        if (i) {
+            e.attr_timeout = f->timeout;
+            e.entry_timeout = f->timeout;
+            e.ino = (fuse_ino_t) i;
+            e.generation = i->generation;
+        } else {
+            int err = do_lookup(f, nodeid, ent->name, &e);
+            if (err == ENOENT)
+                continue; // Removed since the snapshot was taken
+            if (err)
+                return err;
+        }
+
+        size_t written = fuse_add_direntry_plus_len(read_iov, ent->name, ent->namelen, &e, ent->off);
+        if (written == 0) {
+            forget_one(f, e.ino, 1);
+            break;
+        }
+        *rem -= written;
+    }
+    return 0;
+}
+
+// Puts the stream of the handle at off, the offset of the previous entry the host got.
+// The carried over entry of an asynchronous READDIRPLUS is only kept if keep_carry is set,
+// otherwise the stream goes back to it.
+static void directory_seek(struct directory *d, off_t off, bool keep_carry)
+{
+    bool carry = false;
+#ifndef IORING_METADATA_DISABLED
+    carry = d->batch && d->batch->carry;
+#endif
+    if (off == d->offset && (!carry || keep_carry))
+        return;
+#ifdef DEBUG_ENABLED
+    printf("DEBUG: readdir(): seeking to %ld\n", off);
+#endif
+    seekdir(d->dp, off);
+    d->offset = off;
+#ifndef IORING_METADATA_DISABLED
+    if (d->batch)
+        d->batch->carry = false;
+#endif
+}
+
+#ifndef IORING_METADATA_DISABLED
+// All lookups of the page completed
+static void fuser_mirror_readdirplus_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
+{
+    struct fuser *f = cb_data->f;
+    struct readdir_batch *b = cb_data->readdir.batch;
+    uint32_t size = cb_data->readdir.size;
+    uint32_t rem = size;
+    int err = 0;
+
+    size_t j = 0;
+    while (j < b->n) {
+        struct readdir_ent *ent = &b->ents[j++];
+        struct fuse_entry_param e;
+        err = lookup_complete(f, ent->open.res, ent->stat.res, &ent->s, &e);
+        if (err == ENOENT) {
+            err = 0;
+            continue; // Removed since it was read from the directory
+        }
+        if (err)
+            break;
+
+        size_t written = fuse_add_direntry_plus_len(&cb_data->readdir.read_iov, ent->name,
+                ent->namelen, &e, ent->off);
+        if (written == 0) {
+            forget_one(f, e.ino, 1);
+            break;
+        }
+        rem -= written;
+    }
+    // The entries after an error don't make it into the reply, the host continues at the
+    // offset of the last entry it got, so they are read again
+    for (; j < b->n; j++) {
+        if (b->ents[j].open.res >= 0)
+            close(b->ents[j].open.res);
+    }
+
+    if (err && rem == size) {
+        if (err == ENFILE || err == EMFILE)
+            fprintf(stderr, "%s: ERROR: Reached maximum number of file descriptors.\n", __func__);
+        cb_data->out_hdr->error = -err;
+    } else {
+        cb_data->out_hdr->len += size - rem;
+    }
+    dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
+}
+
+// Reads a page worth of entries from the stream of the handle and submits an openat and a
+// statx for every one of them at once, instead of two syscalls per entry on this thread.
+// The directory stream itself is read with getdents64 in bulk by readdir().
+// Returns EWOULDBLOCK if the lookups were submitted, 0 at the end of the stream or an error.
+// Must hold the mutex of the inode of the directory
+static int readdirplus_submit(struct fuser *f, struct fuse_session *se,
+                              struct fuse_in_header *in_hdr, struct fuse_read_in *in_read,
+                              struct directory *d, struct fuse_out_header *out_hdr,
+                              struct iov read_iov, void *completion_context, uint16_t device_id)
+{
+    if (!d->batch) {
+        d->batch = calloc(1, sizeof(*d->batch));
+        if (!d->batch)
+            return ENOMEM;
+    }
+    struct readdir_batch *b = d->batch;
+    struct io_uring *ring = &f->rings[dpfs_hal_thread_id()];
+
+    // At least one entry, batched SQEs are submitted to make room
+    int ret = fuser_sq_reserve(f, dpfs_hal_thread_id(), 2);
+    if (ret < 0)
+        // EWOULDBLOCK is taken, it means the lookups were submitted
+        return ret == -EWOULDBLOCK ? EBUSY : -ret;
+    size_t max = io_uring_sq_space_left(ring) / 2;
+    if (max > FUSER_READDIRPLUS_BATCH)
+        max = FUSER_READDIRPLUS_BATCH;
+
+    uint32_t rem = in_read->size;
+    b->n = 0;
+    while (b->n < max) {
+        struct readdir_ent *ent = &b->ents[b->n];
+        if (b->carry) {
+            b->carry = false;
+            ent->off = b->carry_off;
+            ent->namelen = strlen(b->carry_name);
+            memcpy(ent->name, b->carry_name, ent->namelen + 1);
+        } else {
+            errno = 0;
+            struct dirent *entry = readdir(d->dp);
+            if (!entry) {
+                if (errno && b->n == 0)
+                    return errno;
+                break; // End of stream, or the error comes with the next page
+            }
+            if (is_dot_or_dotdot(entry->d_name)) {
+                d->offset = entry->d_off;
+                continue;
+            }
+            ent->off = entry->d_off;
+            ent->namelen = strlen(entry->d_name);
+            memcpy(ent->name, entry->d_name, ent->namelen + 1);
+        }
+
+        size_t entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + ent->namelen);
+        if (entlen > rem) {
+            // For the next page, unless the host goes elsewhere
+            b->carry = true;
+            b->carry_off = ent->off;
+            memcpy(b->carry_name, ent->name, ent->namelen + 1);
+            break;
+        }
+        rem -= entlen;
+        d->offset = ent->off;
+        b->n++;
+    }
+    if (b->n == 0)
+        return 0;
+
+    CB_DATA(fuser_mirror_readdirplus_cb);
+    cb_data->readdir.batch = b;
+    cb_data->readdir.read_iov = read_iov;
+    cb_data->readdir.size = in_read->size;
+    cb_data->parts = b->n * 2;
+
+    int dirfd = ino_to_fd(f, in_hdr->nodeid);
+    for (size_t j = 0; j < b->n; j++) {
+        struct readdir_ent *ent = &b->ents[j];
+        ent->open.cb_data = cb_data;
+        ent->open.res = -ECANCELED;
+        ent->stat.cb_data = cb_data;
+        ent->stat.res = -ECANCELED;
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+        io_uring_prep_openat(sqe, dirfd, ent->name, O_PATH | O_NOFOLLOW, 0);
+        io_uring_sqe_set_data(sqe, fuser_cb_data_part(&ent->open));
+        sqe->flags |= IOSQE_IO_LINK;
+
+        sqe = io_uring_get_sqe(ring);
+        io_uring_prep_statx(sqe, dirfd, ent->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                STATX_BASIC_STATS, &ent->s);
+        io_uring_sqe_set_data(sqe, fuser_cb_data_part(&ent->stat));
+    }
+
+    // The whole page in one go
+    fuser_submit(f, thread_id);
+    return EWOULDBLOCK;
+}
+#endif
+
 int fuser_mirror_readdir(struct fuse_session *se, void *user_data,
                        struct fuse_in_header *in_hdr, struct fuse_read_in *in_read, bool plus,
                        struct fuse_out_header *out_hdr, struct iov read_iov,
@@ -496,7 +1050,7 @@ int fuser_mirror_readdir(struct fuse_session *se, void *user_data,
     const off_t off = in_read->offset;
     struct directory *d = (struct directory *) in_read->fh;
     struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
-    pthread_mutex_lock(&i->m);
+    inode_lock(i);
 
     uint32_t rem = in_read->size; // remaining bytes to read from dir (user requested)
     int err = 0, count = 0; // count = dirents read
@@ -505,14 +1059,46 @@ int fuser_mirror_readdir(struct fuse_session *se, void *user_data,
     printf("DEBUG: readdir(): started with offset %ld\n", off);
 #endif
 
-    if (off != d->offset) {
-#ifdef DEBUG_ENABLED
-        printf("DEBUG: readdir(): seeking to %ld\n", off);
-#endif
-        seekdir(d->dp, off);
-        d->offset = off;
+    if (f->dir_cache_max_entries && f->timeout) {
+        // A new listing, start it on the current snapshot (if it is still usable)
+        if (off == 0) {
+            if (d->snap) {
+                dir_snapshot_put(d->snap);
+                d->snap = NULL;
+            }
+            if (i->snap && (i->snap->expires_msec <= dir_cache_now_msec() || (plus && !i->snap->attrs))) {
+                dir_snapshot_put(i->snap);
+                i->snap = NULL;
+            }
+            if (!i->snap)
+                i->snap = dir_snapshot_take(f, i, plus);
+            if (i->snap) {
+                i->snap->refs++;
+                d->snap = i->snap;
+            }
+        }
+        if (d->snap) {
+            err = dir_snapshot_readdir(f, d->snap, in_hdr->nodeid, off, plus, &read_iov, &rem);
+            goto error;
+        }
     }
 
+    directory_seek(d, off, plus);
+
+#ifndef IORING_METADATA_DISABLED
+    if (plus) {
+        int ret = readdirplus_submit(f, se, in_hdr, in_read, d, out_hdr, read_iov, completion_context,
+                device_id);
+        // Only an empty page or an error is replied to right away
+        if (ret == EWOULDBLOCK) {
+            inode_unlock(i);
+            return EWOULDBLOCK;
+        }
+        err = ret;
+        goto error;
+    }
+#endif
+
     while (1) {
         errno = 0;
         struct dirent *entry = readdir(d->dp);
@@ -568,7 +1154,7 @@ int fuser_mirror_readdir(struct fuse_session *se, void *user_data,
     err = 0;
 error:
 
-    pthread_mutex_unlock(&i->m);
+    inode_unlock(i);
     // If there's an error, we can only signal it if we haven't stored
     // any entries yet - otherwise we'd end up with wrong lookup
     // counts for the entries that are already in the buffer. So we
@@ -602,12 +1188,14 @@ void fuser_mirror_open_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cq
         return;
     }
 
-    pthread_mutex_lock(&cb_data->open.i->m);
+    if (cb_data->open.fi.flags & O_TRUNC)
+        fuser_block_cache_invalidate(cb_data->f, cb_data->open.i);
+    inode_lock(cb_data->open.i);
     cb_data->open.i->nopen++;
-    pthread_mutex_unlock(&cb_data->open.i->m);
+    inode_unlock(cb_data->open.i);
     cb_data->open.fi.keep_cache = (cb_data->f->timeout != 0);
     cb_data->open.fi.noflush = (cb_data->f->timeout == 0 && (cb_data->open.fi.flags & O_ACCMODE) == O_RDONLY);
-    cb_data->open.fi.fh = cqe->res;
+    cb_data->open.fi.fh = fuser_file_register(cb_data->f, cb_data->thread_id, cqe->res);
 
     fuse_ll_reply_open(cb_data->se, cb_data->out_hdr, cb_data->open.out_open, &cb_data->open.fi);
     dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
@@ -674,20 +1262,17 @@ int fuser_mirror_open(struct fuse_session *se, void *user_data,
     cb_data->open.fi = fi;
     cb_data->open.out_open = out_open;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
     io_uring_prep_openat(sqe, -1, buf, flags, 0);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK;
 #else
@@ -700,12 +1285,14 @@ int fuser_mirror_open(struct fuse_session *se, void *user_data,
         return 0;
     }
 
-    pthread_mutex_lock(&i->m);
+    if (fi.flags & O_TRUNC)
+        fuser_block_cache_invalidate(f, i);
+    inode_lock(i);
     i->nopen++;
-    pthread_mutex_unlock(&i->m);
+    inode_unlock(i);
     fi.keep_cache = (f->timeout != 0);
     fi.noflush = (f->timeout == 0 && (fi.flags & O_ACCMODE) == O_RDONLY);
-    fi.fh = fd;
+    fi.fh = fuser_file_register(f, dpfs_hal_thread_id(), fd);
 
     return fuse_ll_reply_open(se, out_hdr, out_open, &fi);
 #endif
@@ -724,48 +1311,47 @@ int fuser_mirror_release(struct fuse_session *se, void *user_data,
         return 0;
     }
 
-    pthread_mutex_lock(&i->m);
+    inode_lock(i);
     i->nopen--;
-    pthread_mutex_unlock(&i->m);
+    inode_unlock(i);
+    fuser_file_unregister(f, in_release->fh);
 
 #ifndef IORING_METADATA_DISABLED
     CB_DATA(fuser_mirror_generic_cb);
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
-    io_uring_prep_close(sqe, in_release->fh);
+    io_uring_prep_close(sqe, FUSER_FH_FD(in_release->fh));
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 #else
-    close(in_release->fh);
+    close(FUSER_FH_FD(in_release->fh));
 
     return 0;
 #endif
 }
 
 static int do_fsync(struct fuse_session *se, void *user_data,
-        struct fuse_in_header *in_hdr, int fd, unsigned fuse_flags,
+        struct fuse_in_header *in_hdr, uint64_t fh, unsigned fuse_flags,
         struct fuse_out_header *out_hdr,
-        void *completion_context)
+        void *completion_context, uint16_t device_id)
 {
     struct fuser *f = user_data;
 
     CB_DATA(fuser_mirror_generic_cb);
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -773,14 +1359,11 @@ static int do_fsync(struct fuse_session *se, void *user_data,
     // Currently these flags have the same values, compiler will figure it out for us
     if (fuse_flags & FUSE_FSYNC_FDATASYNC)
         flags |=  IORING_FSYNC_DATASYNC;
-    io_uring_prep_fsync(sqe, fd, flags);
+    io_uring_prep_fsync(sqe, FUSER_FH_FD(fh), flags);
+    fuser_sqe_set_file(sqe, thread_id, fh);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 }
@@ -790,7 +1373,7 @@ int fuser_mirror_fsync(struct fuse_session *se, void *user_data,
         struct fuse_out_header *out_hdr,
         void *completion_context, uint16_t device_id)
 {
-    return do_fsync(se, user_data, in_hdr, in_fsync->fh, in_fsync->fsync_flags, out_hdr, completion_context);
+    return do_fsync(se, user_data, in_hdr, in_fsync->fh, in_fsync->fsync_flags, out_hdr, completion_context, device_id);
 }
 
 int fuser_mirror_fsyncdir(struct fuse_session *se, void *user_data,
@@ -801,7 +1384,7 @@ int fuser_mirror_fsyncdir(struct fuse_session *se, void *user_data,
     struct directory *d = (struct directory *) in_fsync->fh;
     int fd = dirfd(d->dp);
 
-    return do_fsync(se, user_data, in_hdr, fd, in_fsync->fsync_flags, out_hdr, completion_context);
+    return do_fsync(se, user_data, in_hdr, fd, in_fsync->fsync_flags, out_hdr, completion_context, device_id);
 }
 
 #ifndef IORING_METADATA_DISABLED
@@ -832,9 +1415,12 @@ void fuser_mirror_create_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *
     }
 
     struct inode *i = ino_to_inodeptr(cb_data->f, e.ino);
-    pthread_mutex_lock(&i->m);
+    // Truncated, or a new file that got the inode number of a deleted one
+    fuser_block_cache_invalidate(cb_data->f, i);
+    inode_lock(i);
     i->nopen++;
-    pthread_mutex_unlock(&i->m);
+    inode_unlock(i);
+    cb_data->create.fi.fh = fuser_file_register(cb_data->f, cb_data->thread_id, cb_data->create.fi.fh);
 
     fuse_ll_reply_create(cb_data->se, cb_data->out_hdr, cb_data->create.out_entry,
             cb_data->create.out_open, &e, &cb_data->create.fi);
@@ -862,14 +1448,16 @@ int fuser_mirror_create(struct fuse_session *se, void *user_data,
         out_hdr->error = -EINVAL;
         return 0;
     }
+    dir_cache_invalidate(f, in_hdr->nodeid);
 
     cb_data->create.out_entry = out_entry;
     cb_data->create.out_open = out_open;
     cb_data->create.in_name = in_name;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -892,11 +1480,7 @@ int fuser_mirror_create(struct fuse_session *se, void *user_data,
                      flags, in_create.mode);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 }
@@ -918,6 +1502,7 @@ int fuser_mirror_create(struct fuse_session *se, void *user_data,
         out_hdr->error = -EINVAL;
         return 0;
     }
+    dir_cache_invalidate(f, in_hdr->nodeid);
 
     int fd = openat(ip->fd, in_name,
                      (fi.flags | O_CREAT) & ~O_NOFOLLOW, in_create.mode);
@@ -940,9 +1525,12 @@ int fuser_mirror_create(struct fuse_session *se, void *user_data,
     }
 
     struct inode *i = ino_to_inodeptr(f, e.ino);
-    pthread_mutex_lock(&i->m);
+    // Truncated, or a new file that got the inode number of a deleted one
+    fuser_block_cache_invalidate(f, i);
+    inode_lock(i);
     i->nopen++;
-    pthread_mutex_unlock(&i->m);
+    inode_unlock(i);
+    fi.fh = fuser_file_register(f, dpfs_hal_thread_id(), fd);
 
     return fuse_ll_reply_create(se, out_hdr, out_entry, out_open, &e, &fi);
 }
@@ -961,9 +1549,10 @@ int fuser_mirror_rmdir(struct fuse_session *se, void *user_data,
         out_hdr->error = -EINVAL;
         return 0;
     }
-    pthread_mutex_lock(&ip->m);
+    dir_cache_invalidate(f, in_hdr->nodeid);
+    inode_lock(ip);
     int res = unlinkat(ip->fd, in_name, AT_REMOVEDIR);
-    pthread_mutex_unlock(&ip->m);
+    inode_unlock(ip);
     if (res == -1)
         out_hdr->error = -errno;
     return 0;
@@ -977,7 +1566,10 @@ int fuser_mirror_forget(struct fuse_session *se, void *user_data,
 {
     struct fuser *f = user_data;
 
-    forget_one(f, in_hdr->nodeid, in_forget->nlookup);
+    if (f->forgets)
+        forget_log_add(f->forgets, dpfs_hal_thread_id(), in_hdr->nodeid, in_forget->nlookup);
+    else
+        forget_one(f, in_hdr->nodeid, in_forget->nlookup);
     return 0;
 }
 
@@ -988,12 +1580,54 @@ int fuser_mirror_batch_forget(struct fuse_session *se, void *user_data,
 {
     struct fuser *f = user_data;
 
+    if (f->forgets) {
+        uint16_t thread_id = dpfs_hal_thread_id();
+        for (int i = 0; i < in_batch_forget->count; i++)
+            forget_log_add(f->forgets, thread_id, in_forget_one[i].nodeid, in_forget_one[i].nlookup);
+        return 0;
+    }
+
     for (int i = 0; i < in_batch_forget->count; i++) {
         forget_one(f, in_forget_one[i].nodeid, in_forget_one[i].nlookup);
     }
     return 0;
 }
 
+void fuser_mirror_forget_apply(void *user_data, struct forget_rec *recs, size_t n)
+{
+    struct fuser *f = user_data;
+    struct inode *dead = NULL;
+
+    for (size_t r = 0; r < n; r++) {
+        struct inode *i = ino_to_inodeptr(f, recs[r].nodeid);
+        inode_lock(i);
+        if (recs[r].nlookup > i->nlookup) {
+            fprintf(stderr, "INTERNAL ERROR: Negative lookup count for inode %ld\n", i->src_ino);
+            exit(-1);
+        }
+        i->nlookup -= recs[r].nlookup;
+        if (i->nlookup) {
+            inode_unlock(i);
+            continue;
+        }
+
+        dev_t dev = i->src_dev;
+        ino_t ino = i->src_ino;
+        inode_unlock(i);
+        if (!inode_table_remove(f->inodes, i, dev, ino))
+            continue;
+        i->next = dead;
+        dead = i;
+    }
+
+    // The host doesn't know these anymore, close their fds without holding any lock
+    while (dead) {
+        struct inode *next = dead->next;
+        inode_destroy(f->inodes, dead);
+        dead = next;
+    }
+}
+
 
 int fuser_mirror_rename(struct fuse_session *se, void *user_data,
                    struct fuse_in_header *in_hdr, const char *const in_name,
@@ -1010,24 +1644,24 @@ int fuser_mirror_rename(struct fuse_session *se, void *user_data,
         out_hdr->error = -EINVAL;
         return 0;
     }
+    dir_cache_invalidate(f, in_hdr->nodeid);
+    if (in_new_parentdir != in_hdr->nodeid)
+        dir_cache_invalidate(f, in_new_parentdir);
 
 #ifndef IORING_METADATA_DISABLED
     CB_DATA(fuser_mirror_generic_cb);
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
     io_uring_prep_renameat(sqe, ip->fd, in_name, new_ip->fd, in_new_name, 0);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 #else
@@ -1039,9 +1673,48 @@ int fuser_mirror_rename(struct fuse_session *se, void *user_data,
 #endif
 }
 
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+// Copies len bytes of buf to the iovecs
+static void buf_to_iov(const char *buf, size_t len, const struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        size_t n = iov[i].iov_len < len ? iov[i].iov_len : len;
+        memcpy(iov[i].iov_base, buf, n);
+        buf += n;
+        len -= n;
+    }
+}
+
+// Copies all of the iovecs to buf
+static void iov_to_buf(const struct iovec *iov, int iovcnt, char *buf)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+        buf += iov[i].iov_len;
+    }
+}
+
 void fuser_mirror_read_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
 {
+    if (cb_data->read.fill) {
+        // Also gives the extents to the cache if the read succeeded
+        size_t n = block_cache_fill_complete(cb_data->f->block_cache, cb_data->read.fill, cqe->res,
+                cb_data->read.offset, cb_data->read.size, cb_data->read.out_iov, cb_data->read.out_iovcnt);
+        if (cqe->res >= 0)
+            cqe->res = n;
+    }
+
+    int buf = cb_data->read.buf;
     if (cqe->res < 0) {
+        if (buf >= 0)
+            fuser_buf_put(cb_data->f, cb_data->thread_id, buf);
         cb_data->out_hdr->error = cqe->res;
 #ifdef DEBUG_ENABLED
         fprintf(stderr, "FUSE OP(%d) request ERROR returned by io_uring=%d, %s\n", cb_data->in_hdr->opcode,
@@ -1051,6 +1724,11 @@ void fuser_mirror_read_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cq
         return;
     }
 
+    if (buf >= 0) {
+        buf_to_iov(fuser_buf_addr(cb_data->f, cb_data->thread_id, buf), cqe->res,
+                cb_data->read.out_iov, cb_data->read.out_iovcnt);
+        fuser_buf_put(cb_data->f, cb_data->thread_id, buf);
+    }
     // Cannot use generic because of this
     cb_data->out_hdr->len += cqe->res;
     dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
@@ -1062,30 +1740,93 @@ int fuser_mirror_read(struct fuse_session *se, void *user_data,
         void *completion_context, uint16_t device_id)
 {
     struct fuser *f = user_data;
+    size_t len = iov_length(out_iov, out_iovcnt);
+
+    struct inode *i = NULL;
+    if (f->block_cache) {
+        i = ino_to_inodeptr(f, in_hdr->nodeid);
+        if (!i) {
+            out_hdr->error = -EINVAL;
+            return 0;
+        }
+        // A hit is served right away, with a single copy into the buffers of the host
+        ssize_t n = block_cache_read(f->block_cache, i->src_dev, i->src_ino, in_read->offset, len,
+                out_iov, out_iovcnt);
+        if (n >= 0) {
+            out_hdr->len += n;
+            return 0;
+        }
+    }
 
     CB_DATA(fuser_mirror_read_cb);
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
-    io_uring_prep_readv(sqe, in_read->fh, out_iov, out_iovcnt, in_read->offset);
+    cb_data->read.fill = NULL;
+    if (i)
+        cb_data->read.fill = block_cache_fill_start(f->block_cache, i->src_dev, i->src_ino, in_read->offset, len);
+    if (cb_data->read.fill) {
+        // Whole extents are read straight into the cache and copied to the host from there
+        struct block_cache_fill *fill = cb_data->read.fill;
+        cb_data->read.buf = -1;
+        cb_data->read.out_iov = out_iov;
+        cb_data->read.out_iovcnt = out_iovcnt;
+        cb_data->read.offset = in_read->offset;
+        cb_data->read.size = len;
+        io_uring_prep_readv(sqe, FUSER_FH_FD(in_read->fh), fill->iov, fill->n, fill->offset);
+        fuser_sqe_set_file(sqe, thread_id, in_read->fh);
+        io_uring_sqe_set_data(sqe, cb_data);
+
+        fuser_submit(f, thread_id);
+        return EWOULDBLOCK;
+    }
+
+    int buf = fuser_buf_get(f, thread_id, len);
+    cb_data->read.buf = buf;
+    if (buf >= 0) {
+        cb_data->read.out_iov = out_iov;
+        cb_data->read.out_iovcnt = out_iovcnt;
+        io_uring_prep_read_fixed(sqe, FUSER_FH_FD(in_read->fh), fuser_buf_addr(f, thread_id, buf),
+                len, in_read->offset, buf);
+    } else {
+        io_uring_prep_readv(sqe, FUSER_FH_FD(in_read->fh), out_iov, out_iovcnt, in_read->offset);
+    }
+    fuser_sqe_set_file(sqe, thread_id, in_read->fh);
     io_uring_sqe_set_data(sqe, cb_data);
     // IOSQE_ASYNC doesn't work on file systems
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 }
 
 static void fuser_mirror_write_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
 {
+    struct fuser *f = cb_data->f;
+    if (f->block_cache) {
+        size_t len = cqe->res > 0 ? cqe->res : 0;
+        if (cb_data->write.buf >= 0) {
+            struct iovec iov = {
+                .iov_base = fuser_buf_addr(f, cb_data->thread_id, cb_data->write.buf),
+                .iov_len = len,
+            };
+            block_cache_write_end(f->block_cache, cb_data->write.dev, cb_data->write.ino,
+                    cb_data->write.offset, &iov, 1, len, cb_data->write.allocate);
+        } else {
+            block_cache_write_end(f->block_cache, cb_data->write.dev, cb_data->write.ino,
+                    cb_data->write.offset, cb_data->write.in_iov, cb_data->write.in_iovcnt,
+                    len, cb_data->write.allocate);
+        }
+    }
+
+    if (cb_data->write.buf >= 0)
+        fuser_buf_put(cb_data->f, cb_data->thread_id, cb_data->write.buf);
+
     if (cqe->res < 0) {
         if (cqe->res == -EINTR) {
             // The write was interrupted for some reason on the backend,so we indicate to the host
@@ -1118,24 +1859,52 @@ int fuser_mirror_write(struct fuse_session *se, void *user_data,
 {
     struct fuser *f = user_data;
 
+    struct inode *i = NULL;
+    if (f->block_cache) {
+        i = ino_to_inodeptr(f, in_hdr->nodeid);
+        if (!i) {
+            out_hdr->error = -EINVAL;
+            return 0;
+        }
+    }
+
     CB_DATA(fuser_mirror_write_cb);
     cb_data->write.out_write = out_write;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
-    io_uring_prep_writev(sqe, in_write->fh, in_iov, in_iovcnt, in_write->offset);
+    if (i) {
+        cb_data->write.in_iov = in_iov;
+        cb_data->write.in_iovcnt = in_iovcnt;
+        cb_data->write.offset = in_write->offset;
+        cb_data->write.dev = i->src_dev;
+        cb_data->write.ino = i->src_ino;
+        // Written data is kept like read data, unless the host wants its writes to go
+        // straight to storage (the same flags that bypass the write gathering of dpfs_fuse).
+        // Then only the extents that are cached already are updated
+        cb_data->write.allocate = !(in_write->flags & (O_SYNC | O_DSYNC | O_DIRECT));
+        block_cache_write_begin(f->block_cache, i->src_dev, i->src_ino);
+    }
+    size_t len = iov_length(in_iov, in_iovcnt);
+    int buf = fuser_buf_get(f, thread_id, len);
+    cb_data->write.buf = buf;
+    if (buf >= 0) {
+        void *addr = fuser_buf_addr(f, thread_id, buf);
+        iov_to_buf(in_iov, in_iovcnt, addr);
+        io_uring_prep_write_fixed(sqe, FUSER_FH_FD(in_write->fh), addr, len, in_write->offset, buf);
+    } else {
+        io_uring_prep_writev(sqe, FUSER_FH_FD(in_write->fh), in_iov, in_iovcnt, in_write->offset);
+    }
+    fuser_sqe_set_file(sqe, thread_id, in_write->fh);
     io_uring_sqe_set_data(sqe, cb_data);
     // IOSQE_ASYNC doesn't work on file systems
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 }
@@ -1145,6 +1914,7 @@ static int make_something(struct fuser *f, fuse_ino_t parent,
                               const char *link, struct fuse_entry_param *out_e) {
     int res;
     struct inode *ip = ino_to_inodeptr(f, parent);
+    dir_cache_invalidate(f, parent);
 
     if (S_ISDIR(mode)) {
         res = mkdirat(ip->fd, name, mode);
@@ -1162,6 +1932,7 @@ static int make_something(struct fuser *f, fuse_ino_t parent,
     saverr = do_lookup(f, parent, name, out_e);
     if (saverr)
         goto out_err;
+    fuser_block_cache_new_inode(f, out_e);
 
     return 0;
 
@@ -1179,11 +1950,13 @@ static void fuser_mirror_mk_cb(struct fuser_cb_data *cb_data, struct io_uring_cq
         goto out_err;
 
     struct fuse_entry_param e;
+    // do_lookup() returns a positive errno
     res = do_lookup(cb_data->f, cb_data->in_hdr->nodeid, cb_data->mk.in_name, &e);
-    if (res < 0) {
+    if (res) {
         res = -res;
         goto out_err;
     }
+    fuser_block_cache_new_inode(cb_data->f, &e);
 
     fuse_ll_reply_entry(cb_data->se, cb_data->out_hdr, cb_data->mk.out_entry, &e);
     dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
@@ -1209,25 +1982,23 @@ int fuser_mirror_mkdir(struct fuse_session *se, void *user_data,
 {
     struct fuser *f = user_data;
     struct inode *parent = ino_to_inodeptr(f, in_hdr->nodeid);
+    dir_cache_invalidate(f, in_hdr->nodeid);
 
     CB_DATA(fuser_mirror_mk_cb);
     cb_data->mk.in_name = in_name;
     cb_data->mk.out_entry = out_entry;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
     io_uring_prep_mkdirat(sqe, parent->fd, in_name, in_mkdir->mode | S_IFDIR);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 }
@@ -1239,23 +2010,21 @@ int fuser_mirror_symlink(struct fuse_session *se, void *user_data,
 {
     struct fuser *f = user_data;
     struct inode *parent = ino_to_inodeptr(f, in_hdr->nodeid);
+    dir_cache_invalidate(f, in_hdr->nodeid);
 
     CB_DATA(fuser_mirror_mk_cb);
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
     io_uring_prep_symlinkat(sqe, in_link, parent->fd, in_name);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 }
@@ -1333,6 +2102,16 @@ int fuser_mirror_statfs(struct fuse_session *se, void *user_data,
     return fuse_ll_reply_statfs(se, out_hdr, out_statfs, &stbuf);
 }
 
+#ifndef IORING_METADATA_DISABLED
+static void fuser_mirror_unlink_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
+{
+    // The last link is gone, so the backend may hand out the inode number again
+    if (cqe->res >= 0 && cb_data->unlink.nlink == 1)
+        block_cache_invalidate(cb_data->f->block_cache, cb_data->unlink.dev, cb_data->unlink.ino);
+    fuser_mirror_generic_cb(cb_data, cqe);
+}
+#endif
+
 int fuser_mirror_unlink(struct fuse_session *se, void *user_data,
                   struct fuse_in_header *in_hdr, const char *const in_name,
                   struct fuse_out_header *out_hdr,
@@ -1345,6 +2124,12 @@ int fuser_mirror_unlink(struct fuse_session *se, void *user_data,
         out_hdr->error = -EINVAL;
         return 0;
     }
+    dir_cache_invalidate(f, in_hdr->nodeid);
+    // For the block cache, which has to drop the extents of the file with its last link.
+    // A link that is added in the meantime only costs a spurious invalidation
+    struct stat st = { 0 };
+    if (f->block_cache && fstatat(ip->fd, in_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        st.st_nlink = 0;
     // Release inode.fd before last unlink like nfsd EXPORT_OP_CLOSE_BEFORE_UNLINK
     // to test reused inode numbers.
     // Skip this when inode has an open file and when writeback cache is enabled.
@@ -1361,46 +2146,46 @@ int fuser_mirror_unlink(struct fuse_session *se, void *user_data,
                 out_hdr->error = -EINVAL;
                 return 0;
             }
-            pthread_mutex_lock(&i->m);
+            inode_lock(i);
             if (i->fd > 0 && !i->nopen) {
 #ifdef DEBUG_ENABLED
                 fprintf(stderr, "DEBUG: unlink: release inode %ld; fd=%d\n", e.attr.st_ino, i->fd);
 #endif
-                pthread_mutex_lock(&f->m);
                 close(i->fd);
                 i->fd = -ENOENT;
                 i->generation++;
-                pthread_mutex_unlock(&f->m);
             }
-            pthread_mutex_unlock(&i->m);
+            inode_unlock(i);
         }
 
         // decrease the ref which lookup above had increased
         forget_one(f, e.ino, 1);
     }
 #ifndef IORING_METADATA_DISABLED
-    CB_DATA(fuser_mirror_generic_cb);
+    CB_DATA(fuser_mirror_unlink_cb);
+    cb_data->unlink.dev = st.st_dev;
+    cb_data->unlink.ino = st.st_ino;
+    cb_data->unlink.nlink = st.st_nlink;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
     io_uring_prep_unlinkat(sqe, ip->fd, in_name, 0);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 #else
     int res = unlinkat(ip->fd, in_name, 0);
     if (res == -1)
         out_hdr->error = -errno;
+    else if (st.st_nlink == 1)
+        block_cache_invalidate(f->block_cache, st.st_dev, st.st_ino);
     return 0;
 #endif
 }
@@ -1410,7 +2195,7 @@ int fuser_mirror_flush(struct fuse_session *se, void *user_data,
                struct fuse_out_header *out_hdr,
                void *completion_context, uint16_t device_id)
 {
-    return do_fsync(se, user_data, in_hdr, fi.fh, FUSE_FSYNC_FDATASYNC, out_hdr, completion_context);
+    return do_fsync(se, user_data, in_hdr, fi.fh, FUSE_FSYNC_FDATASYNC, out_hdr, completion_context, device_id);
 }
 
 int fuser_mirror_flock(struct fuse_session *se, void *user_data,
@@ -1420,7 +2205,7 @@ int fuser_mirror_flock(struct fuse_session *se, void *user_data,
 {
     (void) in_hdr;
 
-    int res = flock(fi.fh, op);
+    int res = flock(FUSER_FH_FD(fi.fh), op);
 
     if (res == -1)
         out_hdr->error = -errno;
@@ -1428,46 +2213,179 @@ int fuser_mirror_flock(struct fuse_session *se, void *user_data,
 }
 
 
+#ifndef IORING_METADATA_DISABLED
+static void fuser_mirror_fallocate_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
+{
+    // Punching holes or zeroing ranges changes the data, and the file may have grown
+    if (cqe->res >= 0 && cb_data->f->block_cache)
+        block_cache_invalidate(cb_data->f->block_cache, cb_data->write.dev, cb_data->write.ino);
+    fuser_mirror_generic_cb(cb_data, cqe);
+}
+#endif
+
 int fuser_mirror_fallocate(struct fuse_session *se, void *user_data,
                         struct fuse_in_header *in_hdr, struct fuse_fallocate_in *in_fallocate,
                       struct fuse_out_header *out_hdr,
                       void *completion_context, uint16_t device_id)
 {
-#ifndef IORING_METADATA_DISABLED
     struct fuser *f = user_data;
+    struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+    if (!i) {
+        out_hdr->error = -EINVAL;
+        return 0;
+    }
+#ifndef IORING_METADATA_DISABLED
+    CB_DATA(fuser_mirror_fallocate_cb);
+    cb_data->write.dev = i->src_dev;
+    cb_data->write.ino = i->src_ino;
 
-    CB_DATA(fuser_mirror_generic_cb);
-
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        fuser_cb_data_abort(f, cb_data);
         out_hdr->error = -ENOMEM;
         return 0;
     }
-    io_uring_prep_fallocate(sqe, in_fallocate->fh, in_fallocate->mode, in_fallocate->offset, in_fallocate->length);
+    io_uring_prep_fallocate(sqe, FUSER_FH_FD(in_fallocate->fh), in_fallocate->mode, in_fallocate->offset, in_fallocate->length);
+    fuser_sqe_set_file(sqe, thread_id, in_fallocate->fh);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
-    if (res < 0) {
-        out_hdr->error = res;
-        return 0;
-    }
+    fuser_submit(f, thread_id);
 
     return EWOULDBLOCK; // We move async
 #else
-    int res = fallocate64(in_fallocate->fh, in_fallocate->mode, in_fallocate->offset, in_fallocate->length);
+    int res = fallocate64(FUSER_FH_FD(in_fallocate->fh), in_fallocate->mode, in_fallocate->offset, in_fallocate->length);
 
     if (res == -1)
         out_hdr->error = -errno;
+    else
+        fuser_block_cache_invalidate(f, i);
     return 0;
 #endif
 }
 
+// io_uring has no copy_file_range, so this blocks the virtio poller thread.
+// On file systems with reflinks (XFS, btrfs) the kernel just clones the extents,
+// otherwise it copies in kernel, so we bound the time the poller is stuck by
+// copying at most this many bytes per request. The host retries short copies.
+#define FUSER_MIRROR_COPY_FILE_RANGE_MAX (16 << 20)
+
+int fuser_mirror_copy_file_range(struct fuse_session *se, void *user_data,
+                        struct fuse_in_header *in_hdr, struct fuse_copy_file_range_in *in_cfr,
+                        struct fuse_out_header *out_hdr, struct fuse_write_out *out_write,
+                        void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    (void) in_hdr;
+
+    loff_t off_in = in_cfr->off_in;
+    loff_t off_out = in_cfr->off_out;
+    size_t len = in_cfr->len;
+    if (len > FUSER_MIRROR_COPY_FILE_RANGE_MAX)
+        len = FUSER_MIRROR_COPY_FILE_RANGE_MAX;
+
+    ssize_t res = copy_file_range(FUSER_FH_FD(in_cfr->fh_in), &off_in, FUSER_FH_FD(in_cfr->fh_out), &off_out, len, in_cfr->flags);
+
+    if (res == -1) {
+        out_hdr->error = -errno;
+        return 0;
+    }
+    struct inode *i = ino_to_inodeptr(f, in_cfr->nodeid_out);
+    if (i)
+        fuser_block_cache_invalidate(f, i);
+    out_write->size = res;
+    out_hdr->len += sizeof(*out_write);
+    return 0;
+}
+
+// A cheap syscall, and io_uring has no lseek anyway
+int fuser_mirror_lseek(struct fuse_session *se, void *user_data,
+                        struct fuse_in_header *in_hdr, struct fuse_lseek_in *in_lseek,
+                        struct fuse_out_header *out_hdr, struct fuse_lseek_out *out_lseek,
+                        void *completion_context, uint16_t device_id)
+{
+    (void) in_hdr;
+
+    off_t res = lseek(FUSER_FH_FD(in_lseek->fh), in_lseek->offset, in_lseek->whence);
+
+    if (res == -1) {
+        out_hdr->error = -errno;
+        return 0;
+    }
+    out_lseek->offset = res;
+    out_hdr->len += sizeof(*out_lseek);
+    return 0;
+}
+
+// The result of the cancel itself is of no interest, if it was too late the request
+// just completes as usual. fuser_complete() returns the cb_data of the cancel to the pool
+// after this, like it does for every other request
+static void fuser_mirror_interrupt_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
+{
+#ifdef DEBUG_ENABLED
+    printf("Uring: cancel of FUSE request id=%lu returned %d\n", cb_data->unique, cqe->res);
+#endif
+}
+
+int fuser_mirror_interrupt(struct fuse_session *se, void *user_data,
+                        struct fuse_in_header *in_hdr, struct fuse_interrupt_in *in_interrupt,
+                        void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    size_t thread_id = dpfs_hal_thread_id();
+
+    // A device is handled by a single DPFS thread, so the interrupted request is on our ring.
+    // The request can complete right after this and its cb_data be reused, but only by a request
+    // of this thread, whose SQE comes after the cancel in the ring. The kernel takes the SQEs in
+    // order, so the cancel can't hit that request.
+    struct fuser_cb_data *target = fuser_inflight_find(f, thread_id, device_id,
+            in_interrupt->unique);
+    if (!target)
+        return 0;
+
+    struct fuser_cb_data *cb_data = fuser_cb_data_get(f, thread_id);
+    if (!cb_data)
+        return 0;
+    cb_data->thread_id = thread_id;
+    cb_data->cb = fuser_mirror_interrupt_cb;
+    cb_data->f = f;
+    cb_data->se = se;
+    cb_data->completion_context = NULL;
+    cb_data->in_hdr = in_hdr;
+    cb_data->out_hdr = NULL;
+    cb_data->unique = in_interrupt->unique;
+    cb_data->device_id = device_id;
+    // Not in flight as far as FUSE_INTERRUPT is concerned
+    init_list_head(&cb_data->inflight);
+
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
+    if (!sqe) {
+        fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
+        // Never submitted, so it never reaches fuser_complete()
+        fuser_cb_data_abort(f, cb_data);
+        return 0;
+    }
+    // The cancelled request completes with -ECANCELED, which the cq thread turns into -EINTR
+    io_uring_prep_cancel(sqe, target, 0);
+    io_uring_sqe_set_data(sqe, cb_data);
+
+    // Not batched, the request may already be waiting for the cancel. If this fails, the cancel
+    // stays in the ring and the poll hook submits it
+    int ret = fuser_sq_flush(f, thread_id);
+    if (ret < 0 && ret != -EAGAIN && ret != -EBUSY && ret != -EINTR)
+        fprintf(stderr, "ERROR: failed to submit the cancel of request %lu: %s\n",
+                (uint64_t) in_interrupt->unique, strerror(-ret));
+    return 0;
+}
+
 void fuser_mirror_assign_ops(struct fuse_ll_operations *ops) {
     memset(ops, 0, sizeof(*ops));
     ops->init = fuser_mirror_init;
     ops->destroy = fuser_mirror_destroy;
     ops->getattr = fuser_mirror_getattr;
+#ifdef DPFS_FUSE_STATX
+    ops->statx = fuser_mirror_statx;
+#endif
     ops->lookup = fuser_mirror_lookup;
     ops->setattr = fuser_mirror_setattr;
     ops->opendir = fuser_mirror_opendir;
@@ -1492,5 +2410,8 @@ void fuser_mirror_assign_ops(struct fuse_ll_operations *ops) {
     ops->flock = fuser_mirror_flock;
     ops->flush = fuser_mirror_flush;
     ops->fallocate = fuser_mirror_fallocate;
+    ops->copy_file_range = fuser_mirror_copy_file_range;
+    ops->lseek = fuser_mirror_lseek;
+    ops->interrupt = fuser_mirror_interrupt;
 }
 
@@ -12,10 +12,46 @@
 #include <linux/io_uring.h>
 #include <liburing.h>
 #include <linux/stat.h>
+#include <limits.h>
+#include <stdbool.h>
+#include "list.h"
+#include "forget_log.h"
 
 struct fuser_cb_data;
 typedef void (*fuser_uring_cb) (struct fuser_cb_data *, struct io_uring_cqe *);
 
+// One of many SQEs of a request that don't depend on each other, see fuser_cb_data_part()
+struct fuser_cb_part {
+    struct fuser_cb_data *cb_data;
+    int res;
+};
+
+#ifndef IORING_METADATA_DISABLED
+// Max entries of a single asynchronous READDIRPLUS
+#define FUSER_READDIRPLUS_BATCH 128
+
+// The entries of a page of READDIRPLUS, each is looked up with an openat and a statx
+struct readdir_ent {
+    struct fuser_cb_part open;
+    struct fuser_cb_part stat;
+    struct statx s;
+    off_t off;
+    uint32_t namelen;
+    char name[NAME_MAX + 1];
+};
+
+// Per directory handle, the host doesn't read a directory handle concurrently
+struct readdir_batch {
+    size_t n;
+    struct readdir_ent ents[FUSER_READDIRPLUS_BATCH];
+    // An entry that was read from the directory but didn't fit in the previous reply,
+    // it comes first if the host continues at the offset of the handle
+    bool carry;
+    off_t carry_off;
+    char carry_name[NAME_MAX + 1];
+};
+#endif
+
 struct fuser_cb_data {
     uint16_t thread_id;
     fuser_uring_cb cb;
@@ -24,15 +60,59 @@ struct fuser_cb_data {
 
     struct fuse_in_header *in_hdr;
     struct fuse_out_header *out_hdr;
+    // Copied from in_hdr, so that FUSE_INTERRUPT can find the request in fuser.inflight.
+    // Uniques are per device and a ring can serve several devices
+    uint64_t unique;
+    uint16_t device_id;
+    struct list_head inflight;
+    // The result of the SQE before the last one of a linked chain, see fuser_cb_data_link()
+    int link_res;
+    // The parts that haven't completed yet, see fuser_cb_data_part()
+    uint32_t parts;
     union {
+        struct {
+            struct iovec *out_iov;
+            int out_iovcnt;
+            // The registered buffer that the data bounces through, -1 if none
+            int buf;
+            // NULL unless the read goes into extents of fuser.block_cache
+            struct block_cache_fill *fill;
+            off_t offset;
+            size_t size;
+        } read;
         struct {
             struct fuse_write_out *out_write;
+            int buf;
+            // For fuser.block_cache
+            struct iovec *in_iov;
+            int in_iovcnt;
+            off_t offset;
+            dev_t dev;
+            ino_t ino;
+            bool allocate;
         } write;
+#ifndef IORING_METADATA_DISABLED
+        struct {
+            struct statx s;
+            struct fuse_entry_out *out_entry;
+        } lookup;
+        struct {
+            struct readdir_batch *batch;
+            struct iov read_iov;
+            uint32_t size;
+        } readdir;
+#endif
 #ifndef IORING_DISABLE_METADATA
         struct {
             struct statx s;
             struct fuse_attr_out *out_attr;
         } getattr;
+#ifdef DPFS_FUSE_STATX
+        struct {
+            struct statx s;
+            struct fuse_statx_out *out_statx;
+        } statx;
+#endif
         struct {
             struct inode *i;
             struct fuse_file_info fi;
@@ -48,13 +128,41 @@ struct fuser_cb_data {
             const char *in_name;
             struct fuse_entry_out *out_entry;
         } mk;
+        struct {
+            // Of the file before it was unlinked, nlink 0 if it couldn't be looked up
+            dev_t dev;
+            ino_t ino;
+            nlink_t nlink;
+        } unlink;
 #endif
     };
     void *completion_context;
+    // While free, the next in the free list of the pool
+    struct fuser_cb_data *pool_next;
 };
 
+// The user_data of an SQE that is linked to the SQE of the request (IOSQE_IO_LINK).
+// Its CQE comes first and only stores the result in link_res, the CQE of the request's
+// own SQE completes the request as usual
+#define FUSER_CB_DATA_LINK 1UL
+static inline void *fuser_cb_data_link(struct fuser_cb_data *cb_data)
+{
+    return (void *) ((uintptr_t) cb_data | FUSER_CB_DATA_LINK);
+}
+
+// The user_data of the SQEs of a request that fans out, cb_data->parts counts them.
+// The CQE of every part stores its result in the part, the last one to complete calls the
+// cb of the request. All CQEs of a ring are reaped by the same cq thread, so parts needs no atomics
+#define FUSER_CB_DATA_PART 2UL
+static inline void *fuser_cb_data_part(struct fuser_cb_part *part)
+{
+    return (void *) ((uintptr_t) part | FUSER_CB_DATA_PART);
+}
+
 
 
 void fuser_mirror_assign_ops(struct fuse_ll_operations *);
+// The forget_log_apply_t of fuser.forgets
+void fuser_mirror_forget_apply(void *user_data, struct forget_rec *recs, size_t n);
 
 #endif // VIRTIOFUSER_MIRROR_IMPL_H
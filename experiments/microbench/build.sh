@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Builds the microbenchmarks, on the DPU after DPFS itself has been built
+
+SCRIPT_DIR=$( cd -- "$( dirname -- "${BASH_SOURCE[0]}" )" &> /dev/null && pwd )
+cd $SCRIPT_DIR
+ROOT=$(realpath ../..)
+
+CFLAGS="-O2 -g -Wall"
+# libdpfs_fuse and libdpfs_hal as built by libtool, override if they are installed elsewhere
+DPFS_FUSE_LIBDIR=${DPFS_FUSE_LIBDIR:-$ROOT/dpfs_fuse/.libs}
+DPFS_HAL_LIBDIR=${DPFS_HAL_LIBDIR:-$ROOT/dpfs_hal/.libs}
+
+set -e
+g++ -std=c++17 $CFLAGS -I$ROOT/dpfs_fuse -I$ROOT/dpfs_hal/include \
+	fuse_dispatch.cpp -o fuse_dispatch \
+	-L$DPFS_FUSE_LIBDIR -Wl,-rpath,$DPFS_FUSE_LIBDIR -ldpfs_fuse
+g++ -std=c++17 $CFLAGS -I$ROOT/dpfs_fuse -I$ROOT/dpfs_hal/include \
+	readdir.cpp -o readdir \
+	-L$DPFS_FUSE_LIBDIR -Wl,-rpath,$DPFS_FUSE_LIBDIR -ldpfs_fuse
+# The inode table of dpfs_uring, with everything of dpfs_uring but its main()
+gcc -std=gnu11 $CFLAGS -I$ROOT -I$ROOT/dpfs_uring -I$ROOT/lib -I$ROOT/dpfs_fuse \
+	-I$ROOT/dpfs_hal/include -I$ROOT/extern/tomlcpp -I/usr/local/include \
+	inode_table.c $ROOT/dpfs_uring/fuser.c $ROOT/dpfs_uring/mirror_impl.c \
+	$ROOT/dpfs_uring/block_cache.c $ROOT/lib/forget_log.c $ROOT/lib/slab.c \
+	$ROOT/extern/tomlcpp/toml.c -o inode_table \
+	-L$DPFS_FUSE_LIBDIR -Wl,-rpath,$DPFS_FUSE_LIBDIR -ldpfs_fuse \
+	-L$DPFS_HAL_LIBDIR -Wl,-rpath,$DPFS_HAL_LIBDIR -ldpfs_hal \
+	-lck -lpthread -luring
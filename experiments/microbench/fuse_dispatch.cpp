@@ -0,0 +1,290 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+// Per request cost of the dispatching of dpfs_fuse: the C path (fuse_handlers[] and
+// fuse_ll_operations) against dpfs::FuseServer (dpfs_fuse.hpp).
+// A synthetic trace of GETATTR, LOOKUP, 4k READ and 4k WRITE requests is replayed as fast as
+// possible (see trace.h) into a backend that replies right away, once for every front end.
+// Both backends do the same work, so the difference is the dispatching.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <linux/fuse.h>
+#include "dpfs_fuse.h"
+#include "dpfs_fuse.hpp"
+#include "trace.h"
+
+#define TRACE_ALIGN(x) (((x) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+#define IO_SIZE 4096
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Appends a record without payloads, lens are the in iovecs followed by the out iovecs
+static void trace_add(FILE *fp, uint64_t start_nsec, const std::vector<uint32_t> &lens,
+                      int in_iovcnt, const void *in, size_t in_len)
+{
+    int out_iovcnt = lens.size() - in_iovcnt;
+    size_t lens_size = TRACE_ALIGN(lens.size() * sizeof(uint32_t));
+    // The out iovecs up to the payload are captured as well, zeroes will do
+    uint32_t opcode = ((const struct fuse_in_header *) in)->opcode;
+    size_t out_len = 0;
+    for (int i = 0; i < fuse_ll_trace_payload_iov(opcode, true, out_iovcnt); i++)
+        out_len += lens[in_iovcnt + i];
+
+    std::vector<char> buf(TRACE_ALIGN(sizeof(struct fuse_ll_trace_rec) + lens_size + in_len + out_len), 0);
+    struct fuse_ll_trace_rec *rec = (struct fuse_ll_trace_rec *) buf.data();
+    rec->len = buf.size();
+    rec->in_iovcnt = in_iovcnt;
+    rec->out_iovcnt = out_iovcnt;
+    rec->start_nsec = start_nsec;
+    rec->latency_nsec = 1;
+    memcpy(rec + 1, lens.data(), lens.size() * sizeof(uint32_t));
+    memcpy(buf.data() + sizeof(*rec) + lens_size, in, in_len);
+    fwrite(buf.data(), 1, buf.size(), fp);
+}
+
+static int write_trace(const char *path, size_t nreqs)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("fopen trace");
+        return -1;
+    }
+    struct fuse_ll_trace_file_hdr hdr = { FUSE_LL_TRACE_MAGIC, FUSE_LL_TRACE_VERSION, 0 };
+    fwrite(&hdr, 1, sizeof(hdr), fp);
+
+    for (size_t i = 0; i < nreqs; i++) {
+        char in[sizeof(struct fuse_in_header) + 64];
+        memset(in, 0, sizeof(in));
+        struct fuse_in_header *in_hdr = (struct fuse_in_header *) in;
+        in_hdr->unique = i + 1;
+        in_hdr->nodeid = 2;
+        char *arg = in + sizeof(*in_hdr);
+        uint64_t start = (i + 1) * 10;
+
+        switch (i % 4) {
+        case 0: {
+            in_hdr->opcode = FUSE_GETATTR;
+            in_hdr->len = sizeof(*in_hdr) + sizeof(struct fuse_getattr_in);
+            trace_add(fp, start, {sizeof(*in_hdr), sizeof(struct fuse_getattr_in),
+                    sizeof(struct fuse_out_header), sizeof(struct fuse_attr_out)},
+                    2, in, in_hdr->len);
+            break;
+        }
+        case 1: {
+            in_hdr->opcode = FUSE_LOOKUP;
+            in_hdr->nodeid = 1;
+            strcpy(arg, "file");
+            in_hdr->len = sizeof(*in_hdr) + 5;
+            trace_add(fp, start, {sizeof(*in_hdr), 5,
+                    sizeof(struct fuse_out_header), sizeof(struct fuse_entry_out)},
+                    2, in, in_hdr->len);
+            break;
+        }
+        case 2: {
+            in_hdr->opcode = FUSE_READ;
+            struct fuse_read_in *in_read = (struct fuse_read_in *) arg;
+            in_read->offset = (i / 4) * IO_SIZE;
+            in_read->size = IO_SIZE;
+            in_hdr->len = sizeof(*in_hdr) + sizeof(*in_read);
+            trace_add(fp, start, {sizeof(*in_hdr), sizeof(*in_read),
+                    sizeof(struct fuse_out_header), IO_SIZE},
+                    2, in, in_hdr->len);
+            break;
+        }
+        case 3: {
+            in_hdr->opcode = FUSE_WRITE;
+            struct fuse_write_in *in_write = (struct fuse_write_in *) arg;
+            in_write->offset = (i / 4) * IO_SIZE;
+            in_write->size = IO_SIZE;
+            in_hdr->len = sizeof(*in_hdr) + sizeof(*in_write) + IO_SIZE;
+            // The data is a payload, it is replayed as zeroes
+            trace_add(fp, start, {sizeof(*in_hdr), sizeof(*in_write), IO_SIZE,
+                    sizeof(struct fuse_out_header), sizeof(struct fuse_write_out)},
+                    3, in, sizeof(*in_hdr) + sizeof(*in_write));
+            break;
+        }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void fill_stat(uint64_t nodeid, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_ino = nodeid;
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_size = 1 << 30;
+    st->st_blksize = IO_SIZE;
+}
+
+// The backend of the C path
+static int c_init(struct fuse_session *se, void *user_data,
+                  struct fuse_in_header *in_hdr, struct fuse_init_in *in_init,
+                  struct fuse_conn_info *conn, struct fuse_out_header *out_hdr,
+                  uint16_t device_id)
+{
+    se->init_done = true;
+    return 0;
+}
+
+static int c_getattr(struct fuse_session *se, void *user_data,
+                     struct fuse_in_header *in_hdr, struct fuse_getattr_in *in_getattr,
+                     struct fuse_out_header *out_hdr, struct fuse_attr_out *out_attr,
+                     void *completion_context, uint16_t device_id)
+{
+    struct stat st;
+    fill_stat(in_hdr->nodeid, &st);
+    return fuse_ll_reply_attr(se, out_hdr, out_attr, &st, 1);
+}
+
+static int c_lookup(struct fuse_session *se, void *user_data,
+                    struct fuse_in_header *in_hdr, const char *const in_name,
+                    struct fuse_out_header *out_hdr, struct fuse_entry_out *out_entry,
+                    void *completion_context, uint16_t device_id)
+{
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = 2;
+    e.attr_timeout = 1;
+    e.entry_timeout = 1;
+    fill_stat(e.ino, &e.attr);
+    return fuse_ll_reply_entry(se, out_hdr, out_entry, &e);
+}
+
+static int c_read(struct fuse_session *se, void *user_data,
+                  struct fuse_in_header *in_hdr, struct fuse_read_in *in_read,
+                  struct fuse_out_header *out_hdr, struct iovec *out_iov, int iovcnt,
+                  void *completion_context, uint16_t device_id)
+{
+    out_hdr->len += in_read->size;
+    return 0;
+}
+
+static int c_write(struct fuse_session *se, void *user_data,
+                   struct fuse_in_header *in_hdr, struct fuse_write_in *in_write,
+                   struct iovec *in_iov, int iovcnt,
+                   struct fuse_out_header *out_hdr, struct fuse_write_out *out_write,
+                   void *completion_context, uint16_t device_id)
+{
+    out_write->size = in_write->size;
+    out_hdr->len += sizeof(*out_write);
+    return 0;
+}
+
+// The same backend for dpfs::FuseServer
+class NullFs {
+public:
+    int init(const dpfs::Request &req, struct fuse_init_in *in_init, struct fuse_conn_info *conn)
+    {
+        req.se->init_done = true;
+        return 0;
+    }
+
+    int getattr(const dpfs::Request &req, struct fuse_getattr_in *in_getattr,
+                struct fuse_attr_out *out_attr)
+    {
+        struct stat st;
+        fill_stat(req.nodeid(), &st);
+        return fuse_ll_reply_attr(req.se, req.out_hdr, out_attr, &st, 1);
+    }
+
+    int lookup(const dpfs::Request &req, const char *name, struct fuse_entry_out *out_entry)
+    {
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = 2;
+        e.attr_timeout = 1;
+        e.entry_timeout = 1;
+        fill_stat(e.ino, &e.attr);
+        return fuse_ll_reply_entry(req.se, req.out_hdr, out_entry, &e);
+    }
+
+    int read(const dpfs::Request &req, struct fuse_read_in *in_read, struct iovec *iov, int iovcnt)
+    {
+        req.out_hdr->len += in_read->size;
+        return 0;
+    }
+
+    int write(const dpfs::Request &req, struct fuse_write_in *in_write,
+              struct iovec *iov, int iovcnt, struct fuse_write_out *out_write)
+    {
+        out_write->size = in_write->size;
+        req.out_hdr->len += sizeof(*out_write);
+        return 0;
+    }
+};
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <requests> <tmp dir>\n", argv[0]);
+        return 2;
+    }
+    size_t nreqs = strtoull(argv[1], NULL, 10);
+    std::string trace_path = std::string(argv[2]) + "/fuse_dispatch.trace";
+    std::string conf_path = std::string(argv[2]) + "/fuse_dispatch.toml";
+
+    if (write_trace(trace_path.c_str(), nreqs) != 0)
+        return 1;
+    FILE *fp = fopen(conf_path.c_str(), "w");
+    if (!fp) {
+        perror("fopen conf");
+        return 1;
+    }
+    fprintf(fp, "[dpfs]\nreplay = \"%s\"\nreplay_timing = \"fast\"\n", trace_path.c_str());
+    fclose(fp);
+
+    struct fuse_ll_operations ops;
+    memset(&ops, 0, sizeof(ops));
+    ops.init = c_init;
+    ops.getattr = c_getattr;
+    ops.lookup = c_lookup;
+    ops.read = c_read;
+    ops.write = c_write;
+
+    printf("C path (fuse_ll_operations):\n");
+    struct dpfs_fuse *f = dpfs_fuse_new(&ops, conf_path.c_str(), NULL, NULL, NULL);
+    if (!f)
+        return 1;
+    uint64_t start = now_nsec();
+    dpfs_fuse_loop(f);
+    uint64_t c_nsec = now_nsec() - start;
+    dpfs_fuse_destroy(f);
+
+    printf("\ndpfs::FuseServer:\n");
+    NullFs fs;
+    uint64_t cpp_nsec;
+    {
+        dpfs::FuseServer<NullFs> server(fs, conf_path.c_str());
+        if (!server.valid())
+            return 1;
+        start = now_nsec();
+        server.loop();
+        cpp_nsec = now_nsec() - start;
+    }
+
+    // Including the overhead of the replayer itself, the averages per opcode above are without
+    printf("\n%-20s %16s\n", "front end", "wall ns/request");
+    printf("%-20s %16.1f\n", "C", (double) c_nsec / nreqs);
+    printf("%-20s %16.1f\n", "dpfs::FuseServer", (double) cpp_nsec / nreqs);
+
+    remove(trace_path.c_str());
+    remove(conf_path.c_str());
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+// Scaling of the inode table of dpfs_uring (struct inode_table in fuser.h) with the number of
+// threads that look up inodes, like the DPFS threads do for LOOKUP, READDIRPLUS and FORGET.
+// The table is filled first, which also times the growing of the stripes. Then every thread
+// count runs two workloads:
+// - get: inode_table_get() of random inodes of the table, the common case
+// - churn: a lookup and a forget of an inode, with every thread on inodes of its own that
+//   are inserted and removed again, on top of the filled table
+// Both are also run with every call under a single global mutex, which is how the inode
+// table was protected before it was split into stripes.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "fuser.h"
+
+enum workload {
+    WL_GET,
+    WL_CHURN,
+};
+static const char *workload_names[] = { "get", "churn" };
+
+struct bench {
+    struct inode_table *t;
+    size_t ninodes;
+    size_t nops;
+    enum workload wl;
+    // NULL to use the table as is
+    pthread_mutex_t *global;
+    pthread_barrier_t barrier;
+};
+
+struct worker {
+    pthread_t thread;
+    struct bench *b;
+    uint16_t id;
+    uint64_t sum;
+};
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift64(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+// The inode numbers of a file system are mostly sequential, so are these
+#define BENCH_DEV 42
+#define CHURN_INO_BASE (1ULL << 40)
+#define CHURN_INODES 1024
+
+static struct inode *bench_get(struct bench *b, ino_t ino, bool insert)
+{
+    if (b->global)
+        pthread_mutex_lock(b->global);
+    struct inode *i = insert ? inode_table_getsert(b->t, BENCH_DEV, ino) : inode_table_get(b->t, BENCH_DEV, ino);
+    if (b->global)
+        pthread_mutex_unlock(b->global);
+    return i;
+}
+
+// Same as a FORGET of the last reference
+static void bench_forget(struct bench *b, struct inode *i)
+{
+    inode_lock(i);
+    i->nlookup--;
+    bool last = i->nlookup == 0;
+    dev_t dev = i->src_dev;
+    ino_t ino = i->src_ino;
+    inode_unlock(i);
+    if (!last)
+        return;
+
+    if (b->global)
+        pthread_mutex_lock(b->global);
+    bool removed = inode_table_remove(b->t, i, dev, ino);
+    if (b->global)
+        pthread_mutex_unlock(b->global);
+    if (removed)
+        inode_destroy(b->t, i);
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct bench *b = w->b;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (w->id + 1);
+    uint64_t sum = 0;
+
+    pthread_barrier_wait(&b->barrier);
+    for (size_t n = 0; n < b->nops; n++) {
+        if (b->wl == WL_GET) {
+            struct inode *i = bench_get(b, xorshift64(&seed) % b->ninodes + 1, false);
+            if (!i) {
+                fprintf(stderr, "ERROR: an inode of the table wasn't found\n");
+                exit(1);
+            }
+            sum += i->nlookup;
+            inode_unlock(i);
+        } else {
+            ino_t ino = CHURN_INO_BASE + (uint64_t) w->id * CHURN_INODES + n % CHURN_INODES;
+            struct inode *i = bench_get(b, ino, true);
+            if (!i) {
+                fprintf(stderr, "ERROR: no memory for an inode\n");
+                exit(1);
+            }
+            i->nlookup++;
+            sum += i->nlookup;
+            inode_unlock(i);
+            bench_forget(b, i);
+        }
+    }
+    w->sum = sum;
+    return NULL;
+}
+
+// Returns the wall time of the run
+static uint64_t run(struct bench *b, uint16_t nthreads)
+{
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    pthread_barrier_init(&b->barrier, NULL, nthreads + 1);
+    for (uint16_t i = 0; i < nthreads; i++) {
+        workers[i].b = b;
+        workers[i].id = i;
+        pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    }
+    pthread_barrier_wait(&b->barrier);
+    uint64_t start = now_nsec();
+    for (uint16_t i = 0; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+    uint64_t nsec = now_nsec() - start;
+
+    pthread_barrier_destroy(&b->barrier);
+    free(workers);
+    return nsec;
+}
+
+static size_t table_size(struct inode_table *t, size_t *nbuckets)
+{
+    size_t use = 0;
+    *nbuckets = 0;
+    for (size_t s = 0; s < INODE_TABLE_STRIPES; s++) {
+        use += t->stripes[s].use;
+        *nbuckets += t->stripes[s].nbuckets;
+    }
+    return use;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 4) {
+        fprintf(stderr, "Usage: %s [inodes] [lookups per thread] [max threads]\n", argv[0]);
+        return 2;
+    }
+    size_t ninodes = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t nops = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000000;
+    int max_threads = argc > 3 ? atoi(argv[3]) : 8;
+    if (ninodes == 0 || nops == 0 || max_threads < 1 || max_threads > UINT16_MAX) {
+        fprintf(stderr, "Usage: %s [inodes] [lookups per thread] [max threads]\n", argv[0]);
+        return 2;
+    }
+
+    struct inode_table *t;
+    if (inode_table_init(&t, max_threads) != 0)
+        return 1;
+
+    uint64_t start = now_nsec();
+    for (ino_t ino = 1; ino <= ninodes; ino++) {
+        struct inode *i = inode_table_getsert(t, BENCH_DEV, ino);
+        if (!i) {
+            fprintf(stderr, "ERROR: no memory for an inode\n");
+            return 1;
+        }
+        i->nlookup = 1;
+        inode_unlock(i);
+    }
+    double fill_nsec = now_nsec() - start;
+    size_t nbuckets;
+    size_t use = table_size(t, &nbuckets);
+    printf("%zu inodes in %zu buckets over %d stripes, filled in %.1f ns/inode\n",
+            use, nbuckets, INODE_TABLE_STRIPES, fill_nsec / ninodes);
+    printf("%zu operations per thread\n", nops);
+
+    pthread_mutex_t global = PTHREAD_MUTEX_INITIALIZER;
+    printf("%-8s %-12s %8s %14s %10s\n", "workload", "lock", "threads", "Mops/s", "speedup");
+    for (int wl = WL_GET; wl <= WL_CHURN; wl++) {
+        for (int g = 0; g < 2; g++) {
+            struct bench b = { .t = t, .ninodes = ninodes, .nops = nops, .wl = wl,
+                               .global = g ? &global : NULL };
+            double base = 0;
+            for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+                double nsec = run(&b, nthreads);
+                double mops = (double) nops * nthreads * 1000.0 / nsec;
+                if (nthreads == 1)
+                    base = mops;
+                printf("%-8s %-12s %8d %14.2f %10.2f\n", workload_names[wl],
+                        g ? "global" : "stripes", nthreads, mops, mops / base);
+                if (nthreads < max_threads && nthreads * 2 > max_threads)
+                    nthreads = max_threads / 2;
+            }
+        }
+    }
+
+    // Everything the churn inserted has been removed again
+    if (table_size(t, &nbuckets) != use) {
+        fprintf(stderr, "ERROR: the table has %zu inodes instead of %zu\n", table_size(t, &nbuckets), use);
+        return 1;
+    }
+    // The inodes of the fill are still referenced, they are freed with the table
+    inode_table_destroy(t);
+    return 0;
+}
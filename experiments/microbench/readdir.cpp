@@ -0,0 +1,227 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+// Cost of encoding the entries of a READDIR and READDIRPLUS reply, for a directory with
+// many entries. The reply buffer is split into segments like the pages of a virtio-fs
+// descriptor chain, so some entries cross into the next segment.
+// Encoders:
+// - copy: the entry is built on the stack and copied into the reply with iov_write_buf(),
+//   which is what fuse_add_direntry() did before it encoded in place
+// - fuse_add_direntry(): in place, with strlen() on every name
+// - fuse_add_direntry_len(): in place, the backend knows the length of the name
+// - fuse_add_direntries(): in place, an array of entries at once
+// The replies of all encoders are compared, they must be the same.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <linux/fuse.h>
+#include "dpfs_fuse.h"
+
+enum encoder {
+    ENC_COPY,
+    ENC_ONE,
+    ENC_LEN,
+    ENC_BULK,
+};
+static const char *encoder_names[] = { "copy", "fuse_add_direntry", "_len", "bulk" };
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct dir {
+    std::vector<std::string> names;
+    std::vector<struct fuse_direntry> ents;
+    std::vector<struct fuse_direntry_plus> ents_plus;
+};
+
+static void make_dir(struct dir *d, size_t nents)
+{
+    d->names.resize(nents);
+    for (size_t i = 0; i < nents; i++)
+        d->names[i] = "file_" + std::to_string(i * 7919);
+
+    d->ents.resize(nents);
+    d->ents_plus.resize(nents);
+    for (size_t i = 0; i < nents; i++) {
+        struct fuse_direntry *ent = &d->ents[i];
+        ent->name = d->names[i].c_str();
+        ent->namelen = d->names[i].size();
+        ent->off = i + 1;
+        ent->ino = i + 2;
+        ent->mode = (i % 8 == 0 ? S_IFDIR : S_IFREG) | 0644;
+
+        struct fuse_direntry_plus *ent_plus = &d->ents_plus[i];
+        memset(ent_plus, 0, sizeof(*ent_plus));
+        ent_plus->name = ent->name;
+        ent_plus->namelen = ent->namelen;
+        ent_plus->off = ent->off;
+        ent_plus->e.ino = ent->ino;
+        ent_plus->e.attr_timeout = 1;
+        ent_plus->e.entry_timeout = 1;
+        ent_plus->e.attr.st_ino = ent->ino;
+        ent_plus->e.attr.st_mode = ent->mode;
+        ent_plus->e.attr.st_nlink = 1;
+        ent_plus->e.attr.st_size = i * 4096;
+    }
+}
+
+// The entry on the stack first, then copied into the reply
+static size_t add_copy(struct iov *read_iov, const struct fuse_direntry_plus *ent, bool plus)
+{
+    size_t namelen = strlen(ent->name);
+    size_t entlen = FUSE_DIRENT_ALIGN((plus ? FUSE_NAME_OFFSET_DIRENTPLUS : FUSE_NAME_OFFSET) + namelen);
+    if (read_iov->bytes_unused < entlen)
+        return 0;
+
+    uint64_t buf[(FUSE_NAME_OFFSET_DIRENTPLUS + 256) / sizeof(uint64_t) + 1];
+    struct iovec v = { buf, entlen };
+    struct iov tmp;
+    iov_init(&tmp, &v, 1);
+    if (plus) {
+        fuse_add_direntry_plus_len(&tmp, ent->name, namelen, &ent->e, ent->off);
+    } else {
+        struct stat st;
+        st.st_ino = ent->e.attr.st_ino;
+        st.st_mode = ent->e.attr.st_mode;
+        fuse_add_direntry_len(&tmp, ent->name, namelen, &st, ent->off);
+    }
+    return iov_write_buf(read_iov, buf, entlen);
+}
+
+// Fills a reply with the entries from start on, returns how many fit
+static size_t fill_reply(struct dir *d, enum encoder enc, bool plus, size_t start,
+                         struct iovec *segs, int nsegs, size_t *written)
+{
+    struct iov read_iov;
+    iov_init(&read_iov, segs, nsegs);
+    size_t nents = d->ents.size();
+    size_t i = start;
+    *written = 0;
+
+    if (enc == ENC_BULK) {
+        if (plus)
+            return fuse_add_direntries_plus(&read_iov, &d->ents_plus[start], nents - start, written);
+        else
+            return fuse_add_direntries(&read_iov, &d->ents[start], nents - start, written);
+    }
+
+    for (; i < nents; i++) {
+        struct fuse_direntry_plus *ent = &d->ents_plus[i];
+        size_t w;
+        if (enc == ENC_COPY) {
+            w = add_copy(&read_iov, ent, plus);
+        } else if (plus) {
+            if (enc == ENC_ONE)
+                w = fuse_add_direntry_plus(&read_iov, ent->name, &ent->e, ent->off);
+            else
+                w = fuse_add_direntry_plus_len(&read_iov, ent->name, ent->namelen, &ent->e, ent->off);
+        } else {
+            struct stat st;
+            st.st_ino = ent->e.attr.st_ino;
+            st.st_mode = ent->e.attr.st_mode;
+            if (enc == ENC_ONE)
+                w = fuse_add_direntry(&read_iov, ent->name, &st, ent->off);
+            else
+                w = fuse_add_direntry_len(&read_iov, ent->name, ent->namelen, &st, ent->off);
+        }
+        if (w == 0)
+            break;
+        *written += w;
+    }
+    return i - start;
+}
+
+// Lists the whole directory reply by reply, like the host does. With check, returns the
+// checksum of the replies
+static uint64_t list_dir(struct dir *d, enum encoder enc, bool plus, bool check,
+                         struct iovec *segs, int nsegs, size_t *nreplies)
+{
+    uint64_t sum = 0;
+    *nreplies = 0;
+    for (size_t start = 0; start < d->ents.size();) {
+        size_t written;
+        size_t n = fill_reply(d, enc, plus, start, segs, nsegs, &written);
+        if (n == 0) {
+            fprintf(stderr, "An entry doesn't fit in the reply\n");
+            exit(1);
+        }
+        start += n;
+        (*nreplies)++;
+
+        if (!check)
+            continue;
+        size_t left = written;
+        for (int s = 0; s < nsegs && left > 0; s++) {
+            size_t len = left < segs[s].iov_len ? left : segs[s].iov_len;
+            const unsigned char *p = (const unsigned char *) segs[s].iov_base;
+            for (size_t j = 0; j < len; j++)
+                sum = sum * 31 + p[j];
+            left -= len;
+        }
+    }
+    return sum;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 5) {
+        fprintf(stderr, "Usage: %s [entries] [reply KiB] [segment bytes] [passes]\n", argv[0]);
+        return 2;
+    }
+    size_t nents = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000;
+    size_t reply_size = (argc > 2 ? strtoull(argv[2], NULL, 10) : 128) * 1024;
+    size_t seg_size = argc > 3 ? strtoull(argv[3], NULL, 10) : 4096;
+    int passes = argc > 4 ? atoi(argv[4]) : 20;
+    if (nents == 0 || seg_size < 512 || reply_size < seg_size || passes < 1) {
+        fprintf(stderr, "Usage: %s [entries] [reply KiB] [segment bytes] [passes]\n", argv[0]);
+        return 2;
+    }
+
+    struct dir d;
+    make_dir(&d, nents);
+
+    int nsegs = (reply_size + seg_size - 1) / seg_size;
+    std::vector<char> mem(nsegs * seg_size);
+    std::vector<struct iovec> segs(nsegs);
+    for (int s = 0; s < nsegs; s++) {
+        segs[s].iov_base = mem.data() + s * seg_size;
+        segs[s].iov_len = seg_size;
+    }
+
+    printf("%zu entries, replies of %zu KiB in %d segments of %zu bytes, %d passes\n",
+            nents, reply_size / 1024, nsegs, seg_size, passes);
+    printf("%-12s %-18s %10s %12s %14s\n", "opcode", "encoder", "replies", "ns/entry", "Mentries/s");
+    for (int plus = 0; plus < 2; plus++) {
+        uint64_t sums[4];
+        for (int enc = ENC_COPY; enc <= ENC_BULK; enc++) {
+            size_t nreplies = 0;
+            // Warm up
+            sums[enc] = list_dir(&d, (enum encoder) enc, plus, true, segs.data(), nsegs, &nreplies);
+            uint64_t start = now_nsec();
+            for (int p = 0; p < passes; p++)
+                list_dir(&d, (enum encoder) enc, plus, false, segs.data(), nsegs, &nreplies);
+            double nsec = now_nsec() - start;
+            double per_ent = nsec / ((double) nents * passes);
+            printf("%-12s %-18s %10zu %12.1f %14.2f\n", plus ? "READDIRPLUS" : "READDIR",
+                    encoder_names[enc], nreplies, per_ent, 1000.0 / per_ent);
+            if (sums[enc] != sums[ENC_COPY]) {
+                fprintf(stderr, "ERROR: the replies of %s differ from those of copy\n", encoder_names[enc]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+# dpfs_uring with and without kernel-side submission polling (uring_sq_polling).
+# dpfs_uring is (re)started on the DPU over ssh for every mode, with DPFS_CONF and the
+# uring_sq_* options of the mode under [local_mirror].
+# Per mode, fio measures the latency and throughput, and perf stat on the DPU counts the
+# io_uring_enter() syscalls and the CPU time of dpfs_uring while fio runs, which is what
+# SQPOLL trades. The SQPOLL kernel thread (iou-sqp-<pid>) is a thread of dpfs_uring and
+# counts towards its CPU time.
+
+if [[ -z $OUT || -z $MNT ]]; then
+	echo OUT and MNT must be defined!
+	exit 1
+fi
+
+if [[ -z $DPU || -z $DPFS_URING || -z $DPFS_CONF ]]; then
+	echo "DPU (ssh destination), DPFS_URING (the dpfs_uring binary on the DPU) and DPFS_CONF (its config on the DPU) must be defined!"
+	exit 1
+fi
+
+# The virtio-fs tag of the device, see `tag` under [snap_hal]
+TAG="${TAG:-dpfs-0}"
+# -1 doesn't pin the kernel thread
+SQ_THREAD_CPU="${SQ_THREAD_CPU:--1}"
+SQ_THREAD_IDLE_MSEC="${SQ_THREAD_IDLE_MSEC:-2000}"
+RUNTIME="${RUNTIME:-60s}"
+DPU_CONF=/tmp/dpfs_uring_sqpoll.toml
+
+BS_LIST=("4k" "64k")
+QD_LIST=("1" "16" "128")
+
+TIME=$(python3 -c "
+import datetime
+t = 2*(2*2*3*(10+${RUNTIME%s}) + 2*20)
+print(datetime.timedelta(seconds=t))
+")
+echo "Running: dpfs_uring SQPOLL experiments which will take $TIME"
+
+BASE_OUT=$OUT
+for SQPOLL in "false" "true"; do
+	export OUT=$BASE_OUT/sqpoll_$SQPOLL
+	mkdir -p $OUT
+	echo dpfs_uring uring_sq_polling=$SQPOLL
+
+	# The uring_sq_* options of DPFS_CONF are replaced by those of the mode
+	ssh $DPU "sed -e '/^uring_sq_/d' \
+		-e '/^\[local_mirror\]/a uring_sq_polling = $SQPOLL\nuring_sq_thread_cpu = $SQ_THREAD_CPU\nuring_sq_thread_idle_msec = $SQ_THREAD_IDLE_MSEC' \
+		$DPFS_CONF > $DPU_CONF"
+	ssh $DPU "sudo nohup $DPFS_URING -c $DPU_CONF > /tmp/dpfs_uring_sqpoll_$SQPOLL.log 2>&1 &"
+	# The emulation of the device takes a while to come up
+	sleep 20
+
+	if [ -n "$MODULE" ]; then
+		sudo modprobe $MODULE
+	fi
+	sudo mkdir -p $MNT > /dev/null 2>&1
+	sudo mount -t virtiofs $TAG $MNT
+	sudo -E RUNTIME="10s" RW=randrw BS=4k QD=128 P=1 ./workloads/fio.sh > /dev/null
+
+	for RW in "randread" "randwrite"; do
+		for BS in "${BS_LIST[@]}"; do
+			for QD in "${QD_LIST[@]}"; do
+				echo fio RW=$RW BS=$BS QD=$QD P=1
+				# Skips the ramp time of fio
+				ssh $DPU "sleep 10; sudo perf stat -x ',' -e syscalls:sys_enter_io_uring_enter,task-clock \
+					-p \$(pgrep -x dpfs_uring) -- sleep ${RUNTIME%s}" \
+					> $OUT/perf_${RW}_${BS}_${QD}_1.out 2>&1 &
+				sudo -E env RUNTIME=$RUNTIME BS=$BS QD=$QD P=1 RW=$RW \
+					./workloads/fio.sh > $OUT/fio_${RW}_${BS}_${QD}_1.out
+				wait
+			done
+		done
+	done
+
+	sudo umount $MNT
+	if [ -n "$MODULE" ]; then
+		sudo rmmod $MODULE
+	fi
+	ssh $DPU "sudo pkill -INT -x dpfs_uring; sleep 5; cat /tmp/dpfs_uring_sqpoll_$SQPOLL.log" > $OUT/dpfs_uring.log
+done
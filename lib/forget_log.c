@@ -0,0 +1,164 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "forget_log.h"
+
+// Applies everything that has been logged so far
+static void forget_log_drain(struct forget_log *l) {
+    for (uint16_t t = 0; t < l->nthreads; t++) {
+        struct forget_log_thread *lt = &l->threads[t];
+
+        pthread_spin_lock(&lt->lock);
+        size_t n = lt->n;
+        memcpy(l->batch, lt->recs, n * sizeof(*lt->recs));
+        lt->n = 0;
+        pthread_spin_unlock(&lt->lock);
+
+        if (n)
+            l->apply(l->user_data, l->batch, n);
+    }
+}
+
+static void *forget_log_reclaimer(void *arg) {
+    struct forget_log *l = arg;
+
+    pthread_mutex_lock(&l->m);
+    while (!l->stop) {
+        if (!l->wakeup) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += l->interval_msec / 1000;
+            deadline.tv_nsec += (l->interval_msec % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&l->cv, &l->m, &deadline);
+        }
+        l->wakeup = false;
+        pthread_mutex_unlock(&l->m);
+
+        forget_log_drain(l);
+
+        pthread_mutex_lock(&l->m);
+    }
+    pthread_mutex_unlock(&l->m);
+
+    return NULL;
+}
+
+// Not thread-safe!
+int forget_log_init(struct forget_log **lp, uint16_t nthreads, size_t capacity,
+        uint64_t interval_msec, forget_log_apply_t apply, void *user_data) {
+    if (nthreads < 1 || capacity < 2 || interval_msec < 1) {
+        fprintf(stderr, "forget_log: nthreads must be >= 1, capacity >= 2 and interval_msec >= 1\n");
+        return -EINVAL;
+    }
+
+    struct forget_log *l = calloc(1, sizeof(struct forget_log));
+    if (!l)
+        return -ENOMEM;
+    l->apply = apply;
+    l->user_data = user_data;
+    l->capacity = capacity;
+    l->interval_msec = interval_msec;
+    l->nthreads = nthreads;
+
+    l->threads = aligned_alloc(64, nthreads * sizeof(*l->threads));
+    l->batch = malloc(capacity * sizeof(*l->batch));
+    if (!l->threads || !l->batch)
+        goto err;
+    memset(l->threads, 0, nthreads * sizeof(*l->threads));
+    for (uint16_t t = 0; t < nthreads; t++) {
+        l->threads[t].recs = malloc(capacity * sizeof(*l->threads[t].recs));
+        if (!l->threads[t].recs)
+            goto err;
+        pthread_spin_init(&l->threads[t].lock, PTHREAD_PROCESS_PRIVATE);
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&l->cv, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&l->m, NULL);
+
+    if (pthread_create(&l->reclaimer, NULL, forget_log_reclaimer, l) != 0) {
+        pthread_cond_destroy(&l->cv);
+        pthread_mutex_destroy(&l->m);
+        goto err;
+    }
+
+    *lp = l;
+    return 0;
+
+err:
+    if (l->threads) {
+        for (uint16_t t = 0; t < nthreads; t++) {
+            if (l->threads[t].recs)
+                pthread_spin_destroy(&l->threads[t].lock);
+            free(l->threads[t].recs);
+        }
+    }
+    free(l->threads);
+    free(l->batch);
+    free(l);
+    return -ENOMEM;
+}
+
+// Not thread-safe!
+// The threads that add records must have stopped
+void forget_log_destroy(struct forget_log *l) {
+    pthread_mutex_lock(&l->m);
+    l->stop = true;
+    pthread_cond_signal(&l->cv);
+    pthread_mutex_unlock(&l->m);
+    pthread_join(l->reclaimer, NULL);
+
+    forget_log_drain(l);
+
+    for (uint16_t t = 0; t < l->nthreads; t++) {
+        pthread_spin_destroy(&l->threads[t].lock);
+        free(l->threads[t].recs);
+    }
+    pthread_cond_destroy(&l->cv);
+    pthread_mutex_destroy(&l->m);
+    free(l->threads);
+    free(l->batch);
+    free(l);
+}
+
+// Thread-safe
+void forget_log_add(struct forget_log *l, uint16_t thread_id, uint64_t nodeid, uint64_t nlookup) {
+    struct forget_log_thread *lt = &l->threads[thread_id];
+
+    pthread_spin_lock(&lt->lock);
+    if (lt->n == l->capacity) {
+        pthread_spin_unlock(&lt->lock);
+        // The reclaimer is behind, don't let the log grow
+        struct forget_rec rec = { .nodeid = nodeid, .nlookup = nlookup };
+        l->apply(l->user_data, &rec, 1);
+        return;
+    }
+    lt->recs[lt->n].nodeid = nodeid;
+    lt->recs[lt->n].nlookup = nlookup;
+    bool half_full = ++lt->n == l->capacity / 2;
+    pthread_spin_unlock(&lt->lock);
+
+    if (half_full) {
+        pthread_mutex_lock(&l->m);
+        l->wakeup = true;
+        pthread_cond_signal(&l->cv);
+        pthread_mutex_unlock(&l->m);
+    }
+}
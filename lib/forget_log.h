@@ -0,0 +1,83 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef FORGET_LOG_H
+#define FORGET_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    forget_log takes FORGET and BATCH_FORGET off the request handling threads. These only
+    append the nodeid and lookup count to a log of their own, a reclaimer thread collects
+    the logs every interval (or sooner, once a log is half full) and hands the records to
+    the backend in batches. The backend then drops the lookup counts and frees the inodes
+    while it holds its locks once per batch instead of once per inode.
+
+    Lookup counts only ever get added to and subtracted from, so the backend may see a
+    LOOKUP of an inode before an older FORGET of it is applied.
+    The logs have a fixed capacity. If a log is full, the record is applied right away on
+    the calling thread, so memory usage is bounded by nthreads * capacity records.
+*/
+
+struct forget_rec {
+    uint64_t nodeid;
+    uint64_t nlookup;
+};
+
+// Called on the reclaimer thread, or on a request handling thread if its log is full
+typedef void (*forget_log_apply_t)(void *user_data, struct forget_rec *recs, size_t n);
+
+struct forget_log_thread {
+    pthread_spinlock_t lock;
+    struct forget_rec *recs;
+    size_t n;
+} __attribute__((aligned(64)));
+
+struct forget_log {
+    forget_log_apply_t apply;
+    void *user_data;
+    // Records per thread
+    size_t capacity;
+    uint64_t interval_msec;
+
+    uint16_t nthreads;
+    struct forget_log_thread *threads;
+
+    // Only used by the reclaimer thread
+    struct forget_rec *batch;
+    pthread_t reclaimer;
+    pthread_mutex_t m;
+    pthread_cond_t cv;
+    bool wakeup;
+    bool stop;
+};
+
+/*
+ nthreads = the number of threads that add records, thread_id < nthreads
+ capacity = records per thread, the batches are at most this large
+ returns error code if unsuccesful
+ */
+int forget_log_init(struct forget_log **, uint16_t nthreads, size_t capacity,
+        uint64_t interval_msec, forget_log_apply_t apply, void *user_data);
+// Stops the reclaimer and applies whatever is left
+void forget_log_destroy(struct forget_log *);
+
+// Thread-safe, for the thread_id of the calling thread
+void forget_log_add(struct forget_log *, uint16_t thread_id, uint64_t nodeid, uint64_t nlookup);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FORGET_LOG_H
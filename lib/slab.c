@@ -0,0 +1,129 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "slab.h"
+
+#define SLAB_CHUNK_HEADER ((sizeof(struct slab_chunk) + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1))
+
+// The cache of a thread is picked the first time it allocates, the same for all slabs
+static __thread int slab_thread = -1;
+static int slab_nthreads = 0;
+
+static struct slab_cache *slab_cache_of_thread(struct slab *s) {
+    if (slab_thread == -1)
+        slab_thread = __atomic_fetch_add(&slab_nthreads, 1, __ATOMIC_RELAXED);
+    return &s->caches[slab_thread % s->ncaches];
+}
+
+// Must hold the lock of c
+static int slab_grow(struct slab *s, struct slab_cache *c) {
+    struct slab_chunk *chunk = aligned_alloc(SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE);
+    if (!chunk)
+        return -ENOMEM;
+    chunk->cache = c;
+    chunk->next = c->chunks;
+    c->chunks = chunk;
+    c->nchunks++;
+
+    char *obj = (char *) chunk + SLAB_CHUNK_HEADER;
+    for (size_t i = 0; i < s->objs_per_chunk; i++, obj += s->obj_size) {
+        *(void **) obj = c->free;
+        c->free = obj;
+    }
+    return 0;
+}
+
+// Thread-safe
+void *slab_alloc(struct slab *s) {
+    struct slab_cache *c = slab_cache_of_thread(s);
+
+    pthread_spin_lock(&c->lock);
+    if (!c->free && slab_grow(s, c) != 0) {
+        pthread_spin_unlock(&c->lock);
+        return NULL;
+    }
+    void *obj = c->free;
+    c->free = *(void **) obj;
+    c->nused++;
+    pthread_spin_unlock(&c->lock);
+
+    memset(obj, 0, s->obj_size);
+    return obj;
+}
+
+// Thread-safe
+void slab_free(struct slab *s, void *obj) {
+    struct slab_chunk *chunk = (struct slab_chunk *) ((uintptr_t) obj & ~((uintptr_t) SLAB_CHUNK_SIZE - 1));
+    struct slab_cache *c = chunk->cache;
+
+    pthread_spin_lock(&c->lock);
+    *(void **) obj = c->free;
+    c->free = obj;
+    c->nused--;
+    pthread_spin_unlock(&c->lock);
+}
+
+// Thread-safe, but only a snapshot
+void slab_stats(struct slab *s, size_t *used, size_t *allocated) {
+    *used = 0;
+    *allocated = 0;
+    for (uint16_t i = 0; i < s->ncaches; i++) {
+        struct slab_cache *c = &s->caches[i];
+        pthread_spin_lock(&c->lock);
+        *used += c->nused * s->obj_size;
+        *allocated += c->nchunks * SLAB_CHUNK_SIZE;
+        pthread_spin_unlock(&c->lock);
+    }
+}
+
+// Not thread-safe!
+int slab_init(struct slab **sp, size_t obj_size, uint16_t ncaches) {
+    obj_size = (obj_size + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1);
+    if (ncaches < 1 || obj_size < sizeof(void *) || obj_size > SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER) {
+        fprintf(stderr, "slab: ncaches must be >= 1 and the objects must fit in a chunk\n");
+        return -EINVAL;
+    }
+
+    struct slab *s = calloc(1, sizeof(struct slab));
+    if (!s)
+        return -ENOMEM;
+    s->obj_size = obj_size;
+    s->objs_per_chunk = (SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER) / obj_size;
+    s->ncaches = ncaches;
+    s->caches = aligned_alloc(64, ncaches * sizeof(*s->caches));
+    if (!s->caches) {
+        free(s);
+        return -ENOMEM;
+    }
+    memset(s->caches, 0, ncaches * sizeof(*s->caches));
+    for (uint16_t i = 0; i < ncaches; i++)
+        pthread_spin_init(&s->caches[i].lock, PTHREAD_PROCESS_PRIVATE);
+
+    *sp = s;
+    return 0;
+}
+
+// Not thread-safe!
+void slab_destroy(struct slab *s) {
+    for (uint16_t i = 0; i < s->ncaches; i++) {
+        struct slab_cache *c = &s->caches[i];
+        while (c->chunks) {
+            struct slab_chunk *next = c->chunks->next;
+            free(c->chunks);
+            c->chunks = next;
+        }
+        pthread_spin_destroy(&c->lock);
+    }
+    free(s->caches);
+    free(s);
+}
@@ -0,0 +1,76 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    slab is a thread-safe allocator for many small objects of one size, that CAN grow.
+    The objects are cache line aligned and carved out of SLAB_CHUNK_SIZE chunks, so that they
+    are packed together instead of scattered over the heap with a malloc header each.
+    Every thread allocates from the chunks of its own cache, a freed object goes back to
+    the cache it came from (found through the chunk it lies in), whichever thread frees it.
+    The caches each have a lock, which is only contended when threads free each other's
+    objects or when there are more threads than caches.
+    Chunks are only given back to the OS by slab_destroy.
+*/
+
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_ALIGN 64
+
+struct slab_cache;
+
+// At the start of every chunk, padded to SLAB_ALIGN
+struct slab_chunk {
+    struct slab_cache *cache;
+    struct slab_chunk *next;
+};
+
+struct slab_cache {
+    pthread_spinlock_t lock;
+    // Linked through the first pointer of every free object
+    void *free;
+    struct slab_chunk *chunks;
+    size_t nchunks;
+    size_t nused;
+} __attribute__((aligned(64)));
+
+struct slab {
+    size_t obj_size;
+    size_t objs_per_chunk;
+    uint16_t ncaches;
+    struct slab_cache *caches;
+};
+
+// Returns zeroed memory, or NULL if no new chunk could be allocated
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *obj);
+// Of all caches together, the bytes in use by objects and the bytes of all chunks
+void slab_stats(struct slab *s, size_t *used, size_t *allocated);
+
+/*
+ obj_size = the size of each object, it is rounded up to SLAB_ALIGN
+ ncaches = the number of per-thread caches, threads beyond it share caches
+ returns error code if unsuccesful
+ */
+int slab_init(struct slab **s, size_t obj_size, uint16_t ncaches);
+// All objects are freed with it
+void slab_destroy(struct slab *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SLAB_H